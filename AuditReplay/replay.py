@@ -0,0 +1,189 @@
+'''
+Replays a trace recorded by the AuditReplay spython through the audit
+hooks of whichever interpreter runs this script.
+
+    SPYTHONTRACE=app.trace ./spython app.py
+    ../LogToFile/spython replay.py app.trace -n 10
+
+Every recorded event is raised again with sys.audit(), which calls the
+same hooks as PySys_Audit() in the runtime, in a tight loop. Arguments
+that could not be recorded are replaced by Recorded objects whose repr()
+matches the original.
+
+Use --verdicts to save which events each hook blocked, and --expect to
+compare against a saved run, for example in a regression test.
+'''
+
+import argparse
+import fnmatch
+import marshal
+import sys
+import time
+
+# Lifecycle events change the state of the hook itself, so they are not
+# replayed unless --all is passed
+LIFECYCLE = ("cpython.PyInterpreterState_*", "cpython._PySys_ClearAuditHooks")
+
+
+class Recorded:
+    '''Stands in for an argument that could not be recorded.'''
+    __slots__ = ("type_name", "_repr")
+
+    def __init__(self, type_name, r):
+        self.type_name = type_name
+        self._repr = r
+
+    def __repr__(self):
+        return self._repr or "<{} object>".format(self.type_name)
+
+
+def rebuild(obj):
+    if isinstance(obj, tuple):
+        return tuple(rebuild(o) for o in obj)
+    if isinstance(obj, list):
+        return [rebuild(o) for o in obj]
+    if isinstance(obj, dict):
+        if "__spython_obj__" in obj:
+            return Recorded(obj["__spython_obj__"], obj.get("repr"))
+        return {k: rebuild(v) for k, v in obj.items()}
+    return obj
+
+
+def load(path):
+    records = []
+    with open(path, "rb") as f:
+        header = marshal.load(f)
+        if not isinstance(header, tuple) or header[:2] != ("spython-trace", 1):
+            raise ValueError("{} is not an spython trace".format(path))
+        while True:
+            try:
+                t, tid, event, args = marshal.load(f)
+            except EOFError:
+                break
+            records.append((t, tid, event, rebuild(args)))
+    return header[2], records
+
+
+def select(records, include, exclude):
+    def wanted(event):
+        if include and not any(fnmatch.fnmatchcase(event, p) for p in include):
+            return False
+        return not any(fnmatch.fnmatchcase(event, p) for p in exclude)
+    return [r for r in records if wanted(r[2])]
+
+
+def replay_once(records, verdicts=None):
+    audit = sys.audit
+    blocked = 0
+    for _, _, event, args in records:
+        try:
+            audit(event, *args)
+        except Exception as ex:
+            blocked += 1
+            if verdicts is not None:
+                verdicts.append("{} {}".format(event, type(ex).__name__))
+        else:
+            if verdicts is not None:
+                verdicts.append("{} ok".format(event))
+    return blocked
+
+
+def replay_realtime(records):
+    '''Keeps the recorded gaps between events.'''
+    audit = sys.audit
+    start = time.perf_counter_ns()
+    t0 = records[0][0] if records else 0
+    for t, _, event, args in records:
+        delay = (t - t0) - (time.perf_counter_ns() - start)
+        if delay > 0:
+            time.sleep(delay / 1e9)
+        try:
+            audit(event, *args)
+        except Exception:
+            pass
+
+
+def per_event(records):
+    audit = sys.audit
+    perf = time.perf_counter_ns
+    totals = {}
+    for _, _, event, args in records:
+        t = perf()
+        try:
+            audit(event, *args)
+        except Exception:
+            pass
+        t = perf() - t
+        n, total = totals.get(event, (0, 0))
+        totals[event] = (n + 1, total + t)
+    return totals
+
+
+parser = argparse.ArgumentParser("replay")
+parser.add_argument("trace")
+parser.add_argument("-n", type=int, default=1, help="number of passes over the trace")
+parser.add_argument("--include", action="append", default=[], metavar="PATTERN",
+                    help="only replay events matching this pattern")
+parser.add_argument("--exclude", action="append", default=[], metavar="PATTERN",
+                    help="do not replay events matching this pattern")
+parser.add_argument("--all", action="store_true", help="also replay interpreter lifecycle events")
+parser.add_argument("--realtime", action="store_true", help="keep the recorded timing between events")
+parser.add_argument("--top", type=int, default=0, metavar="N",
+                    help="show the mean cost of the N most expensive events")
+parser.add_argument("--verdicts", metavar="FILE", help="write the outcome of each event to FILE")
+parser.add_argument("--expect", metavar="FILE", help="fail if outcomes differ from a saved --verdicts FILE")
+
+
+def main():
+    args = parser.parse_args()
+    recorded_version, records = load(args.trace)
+    exclude = args.exclude + ([] if args.all else list(LIFECYCLE))
+    records = select(records, args.include, exclude)
+    print("trace: {} events recorded by Python {}".format(len(records), recorded_version.split()[0]))
+    print("replaying with Python {}".format(sys.version.split()[0]))
+
+    if args.realtime:
+        start = time.perf_counter()
+        replay_realtime(records)
+        print("realtime replay took {:.3f}s".format(time.perf_counter() - start))
+        return 0
+
+    verdicts = [] if (args.verdicts or args.expect) else None
+    blocked = replay_once(records, verdicts)
+
+    start = time.perf_counter()
+    for _ in range(args.n):
+        replay_once(records)
+    elapsed = time.perf_counter() - start
+    events = len(records) * args.n
+    print("{} events in {:.3f}s: {:,.0f} events/sec, {:.0f} ns/event, {} blocked per pass".format(
+        events, elapsed, events / elapsed if elapsed else 0,
+        elapsed * 1e9 / events if events else 0, blocked))
+
+    if args.top:
+        totals = per_event(records)
+        ranked = sorted(totals.items(), key=lambda i: i[1][1], reverse=True)[:args.top]
+        print("{:<40} {:>8} {:>10} {:>12}".format("event", "count", "mean ns", "total ms"))
+        for event, (n, total) in ranked:
+            print("{:<40} {:>8} {:>10.0f} {:>12.3f}".format(event, n, total / n, total / 1e6))
+
+    if args.verdicts:
+        with open(args.verdicts, "w") as f:
+            f.writelines(v + "\n" for v in verdicts)
+    if args.expect:
+        with open(args.expect) as f:
+            expected = [line.rstrip("\n") for line in f]
+        changed = [(i, e, a) for i, (e, a) in enumerate(zip(expected, verdicts)) if e != a]
+        if len(expected) != len(verdicts):
+            print("expected {} outcomes, got {}".format(len(expected), len(verdicts)))
+            return 1
+        for i, e, a in changed[:20]:
+            print("event #{}: expected '{}', got '{}'".format(i, e, a))
+        if changed:
+            print("{} outcomes changed".format(len(changed)))
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,272 @@
+/* Audit event recorder
+ *
+ * Runs Python normally, with a hook that records every audit event to a
+ * trace file: when it was raised, on which thread, its name and its
+ * arguments. replay.py feeds a trace back through any other spython so
+ * hooks can be benchmarked against a real workload.
+ *
+ * Each record is a marshalled tuple of
+ *     (time_ns, thread_id, event, args)
+ * preceded by a header of ('spython-trace', version, sys.version).
+ * Arguments that marshal cannot represent faithfully across Python
+ * versions are replaced by {'__spython_obj__': type name, 'repr': repr}
+ * so that their shape is kept.
+ */
+#include "Python.h"
+#include "marshal.h"
+#include "pythread.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef MS_WINDOWS
+#include <windows.h>
+#define TRACE_PATH_MAX MAX_PATH
+#else
+#include <limits.h>
+#include <unistd.h>
+#define TRACE_PATH_MAX PATH_MAX
+#endif
+
+#define TRACE_VERSION 1
+/* Marshal version 2 is readable by every Python with audit hooks */
+#define MARSHAL_VERSION 2
+/* Deeper or longer containers are recorded as placeholders */
+#define MAX_DEPTH 8
+#define MAX_ITEMS 4096
+#define MAX_REPR 200
+
+static FILE *trace = NULL;
+static long long start_ns;
+static atomic_ullong records_lost;
+
+
+static long long
+monotonic_ns(void)
+{
+#ifdef MS_WINDOWS
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (long long)(now.QuadPart / freq.QuadPart) * 1000000000LL
+        + (long long)(now.QuadPart % freq.QuadPart) * 1000000000LL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static PyObject *
+placeholder(PyObject *obj)
+{
+    PyObject *r = NULL;
+    /* repr() is not safe to call during startup and shutdown */
+    if (Py_IsInitialized()) {
+        r = PyObject_Repr(obj);
+        if (!r) {
+            PyErr_Clear();
+        } else if (PyUnicode_GET_LENGTH(r) > MAX_REPR) {
+            Py_SETREF(r, PyUnicode_Substring(r, 0, MAX_REPR));
+        }
+    }
+    PyObject *d = Py_BuildValue("{s:s,s:O}", "__spython_obj__",
+                                Py_TYPE(obj)->tp_name,
+                                "repr", r ? r : Py_None);
+    Py_XDECREF(r);
+    return d;
+}
+
+/* Returns a new reference to obj, or to a copy of it that only contains
+   types marshal writes the same way in every version. */
+static PyObject *
+sanitize(PyObject *obj, int depth)
+{
+    if (obj == Py_None || PyBool_Check(obj) || PyLong_CheckExact(obj)
+        || PyFloat_CheckExact(obj) || PyComplex_CheckExact(obj)
+        || PyUnicode_CheckExact(obj) || PyBytes_CheckExact(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+
+    int is_tuple = PyTuple_CheckExact(obj), is_list = PyList_CheckExact(obj);
+    if ((is_tuple || is_list) && depth < MAX_DEPTH
+        && Py_SIZE(obj) <= MAX_ITEMS) {
+        Py_ssize_t n = Py_SIZE(obj);
+        PyObject *copy = is_tuple ? PyTuple_New(n) : PyList_New(n);
+        if (!copy) {
+            return NULL;
+        }
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            PyObject *item = is_tuple ? PyTuple_GET_ITEM(obj, i)
+                                      : PyList_GET_ITEM(obj, i);
+            item = sanitize(item, depth + 1);
+            if (!item) {
+                Py_DECREF(copy);
+                return NULL;
+            }
+            if (is_tuple) {
+                PyTuple_SET_ITEM(copy, i, item);
+            } else {
+                PyList_SET_ITEM(copy, i, item);
+            }
+        }
+        return copy;
+    }
+
+    if (PyDict_CheckExact(obj) && depth < MAX_DEPTH
+        && PyDict_GET_SIZE(obj) <= MAX_ITEMS) {
+        PyObject *copy = PyDict_New(), *key, *value;
+        Py_ssize_t pos = 0;
+        if (!copy) {
+            return NULL;
+        }
+        while (PyDict_Next(obj, &pos, &key, &value)) {
+            PyObject *k = sanitize(key, depth + 1);
+            if (!k) {
+                Py_DECREF(copy);
+                return NULL;
+            }
+            /* keys that became placeholders are unhashable, so skip them */
+            if (PyDict_CheckExact(k)) {
+                Py_DECREF(k);
+                continue;
+            }
+            PyObject *v = sanitize(value, depth + 1);
+            if (!v || PyDict_SetItem(copy, k, v) < 0) {
+                Py_DECREF(k);
+                Py_XDECREF(v);
+                Py_DECREF(copy);
+                return NULL;
+            }
+            Py_DECREF(k);
+            Py_DECREF(v);
+        }
+        return copy;
+    }
+
+    return placeholder(obj);
+}
+
+static int
+write_record(PyObject *record)
+{
+    PyObject *data = PyMarshal_WriteObjectToString(record, MARSHAL_VERSION);
+    if (!data) {
+        return -1;
+    }
+    /* One fwrite per record, so threads do not interleave */
+    size_t len = (size_t)PyBytes_GET_SIZE(data);
+    size_t n = fwrite(PyBytes_AS_STRING(data), 1, len, trace);
+    Py_DECREF(data);
+    return n == len ? 0 : -1;
+}
+
+static int
+write_header(void)
+{
+    PyObject *header = Py_BuildValue("(sis)", "spython-trace",
+                                     TRACE_VERSION, Py_GetVersion());
+    if (!header) {
+        return -1;
+    }
+    int r = write_record(header);
+    Py_DECREF(header);
+    return r;
+}
+
+static int
+record_hook(const char *event, PyObject *args, void *userData)
+{
+    long long t = monotonic_ns() - start_ns;
+    PyObject *error_type, *error_value, *error_tb;
+
+    /* Never let recording fail the event or clobber a pending error */
+    PyErr_Fetch(&error_type, &error_value, &error_tb);
+
+    /* The header needs objects, so it is written with the first event */
+    static atomic_int header_written;
+    if (!atomic_exchange(&header_written, 1) && write_header() < 0) {
+        PyErr_Clear();
+    }
+
+    int r = -1;
+    PyObject *clean = args ? sanitize(args, 0) : PyTuple_New(0);
+    if (clean) {
+        PyObject *record = Py_BuildValue("(LksN)", t,
+                                         PyThread_get_thread_ident(),
+                                         event, clean);
+        if (record) {
+            r = write_record(record);
+            Py_DECREF(record);
+        }
+    }
+    if (r < 0) {
+        PyErr_Clear();
+        atomic_fetch_add_explicit(&records_lost, 1, memory_order_relaxed);
+    }
+
+    PyErr_Restore(error_type, error_value, error_tb);
+    return 0;
+}
+
+/* Writes '<executable>.trace' into path. argv[0] is not used, because it
+   is only a name when spython is run from PATH and would put the trace in
+   the current directory. */
+static int
+default_trace_path(char *path, size_t size)
+{
+    size -= sizeof(".trace");
+#ifdef MS_WINDOWS
+    DWORD len = GetModuleFileNameA(NULL, path, (DWORD)size);
+    if (len == 0 || len >= size) {
+        return -1;
+    }
+#else
+    ssize_t len = readlink("/proc/self/exe", path, size);
+    if (len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+#endif
+    memcpy(path + len, ".trace", sizeof(".trace"));
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = getenv("SPYTHONTRACE");
+    char default_path[TRACE_PATH_MAX];
+
+    if (!path || !*path) {
+        if (default_trace_path(default_path, sizeof(default_path)) < 0) {
+            fprintf(stderr, "Fatal Python error: "
+                    "failed to locate the executable, set SPYTHONTRACE\n");
+            return 1;
+        }
+        path = default_path;
+    }
+
+    trace = fopen(path, "wb");
+    if (!trace) {
+        fprintf(stderr, "Fatal Python error: failed to open trace file: %s\n",
+                path);
+        return 1;
+    }
+
+    atomic_init(&records_lost, 0);
+    start_ns = monotonic_ns();
+    PySys_AddAuditHook(record_hook, NULL);
+
+    int exitcode = Py_BytesMain(argc, argv);
+
+    fclose(trace);
+    unsigned long long lost = atomic_load(&records_lost);
+    if (lost) {
+        fprintf(stderr, "spython: %llu events could not be recorded\n", lost);
+    }
+    return exitcode;
+}
@@ -0,0 +1,429 @@
+#!/usr/bin/env python3
+'''
+End-to-end workload benchmarks for the spython samples.
+
+Runs four small but realistic programs under a Python without hooks and
+under every Linux spython build it finds in the repository:
+
+    cli       an import-heavy command line tool, one process per operation
+    pickle    a data job that pickles and unpickles batches of records
+    socket    a client that makes one TCP connection per request
+    template  a templating job that compiles and executes generated code
+
+For each variant and workload it reports throughput, latency percentiles,
+peak RSS and the number of log bytes written, as a table and optionally
+as JSON. --compare checks the results against an earlier JSON file and
+exits with 1 if any of them regressed by more than --threshold percent.
+
+    python3 bench_workloads.py [--python python3.8] [--runs 5] [--json results.json]
+                               [--variant name=path [ENV=value ...]] [--only LogToFile,...]
+                               [--workloads cli,pickle] [--compare baseline.json]
+'''
+
+import argparse
+import array
+import datetime
+import hashlib
+import json
+import math
+import os
+import platform
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+XATTR_NAME = "user.org.python.x-spython-hash"
+
+# Each workload is run as 'exe script <latency file> <ops> [args]'. It
+# writes the latency of every operation, in seconds, to the latency file
+# as an array of doubles. The cli workload does one operation per process
+# and is timed from outside instead.
+WORKLOADS = {}
+
+WORKLOADS["cli"] = (1, r'''
+import argparse, csv, datetime, decimal, email.parser, http.client, io, json
+import logging, pathlib, shutil, tempfile, urllib.parse, uuid
+parser = argparse.ArgumentParser(prog="tool")
+parser.add_argument("out")
+parser.add_argument("ops", type=int)
+parser.add_argument("port", nargs="?")
+parser.add_argument("--format", choices=["json", "csv"], default="json")
+args = parser.parse_args()
+logging.basicConfig(level=logging.WARNING)
+row = {"id": str(uuid.UUID(int=1)), "path": str(pathlib.Path(args.out).parent),
+       "when": datetime.date(2000, 1, 1).isoformat(), "total": str(decimal.Decimal("1.10")),
+       "url": urllib.parse.urljoin("http://localhost/", "a/b")}
+json.dumps(row)
+csv.writer(io.StringIO()).writerow(row.values())
+''')
+
+WORKLOADS["pickle"] = (200, r'''
+import array, datetime, decimal, pickle, sys, time
+records = [{"id": i, "name": "record%d" % i, "score": i / 7,
+            "when": datetime.datetime(2000, 1, 1 + i % 28, i % 24),
+            "amount": decimal.Decimal(i) / 100, "tags": ("a", "b", str(i % 10)),
+            "values": list(range(i % 16))} for i in range(2000)]
+perf = time.perf_counter
+latencies = array.array("d")
+for i in range(int(sys.argv[2])):
+    t = perf()
+    data = pickle.dumps(records[i % 10:], protocol=4)
+    pickle.loads(data)
+    latencies.append(perf() - t)
+with open(sys.argv[1], "wb") as f:
+    latencies.tofile(f)
+''')
+
+WORKLOADS["socket"] = (500, r'''
+import array, socket, sys, time
+port = int(sys.argv[3])
+perf = time.perf_counter
+latencies = array.array("d")
+for i in range(int(sys.argv[2])):
+    t = perf()
+    with socket.create_connection(("127.0.0.1", port)) as s:
+        s.sendall(b"GET %d\n" % (i % 64))
+        while s.recv(65536):
+            pass
+    latencies.append(perf() - t)
+with open(sys.argv[1], "wb") as f:
+    latencies.tofile(f)
+''')
+
+WORKLOADS["template"] = (500, r'''
+import array, re, sys, time
+TEMPLATE = """<h1>{{ title }}</h1>
+<ul>{% for item in items %}<li>{{ item.name }}: {{ item.price }}</li>{% endfor %}</ul>
+<p>{{ footer }}</p>"""
+TOKEN = re.compile(r"{{ (\w+(?:\.\w+)*) }}|{% for (\w+) in (\w+) %}|{% endfor %}")
+
+def translate(template, name):
+    """Translates the template into the source of a render function"""
+    lines = ["def %s(ctx, out):" % name]
+    indent, pos = 1, 0
+    for m in TOKEN.finditer(template):
+        lines.append("    " * indent + "out.append(%r)" % template[pos:m.start()])
+        if m.group(1):
+            first, *rest = m.group(1).split(".")
+            expr = first if indent > 1 else "ctx[%r]" % first
+            lines.append("    " * indent + "out.append(str(%s))" % ".".join([expr] + rest))
+        elif m.group(2):
+            lines.append("    " * indent + "for %s in ctx[%r]:" % (m.group(2), m.group(3)))
+            indent += 1
+        else:
+            indent -= 1
+        pos = m.end()
+    lines.append("    " * indent + "out.append(%r)" % template[pos:])
+    return "\n".join(lines)
+
+class Item:
+    def __init__(self, i):
+        self.name, self.price = "item%d" % i, i * 3
+ctx = {"title": "Prices", "footer": "end", "items": [Item(i) for i in range(20)]}
+perf = time.perf_counter
+latencies = array.array("d")
+for i in range(int(sys.argv[2])):
+    t = perf()
+    # every template is new, so nothing is cached between operations
+    name = "render_%d" % i
+    namespace = {}
+    exec(compile(translate(TEMPLATE + "<!-- %d -->" % i, name), "<template %d>" % i, "exec"),
+         namespace)
+    out = []
+    namespace[name](ctx, out)
+    "".join(out)
+    latencies.append(perf() - t)
+with open(sys.argv[1], "wb") as f:
+    latencies.tofile(f)
+''')
+
+# Classes the pickle workload stores, for SPYTHONPICKLEALLOW
+PICKLE_ALLOW = '''
+datetime:datetime
+decimal:Decimal
+'''
+
+NET_POLICY = '''
+default deny
+allow 127.0.0.0/8
+'''
+
+COMPOSABLE_CONF = '''
+[startup]
+plugin = {root}/Composable/plugins/startup.so
+
+[log]
+plugin = {root}/Composable/plugins/logfile.so
+log = {logdir}/spython.log
+'''
+
+# name, executable relative to the repository, environment. {tmp} is a
+# directory for configuration and {logdir} is emptied before every run;
+# everything written to it and to stderr counts as log bytes.
+VARIANTS = [
+    ("LogToStderrMinimal", "LogToStderrMinimal/spython", {}),
+    ("LogToStderr", "LogToStderr/spython", {}),
+    ("LogToFile", "LogToFile/spython", {"SPYTHONLOG": "{logdir}/spython.log",
+                                        "SPYTHONPICKLEALLOW": "{tmp}/pickle.allow"}),
+    ("LogToFile-json", "LogToFile/spython", {"SPYTHONLOG": "{logdir}/spython.log",
+                                             "SPYTHONPICKLEALLOW": "{tmp}/pickle.allow",
+                                             "SPYTHONLOGFORMAT": "json"}),
+    ("syslog", "syslog/spython", {}),
+    ("StartupControl", "StartupControl/spython", {}),
+    ("NetworkPrompt", "NetworkPrompt/spython", {"SPYTHONNETPOLICY": "{tmp}/netpolicy"}),
+    ("AuditReplay", "AuditReplay/spython", {"SPYTHONTRACE": "{logdir}/spython.trace"}),
+    ("Composable", "Composable/spython", {"SPYTHONCONFIG": "{tmp}/composable.conf"}),
+    ("linux_xattr", "linux_xattr/spython", {}),
+]
+
+parser = argparse.ArgumentParser("bench_workloads")
+parser.add_argument("--python", default="python3.8",
+                    help="Python without hooks, matching the one spython was built with")
+parser.add_argument("--variant", nargs="+", action="append", default=[],
+                    metavar="NAME=PATH [ENV=VALUE]",
+                    help="add a variant, for builds outside the repository or "
+                         "other configurations")
+parser.add_argument("--only", help="comma-separated variants to run")
+parser.add_argument("--workloads", default=",".join(WORKLOADS))
+parser.add_argument("--runs", type=int, default=5, help="processes per workload")
+parser.add_argument("--scale", type=float, default=1.0,
+                    help="multiplies the operations per process")
+parser.add_argument("--json", help="write the results to this file, or '-' for stdout")
+parser.add_argument("--compare", help="JSON results of an earlier run")
+parser.add_argument("--threshold", type=float, default=10.0,
+                    help="percentage that counts as a regression for --compare")
+
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        n = int(self.rfile.readline().split()[1])
+        self.wfile.write(b"x" * (1024 * n))
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 128
+
+
+def find_variants(args):
+    variants = [("python", args.python, {})]
+    for name, path, env in VARIANTS:
+        exe = os.path.join(ROOT, path)
+        if os.access(exe, os.X_OK):
+            variants.append((name, exe, env))
+    for spec in args.variant:
+        name, _, path = spec[0].partition("=")
+        env = dict(s.partition("=")[::2] for s in spec[1:])
+        variants.append((name, os.path.abspath(path) if os.sep in path else path, env))
+    if args.only:
+        only = args.only.split(",")
+        variants = [v for v in variants if v[0] in only]
+    return variants
+
+
+def write_script(path, text):
+    with open(path, "w") as f:
+        f.write(text)
+    # so that linux_xattr accepts the script
+    try:
+        os.setxattr(path, XATTR_NAME,
+                    hashlib.sha256(text.encode()).hexdigest().encode("ascii"))
+    except OSError:
+        pass
+
+
+def directory_size(path):
+    return sum(os.path.getsize(os.path.join(d, f))
+               for d, _, files in os.walk(path) for f in files)
+
+
+def run_once(exe, argv, env, logdir):
+    """Runs one process, returning (wall seconds, max RSS in KiB, log bytes)"""
+    for name in os.listdir(logdir):
+        os.unlink(os.path.join(logdir, name))
+    stderr = os.path.join(logdir, "stderr")
+    actions = [
+        (os.POSIX_SPAWN_OPEN, 0, os.devnull, os.O_RDONLY, 0),
+        (os.POSIX_SPAWN_OPEN, 1, os.devnull, os.O_WRONLY, 0),
+        (os.POSIX_SPAWN_OPEN, 2, stderr, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644),
+    ]
+    start = time.perf_counter()
+    pid = os.posix_spawnp(exe, [exe] + argv, env, file_actions=actions)
+    _, status, rusage = os.wait4(pid, 0)
+    wall = time.perf_counter() - start
+    if status:
+        with open(stderr, "rb") as f:
+            tail = f.read()[-2000:].decode(errors="replace")
+        raise RuntimeError("{} {} failed with status {}:\n{}".format(
+            exe, " ".join(argv), status, tail))
+    return wall, rusage.ru_maxrss, directory_size(logdir)
+
+
+def percentile(values, p):
+    """Nearest-rank percentile of sorted values"""
+    return values[max(0, math.ceil(len(values) * p / 100) - 1)]
+
+
+def bench(variant, workload, args, tmp, port):
+    name, exe, env_template = variant
+    ops = max(1, int(WORKLOADS[workload][0] * args.scale))
+    logdir = os.path.join(tmp, "log")
+    os.makedirs(logdir, exist_ok=True)
+    env = dict(os.environ)
+    env.update((k, v.format(tmp=tmp, logdir=logdir)) for k, v in env_template.items())
+    latency_file = os.path.join(tmp, "latencies")
+    argv = [os.path.join(tmp, "workload_" + workload + ".py"), latency_file, str(ops), str(port)]
+
+    latencies, walls, rss, log_bytes = [], [], [], []
+    for _ in range(args.runs):
+        wall, maxrss, logged = run_once(exe, argv, env, logdir)
+        walls.append(wall)
+        rss.append(maxrss)
+        log_bytes.append(logged)
+        if workload == "cli":
+            latencies.append(wall)
+        else:
+            values = array.array("d")
+            with open(latency_file, "rb") as f:
+                values.frombytes(f.read())
+            os.unlink(latency_file)
+            latencies.extend(values)
+    latencies.sort()
+    walls.sort()
+    return {
+        "variant": name,
+        "workload": workload,
+        "runs": args.runs,
+        "ops": len(latencies),
+        "throughput_ops_s": len(latencies) / sum(latencies),
+        "latency_ms": {
+            "p50": percentile(latencies, 50) * 1e3,
+            "p90": percentile(latencies, 90) * 1e3,
+            "p99": percentile(latencies, 99) * 1e3,
+            "max": latencies[-1] * 1e3,
+        },
+        "wall_ms_p50": percentile(walls, 50) * 1e3,
+        "max_rss_kib": max(rss),
+        "log_bytes_per_run": sum(log_bytes) // len(log_bytes),
+    }
+
+
+def metadata(args):
+    try:
+        commit = subprocess.check_output(["git", "-C", ROOT, "rev-parse", "HEAD"],
+                                         stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        commit = None
+    version = subprocess.check_output(
+        [args.python, "-c", "import sys; print(sys.version.split()[0])"]).decode().strip()
+    return {
+        "date": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec="seconds"),
+        "commit": commit,
+        "python": version,
+        "platform": platform.platform(),
+        "cpus": os.cpu_count(),
+        "runs": args.runs,
+        "scale": args.scale,
+    }
+
+
+# Metrics checked by --compare, and whether higher is better
+COMPARED = [
+    ("throughput_ops_s", lambda r: r["throughput_ops_s"], True),
+    ("p50 ms", lambda r: r["latency_ms"]["p50"], False),
+    ("p99 ms", lambda r: r["latency_ms"]["p99"], False),
+    ("max_rss_kib", lambda r: r["max_rss_kib"], False),
+    ("log_bytes_per_run", lambda r: r["log_bytes_per_run"], False),
+]
+
+
+def compare(results, path, threshold):
+    """Prints the metrics that got worse than before by more than
+    threshold percent, and returns how many there were"""
+    with open(path) as f:
+        before = {(r["variant"], r["workload"]): r for r in json.load(f)["results"]}
+    regressions = 0
+    for r in results:
+        old = before.get((r["variant"], r["workload"]))
+        if old is None:
+            continue
+        for metric, get, higher_is_better in COMPARED:
+            a, b = get(old), get(r)
+            if not a:
+                continue
+            change = (b - a) * 100 / a
+            if (-change if higher_is_better else change) > threshold:
+                regressions += 1
+                print("REGRESSION {:<20} {:<9} {:<18} {:>12.2f} -> {:>12.2f} ({:+.1f}%)".format(
+                    r["variant"], r["workload"], metric, a, b, change), file=sys.stderr)
+    return regressions
+
+
+def main():
+    args = parser.parse_args()
+    workloads = args.workloads.split(",")
+    unknown = set(workloads) - set(WORKLOADS)
+    if unknown:
+        parser.error("unknown workloads: " + ", ".join(sorted(unknown)))
+    variants = find_variants(args)
+    # keep the table off stdout when the JSON goes there
+    out = sys.stderr if args.json == "-" else sys.stdout
+
+    server = Server(("127.0.0.1", 0), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    port = server.server_address[1]
+
+    results = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for workload in workloads:
+            # named so that they do not shadow the modules they import
+            write_script(os.path.join(tmp, "workload_" + workload + ".py"),
+                         WORKLOADS[workload][1])
+        with open(os.path.join(tmp, "pickle.allow"), "w") as f:
+            f.write(PICKLE_ALLOW)
+        with open(os.path.join(tmp, "netpolicy"), "w") as f:
+            f.write(NET_POLICY)
+        with open(os.path.join(tmp, "composable.conf"), "w") as f:
+            f.write(COMPOSABLE_CONF.format(root=ROOT, logdir=os.path.join(tmp, "log")))
+
+        print("{:<20} {:<9} {:>10} {:>9} {:>9} {:>9} {:>9} {:>11}".format(
+            "variant", "workload", "ops/s", "p50 ms", "p90 ms", "p99 ms", "RSS KiB",
+            "log B/run"), file=out)
+        for variant in variants:
+            for workload in workloads:
+                try:
+                    r = bench(variant, workload, args, tmp, port)
+                except (OSError, RuntimeError) as ex:
+                    print("{:<20} {:<9} failed: {}".format(variant[0], workload, ex),
+                          file=sys.stderr)
+                    continue
+                results.append(r)
+                print("{:<20} {:<9} {:>10.1f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9} {:>11}".format(
+                    r["variant"], r["workload"], r["throughput_ops_s"],
+                    r["latency_ms"]["p50"], r["latency_ms"]["p90"], r["latency_ms"]["p99"],
+                    r["max_rss_kib"], r["log_bytes_per_run"]), file=out)
+    server.shutdown()
+
+    if args.json:
+        document = {"metadata": metadata(args), "results": results}
+        if args.json == "-":
+            json.dump(document, sys.stdout, indent=2)
+            print()
+        else:
+            with open(args.json, "w") as f:
+                json.dump(document, f, indent=2)
+                f.write("\n")
+    if args.compare and compare(results, args.compare, args.threshold):
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,89 @@
+/* LogToFile as a plugin: writes every event to the file named by the
+ * 'log' option, or to stderr.
+ */
+#include "spython_plugin.h"
+
+static FILE *audit_log = NULL;
+
+static int
+log_import(const char *event, PyObject *args, void *state)
+{
+    PyObject *module, *filename, *sysPath, *sysMetaPath, *sysPathHooks;
+    if (!PyArg_ParseTuple(args, "OOOOO", &module, &filename, &sysPath,
+                          &sysMetaPath, &sysPathHooks)) {
+        return -1;
+    }
+
+    PyObject *msg;
+    if (PyObject_IsTrue(filename)) {
+        msg = PyUnicode_FromFormat("importing %S from %S", module, filename);
+    } else {
+        msg = PyUnicode_FromFormat("importing %S", module);
+    }
+    if (!msg) {
+        return -1;
+    }
+
+    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
+    Py_DECREF(msg);
+    return 0;
+}
+
+static int
+log_compile(const char *event, PyObject *args, void *state)
+{
+    PyObject *code, *filename;
+    if (!PyArg_ParseTuple(args, "OO", &code, &filename)) {
+        return -1;
+    }
+
+    /* Do not print the full code of every module */
+    if (PyObject_IsTrue(filename)) {
+        fprintf(audit_log, "%s: compiling %s\n", event,
+                PyUnicode_Check(filename) ? PyUnicode_AsUTF8(filename) : "?");
+    } else {
+        fprintf(audit_log, "%s: compiling <%s>\n", event, Py_TYPE(code)->tp_name);
+    }
+    return 0;
+}
+
+static int
+log_default(const char *event, PyObject *args, void *state)
+{
+    if (!Py_IsInitialized()) {
+        fprintf(audit_log, "%s: during startup/shutdown we cannot call repr() on arguments\n", event);
+        return 0;
+    }
+
+    PyObject *msg = PyObject_Repr(args);
+    if (!msg) {
+        return -1;
+    }
+
+    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
+    Py_DECREF(msg);
+    return 0;
+}
+
+int
+spython_plugin_init(const spython_api *api, spython_registry *reg)
+{
+    const char *path = api->get_option(reg, "log");
+    if (path) {
+        audit_log = fopen(path, "w");
+        if (!audit_log) {
+            fprintf(stderr, "Fatal Python error: "
+                "failed to open log file: %s\n", path);
+            return -1;
+        }
+    } else {
+        audit_log = stderr;
+    }
+
+    if (api->add_handler(reg, "import", log_import, NULL, 0) < 0
+        || api->add_handler(reg, "compile", log_compile, NULL, 0) < 0
+        || api->add_handler(reg, "*", log_default, NULL, SPYTHON_FALLBACK) < 0) {
+        return -1;
+    }
+    return 0;
+}
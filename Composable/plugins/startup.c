@@ -0,0 +1,21 @@
+/* StartupControl as a plugin: disallows all ways of launching Python
+ * other than passing a filename.
+ */
+#include "spython_plugin.h"
+
+static int
+startup_hook(const char *event, PyObject *args, void *state)
+{
+    /* cpython.run_*(*) - disable launch options except run_file */
+    if (strcmp(event, "cpython.run_file") != 0) {
+        PyErr_Format(PyExc_OSError, "'%.100s' is disabled by policy", &event[8]);
+        return -1;
+    }
+    return 0;
+}
+
+int
+spython_plugin_init(const spython_api *api, spython_registry *reg)
+{
+    return api->add_handler(reg, "cpython.run_*", startup_hook, NULL, 0);
+}
@@ -0,0 +1,167 @@
+/* linux_xattr as a plugin: reads code only from regular files on
+ * executable file systems, whose SHA-256 matches the hash stored in
+ * the user.org.python.x-spython-hash extended attribute.
+ *
+ * When built with HAVE_SECCOMP, setxattr syscalls are also blocked.
+ */
+#include "spython_plugin.h"
+#include "pystrhex.h"
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#ifdef HAVE_SECCOMP
+#include <sys/prctl.h>
+#include <seccomp.h>
+#endif
+
+#include <openssl/evp.h>
+
+// 2 MB
+#define MAX_PY_FILE_SIZE (2*1024*1024)
+
+#define XATTR_NAME "user.org.python.x-spython-hash"
+#define XATTR_LENGTH ((EVP_MAX_MD_SIZE * 2) + 1)
+
+#ifdef HAVE_SECCOMP
+static int
+xattr_seccomp_setxattr(void)
+{
+    scmp_filter_ctx ctx = seccomp_init(SCMP_ACT_ALLOW);
+    int rc = -1;
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+        perror("PR_SET_NO_NEW_PRIVS=1\n");
+        return -1;
+    }
+    if (ctx == NULL) {
+        return -1;
+    }
+    if (seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(setxattr), 0) >= 0
+        && seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(fsetxattr), 0) >= 0
+        && seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(lsetxattr), 0) >= 0) {
+        rc = seccomp_load(ctx);
+    }
+    seccomp_release(ctx);
+    if (rc != 0) {
+        perror("seccomp failed.\n");
+    }
+    return rc;
+}
+#endif
+
+static int
+xattr_check_file(const char *filename, int fd, struct stat *sb)
+{
+    struct statvfs sbvfs;
+
+    if (fstat(fd, sb) == -1 || fstatvfs(fd, &sbvfs) == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return -1;
+    }
+    if (!S_ISREG(sb->st_mode) || (sbvfs.f_flag & ST_NOEXEC) == ST_NOEXEC) {
+        errno = EINVAL;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return -1;
+    }
+    if (sb->st_size > MAX_PY_FILE_SIZE) {
+        errno = EFBIG;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+xattr_read_verified(const char *filename, int fd)
+{
+    struct stat sb;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    char expected[XATTR_LENGTH];
+    PyObject *buffer, *file_hash;
+
+    if (xattr_check_file(filename, fd, &sb) < 0) {
+        return NULL;
+    }
+
+    buffer = PyBytes_FromStringAndSize(NULL, sb.st_size);
+    if (!buffer) {
+        return NULL;
+    }
+    char *p = PyBytes_AS_STRING(buffer);
+    for (Py_ssize_t done = 0; done < sb.st_size; ) {
+        ssize_t r = read(fd, p + done, sb.st_size - done);
+        if (r <= 0) {
+            if (r == 0) {
+                errno = EIO;
+            }
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+            Py_DECREF(buffer);
+            return NULL;
+        }
+        done += r;
+    }
+
+    if (!EVP_Digest(p, sb.st_size, digest, &digest_size, EVP_sha256(), NULL)) {
+        PyErr_SetString(PyExc_ValueError, "EVP_Digest SHA-256 failed");
+        Py_DECREF(buffer);
+        return NULL;
+    }
+    file_hash = _Py_strhex((const char *)digest, (Py_ssize_t)digest_size);
+    ssize_t size = fgetxattr(fd, XATTR_NAME, expected, sizeof(expected) - 1);
+    if (!file_hash || size < 0) {
+        if (file_hash) {
+            PyErr_Format(PyExc_OSError, "File %s has no xattr %s.", filename, XATTR_NAME);
+        }
+        Py_XDECREF(file_hash);
+        Py_DECREF(buffer);
+        return NULL;
+    }
+    expected[size] = '\0';
+    if (strcmp(PyUnicode_AsUTF8(file_hash), expected) != 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "File hash mismatch: %s (expected: '%s', got %R)",
+                     filename, expected, file_hash);
+        Py_DECREF(file_hash);
+        Py_DECREF(buffer);
+        return NULL;
+    }
+    Py_DECREF(file_hash);
+    return buffer;
+}
+
+static PyObject *
+xattr_read_code(PyObject *path, void *state)
+{
+    PyObject *filename_obj = NULL, *buffer = NULL;
+
+    if (!PyUnicode_FSConverter(path, &filename_obj)) {
+        return NULL;
+    }
+    const char *filename = PyBytes_AS_STRING(filename_obj);
+    int fd = _Py_open(filename, O_RDONLY);
+    if (fd >= 0) {
+        buffer = xattr_read_verified(filename, fd);
+        close(fd);
+    }
+    Py_DECREF(filename_obj);
+    return buffer;
+}
+
+int
+spython_plugin_init(const spython_api *api, spython_registry *reg)
+{
+#ifdef HAVE_SECCOMP
+    const char *seccomp = api->get_option(reg, "seccomp");
+    if (!seccomp || strcmp(seccomp, "no") != 0) {
+        if (xattr_seccomp_setxattr() < 0) {
+            return -1;
+        }
+    }
+#endif
+    return api->set_read_code(reg, xattr_read_code, NULL);
+}
@@ -0,0 +1,627 @@
+/* Composable spython with pluggable hook modules
+ *
+ * Plugins listed in the configuration file are loaded before Python is
+ * initialized and register handlers for events. All handlers are merged
+ * into a single audit hook: the first time an event name is seen, the
+ * handlers that apply to it are resolved into a chain, which is cached
+ * so that later events cost one hash lookup regardless of how many
+ * plugins are loaded. Lookups take no lock, so the hook scales across
+ * threads on free-threaded builds; only building a new chain does.
+ */
+#include "Python.h"
+#include "spython_plugin.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_PLUGINS 32
+#define MAX_OPTIONS 32
+#define MAX_CHECKS 8
+#define CHAIN_TABLE_MIN_SIZE 256
+#define CHAIN_TABLE_MAX_USED 4096
+
+typedef struct _PluginOption {
+    char *name;
+    char *value;
+} PluginOption;
+
+struct _spython_registry {
+    char *name;
+    char *path;
+    void *handle;
+    int noptions;
+    PluginOption options[MAX_OPTIONS];
+};
+
+typedef struct _Handler {
+    char *event;
+    size_t len;
+    int is_prefix;
+    int flags;
+    spython_registry *plugin;
+    spython_event_handler fn;
+    void *state;
+} Handler;
+
+typedef struct _ChainLink {
+    spython_event_handler fn;
+    void *state;
+} ChainLink;
+
+/* event is published last, so a reader that sees it sees the rest */
+typedef struct _Chain {
+    _Atomic(char *) event;
+    Py_uhash_t hash;
+    int n;
+    ChainLink *links;
+} Chain;
+
+typedef struct _ChainTable {
+    size_t size;
+    size_t used;
+    struct _ChainTable *retired;
+    Chain slots[];
+} ChainTable;
+
+static spython_registry plugins[MAX_PLUGINS];
+static int nplugins = 0;
+
+static Handler *handlers = NULL;
+static int nhandlers = 0;
+
+/* Open addressing, size is a power of two. When the table grows, the
+   old one is kept on the retired list because other threads may still
+   be probing it; chains are shared between both. Once the table holds
+   CHAIN_TABLE_MAX_USED names, chains for new names are built for each
+   event and not cached, so neither the table nor the retired list can
+   grow without bound. */
+static _Atomic(ChainTable *) chains = NULL;
+static pthread_mutex_t chains_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static spython_read_code_handler read_code = NULL;
+static void *read_code_state = NULL;
+static spython_check_code_handler check_code[MAX_CHECKS];
+static void *check_code_state[MAX_CHECKS];
+static int ncheck_code = 0;
+
+
+static int
+api_add_handler(spython_registry *reg, const char *event,
+                spython_event_handler fn, void *state, int flags)
+{
+    Handler *h = (Handler*)realloc(handlers, (nhandlers + 1) * sizeof(Handler));
+    if (!h) {
+        return -1;
+    }
+    handlers = h;
+    h = &handlers[nhandlers];
+    h->len = strlen(event);
+    h->is_prefix = h->len && event[h->len - 1] == '*';
+    if (h->is_prefix) {
+        h->len -= 1;
+    }
+    h->event = strdup(event);
+    if (!h->event) {
+        return -1;
+    }
+    h->flags = flags;
+    h->plugin = reg;
+    h->fn = fn;
+    h->state = state;
+    nhandlers += 1;
+    return 0;
+}
+
+static int
+api_set_read_code(spython_registry *reg, spython_read_code_handler fn, void *state)
+{
+    if (read_code) {
+        fprintf(stderr, "plugin %s: another plugin already reads code\n", reg->name);
+        return -1;
+    }
+    read_code = fn;
+    read_code_state = state;
+    return 0;
+}
+
+static int
+api_add_check_code(spython_registry *reg, spython_check_code_handler fn, void *state)
+{
+    if (ncheck_code == MAX_CHECKS) {
+        fprintf(stderr, "plugin %s: too many code checks\n", reg->name);
+        return -1;
+    }
+    check_code[ncheck_code] = fn;
+    check_code_state[ncheck_code] = state;
+    ncheck_code += 1;
+    return 0;
+}
+
+static const char *
+api_get_option(spython_registry *reg, const char *name)
+{
+    for (int i = 0; i < reg->noptions; ++i) {
+        if (strcmp(reg->options[i].name, name) == 0) {
+            return reg->options[i].value;
+        }
+    }
+    return NULL;
+}
+
+static const spython_api api = {
+    SPYTHON_PLUGIN_API_VERSION,
+    api_add_handler,
+    api_set_read_code,
+    api_add_check_code,
+    api_get_option,
+};
+
+static Py_uhash_t
+event_hash(const char *event)
+{
+    /* FNV-1a */
+    Py_uhash_t h = 2166136261u;
+    for (; *event; ++event) {
+        h = (h ^ (unsigned char)*event) * 16777619u;
+    }
+    return h;
+}
+
+static int
+handler_matches(const Handler *h, const char *event)
+{
+    if (h->is_prefix) {
+        return strncmp(event, h->event, h->len) == 0;
+    }
+    return strcmp(event, h->event) == 0;
+}
+
+/* Resolves the handlers for one event name, in plugin order. A plugin's
+   fallback handlers are only used if none of its other handlers match. */
+static int
+chain_build(Chain *chain, const char *event)
+{
+    chain->links = (ChainLink*)malloc((nhandlers + 1) * sizeof(ChainLink));
+    if (!chain->links) {
+        return -1;
+    }
+    chain->n = 0;
+    for (int p = 0; p < nplugins; ++p) {
+        int matched = 0;
+        for (int pass = 0; pass < 2 && !matched; ++pass) {
+            int want = pass == 0 ? 0 : SPYTHON_FALLBACK;
+            for (int i = 0; i < nhandlers; ++i) {
+                const Handler *h = &handlers[i];
+                if (h->plugin != &plugins[p]
+                    || (h->flags & SPYTHON_FALLBACK) != want
+                    || !handler_matches(h, event)) {
+                    continue;
+                }
+                chain->links[chain->n].fn = h->fn;
+                chain->links[chain->n].state = h->state;
+                chain->n += 1;
+                matched = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static Chain *
+chain_find(ChainTable *table, const char *event, Py_uhash_t hash)
+{
+    size_t mask = table->size - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        Chain *c = &table->slots[i];
+        char *e = atomic_load_explicit(&c->event, memory_order_acquire);
+        if (!e || (c->hash == hash && strcmp(e, event) == 0)) {
+            return c;
+        }
+    }
+}
+
+/* Called with chains_lock held */
+static ChainTable *
+chain_grow(ChainTable *old)
+{
+    size_t new_size = old ? old->size * 2 : CHAIN_TABLE_MIN_SIZE;
+    ChainTable *table = (ChainTable*)calloc(1, sizeof(ChainTable)
+                                               + new_size * sizeof(Chain));
+    if (!table) {
+        return NULL;
+    }
+    table->size = new_size;
+    table->retired = old;
+    for (size_t i = 0; old && i < old->size; ++i) {
+        char *e = atomic_load_explicit(&old->slots[i].event, memory_order_relaxed);
+        if (e) {
+            Chain *c = chain_find(table, e, old->slots[i].hash);
+            c->hash = old->slots[i].hash;
+            c->n = old->slots[i].n;
+            c->links = old->slots[i].links;
+            atomic_store_explicit(&c->event, e, memory_order_relaxed);
+            table->used += 1;
+        }
+    }
+    atomic_store_explicit(&chains, table, memory_order_release);
+    return table;
+}
+
+/* Returns the cached chain for event, or builds it into uncached if
+   the table is full. The caller frees uncached->links. */
+static Chain *
+chain_lookup(const char *event, Chain *uncached)
+{
+    Py_uhash_t hash = event_hash(event);
+    ChainTable *table = atomic_load_explicit(&chains, memory_order_acquire);
+    Chain *c;
+    if (table) {
+        c = chain_find(table, event, hash);
+        if (atomic_load_explicit(&c->event, memory_order_relaxed)) {
+            return c;
+        }
+    }
+
+    /* Slow path: another thread may have added it while we waited */
+    pthread_mutex_lock(&chains_lock);
+    table = atomic_load_explicit(&chains, memory_order_relaxed);
+    c = table ? chain_find(table, event, hash) : NULL;
+    if (!c || !atomic_load_explicit(&c->event, memory_order_relaxed)) {
+        if (table && table->used >= CHAIN_TABLE_MAX_USED) {
+            pthread_mutex_unlock(&chains_lock);
+            return chain_build(uncached, event) < 0 ? NULL : uncached;
+        }
+        if (!table || (table->used + 1) * 2 > table->size) {
+            table = chain_grow(table);
+            if (!table) {
+                pthread_mutex_unlock(&chains_lock);
+                return NULL;
+            }
+            c = chain_find(table, event, hash);
+        }
+        Chain chain = { NULL, hash, 0, NULL };
+        char *e = strdup(event);
+        if (!e || chain_build(&chain, event) < 0) {
+            free(e);
+            pthread_mutex_unlock(&chains_lock);
+            return NULL;
+        }
+        c->hash = hash;
+        c->n = chain.n;
+        c->links = chain.links;
+        atomic_store_explicit(&c->event, e, memory_order_release);
+        table->used += 1;
+    }
+    pthread_mutex_unlock(&chains_lock);
+    return c;
+}
+
+static int
+composed_hook(const char *event, PyObject *args, void *userData)
+{
+    Chain uncached = { NULL, 0, 0, NULL };
+    Chain *chain = chain_lookup(event, &uncached);
+    int result = 0;
+    if (!chain) {
+        if (Py_IsInitialized()) {
+            PyErr_NoMemory();
+        }
+        return -1;
+    }
+    for (int i = 0; i < chain->n; ++i) {
+        if (chain->links[i].fn(event, args, chain->links[i].state) < 0) {
+            result = -1;
+            break;
+        }
+    }
+    free(uncached.links);
+    return result;
+}
+
+/* Cached reference to the _io module. Hooks may run on many threads at
+   once without a GIL, so the first thread to import it publishes it and
+   any others release their own reference. */
+static _Atomic(PyObject *) io_module = NULL;
+
+static PyObject *
+spython_get_io(void)
+{
+    PyObject *io = atomic_load_explicit(&io_module, memory_order_acquire);
+    if (io) {
+        return io;
+    }
+    io = PyImport_ImportModule("_io");
+    if (!io) {
+        return NULL;
+    }
+    PyObject *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&io_module, &expected, io,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        Py_DECREF(io);
+        io = expected;
+    }
+    return io;
+}
+
+static PyObject *
+default_read_code(PyObject *path, void *state)
+{
+    PyObject *io;
+    PyObject *stream, *buffer, *err;
+
+    io = spython_get_io();
+    if (!io) {
+        return NULL;
+    }
+
+    stream = PyObject_CallMethod(io, "open", "Osisssi", path, "rb",
+                                 -1, NULL, NULL, NULL, 1);
+    if (!stream) {
+        return NULL;
+    }
+
+    buffer = PyObject_CallMethod(stream, "read", "(i)", -1);
+    err = PyObject_CallMethod(stream, "close", NULL);
+    Py_DECREF(stream);
+    if (!buffer || !err) {
+        Py_XDECREF(buffer);
+        Py_XDECREF(err);
+        return NULL;
+    }
+    Py_DECREF(err);
+    return buffer;
+}
+
+/* Reads with the plugin provider (or plainly), runs every check over
+   the same buffer, and wraps it in a BytesIO */
+static PyObject *
+composed_open_code(PyObject *path, void *userData)
+{
+    PyObject *io;
+
+    if (PySys_Audit("spython.open_code", "O", path) < 0) {
+        return NULL;
+    }
+
+    PyObject *buffer = read_code ? read_code(path, read_code_state)
+                                 : default_read_code(path, NULL);
+    if (!buffer) {
+        return NULL;
+    }
+    for (int i = 0; i < ncheck_code; ++i) {
+        if (check_code[i](path, buffer, check_code_state[i]) < 0) {
+            Py_DECREF(buffer);
+            return NULL;
+        }
+    }
+
+    io = spython_get_io();
+    if (!io) {
+        Py_DECREF(buffer);
+        return NULL;
+    }
+    return PyObject_CallMethod(io, "BytesIO", "N", buffer);
+}
+
+static char *
+strip(char *s)
+{
+    while (*s == ' ' || *s == '\t') {
+        ++s;
+    }
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t'
+                       || end[-1] == '\r' || end[-1] == '\n')) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+/* Configuration files and plugins decide what the hooks allow, so refuse
+   any that users other than the owner can change */
+static int
+check_not_writable(int fd, const char *path)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Fatal Python error: failed to stat %s\n", path);
+        return -1;
+    }
+    if (st.st_mode & (S_IWGRP | S_IWOTH)) {
+        fprintf(stderr, "Fatal Python error: "
+                "%s is writable by group or others\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads an INI-style file. Each [section] is a plugin, and its 'plugin'
+   option is the path to the shared library, relative to the file. */
+static int
+config_read(const char *path)
+{
+    char line[1024];
+    char dir[PATH_MAX];
+    char full[PATH_MAX * 2];
+    int lineno = 0;
+    spython_registry *current = NULL;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Fatal Python error: "
+                "failed to open configuration file: %s\n", path);
+        return -1;
+    }
+    if (check_not_writable(fileno(f), path) < 0) {
+        fclose(f);
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s", path);
+    dirname(dir);
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno += 1;
+        char *s = strip(line);
+        if (!*s || *s == '#' || *s == ';') {
+            continue;
+        }
+        if (*s == '[') {
+            char *end = strchr(s, ']');
+            if (!end || nplugins == MAX_PLUGINS) {
+                goto invalid;
+            }
+            *end = '\0';
+            current = &plugins[nplugins++];
+            current->name = strdup(strip(s + 1));
+            continue;
+        }
+        char *eq = strchr(s, '=');
+        if (!eq || !current || current->noptions == MAX_OPTIONS) {
+            goto invalid;
+        }
+        *eq = '\0';
+        char *name = strip(s), *value = strip(eq + 1);
+        if (strcmp(name, "plugin") == 0) {
+            snprintf(full, sizeof(full), "%s/%s", value[0] == '/' ? "" : dir, value);
+            current->path = strdup(value[0] == '/' ? value : full);
+        } else {
+            current->options[current->noptions].name = strdup(name);
+            current->options[current->noptions].value = strdup(value);
+            current->noptions += 1;
+        }
+    }
+    fclose(f);
+    return 0;
+
+  invalid:
+    fprintf(stderr, "%s:%d: invalid configuration line\n", path, lineno);
+    fclose(f);
+    return -1;
+}
+
+/* Plugins are loaded through the descriptor that was checked, so the
+   file cannot be swapped between the check and dlopen(). Descriptors stay
+   open until every plugin is loaded, because dlopen() would return an
+   earlier plugin for a /proc/self/fd path that it has already seen. */
+static int
+plugin_load(spython_registry *p, int *fd)
+{
+    char fd_path[64];
+    if (!p->path) {
+        fprintf(stderr, "plugin %s: no 'plugin' path given\n", p->name);
+        return -1;
+    }
+    *fd = open(p->path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        fprintf(stderr, "plugin %s: failed to open %s\n", p->name, p->path);
+        return -1;
+    }
+    if (check_not_writable(*fd, p->path) < 0) {
+        return -1;
+    }
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", *fd);
+    p->handle = dlopen(fd_path, RTLD_NOW | RTLD_LOCAL);
+    if (!p->handle) {
+        fprintf(stderr, "plugin %s: %s\n", p->name, dlerror());
+        return -1;
+    }
+    spython_plugin_init_func init = (spython_plugin_init_func)dlsym(
+        p->handle, SPYTHON_PLUGIN_INIT);
+    if (!init) {
+        fprintf(stderr, "plugin %s: %s\n", p->name, dlerror());
+        return -1;
+    }
+    if (init(&api, p) < 0) {
+        fprintf(stderr, "plugin %s: failed to initialize\n", p->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+plugins_load(void)
+{
+    int fds[MAX_PLUGINS];
+    int result = 0;
+    for (int i = 0; i < nplugins; ++i) {
+        fds[i] = -1;
+    }
+    for (int i = 0; i < nplugins && result == 0; ++i) {
+        result = plugin_load(&plugins[i], &fds[i]);
+    }
+    for (int i = 0; i < nplugins; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return result;
+}
+
+int
+main(int argc, char **argv)
+{
+    PyStatus status;
+    PyConfig config;
+
+    /* load plugins from SPYTHONCONFIG, or <executable>.conf. argv[0] is
+       not used, because it is only a name when spython is run from PATH
+       and would find a file in the current directory. */
+    const char *config_path = getenv("SPYTHONCONFIG");
+    char default_path[PATH_MAX];
+    if (!config_path || !*config_path) {
+        ssize_t len = readlink("/proc/self/exe", default_path,
+                               sizeof(default_path) - sizeof(".conf"));
+        if (len < 0) {
+            fprintf(stderr, "Fatal Python error: "
+                    "failed to locate the executable, set SPYTHONCONFIG\n");
+            return 1;
+        }
+        memcpy(default_path + len, ".conf", sizeof(".conf"));
+        config_path = default_path;
+    }
+    if (config_read(config_path) < 0 || plugins_load() < 0) {
+        return 1;
+    }
+
+    /* install one hook for all plugins */
+    PySys_AddAuditHook(composed_hook, NULL);
+    if (read_code || ncheck_code) {
+        PyFile_SetOpenCodeHook(composed_open_code, NULL);
+    }
+
+    /* initialize Python in isolated mode, but allow argv */
+    PyConfig_InitIsolatedConfig(&config);
+
+    /* handle and parse argv */
+    config.parse_argv = 1;
+    status = PyConfig_SetBytesArgv(&config, argc, argv);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+
+    /* Py_InitializeFromConfig() reads the config itself. Reading it here
+       first makes 3.8 parse argv twice and lose the script name. */
+    status = Py_InitializeFromConfig(&config);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+    PyConfig_Clear(&config);
+
+    return Py_RunMain();
+
+  fail:
+    PyConfig_Clear(&config);
+    if (PyStatus_IsExit(status)) {
+        return status.exitcode;
+    }
+    /* Display the error message and exit the process with
+       non-zero exit code */
+    Py_ExitStatusException(status);
+}
@@ -0,0 +1,58 @@
+/* Plugin interface for the composable spython
+ *
+ * A plugin is a shared library exporting spython_plugin_init. It is
+ * called before Python is initialized, and registers handlers with the
+ * functions in the api table. Only the pre-initialization parts of the
+ * Python C API may be used from spython_plugin_init.
+ */
+#ifndef SPYTHON_PLUGIN_H
+#define SPYTHON_PLUGIN_H
+
+#include "Python.h"
+
+#define SPYTHON_PLUGIN_API_VERSION 1
+
+/* Handler flags */
+/* Only called for events no other handler of the same plugin matched */
+#define SPYTHON_FALLBACK 0x1
+
+/* Same signature as an audit hook. Return -1 with an exception set to
+   abort the event, which also stops the remaining handlers. */
+typedef int (*spython_event_handler)(const char *event, PyObject *args,
+                                     void *state);
+
+/* Returns the content of path as a bytes object, or NULL with an
+   exception set. Only one plugin may provide this. */
+typedef PyObject *(*spython_read_code_handler)(PyObject *path, void *state);
+
+/* Inspects the content read for path. Return -1 with an exception set
+   to refuse it. */
+typedef int (*spython_check_code_handler)(PyObject *path, PyObject *buffer,
+                                          void *state);
+
+typedef struct _spython_registry spython_registry;
+
+typedef struct _spython_api {
+    int version;
+
+    /* event is an exact name, a prefix ending in '*', or "*" for all */
+    int (*add_handler)(spython_registry *reg, const char *event,
+                       spython_event_handler handler, void *state, int flags);
+
+    int (*set_read_code)(spython_registry *reg,
+                         spython_read_code_handler handler, void *state);
+
+    int (*add_check_code)(spython_registry *reg,
+                          spython_check_code_handler handler, void *state);
+
+    /* Options come from the plugin's section of the configuration
+       file. Returns NULL if the option is not set. */
+    const char *(*get_option)(spython_registry *reg, const char *name);
+} spython_api;
+
+typedef int (*spython_plugin_init_func)(const spython_api *api,
+                                        spython_registry *reg);
+
+#define SPYTHON_PLUGIN_INIT "spython_plugin_init"
+
+#endif /* SPYTHON_PLUGIN_H */
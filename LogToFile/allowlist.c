@@ -0,0 +1,173 @@
+#include "allowlist.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct _AllowEntry {
+    uint64_t hash;
+    /* "module\0qualname", or NULL for an empty slot */
+    char *key;
+    size_t module_len;
+    size_t name_len;
+} AllowEntry;
+
+struct _Allowlist {
+    /* A power of two, at least twice the number of entries */
+    size_t size;
+    AllowEntry *slots;
+};
+
+/* FNV-1a over the module, a separator and the name */
+static uint64_t
+allow_hash(const char *module, size_t module_len, const char *name, size_t name_len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < module_len; ++i) {
+        h = (h ^ (unsigned char)module[i]) * 0x100000001b3ULL;
+    }
+    h = (h ^ 0xFF) * 0x100000001b3ULL;
+    for (size_t i = 0; i < name_len; ++i) {
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static const AllowEntry *
+allow_find(const Allowlist *allow, const char *module, size_t module_len,
+           const char *name, size_t name_len)
+{
+    uint64_t hash = allow_hash(module, module_len, name, name_len);
+    size_t mask = allow->size - 1;
+    for (size_t i = (size_t)hash & mask; ; i = (i + 1) & mask) {
+        const AllowEntry *e = &allow->slots[i];
+        if (!e->key) {
+            return e;
+        }
+        if (e->hash == hash && e->module_len == module_len &&
+            e->name_len == name_len &&
+            memcmp(e->key, module, module_len) == 0 &&
+            memcmp(e->key + module_len + 1, name, name_len) == 0) {
+            return e;
+        }
+    }
+}
+
+static int
+allow_add(Allowlist *allow, const char *line, const char *path, int lineno)
+{
+    const char *colon = strchr(line, ':');
+    if (!colon || colon == line || !colon[1] || strchr(colon + 1, ':')) {
+        fprintf(stderr, "%s:%d: expected module:qualname\n", path, lineno);
+        return -1;
+    }
+    size_t module_len = colon - line;
+    size_t name_len = strlen(colon + 1);
+    AllowEntry *e = (AllowEntry *)allow_find(allow, line, module_len,
+                                             colon + 1, name_len);
+    if (e->key) {
+        /* Listed twice */
+        return 0;
+    }
+    e->key = strdup(line);
+    if (!e->key) {
+        fprintf(stderr, "out of memory loading %s\n", path);
+        return -1;
+    }
+    e->key[module_len] = '\0';
+    e->hash = allow_hash(line, module_len, colon + 1, name_len);
+    e->module_len = module_len;
+    e->name_len = name_len;
+    return 0;
+}
+
+Allowlist *
+allowlist_load(const char *path)
+{
+    char line[1024];
+    size_t count = 0;
+    int lineno = 0, r = 0;
+    Allowlist *allow = NULL;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    /* Size the table from the number of lines, so it never needs to grow */
+    while (fgets(line, sizeof(line), f)) {
+        ++count;
+    }
+    allow = (Allowlist *)calloc(1, sizeof(Allowlist));
+    if (!allow) {
+        goto error;
+    }
+    for (allow->size = 16; allow->size < count * 2; allow->size *= 2) {
+    }
+    allow->slots = (AllowEntry *)calloc(allow->size, sizeof(AllowEntry));
+    if (!allow->slots) {
+        goto error;
+    }
+
+    rewind(f);
+    while (r == 0 && fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        ++lineno;
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            line[--len] = '\0';
+        }
+        if (len && line[0] != '#') {
+            r = allow_add(allow, line, path, lineno);
+        }
+    }
+    fclose(f);
+    if (r == 0) {
+        return allow;
+    }
+    f = NULL;
+
+error:
+    if (f) {
+        fprintf(stderr, "out of memory loading %s\n", path);
+        fclose(f);
+    }
+    if (allow && allow->slots) {
+        for (size_t i = 0; i < allow->size; ++i) {
+            free(allow->slots[i].key);
+        }
+        free(allow->slots);
+    }
+    free(allow);
+    return NULL;
+}
+
+/* ASCII strings are read in place. Others use the UTF-8 copy that
+   CPython keeps with the string after the first request. */
+static const char *
+allow_utf8(PyObject *s, Py_ssize_t *len)
+{
+    if (!PyUnicode_Check(s)) {
+        return NULL;
+    }
+    if (PyUnicode_IS_ASCII(s)) {
+        *len = PyUnicode_GET_LENGTH(s);
+        return (const char *)PyUnicode_DATA(s);
+    }
+    const char *utf8 = PyUnicode_AsUTF8AndSize(s, len);
+    if (!utf8) {
+        PyErr_Clear();
+    }
+    return utf8;
+}
+
+int
+allowlist_contains(const Allowlist *allow, PyObject *module, PyObject *name)
+{
+    Py_ssize_t module_len, name_len;
+    const char *m = allow_utf8(module, &module_len);
+    const char *n = m ? allow_utf8(name, &name_len) : NULL;
+    if (!n) {
+        return 0;
+    }
+    return allow_find(allow, m, (size_t)module_len, n, (size_t)name_len)->key != NULL;
+}
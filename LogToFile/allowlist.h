@@ -0,0 +1,22 @@
+/* Allowlist of globals that pickle may load
+ *
+ * The file has one "module:qualname" entry per line, such as
+ * "collections:OrderedDict". Blank lines and lines starting with '#' are
+ * ignored. Entries are loaded into an open addressing hash set before
+ * Python is initialized and never change, so lookups take no lock and
+ * never allocate.
+ */
+#ifndef SPYTHON_ALLOWLIST_H
+#define SPYTHON_ALLOWLIST_H
+
+#include "Python.h"
+
+typedef struct _Allowlist Allowlist;
+
+/* Prints the reason and returns NULL on failure */
+Allowlist *allowlist_load(const char *path);
+
+/* Returns 1 if module and name are str and listed. Never raises. */
+int allowlist_contains(const Allowlist *allow, PyObject *module, PyObject *name);
+
+#endif /* SPYTHON_ALLOWLIST_H */
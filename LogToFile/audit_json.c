@@ -0,0 +1,480 @@
+#include "audit_json.h"
+
+#include "pythread.h"
+
+#include <math.h>
+#include <time.h>
+
+#ifdef MS_WINDOWS
+#include <process.h>
+#define getpid _getpid
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Nested containers deeper than this are written as their type */
+#define JSON_MAX_DEPTH 4
+
+
+static void
+json_append(JsonRecord *r, const char *s, size_t n)
+{
+    if (r->failed) {
+        return;
+    }
+    if (r->len + n > r->capacity) {
+        size_t capacity = r->capacity * 2;
+        if (capacity < r->len + n) {
+            capacity = r->len + n;
+        }
+        char *data;
+        if (r->data == r->inline_data) {
+            data = (char*)malloc(capacity);
+            if (data) {
+                memcpy(data, r->data, r->len);
+            }
+        } else {
+            data = (char*)realloc(r->data, capacity);
+        }
+        if (!data) {
+            r->failed = 1;
+            return;
+        }
+        r->data = data;
+        r->capacity = capacity;
+    }
+    memcpy(r->data + r->len, s, n);
+    r->len += n;
+}
+
+#define JSON_LITERAL(r, s) json_append((r), (s), sizeof(s) - 1)
+
+/* snprintf is a large part of the cost of a record, so integers are
+   formatted by hand. Pads with zeros to at least width digits. */
+static void
+json_uint(JsonRecord *r, unsigned long long v, int width)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+        --width;
+    } while (v || width > 0);
+    json_append(r, p, buf + sizeof(buf) - p);
+}
+
+static void
+json_int(JsonRecord *r, long long v)
+{
+    if (v < 0) {
+        JSON_LITERAL(r, "-");
+        json_uint(r, 0ULL - (unsigned long long)v, 0);
+    } else {
+        json_uint(r, (unsigned long long)v, 0);
+    }
+}
+
+/* Writes the characters of a JSON string, without the quotes */
+static void
+json_escape_chars(JsonRecord *r, const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+
+    for (const char *end = s + n; s < end; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        json_append(r, run, s - run);
+        run = s + 1;
+        switch (c) {
+        case '"': JSON_LITERAL(r, "\\\""); break;
+        case '\\': JSON_LITERAL(r, "\\\\"); break;
+        case '\n': JSON_LITERAL(r, "\\n"); break;
+        case '\r': JSON_LITERAL(r, "\\r"); break;
+        case '\t': JSON_LITERAL(r, "\\t"); break;
+        default: {
+            char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            json_append(r, u, sizeof(u));
+        }
+        }
+    }
+    json_append(r, run, s - run);
+}
+
+static void
+json_escape(JsonRecord *r, const char *s, size_t n)
+{
+    JSON_LITERAL(r, "\"");
+    json_escape_chars(r, s, n);
+    JSON_LITERAL(r, "\"");
+}
+
+static void
+json_key(JsonRecord *r, const char *key)
+{
+    JSON_LITERAL(r, ", ");
+    json_escape(r, key, strlen(key));
+    JSON_LITERAL(r, ": ");
+}
+
+static void
+json_type(JsonRecord *r, PyObject *obj)
+{
+    const char *name = Py_TYPE(obj)->tp_name;
+    JSON_LITERAL(r, "{\"type\": ");
+    json_escape(r, name, strlen(name));
+    JSON_LITERAL(r, "}");
+}
+
+/* Strings are converted to UTF-8 by hand, because events such as
+   marshal.loads are raised before the codec registry exists, and errors
+   from the codecs would look up their error handler there */
+static void
+json_scratch_init(JsonRecord *scratch)
+{
+    scratch->data = scratch->inline_data;
+    scratch->len = 0;
+    scratch->capacity = sizeof(scratch->inline_data);
+    scratch->failed = 0;
+}
+
+/* Escapes the UTF-8 collected in scratch into r and empties scratch */
+static void
+json_scratch_flush(JsonRecord *r, JsonRecord *scratch)
+{
+    if (scratch->failed) {
+        r->failed = 1;
+    } else {
+        json_escape_chars(r, scratch->data, scratch->len);
+    }
+    scratch->len = 0;
+}
+
+static void
+json_scratch_free(JsonRecord *scratch)
+{
+    if (scratch->data != scratch->inline_data) {
+        free(scratch->data);
+    }
+}
+
+/* Writes a str as UTF-8. Lone surrogates, such as those in file names
+   that were not valid in the file system encoding, cannot be encoded and
+   are written as \udcxx escapes, which JSON decoders such as Python's
+   json module turn back into the same surrogate. */
+static void
+json_unicode(JsonRecord *r, PyObject *s, Py_ssize_t max_len)
+{
+    static const char hex[] = "0123456789abcdef";
+    Py_ssize_t len = PyUnicode_GET_LENGTH(s);
+    if (max_len >= 0 && len > max_len) {
+        len = max_len;
+    }
+    if (PyUnicode_IS_ASCII(s)) {
+        json_escape(r, (const char *)PyUnicode_DATA(s), (size_t)len);
+        return;
+    }
+
+    JsonRecord utf8;
+    int kind = PyUnicode_KIND(s);
+    const void *data = PyUnicode_DATA(s);
+    json_scratch_init(&utf8);
+    JSON_LITERAL(r, "\"");
+    for (Py_ssize_t i = 0; i < len; ++i) {
+        Py_UCS4 ch = PyUnicode_READ(kind, data, i);
+        char buf[6];
+        if (ch < 0x80) {
+            buf[0] = (char)ch;
+            json_append(&utf8, buf, 1);
+        } else if (ch < 0x800) {
+            buf[0] = (char)(0xC0 | (ch >> 6));
+            buf[1] = (char)(0x80 | (ch & 0x3F));
+            json_append(&utf8, buf, 2);
+        } else if (ch >= 0xD800 && ch <= 0xDFFF) {
+            json_scratch_flush(r, &utf8);
+            buf[0] = '\\';
+            buf[1] = 'u';
+            for (int j = 5; j >= 2; --j, ch >>= 4) {
+                buf[j] = hex[ch & 0xF];
+            }
+            json_append(r, buf, 6);
+        } else if (ch < 0x10000) {
+            buf[0] = (char)(0xE0 | (ch >> 12));
+            buf[1] = (char)(0x80 | ((ch >> 6) & 0x3F));
+            buf[2] = (char)(0x80 | (ch & 0x3F));
+            json_append(&utf8, buf, 3);
+        } else {
+            buf[0] = (char)(0xF0 | (ch >> 18));
+            buf[1] = (char)(0x80 | ((ch >> 12) & 0x3F));
+            buf[2] = (char)(0x80 | ((ch >> 6) & 0x3F));
+            buf[3] = (char)(0x80 | (ch & 0x3F));
+            json_append(&utf8, buf, 4);
+        }
+    }
+    json_scratch_flush(r, &utf8);
+    json_scratch_free(&utf8);
+    JSON_LITERAL(r, "\"");
+}
+
+/* Bytes are written as {"type": "bytes", "b64": "<base64>"}, so they can
+   be told apart from str and decoded exactly */
+static void
+json_bytes(JsonRecord *r, PyObject *b, Py_ssize_t max_len)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    Py_ssize_t len = PyBytes_GET_SIZE(b);
+    if (max_len >= 0 && len > max_len) {
+        len = max_len;
+    }
+    const unsigned char *s = (const unsigned char *)PyBytes_AS_STRING(b);
+    char buf[4];
+
+    JSON_LITERAL(r, "{\"type\": \"bytes\", \"b64\": \"");
+    for (Py_ssize_t i = 0; i < len; i += 3) {
+        unsigned int v = (unsigned int)s[i] << 16;
+        if (i + 1 < len) {
+            v |= (unsigned int)s[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            v |= s[i + 2];
+        }
+        buf[0] = b64[(v >> 18) & 0x3F];
+        buf[1] = b64[(v >> 12) & 0x3F];
+        buf[2] = i + 1 < len ? b64[(v >> 6) & 0x3F] : '=';
+        buf[3] = i + 2 < len ? b64[v & 0x3F] : '=';
+        json_append(r, buf, 4);
+    }
+    JSON_LITERAL(r, "\"}");
+}
+
+static void
+json_value(JsonRecord *r, PyObject *obj, int depth)
+{
+    char buf[32];
+
+    if (obj == Py_None) {
+        JSON_LITERAL(r, "null");
+    } else if (obj == Py_True) {
+        JSON_LITERAL(r, "true");
+    } else if (obj == Py_False) {
+        JSON_LITERAL(r, "false");
+    } else if (PyLong_Check(obj)) {
+        int overflow;
+        long long v = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (!overflow && !(v == -1 && PyErr_Occurred())) {
+            json_int(r, v);
+        } else {
+            PyErr_Clear();
+            PyObject *digits = PyNumber_ToBase(obj, 10);
+            if (digits) {
+                Py_ssize_t len;
+                const char *s = PyUnicode_AsUTF8AndSize(digits, &len);
+                if (s) {
+                    json_append(r, s, len);
+                }
+                Py_DECREF(digits);
+            }
+            if (!digits || PyErr_Occurred()) {
+                PyErr_Clear();
+                JSON_LITERAL(r, "null");
+            }
+        }
+    } else if (PyFloat_Check(obj)) {
+        double v = PyFloat_AS_DOUBLE(obj);
+        if (isfinite(v)) {
+            json_append(r, buf, snprintf(buf, sizeof(buf), "%.17g", v));
+        } else {
+            JSON_LITERAL(r, "null");
+        }
+    } else if (PyUnicode_Check(obj)) {
+        json_unicode(r, obj, -1);
+    } else if (PyBytes_Check(obj)) {
+        json_bytes(r, obj, -1);
+    } else if ((PyTuple_Check(obj) || PyList_Check(obj)) && depth < JSON_MAX_DEPTH) {
+        PyObject *fast = PySequence_Fast(obj, "");
+        if (!fast) {
+            PyErr_Clear();
+            json_type(r, obj);
+            return;
+        }
+        JSON_LITERAL(r, "[");
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(fast); ++i) {
+            if (i) {
+                JSON_LITERAL(r, ", ");
+            }
+            json_value(r, PySequence_Fast_GET_ITEM(fast, i), depth + 1);
+        }
+        JSON_LITERAL(r, "]");
+        Py_DECREF(fast);
+    } else if (PyDict_Check(obj) && depth < JSON_MAX_DEPTH) {
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+        int first = 1;
+        JSON_LITERAL(r, "{");
+        while (PyDict_Next(obj, &pos, &key, &value)) {
+            /* JSON only allows string keys */
+            if (!PyUnicode_Check(key)) {
+                continue;
+            }
+            if (!first) {
+                JSON_LITERAL(r, ", ");
+            }
+            first = 0;
+            json_unicode(r, key, -1);
+            JSON_LITERAL(r, ": ");
+            json_value(r, value, depth + 1);
+        }
+        JSON_LITERAL(r, "}");
+    } else {
+        json_type(r, obj);
+    }
+}
+
+/* The process ID is cached, and refreshed in forked children */
+static long cached_pid = 0;
+
+#ifndef MS_WINDOWS
+static void
+json_after_fork(void)
+{
+    cached_pid = (long)getpid();
+}
+#endif
+
+static long
+json_pid(void)
+{
+    if (!cached_pid) {
+        cached_pid = (long)getpid();
+#ifndef MS_WINDOWS
+        pthread_atfork(NULL, NULL, json_after_fork);
+#endif
+    }
+    return cached_pid;
+}
+
+/* Formatting the date is most of the cost of a record, so each thread
+   keeps the formatted prefix for the current second */
+typedef struct _JsonTimeCache {
+    time_t sec;
+    size_t len;
+    char prefix[48];
+} JsonTimeCache;
+
+static SPYTHON_THREAD_LOCAL JsonTimeCache time_cache;
+
+void
+json_begin(JsonRecord *r, AuditLog *log, const char *event)
+{
+    struct timespec ts;
+
+    r->data = r->inline_data;
+    r->len = 0;
+    r->capacity = sizeof(r->inline_data);
+    r->failed = 0;
+    r->event = event;
+
+    timespec_get(&ts, TIME_UTC);
+    if (ts.tv_sec != time_cache.sec || !time_cache.len) {
+        struct tm tm;
+#ifdef MS_WINDOWS
+        gmtime_s(&tm, &ts.tv_sec);
+#else
+        gmtime_r(&ts.tv_sec, &tm);
+#endif
+        time_cache.len = strftime(time_cache.prefix, sizeof(time_cache.prefix),
+                                  "{\"ts\": \"%Y-%m-%dT%H:%M:%S", &tm);
+        time_cache.sec = ts.tv_sec;
+    }
+    json_append(r, time_cache.prefix, time_cache.len);
+
+#ifdef PY_HAVE_THREAD_NATIVE_ID
+    unsigned long long tid = PyThread_get_thread_native_id();
+#else
+    unsigned long long tid = PyThread_get_thread_ident();
+#endif
+    JSON_LITERAL(r, ".");
+    json_uint(r, (unsigned long long)(ts.tv_nsec / 1000), 6);
+    JSON_LITERAL(r, "Z\", \"pid\": ");
+    json_int(r, json_pid());
+    JSON_LITERAL(r, ", \"tid\": ");
+    json_uint(r, tid, 0);
+    JSON_LITERAL(r, ", \"interp\": ");
+    json_int(r, audit_log_interp_id(log));
+    json_key(r, "event");
+    json_escape(r, event, strlen(event));
+}
+
+void
+json_field_str(JsonRecord *r, const char *key, const char *value)
+{
+    json_key(r, key);
+    json_escape(r, value, strlen(value));
+}
+
+void
+json_field_int(JsonRecord *r, const char *key, long long value)
+{
+    json_key(r, key);
+    json_int(r, value);
+}
+
+void
+json_field_bool(JsonRecord *r, const char *key, int value)
+{
+    json_key(r, key);
+    if (value) {
+        JSON_LITERAL(r, "true");
+    } else {
+        JSON_LITERAL(r, "false");
+    }
+}
+
+void
+json_field_object(JsonRecord *r, const char *key, PyObject *value)
+{
+    json_key(r, key);
+    json_value(r, value, 0);
+}
+
+void
+json_field_text(JsonRecord *r, const char *key, PyObject *value,
+                Py_ssize_t max_len)
+{
+    int truncated = 0;
+    json_key(r, key);
+    if (PyUnicode_Check(value)) {
+        truncated = PyUnicode_GET_LENGTH(value) > max_len;
+        json_unicode(r, value, max_len);
+    } else if (PyBytes_Check(value)) {
+        truncated = PyBytes_GET_SIZE(value) > max_len;
+        json_bytes(r, value, max_len);
+    } else {
+        json_value(r, value, 0);
+    }
+    if (truncated) {
+        char truncated_key[64];
+        snprintf(truncated_key, sizeof(truncated_key), "%s_truncated", key);
+        json_field_bool(r, truncated_key, 1);
+    }
+}
+
+void
+json_end(JsonRecord *r, AuditLog *log)
+{
+    JSON_LITERAL(r, "}");
+    if (r->failed) {
+        audit_log_drop(log);
+    } else {
+        audit_log_write_record(log, r->event, r->data, r->len);
+    }
+    if (r->data != r->inline_data) {
+        free(r->data);
+    }
+    r->data = NULL;
+}
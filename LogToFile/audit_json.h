@@ -0,0 +1,65 @@
+/* JSON Lines records for LogToFile
+ *
+ * Each record is one JSON object on one line, starting with the fields
+ * every event has:
+ *     {"ts": "2019-08-01T12:00:00.000000Z", "pid": 1, "tid": 1,
+ *      "interp": 0, "event": "import", ...}
+ * followed by the fields for that event:
+ *
+ *     import             module, filename, and sys_path when filename is null
+ *     compile            filename, source (first 200 characters),
+ *                        source_truncated
+ *     open               path, mode, flags
+ *     os.system          command, blocked
+ *     socket.connect     host and port, or address for other families
+ *     spython.open_code  path, allowed, reason
+ *     code.__new__       filename, name, argcount, nlocals, stacksize,
+ *                        flags, and for rejected code error, offset,
+ *                        opcode, oparg, blocked
+ *     pickle.find_class  module, name, blocked
+ *     others             args
+ *
+ * Values are serialized directly from Python objects, without calling
+ * repr() or the json module. Objects with no JSON equivalent are written
+ * as {"type": "<type name>"}, bytes as {"type": "bytes", "b64": ...}, and
+ * lone surrogates in strings as \udcxx escapes.
+ */
+#ifndef SPYTHON_AUDIT_JSON_H
+#define SPYTHON_AUDIT_JSON_H
+
+#include "Python.h"
+#include "audit_log.h"
+
+#define JSON_RECORD_INLINE_SIZE 1024
+
+typedef struct _JsonRecord {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+    const char *event;
+    char inline_data[JSON_RECORD_INLINE_SIZE];
+} JsonRecord;
+
+/* Starts a record with the common fields */
+void json_begin(JsonRecord *r, AuditLog *log, const char *event);
+
+void json_field_str(JsonRecord *r, const char *key, const char *value);
+void json_field_int(JsonRecord *r, const char *key, long long value);
+void json_field_bool(JsonRecord *r, const char *key, int value);
+
+/* Serializes None, bool, int, float, str, bytes, tuple, list and dict.
+   Lone surrogates in str are written as \udcxx escapes, bytes as
+   {"type": "bytes", "b64": "<base64>"} and other objects as
+   {"type": "<type name>"}. Never fails or leaves an exception set. */
+void json_field_object(JsonRecord *r, const char *key, PyObject *value);
+
+/* Like json_field_object, but str and bytes longer than max_len are cut
+   short and "<key>_truncated": true is added */
+void json_field_text(JsonRecord *r, const char *key, PyObject *value,
+                     Py_ssize_t max_len);
+
+/* Finishes the record, writes it to log and releases its memory */
+void json_end(JsonRecord *r, AuditLog *log);
+
+#endif /* SPYTHON_AUDIT_JSON_H */
@@ -0,0 +1,324 @@
+#include "audit_log.h"
+
+#include "log_blocks.h"
+#include "log_ring.h"
+#include "log_rotate.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#ifdef MS_WINDOWS
+#include <io.h>
+#define write _write
+#define close _close
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+struct _AuditLog {
+    int fd;
+    int owns_fd;
+    AuditLogFormat format;
+    long long interp_id;
+    char tag[32];
+    size_t tag_len;
+    /* When set, records go here instead of fd */
+    BlockWriter *blocks;
+    LogRing *ring;
+    /* statistics, updated without locking */
+    atomic_ullong records;
+    atomic_ullong failures;
+};
+
+static SPYTHON_THREAD_LOCAL char record_buffer[AUDIT_LOG_BUFFER_SIZE];
+
+
+AuditLog *
+audit_log_from_fd(int fd, long long interp_id, AuditLogFormat format)
+{
+    AuditLog *log = (AuditLog*)calloc(1, sizeof(AuditLog));
+    if (!log) {
+        return NULL;
+    }
+    log->fd = fd;
+    log->owns_fd = 1;
+    log->format = format;
+    log->interp_id = interp_id;
+    log->tag_len = (size_t)snprintf(log->tag, sizeof(log->tag),
+                                    "[%lld] ", interp_id);
+    atomic_init(&log->records, 0);
+    atomic_init(&log->failures, 0);
+    return log;
+}
+
+AuditLog *
+audit_log_share(AuditLog *log, long long interp_id)
+{
+    AuditLog *shared = audit_log_from_fd(log->fd, interp_id, log->format);
+    if (shared) {
+        shared->owns_fd = 0;
+        shared->blocks = log->blocks;
+        shared->ring = log->ring;
+    }
+    return shared;
+}
+
+AuditLog *
+audit_log_from_ring(LogRing *ring, long long interp_id, AuditLogFormat format)
+{
+    AuditLog *log = audit_log_from_fd(-1, interp_id, format);
+    if (log) {
+        log->owns_fd = 0;
+        log->ring = ring;
+    }
+    return log;
+}
+
+int
+audit_log_compress(AuditLog *log, int index_fd)
+{
+    log->blocks = block_writer_open(log->fd, index_fd);
+    return log->blocks ? 0 : -1;
+}
+
+static void
+audit_log_count(AuditLog *log, int ok)
+{
+    if (ok) {
+        atomic_fetch_add_explicit(&log->records, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&log->failures, 1, memory_order_relaxed);
+    }
+}
+
+static void
+audit_log_emit(AuditLog *log, const char *event, const char *data, size_t len)
+{
+    if (log->blocks) {
+        BlockPart part = { data, len };
+        audit_log_count(log, block_writer_append(log->blocks, event, &part, 1) == 0);
+        return;
+    }
+    if (log->ring) {
+        LogRingPart part = { data, len };
+        audit_log_count(log, log_ring_append(log->ring, &part, 1) == 0);
+        return;
+    }
+
+    /* A single append is atomic with respect to other writers. A short
+       write only happens when the disk is full or on a signal, and we
+       finish the record rather than lose it. */
+    while (len) {
+        Py_ssize_t r = write(log->fd, data, (unsigned int)len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            atomic_fetch_add_explicit(&log->failures, 1, memory_order_relaxed);
+            return;
+        }
+        data += r;
+        len -= r;
+    }
+    atomic_fetch_add_explicit(&log->records, 1, memory_order_relaxed);
+}
+
+void
+audit_log_write(AuditLog *log, const char *event, const char *msg, Py_ssize_t len)
+{
+    size_t event_len = strlen(event);
+    if (len < 0) {
+        len = strlen(msg);
+    }
+
+    size_t total = log->tag_len + event_len + 2 + len + 1;
+    if (total <= sizeof(record_buffer)) {
+        char *p = record_buffer;
+        memcpy(p, log->tag, log->tag_len);
+        p += log->tag_len;
+        memcpy(p, event, event_len);
+        p += event_len;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy(p, msg, len);
+        p += len;
+        *p++ = '\n';
+        audit_log_emit(log, event, record_buffer, total);
+        return;
+    }
+
+#ifdef MS_WINDOWS
+    char *big = (char*)malloc(total);
+    if (!big) {
+        atomic_fetch_add_explicit(&log->failures, 1, memory_order_relaxed);
+        return;
+    }
+    char *p = big;
+    memcpy(p, log->tag, log->tag_len);
+    p += log->tag_len;
+    memcpy(p, event, event_len);
+    p += event_len;
+    memcpy(p, ": ", 2);
+    memcpy(p + 2, msg, len);
+    big[total - 1] = '\n';
+    audit_log_emit(log, event, big, total);
+    free(big);
+#else
+    if (log->blocks) {
+        BlockPart parts[5] = {
+            { log->tag, log->tag_len },
+            { event, event_len },
+            { ": ", 2 },
+            { msg, (size_t)len },
+            { "\n", 1 },
+        };
+        audit_log_count(log, block_writer_append(log->blocks, event, parts, 5) == 0);
+        return;
+    }
+    if (log->ring) {
+        LogRingPart parts[5] = {
+            { log->tag, log->tag_len },
+            { event, event_len },
+            { ": ", 2 },
+            { msg, (size_t)len },
+            { "\n", 1 },
+        };
+        audit_log_count(log, log_ring_append(log->ring, parts, 5) == 0);
+        return;
+    }
+    struct iovec iov[5] = {
+        { log->tag, log->tag_len },
+        { (void*)event, event_len },
+        { ": ", 2 },
+        { (void*)msg, (size_t)len },
+        { "\n", 1 },
+    };
+    ssize_t r;
+    do {
+        r = writev(log->fd, iov, 5);
+    } while (r < 0 && errno == EINTR);
+    if (r == (ssize_t)total) {
+        atomic_fetch_add_explicit(&log->records, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&log->failures, 1, memory_order_relaxed);
+    }
+#endif
+}
+
+int
+audit_log_write_unicode(AuditLog *log, const char *event, PyObject *msg)
+{
+    Py_ssize_t len;
+    const char *utf8 = PyUnicode_AsUTF8AndSize(msg, &len);
+    if (!utf8) {
+        return -1;
+    }
+    audit_log_write(log, event, utf8, len);
+    return 0;
+}
+
+void
+audit_log_writef(AuditLog *log, const char *event, const char *format, ...)
+{
+    char msg[AUDIT_LOG_BUFFER_SIZE / 2];
+    va_list vargs;
+
+    va_start(vargs, format);
+    int len = vsnprintf(msg, sizeof(msg), format, vargs);
+    va_end(vargs);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= sizeof(msg)) {
+        len = sizeof(msg) - 1;
+    }
+    audit_log_write(log, event, msg, len);
+}
+
+void
+audit_log_write_record(AuditLog *log, const char *event,
+                       const char *data, size_t len)
+{
+    if (len < sizeof(record_buffer)) {
+        memcpy(record_buffer, data, len);
+        record_buffer[len] = '\n';
+        audit_log_emit(log, event, record_buffer, len + 1);
+        return;
+    }
+
+#ifdef MS_WINDOWS
+    char *big = (char*)malloc(len + 1);
+    if (!big) {
+        audit_log_drop(log);
+        return;
+    }
+    memcpy(big, data, len);
+    big[len] = '\n';
+    audit_log_emit(log, event, big, len + 1);
+    free(big);
+#else
+    if (log->blocks) {
+        BlockPart parts[2] = {
+            { data, len },
+            { "\n", 1 },
+        };
+        audit_log_count(log, block_writer_append(log->blocks, event, parts, 2) == 0);
+        return;
+    }
+    if (log->ring) {
+        LogRingPart parts[2] = {
+            { data, len },
+            { "\n", 1 },
+        };
+        audit_log_count(log, log_ring_append(log->ring, parts, 2) == 0);
+        return;
+    }
+    struct iovec iov[2] = {
+        { (void*)data, len },
+        { "\n", 1 },
+    };
+    ssize_t r;
+    do {
+        r = writev(log->fd, iov, 2);
+    } while (r < 0 && errno == EINTR);
+    if (r == (ssize_t)(len + 1)) {
+        atomic_fetch_add_explicit(&log->records, 1, memory_order_relaxed);
+    } else {
+        audit_log_drop(log);
+    }
+#endif
+}
+
+void
+audit_log_drop(AuditLog *log)
+{
+    atomic_fetch_add_explicit(&log->failures, 1, memory_order_relaxed);
+}
+
+AuditLogFormat
+audit_log_format(AuditLog *log)
+{
+    return log->format;
+}
+
+long long
+audit_log_interp_id(AuditLog *log)
+{
+    return log->interp_id;
+}
+
+void
+audit_log_close(AuditLog *log)
+{
+    if (log->owns_fd) {
+        log_rotate_remove(log->fd);
+    }
+    if (log->owns_fd && log->blocks) {
+        /* Also closes the file */
+        block_writer_close(log->blocks);
+    } else if (log->owns_fd && log->fd > 2) {
+        close(log->fd);
+    }
+    free(log);
+}
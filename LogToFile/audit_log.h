@@ -0,0 +1,74 @@
+/* Audit log sink for LogToFile
+ *
+ * Records are formatted into a per-thread buffer and written with a
+ * single write() to a file opened for appending, so concurrent hooks
+ * never take a lock and never interleave within a record. Compressed logs
+ * go through log_blocks.h instead, and logs shared by every process on
+ * the host through log_ring.h.
+ */
+#ifndef SPYTHON_AUDIT_LOG_H
+#define SPYTHON_AUDIT_LOG_H
+
+#include "Python.h"
+#include "log_ring.h"
+
+#ifdef _MSC_VER
+#define SPYTHON_THREAD_LOCAL __declspec(thread)
+#else
+#define SPYTHON_THREAD_LOCAL _Thread_local
+#endif
+
+/* Records longer than this are written without copying */
+#define AUDIT_LOG_BUFFER_SIZE 4096
+
+typedef struct _AuditLog AuditLog;
+
+typedef enum _AuditLogFormat {
+    AUDIT_LOG_TEXT,
+    /* JSON Lines, see audit_json.h */
+    AUDIT_LOG_JSON,
+} AuditLogFormat;
+
+/* Takes ownership of fd, which should be opened with O_APPEND. Records
+   are tagged with interp_id, the interpreter whose events they are. */
+AuditLog *audit_log_from_fd(int fd, long long interp_id, AuditLogFormat format);
+
+/* Appends records to a shared memory ring, which the caller keeps open
+   until the log is closed */
+AuditLog *audit_log_from_ring(LogRing *ring, long long interp_id,
+                              AuditLogFormat format);
+
+/* Writes to the same file as log with a different tag. The new sink does
+   not own the file, and must be closed before log. */
+AuditLog *audit_log_share(AuditLog *log, long long interp_id);
+
+/* Writes '[<interp_id>] <event>: <msg>\n'. If len is negative, msg is
+   NUL terminated. */
+void audit_log_write(AuditLog *log, const char *event,
+                     const char *msg, Py_ssize_t len);
+
+/* Writes the UTF-8 form of msg. Returns -1 with an exception set if
+   msg cannot be encoded. */
+int audit_log_write_unicode(AuditLog *log, const char *event, PyObject *msg);
+
+/* printf-style formatting into the per-thread buffer */
+void audit_log_writef(AuditLog *log, const char *event, const char *format, ...);
+
+/* Writes a preformatted record for event, adding only the newline */
+void audit_log_write_record(AuditLog *log, const char *event,
+                            const char *data, size_t len);
+
+/* Sends records to zlib blocks instead of writing them directly, with
+   an index of the blocks written to index_fd. See log_blocks.h. Takes
+   ownership of index_fd. Prints the reason and returns -1 on failure. */
+int audit_log_compress(AuditLog *log, int index_fd);
+
+/* Counts a record that could not be formatted */
+void audit_log_drop(AuditLog *log);
+
+AuditLogFormat audit_log_format(AuditLog *log);
+long long audit_log_interp_id(AuditLog *log);
+
+void audit_log_close(AuditLog *log);
+
+#endif /* SPYTHON_AUDIT_LOG_H */
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+'''
+Benchmark for coalescing repeated records in the LogToFile sample.
+
+Runs ./spython on a script that raises audit events in a hot loop, where
+each event repeats one of a few argument tuples (like a loop opening the
+same config files), and reports the time per event and the size of the
+log with and without SPYTHONLOGCOALESCE, in both log formats.
+
+    python3 bench_coalesce.py [--spython ./spython] [-n 200000] [--distinct 4]
+'''
+
+import argparse
+import os
+import subprocess
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+BENCH_SCRIPT = r'''
+import sys, time
+n, distinct = int(sys.argv[1]), int(sys.argv[2])
+args = [("/etc/app/config-%d.toml" % i, "r", 524288) for i in range(distinct)]
+audit = sys.audit
+start = time.perf_counter()
+for i in range(n):
+    audit("spython.bench", *args[i % distinct])
+print(time.perf_counter() - start)
+'''
+
+parser = argparse.ArgumentParser("bench_coalesce")
+parser.add_argument("--spython", default=os.path.join(HERE, "spython"))
+parser.add_argument("-n", type=int, default=200000, help="events to raise")
+parser.add_argument("--distinct", type=int, default=4,
+                    help="number of different argument tuples")
+parser.add_argument("--window", default="1000", help="SPYTHONLOGCOALESCE in ms")
+
+
+def main():
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, "bench.py")
+        log = os.path.join(tmp, "spython.log")
+        with open(script, "w") as f:
+            f.write(BENCH_SCRIPT)
+
+        print("{:>6} {:>10} {:>12} {:>12}".format("format", "coalesce", "ns/event", "log bytes"))
+        for fmt in ("text", "json"):
+            for window in ("", args.window):
+                env = dict(os.environ, SPYTHONLOG=log, SPYTHONLOGFORMAT=fmt,
+                           SPYTHONLOGCOALESCE=window)
+                out = subprocess.check_output(
+                    [args.spython, script, str(args.n), str(args.distinct)], env=env,
+                ).decode().split()
+                elapsed = float(out[0])
+                print("{:>6} {:>10} {:>12.0f} {:>12}".format(
+                    fmt, window or "off", elapsed * 1e9 / args.n, os.path.getsize(log)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+'''
+Benchmark for the pickle allowlist in the LogToFile sample.
+
+Pickles a list of objects whose classes are all in the allowlist, then
+times pickle.loads() under both ./spython and a Python without hooks.
+The pickle is written without a memo, so the class is looked up again for
+every object, each object raises pickle.find_class, and the difference is
+the cost of the lookup.
+
+    python3 bench_pickle.py [--spython ./spython] [--python python3.8] [--counts 1000,100000]
+'''
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+ALLOW = '''
+# Classes used by the benchmark
+collections:OrderedDict
+datetime:date
+decimal:Decimal
+fractions:Fraction
+'''
+
+MAKE_SCRIPT = r'''
+import collections, datetime, decimal, fractions, pickle, sys
+objects = []
+for i in range(int(sys.argv[2])):
+    objects.append([
+        collections.OrderedDict(a=i),
+        datetime.date(2000, 1, 1 + i % 28),
+        decimal.Decimal(i),
+        fractions.Fraction(i, 7),
+    ][i % 4])
+with open(sys.argv[1], "wb") as f:
+    pickler = pickle.Pickler(f, protocol=4)
+    # Without a memo, every object refers to its class by name
+    pickler.fast = True
+    pickler.dump(objects)
+'''
+
+BENCH_SCRIPT = r'''
+import pickle, sys, time
+with open(sys.argv[1], "rb") as f:
+    data = f.read()
+repeat = int(sys.argv[2])
+loads = pickle.loads
+loads(data)
+best = None
+for _ in range(5):
+    start = time.perf_counter()
+    for _ in range(repeat):
+        loads(data)
+    elapsed = (time.perf_counter() - start) / repeat
+    best = elapsed if best is None else min(best, elapsed)
+print(best)
+'''
+
+parser = argparse.ArgumentParser("bench_pickle")
+parser.add_argument("--spython", default=os.path.join(HERE, "spython"))
+parser.add_argument("--python", default="python3.8",
+                    help="Python without hooks, matching the one spython was built with")
+parser.add_argument("--counts", default="100,10000,100000",
+                    help="comma-separated numbers of objects in each pickle")
+
+
+def run(exe, script, args, env):
+    out = subprocess.check_output([exe, script] + [str(a) for a in args], env=env)
+    return float(out.decode().split()[-1])
+
+
+def main():
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tmp:
+        make_script = os.path.join(tmp, "make.py")
+        bench_script = os.path.join(tmp, "bench.py")
+        allow_file = os.path.join(tmp, "allow.txt")
+        data_file = os.path.join(tmp, "data.pickle")
+        for name, text in [(make_script, MAKE_SCRIPT), (bench_script, BENCH_SCRIPT),
+                           (allow_file, ALLOW)]:
+            with open(name, "w") as f:
+                f.write(text)
+        env = dict(os.environ, SPYTHONLOG=os.path.join(tmp, "spython.log"),
+                   SPYTHONPICKLEALLOW=allow_file)
+
+        print("{:>8} {:>12} {:>12} {:>12} {:>10}".format(
+            "objects", "python ms", "spython ms", "hook ms", "ns/object"))
+        for count in [int(s) for s in args.counts.split(",")]:
+            subprocess.check_call([args.python, make_script, data_file, str(count)])
+            repeat = max(1, 200000 // count)
+            base = run(args.python, bench_script, [data_file, repeat], env)
+            hooked = run(args.spython, bench_script, [data_file, repeat], env)
+            print("{:>8} {:>12.2f} {:>12.2f} {:>12.2f} {:>10.1f}".format(
+                count, base * 1e3, hooked * 1e3, (hooked - base) * 1e3,
+                (hooked - base) * 1e9 / count))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+'''
+Multi-threaded throughput benchmark for the LogToFile sample.
+
+Runs ./spython on a script that starts N threads, each raising audit
+events as fast as it can, and reports the total number of events per
+second handled by the hooks (formatted and appended to the log file).
+On a free-threaded build (3.13t or later) throughput should grow with
+the number of threads up to the number of cores; with the GIL it stays
+roughly flat.
+
+    python3 bench_threads.py [--spython ./spython] [-n 20000] [--threads 1,2,4,8]
+'''
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+BENCH_SCRIPT = r'''
+import sys, threading, time
+nthreads, n = int(sys.argv[1]), int(sys.argv[2])
+barrier = threading.Barrier(nthreads + 1)
+
+def worker(tid):
+    audit = sys.audit
+    barrier.wait()
+    for i in range(n):
+        audit("spython.bench", tid, i)
+
+threads = [threading.Thread(target=worker, args=(t,)) for t in range(nthreads)]
+for t in threads:
+    t.start()
+barrier.wait()
+start = time.perf_counter()
+for t in threads:
+    t.join()
+elapsed = time.perf_counter() - start
+gil = getattr(sys, "_is_gil_enabled", lambda: True)()
+print(nthreads * n, elapsed, int(gil))
+'''
+
+parser = argparse.ArgumentParser("bench_threads")
+parser.add_argument("--spython", default=os.path.join(HERE, "spython"))
+parser.add_argument("-n", type=int, default=20000, help="events per thread")
+parser.add_argument("--threads", default=None,
+                    help="comma-separated thread counts (default: powers of two up to the CPU count)")
+
+
+def thread_counts(spec):
+    if spec:
+        return [int(t) for t in spec.split(",")]
+    counts, t = [], 1
+    while t < (os.cpu_count() or 1):
+        counts.append(t)
+        t *= 2
+    counts.append(os.cpu_count() or 1)
+    return counts
+
+
+def main():
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, "bench.py")
+        log = os.path.join(tmp, "spython.log")
+        with open(script, "w") as f:
+            f.write(BENCH_SCRIPT)
+        env = dict(os.environ, SPYTHONLOG=log)
+
+        print("cpus: {}".format(os.cpu_count()))
+        print("{:>8} {:>12} {:>14} {:>8}".format("threads", "events", "events/sec", "scaling"))
+        base = None
+        for nthreads in thread_counts(args.threads):
+            out = subprocess.check_output(
+                [args.spython, script, str(nthreads), str(args.n)], env=env,
+            ).decode().split()
+            events, elapsed, gil = int(out[0]), float(out[1]), int(out[2])
+            rate = events / elapsed
+            base = base or rate
+            print("{:>8} {:>12} {:>14,.0f} {:>7.2f}x".format(nthreads, events, rate, rate / base))
+
+            with open(log, "rb") as f:
+                logged = sum(1 for line in f if line.startswith(b"[0] spython.bench: "))
+            if logged != events:
+                print("  log has {} records, expected {}".format(logged, events), file=sys.stderr)
+                return 1
+        if gil:
+            print("(the GIL is enabled, so no scaling is expected)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+'''
+Benchmark for the bytecode verifier in the LogToFile sample.
+
+Generates functions with large bodies (loops, branches, calls and
+exception handlers, so jumps need EXTENDED_ARG), marshals their code objects
+and times marshal.loads() under both ./spython and a Python without
+hooks. Loading a code object raises code.__new__, so the difference is
+the cost of the hook: one log record plus verifying the bytecode.
+
+    python3 bench_verifier.py [--spython ./spython] [--python python3.8] [--sizes 100,1000,10000]
+'''
+
+import argparse
+import marshal
+import os
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+BLOCK = '''
+    for i{n} in range(a):
+        if i{n} % 3 == b:
+            x = x + i{n} * {n}
+        elif x > {n}:
+            x = f(x, b, (i{n}, x), *g)
+        else:
+            try:
+                x -= g[i{n}]
+            except KeyError:
+                x += 1
+'''
+
+BENCH_SCRIPT = r'''
+import marshal, sys, time
+with open(sys.argv[1], "rb") as f:
+    data = f.read()
+repeat = int(sys.argv[2])
+loads = marshal.loads
+loads(data)
+best = None
+for _ in range(5):
+    start = time.perf_counter()
+    for _ in range(repeat):
+        loads(data)
+    elapsed = (time.perf_counter() - start) / repeat
+    best = elapsed if best is None else min(best, elapsed)
+print(best)
+'''
+
+parser = argparse.ArgumentParser("bench_verifier")
+parser.add_argument("--spython", default=os.path.join(HERE, "spython"))
+parser.add_argument("--python", default="python3.8",
+                    help="Python without hooks, matching the one spython was built with")
+parser.add_argument("--sizes", default="10,100,1000,5000",
+                    help="comma-separated numbers of blocks in each generated function")
+
+
+def generate(blocks):
+    body = "".join(BLOCK.format(n=n) for n in range(blocks))
+    src = "def big(a, b, f, g):\n    x = 0\n{}    return x\n".format(body)
+    return compile(src, "<big{}>".format(blocks), "exec").co_consts[0]
+
+
+def run(exe, script, code_file, repeat, env):
+    out = subprocess.check_output([exe, script, code_file, str(repeat)], env=env)
+    return float(out.decode().split()[-1])
+
+
+def main():
+    args = parser.parse_args()
+    # Code objects must be generated by the same version that loads them
+    gen = subprocess.check_output([args.python, "-c", "import sys; print(sys.version_info[:2])"])
+    if gen.decode().strip() != str(sys.version_info[:2]):
+        print("run this script with {}".format(args.python), file=sys.stderr)
+        return 1
+
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, "bench.py")
+        with open(script, "w") as f:
+            f.write(BENCH_SCRIPT)
+        env = dict(os.environ, SPYTHONLOG=os.path.join(tmp, "spython.log"))
+
+        print("{:>8} {:>10} {:>12} {:>12} {:>12} {:>10}".format(
+            "blocks", "bytes", "python us", "spython us", "hook us", "ns/instr"))
+        for blocks in [int(s) for s in args.sizes.split(",")]:
+            code = generate(blocks)
+            code_file = os.path.join(tmp, "big.marshal")
+            with open(code_file, "wb") as f:
+                f.write(marshal.dumps(code))
+            repeat = max(1, 20000 // blocks)
+            base = run(args.python, script, code_file, repeat, env)
+            hooked = run(args.spython, script, code_file, repeat, env)
+            instructions = len(code.co_code) // 2
+            print("{:>8} {:>10} {:>12.1f} {:>12.1f} {:>12.1f} {:>10.2f}".format(
+                blocks, len(code.co_code), base * 1e6, hooked * 1e6,
+                (hooked - base) * 1e6, (hooked - base) * 1e9 / instructions))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
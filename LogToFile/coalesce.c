@@ -0,0 +1,268 @@
+#include "coalesce.h"
+
+#include "audit_json.h"
+#include "preinit.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Slots in each interpreter's table */
+#define COALESCE_SLOTS 64
+/* Longer event names are never coalesced */
+#define COALESCE_EVENT_MAX 48
+/* Deeper tuples are never coalesced */
+#define COALESCE_MAX_DEPTH 4
+
+typedef struct _CoalesceRun {
+    uint64_t fingerprint;
+    char event[COALESCE_EVENT_MAX];
+    /* The arguments of the logged record, or NULL for an empty slot */
+    PyObject *args;
+    unsigned long long count;
+    /* When the logged record was written, which starts the window */
+    uint64_t start_us;
+    uint64_t first_us;
+    uint64_t last_us;
+} CoalesceRun;
+
+typedef struct _CoalesceSlot {
+    atomic_flag busy;
+    CoalesceRun run;
+} CoalesceSlot;
+
+struct _Coalescer {
+    CoalesceSlot slots[COALESCE_SLOTS];
+};
+
+static long long window = 0;
+
+
+void
+coalesce_init(long long window_us)
+{
+    window = window_us;
+}
+
+Coalescer *
+coalesce_new(void)
+{
+    if (window <= 0) {
+        return NULL;
+    }
+    Coalescer *c = (Coalescer *)calloc(1, sizeof(Coalescer));
+    if (!c) {
+        return NULL;
+    }
+    for (int i = 0; i < COALESCE_SLOTS; ++i) {
+        atomic_flag_clear(&c->slots[i].busy);
+    }
+    return c;
+}
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t
+mix(uint64_t h, uint64_t v)
+{
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+/* Hashes args without running any Python code. Returns -1 for objects
+   that cannot be compared safely. */
+static int
+fingerprint(PyObject *o, uint64_t *h, int depth)
+{
+    PyTypeObject *type = Py_TYPE(o);
+    *h = mix(*h, (uint64_t)(uintptr_t)type);
+    if (o == Py_None || PyBool_Check(o)) {
+        *h = mix(*h, (uint64_t)(uintptr_t)o);
+    } else if (PyUnicode_CheckExact(o) || PyBytes_CheckExact(o) ||
+               PyLong_CheckExact(o) || PyFloat_CheckExact(o)) {
+        *h = mix(*h, (uint64_t)PyObject_Hash(o));
+    } else if (PyTuple_CheckExact(o) && depth < COALESCE_MAX_DEPTH) {
+        Py_ssize_t n = PyTuple_GET_SIZE(o);
+        *h = mix(*h, (uint64_t)n);
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            if (fingerprint(PyTuple_GET_ITEM(o, i), h, depth + 1) < 0) {
+                return -1;
+            }
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Compares objects that passed fingerprint() */
+static int
+args_equal(PyObject *a, PyObject *b)
+{
+    if (a == b) {
+        return 1;
+    }
+    if (Py_TYPE(a) != Py_TYPE(b)) {
+        return 0;
+    }
+    if (PyUnicode_CheckExact(a)) {
+        return PyUnicode_Compare(a, b) == 0;
+    }
+    if (PyBytes_CheckExact(a)) {
+        return PyBytes_GET_SIZE(a) == PyBytes_GET_SIZE(b) &&
+            memcmp(PyBytes_AS_STRING(a), PyBytes_AS_STRING(b), PyBytes_GET_SIZE(a)) == 0;
+    }
+    if (PyLong_CheckExact(a)) {
+        return PyObject_RichCompareBool(a, b, Py_EQ) == 1;
+    }
+    if (PyFloat_CheckExact(a)) {
+        return PyFloat_AS_DOUBLE(a) == PyFloat_AS_DOUBLE(b);
+    }
+    if (PyTuple_CheckExact(a)) {
+        Py_ssize_t n = PyTuple_GET_SIZE(a);
+        if (n != PyTuple_GET_SIZE(b)) {
+            return 0;
+        }
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            if (!args_equal(PyTuple_GET_ITEM(a, i), PyTuple_GET_ITEM(b, i))) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    /* None and bool are singletons */
+    return 0;
+}
+
+static void
+format_time(uint64_t us, char out[32])
+{
+    time_t sec = (time_t)(us / 1000000);
+    struct tm tm;
+#ifdef MS_WINDOWS
+    gmtime_s(&tm, &sec);
+#else
+    gmtime_r(&sec, &tm);
+#endif
+    size_t n = strftime(out, 32, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(out + n, 32 - n, ".%06uZ", (unsigned)(us % 1000000));
+}
+
+/* Writes the count for a run that has been taken out of the table */
+static void
+write_count(AuditLog *log, const CoalesceRun *s)
+{
+    char first[32], last[32];
+    format_time(s->first_us, first);
+    format_time(s->last_us, last);
+
+    if (audit_log_format(log) == AUDIT_LOG_JSON) {
+        JsonRecord r;
+        json_begin(&r, log, s->event);
+        json_field_int(&r, "repeated", (long long)s->count);
+        json_field_str(&r, "first", first);
+        json_field_str(&r, "last", last);
+        json_field_object(&r, "args", s->args);
+        json_end(&r, log);
+        return;
+    }
+
+    if (!Py_IsInitialized()) {
+        /* repr() is not safe while finalizing */
+        size_t len;
+        char *text = preinit_render(s->args, &len);
+        if (!text) {
+            audit_log_drop(log);
+            return;
+        }
+        audit_log_writef(log, s->event, "repeated %llu times from %s to %s: %.*s",
+                         s->count, first, last, (int)len, text);
+        free(text);
+        return;
+    }
+
+    PyObject *msg = PyUnicode_FromFormat("repeated %llu times from %s to %s: %R",
+                                         s->count, first, last, s->args);
+    if (!msg || audit_log_write_unicode(log, s->event, msg) < 0) {
+        PyErr_Clear();
+        audit_log_drop(log);
+    }
+    Py_XDECREF(msg);
+}
+
+int
+coalesce_record(Coalescer *c, AuditLog *log, const char *event, PyObject *args)
+{
+    size_t event_len = strlen(event);
+    uint64_t fp = 0;
+    if (event_len >= COALESCE_EVENT_MAX) {
+        return 0;
+    }
+    for (size_t i = 0; i < event_len; ++i) {
+        fp = mix(fp, (unsigned char)event[i]);
+    }
+    if (fingerprint(args, &fp, 0) < 0) {
+        return 0;
+    }
+
+    uint64_t now = now_us();
+    CoalesceSlot *slot = &c->slots[fp % COALESCE_SLOTS];
+    CoalesceRun *s = &slot->run;
+    while (atomic_flag_test_and_set_explicit(&slot->busy, memory_order_acquire)) {
+    }
+
+    if (s->args && s->fingerprint == fp && now - s->start_us < (uint64_t)window &&
+        strcmp(s->event, event) == 0 && args_equal(s->args, args)) {
+        if (!s->count++) {
+            s->first_us = now;
+        }
+        s->last_us = now;
+        atomic_flag_clear_explicit(&slot->busy, memory_order_release);
+        return 1;
+    }
+
+    /* This record is logged and starts a new window in the slot */
+    CoalesceRun old = *s;
+    s->fingerprint = fp;
+    memcpy(s->event, event, event_len + 1);
+    Py_INCREF(args);
+    s->args = args;
+    s->count = 0;
+    s->start_us = now;
+    atomic_flag_clear_explicit(&slot->busy, memory_order_release);
+
+    if (old.args) {
+        if (old.count) {
+            write_count(log, &old);
+        }
+        Py_DECREF(old.args);
+    }
+    return 0;
+}
+
+void
+coalesce_flush(Coalescer *c, AuditLog *log)
+{
+    for (int i = 0; i < COALESCE_SLOTS; ++i) {
+        CoalesceSlot *slot = &c->slots[i];
+        while (atomic_flag_test_and_set_explicit(&slot->busy, memory_order_acquire)) {
+        }
+        CoalesceRun old = slot->run;
+        slot->run.args = NULL;
+        slot->run.count = 0;
+        atomic_flag_clear_explicit(&slot->busy, memory_order_release);
+
+        if (old.args) {
+            if (old.count) {
+                write_count(log, &old);
+            }
+            Py_DECREF(old.args);
+        }
+    }
+}
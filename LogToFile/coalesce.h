@@ -0,0 +1,48 @@
+/* Coalescing of repeated audit records for LogToFile
+ *
+ * Hot loops often raise the same event with the same arguments over and
+ * over, such as opening one config file or compiling one template. When
+ * enabled, the first such record in a window is logged as usual and the
+ * repeats are only counted, then written as one record with the count and
+ * the times of the first and last repeat:
+ *
+ *     [0] open: repeated 999 times from 2019-08-01T12:00:00.000001Z
+ *         to 2019-08-01T12:00:00.912345Z: ('app.cfg', 'r', 524288)
+ *
+ * Records are matched by a fingerprint of the event name and the hashes of
+ * its arguments, which str and bytes cache, then compared exactly, so a
+ * repeat costs a hash lookup rather than formatting and a write. Only
+ * events whose arguments are made of None, bool, int, float, str, bytes
+ * and tuples are coalesced, and never events that enforce policy
+ * (sys.addaudithook, spython.open_code, code.__new__, pickle.find_class
+ * and os.system).
+ *
+ * Each interpreter has a small table of recent records, indexed by
+ * fingerprint, so interleaved runs of different records are coalesced
+ * too. A count is written when its slot is needed by another record, when
+ * a repeat arrives after the window, and when the interpreter ends.
+ */
+#ifndef SPYTHON_COALESCE_H
+#define SPYTHON_COALESCE_H
+
+#include "Python.h"
+#include "audit_log.h"
+
+typedef struct _Coalescer Coalescer;
+
+/* Sets the window, in microseconds. Called before Python is initialized. */
+void coalesce_init(long long window_us);
+
+/* Returns a table for a new interpreter, or NULL when coalescing is off */
+Coalescer *coalesce_new(void);
+
+/* Returns 1 if the record for event was counted and should not be
+   logged. Writes the count for any record it replaces to log. */
+int coalesce_record(Coalescer *c, AuditLog *log, const char *event,
+                    PyObject *args);
+
+/* Writes every count to log and releases the stored arguments. Called
+   from the interpreter that owns the table, while it can still run. */
+void coalesce_flush(Coalescer *c, AuditLog *log);
+
+#endif /* SPYTHON_COALESCE_H */
@@ -0,0 +1,351 @@
+#include "import_profile.h"
+
+#include "audit_log.h"
+#include "frameobject.h"
+#include "pythread.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef MS_WINDOWS
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static const char * const phase_names[IMPORT_PHASE_COUNT] = {
+    "[resolve]",
+    "[policy]",
+    "[read]",
+    "[scan]",
+    "[hash]",
+    "[compile]",
+    "[verify bytecode]",
+    "[load extension]",
+    "[exec]",
+    "[audit hooks]",
+};
+
+typedef struct _ImportEntry {
+    /* Folded stack, "parent;...;name" */
+    char *stack;
+    /* The _find_and_load frame, which returns when the import is done.
+       Only compared, never used. */
+    PyFrameObject *frame;
+    ImportPhase phase;
+    int64_t ns[IMPORT_PHASE_COUNT];
+} ImportEntry;
+
+typedef struct _ImportStack {
+    ImportEntry *entries;
+    int depth;
+    int capacity;
+    /* When time was last charged to the top entry */
+    int64_t last;
+} ImportStack;
+
+static SPYTHON_THREAD_LOCAL ImportStack import_stack;
+/* Set while installing or removing the profile function, which raises
+   sys.setprofile */
+static SPYTHON_THREAD_LOCAL int setting_profile;
+
+static FILE *profile_file = NULL;
+
+/* Folded lines for finished imports, from every thread */
+static PyThread_type_lock output_lock = NULL;
+static char *output = NULL;
+static size_t output_len = 0;
+static size_t output_capacity = 0;
+
+
+static int64_t
+now_ns(void)
+{
+#ifdef MS_WINDOWS
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+int
+import_profile_init(const char *path)
+{
+    output_lock = PyThread_allocate_lock();
+    if (!output_lock) {
+        fprintf(stderr, "failed to allocate import profile lock\n");
+        return -1;
+    }
+    profile_file = fopen(path, "w");
+    if (!profile_file) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int
+import_profile_enabled(void)
+{
+    return profile_file != NULL;
+}
+
+/* Charges the time since the last call to the top entry's phase */
+static void
+import_charge(ImportStack *s)
+{
+    int64_t now = now_ns();
+    ImportEntry *top = &s->entries[s->depth - 1];
+    top->ns[top->phase] += now - s->last;
+    s->last = now;
+}
+
+static void
+output_append(const char *stack, const char *phase, long long us)
+{
+    int len = snprintf(NULL, 0, "%s;%s %lld\n", stack, phase, us);
+    if (len < 0) {
+        return;
+    }
+    PyThread_acquire_lock(output_lock, WAIT_LOCK);
+    if (output_len + len + 1 > output_capacity) {
+        size_t capacity = output_capacity ? output_capacity * 2 : 16384;
+        while (output_len + len + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *p = (char *)realloc(output, capacity);
+        if (!p) {
+            PyThread_release_lock(output_lock);
+            return;
+        }
+        output = p;
+        output_capacity = capacity;
+    }
+    snprintf(output + output_len, len + 1, "%s;%s %lld\n", stack, phase, us);
+    output_len += len;
+    PyThread_release_lock(output_lock);
+}
+
+static int profile_callback(PyObject *obj, PyFrameObject *frame, int what, PyObject *arg);
+
+/* Adds a line for each phase that took at least a microsecond */
+static void
+import_record(ImportEntry *e)
+{
+    for (int i = 0; i < IMPORT_PHASE_COUNT; ++i) {
+        long long us = (long long)((e->ns[i] + 500) / 1000);
+        if (us > 0) {
+            output_append(e->stack, phase_names[i], us);
+        }
+    }
+    free(e->stack);
+}
+
+static void
+import_pop(ImportStack *s)
+{
+    import_charge(s);
+    import_record(&s->entries[--s->depth]);
+
+    if (s->depth == 0) {
+        PyThreadState *tstate = PyThreadState_Get();
+        if (tstate->c_profilefunc == profile_callback) {
+            setting_profile = 1;
+            PyEval_SetProfile(NULL, NULL);
+            setting_profile = 0;
+        }
+        free(s->entries);
+        s->entries = NULL;
+        s->capacity = 0;
+    }
+}
+
+static int
+is_find_and_load(PyFrameObject *frame)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    PyCodeObject *code = PyFrame_GetCode(frame);
+    int r = PyUnicode_CompareWithASCIIString(code->co_name, "_find_and_load") == 0;
+    Py_DECREF(code);
+    return r;
+#else
+    return PyUnicode_CompareWithASCIIString(frame->f_code->co_name, "_find_and_load") == 0;
+#endif
+}
+
+/* Only installed while this thread is importing, to find the end of each
+   import */
+static int
+profile_callback(PyObject *obj, PyFrameObject *frame, int what, PyObject *arg)
+{
+    ImportStack *s = &import_stack;
+    if (s->depth == 0) {
+        return 0;
+    }
+    ImportEntry *top = &s->entries[s->depth - 1];
+    if (what == PyTrace_CALL && !top->frame) {
+        if (is_find_and_load(frame)) {
+            top->frame = frame;
+        }
+    } else if (what == PyTrace_RETURN && frame == top->frame) {
+        import_pop(s);
+    }
+    return 0;
+}
+
+static void
+import_push(PyObject *module)
+{
+    ImportStack *s = &import_stack;
+    Py_ssize_t name_len;
+    const char *name = PyUnicode_AsUTF8AndSize(module, &name_len);
+    if (!name) {
+        PyErr_Clear();
+        return;
+    }
+
+    if (s->depth == 0) {
+        /* Someone else is profiling, so the end cannot be found */
+        if (PyThreadState_Get()->c_profilefunc) {
+            return;
+        }
+    } else if (!s->entries[s->depth - 1].frame) {
+        /* The previous import never started */
+        import_pop(s);
+    }
+
+    if (s->depth == s->capacity) {
+        int capacity = s->capacity ? s->capacity * 2 : 16;
+        ImportEntry *entries = (ImportEntry *)realloc(s->entries, capacity * sizeof(ImportEntry));
+        if (!entries) {
+            return;
+        }
+        s->entries = entries;
+        s->capacity = capacity;
+    }
+
+    const char *parent = s->depth ? s->entries[s->depth - 1].stack : NULL;
+    size_t parent_len = parent ? strlen(parent) + 1 : 0;
+    char *stack = (char *)malloc(parent_len + name_len + 1);
+    if (!stack) {
+        return;
+    }
+    if (parent) {
+        memcpy(stack, parent, parent_len - 1);
+        stack[parent_len - 1] = ';';
+    }
+    /* Separators in the folded format */
+    for (Py_ssize_t i = 0; i < name_len; ++i) {
+        char c = name[i];
+        stack[parent_len + i] = (c == ';' || c == ' ' || c == '\n') ? '_' : c;
+    }
+    stack[parent_len + name_len] = '\0';
+
+    if (s->depth) {
+        import_charge(s);
+    } else {
+        s->last = now_ns();
+    }
+    ImportEntry *e = &s->entries[s->depth++];
+    memset(e, 0, sizeof(*e));
+    e->stack = stack;
+    e->phase = IMPORT_PHASE_RESOLVE;
+
+    if (s->depth == 1) {
+        setting_profile = 1;
+        PyEval_SetProfile(profile_callback, NULL);
+        setting_profile = 0;
+    }
+}
+
+static void
+import_set_phase(ImportStack *s, ImportPhase phase)
+{
+    import_charge(s);
+    s->entries[s->depth - 1].phase = phase;
+}
+
+int
+import_profile_event(const char *event, PyObject *args)
+{
+    ImportStack *s = &import_stack;
+    if (setting_profile) {
+        return strcmp(event, "sys.setprofile") == 0;
+    }
+
+    if (strcmp(event, "import") == 0) {
+        PyObject *module = PyTuple_GetItem(args, 0);
+        PyObject *filename = PyTuple_GetItem(args, 1);
+        if (!module || !filename) {
+            PyErr_Clear();
+        } else if (filename == Py_None) {
+            import_push(module);
+        } else if (s->depth) {
+            /* Extension modules raise it again with their filename */
+            import_set_phase(s, IMPORT_PHASE_LOAD);
+        }
+        return 0;
+    }
+
+    if (s->depth == 0) {
+        return 0;
+    }
+    ImportPhase phase = s->entries[s->depth - 1].phase;
+    if (strcmp(event, "compile") == 0 && phase < IMPORT_PHASE_COMPILE) {
+        import_set_phase(s, IMPORT_PHASE_COMPILE);
+    } else if (strcmp(event, "exec") == 0 && phase != IMPORT_PHASE_EXEC) {
+        import_set_phase(s, IMPORT_PHASE_EXEC);
+    }
+    return 0;
+}
+
+ImportPhase
+import_profile_enter(ImportPhase phase)
+{
+    ImportStack *s = &import_stack;
+    if (s->depth == 0) {
+        return phase;
+    }
+    ImportPhase previous = s->entries[s->depth - 1].phase;
+    import_set_phase(s, phase);
+    return previous;
+}
+
+void
+import_profile_leave(ImportPhase previous)
+{
+    ImportStack *s = &import_stack;
+    if (s->depth) {
+        import_set_phase(s, previous);
+    }
+}
+
+void
+import_profile_write(void)
+{
+    ImportStack *s = &import_stack;
+    if (!profile_file) {
+        return;
+    }
+    /* Python is gone, so the profile function is too */
+    while (s->depth) {
+        import_charge(s);
+        import_record(&s->entries[--s->depth]);
+    }
+    free(s->entries);
+    s->entries = NULL;
+
+    if (output_len) {
+        fwrite(output, 1, output_len, profile_file);
+    }
+    fclose(profile_file);
+    profile_file = NULL;
+}
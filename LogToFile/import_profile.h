@@ -0,0 +1,63 @@
+/* Import timing profile for LogToFile
+ *
+ * When enabled, the time spent importing each module is split into
+ * phases: finding it, checking the path, reading it, scanning and hashing
+ * the content, compiling, verifying bytecode, running the audit hooks and
+ * executing the module body. Imports nest like -X importtime, and each
+ * phase excludes the time spent in nested imports.
+ *
+ * An import starts at the "import" event and ends when the importlib
+ * frame that loads it returns, which is found with a profile function
+ * that is only installed while a thread is importing. Each thread keeps
+ * its own stack, so the hooks take no lock until an import finishes.
+ * The profile function slows imports down by about a third, and imports
+ * made while another profiler is installed are not included.
+ *
+ * At exit, the profile is written as folded stacks for flamegraph.pl or
+ * speedscope, one line per module and phase with the time in
+ * microseconds:
+ *
+ *     json;json.decoder;[read] 41
+ *     json;json.decoder;[exec] 212
+ */
+#ifndef SPYTHON_IMPORT_PROFILE_H
+#define SPYTHON_IMPORT_PROFILE_H
+
+#include "Python.h"
+
+typedef enum _ImportPhase {
+    IMPORT_PHASE_RESOLVE,
+    IMPORT_PHASE_POLICY,
+    IMPORT_PHASE_READ,
+    IMPORT_PHASE_SCAN,
+    IMPORT_PHASE_HASH,
+    IMPORT_PHASE_COMPILE,
+    IMPORT_PHASE_VERIFY,
+    IMPORT_PHASE_LOAD,
+    IMPORT_PHASE_EXEC,
+    IMPORT_PHASE_AUDIT,
+    IMPORT_PHASE_COUNT
+} ImportPhase;
+
+/* Opens path for the profile, which is written by import_profile_write.
+   Prints the reason and returns -1 on failure. Called before Python is
+   initialized. */
+int import_profile_init(const char *path);
+
+/* Nonzero after import_profile_init */
+int import_profile_enabled(void);
+
+/* Follows the "import", "compile" and "exec" events. Returns 1 for events
+   raised by the profiler itself, which need not be logged. */
+int import_profile_event(const char *event, PyObject *args);
+
+/* Charges time from now on to phase of the current import, if this thread
+   is importing, and returns the phase to restore */
+ImportPhase import_profile_enter(ImportPhase phase);
+void import_profile_leave(ImportPhase previous);
+
+/* Writes the profile and closes the file. Imports still running on this
+   thread end now. Called after Python is finalized. */
+void import_profile_write(void);
+
+#endif /* SPYTHON_IMPORT_PROFILE_H */
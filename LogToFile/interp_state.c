@@ -0,0 +1,151 @@
+#include "interp_state.h"
+
+#include "pythread.h"
+
+/* Interpreter IDs are never reused, so a cached entry for an interpreter
+   that has gone away can never match again, even if its address is. */
+typedef struct _InterpCache {
+    PyInterpreterState *interp;
+    long long id;
+    SpythonInterpState *state;
+} InterpCache;
+
+static SPYTHON_THREAD_LOCAL InterpCache interp_cache;
+
+static SpythonInterpState main_state;
+static spython_open_interp_log open_interp_log = NULL;
+static const char * const *subinterp_deny = NULL;
+
+/* Protects the list of states, which is only walked on a cache miss */
+static PyThread_type_lock states_lock = NULL;
+static SpythonInterpState *states = &main_state;
+
+
+int
+interp_state_init(AuditLog *main_log, spython_open_interp_log open_log,
+                  const char * const *deny)
+{
+    states_lock = PyThread_allocate_lock();
+    if (!states_lock) {
+        return -1;
+    }
+    main_state.id = 0;
+    main_state.log = main_log;
+    main_state.coalesce = coalesce_new();
+    main_state.deny = NULL;
+    atomic_init(&main_state.io, NULL);
+    open_interp_log = open_log;
+    subinterp_deny = deny;
+    return 0;
+}
+
+static PyInterpreterState *
+current_interp(void)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    PyThreadState *tstate = PyThreadState_GetUnchecked();
+#else
+    PyThreadState *tstate = _PyThreadState_UncheckedGet();
+#endif
+    if (!tstate) {
+        return NULL;
+    }
+#if PY_VERSION_HEX >= 0x03090000
+    return PyThreadState_GetInterpreter(tstate);
+#else
+    return tstate->interp;
+#endif
+}
+
+static SpythonInterpState *
+interp_state_new(long long id)
+{
+    SpythonInterpState *state = (SpythonInterpState*)calloc(1, sizeof(SpythonInterpState));
+    if (!state) {
+        return NULL;
+    }
+    state->id = id;
+    state->coalesce = coalesce_new();
+    state->deny = subinterp_deny;
+    atomic_init(&state->io, NULL);
+    if (open_interp_log) {
+        state->log = open_interp_log(id);
+    }
+    if (!state->log) {
+        state->log = audit_log_share(main_state.log, id);
+    }
+    if (!state->log) {
+        free(state);
+        return NULL;
+    }
+    return state;
+}
+
+/* Finds or creates the state for interpreter id. Called with no lock
+   held; returns the main state if we run out of memory, so that events
+   are never lost. */
+static SpythonInterpState *
+interp_state_lookup(long long id)
+{
+    SpythonInterpState *state;
+
+    PyThread_acquire_lock(states_lock, WAIT_LOCK);
+    for (state = states; state; state = state->next) {
+        if (state->id == id) {
+            break;
+        }
+    }
+    if (!state) {
+        state = interp_state_new(id);
+        if (state) {
+            state->next = states;
+            states = state;
+        }
+    }
+    PyThread_release_lock(states_lock);
+    return state ? state : &main_state;
+}
+
+SpythonInterpState *
+interp_state_get(void)
+{
+    PyInterpreterState *interp = current_interp();
+    if (!interp) {
+        /* Events raised before the main interpreter exists */
+        return &main_state;
+    }
+
+    long long id = (long long)PyInterpreterState_GetID(interp);
+    if (interp_cache.interp == interp && interp_cache.id == id) {
+        return interp_cache.state;
+    }
+    if (id <= 0) {
+        interp_cache.state = &main_state;
+    } else {
+        interp_cache.state = interp_state_lookup(id);
+    }
+    interp_cache.interp = interp;
+    interp_cache.id = id;
+    return interp_cache.state;
+}
+
+void
+interp_state_release(SpythonInterpState *state)
+{
+    if (state == &main_state) {
+        return;
+    }
+
+    PyObject *io = atomic_exchange(&state->io, NULL);
+    Py_XDECREF(io);
+
+    /* The interpreter may still raise events while its modules are torn
+       down, so the state itself stays alive and those records go to the
+       main log. Only the interpreter's own thread can be here. */
+    AuditLog *shared = audit_log_share(main_state.log, state->id);
+    if (shared) {
+        AuditLog *own = state->log;
+        state->log = shared;
+        audit_log_close(own);
+    }
+}
@@ -0,0 +1,50 @@
+/* Per-interpreter hook state for LogToFile
+ *
+ * Audit hooks are shared by every interpreter in the process, but each
+ * interpreter gets its own log and policy. The state for the current
+ * interpreter is cached per thread, so the hot path takes no lock even
+ * when interpreters have their own GIL.
+ *
+ * Subinterpreters log to '<log>.<id>', and block the events listed in
+ * SPYTHONSUBINTERPDENY (comma separated). When a subinterpreter is
+ * cleared its log is closed, and later events go to the main log.
+ */
+#ifndef SPYTHON_INTERP_STATE_H
+#define SPYTHON_INTERP_STATE_H
+
+#include "Python.h"
+#include "audit_log.h"
+#include "coalesce.h"
+
+#include <stdatomic.h>
+
+typedef struct _SpythonInterpState {
+    long long id;
+    /* Falls back to sharing the main log (with this interpreter's tag)
+       after the interpreter is cleared */
+    AuditLog *log;
+    /* Recent records, or NULL when coalescing is off */
+    Coalescer *coalesce;
+    /* Event names that are blocked in this interpreter */
+    const char * const *deny;
+    /* Only ever used by this interpreter, as objects cannot be shared */
+    _Atomic(PyObject *) io;
+    struct _SpythonInterpState *next;
+} SpythonInterpState;
+
+/* Opens the sink for a subinterpreter, or returns NULL to share the
+   main log */
+typedef AuditLog *(*spython_open_interp_log)(long long interp_id);
+
+/* Called before Python is initialized. main_log belongs to interpreter 0.
+   Subinterpreters are denied the NULL-terminated list of events in deny. */
+int interp_state_init(AuditLog *main_log, spython_open_interp_log open_log,
+                      const char * const *deny);
+
+/* Returns the state for the interpreter that is raising the event */
+SpythonInterpState *interp_state_get(void);
+
+/* Called when a subinterpreter is cleared to close its own log */
+void interp_state_release(SpythonInterpState *state);
+
+#endif /* SPYTHON_INTERP_STATE_H */
@@ -0,0 +1,363 @@
+#include "log_blocks.h"
+
+#include "pythread.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef SPYTHON_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef MS_WINDOWS
+#include <io.h>
+#define write _write
+#define close _close
+#define lseek _lseeki64
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Records are gathered into blocks of about this size */
+#define BLOCK_SIZE (64 * 1024)
+/* Full blocks waiting for the thread. Hooks only wait for it when it is
+   this far behind. */
+#define BLOCK_QUEUE 64
+/* How long a block that is not full may wait to be written */
+#define BLOCK_FLUSH_US 1000000
+
+#define BLOCK_HEADER_SIZE 40
+#define INDEX_ENTRY_SIZE 48
+
+typedef struct _Block {
+    char *data;
+    size_t len;
+    size_t capacity;
+    uint32_t records;
+    uint64_t first_us;
+    uint64_t last_us;
+    uint64_t events;
+} Block;
+
+struct _BlockWriter {
+    int fd;
+    int index_fd;
+    /* Protects everything up to the thread's own state */
+    PyThread_type_lock lock;
+    Block current;
+    Block queue[BLOCK_QUEUE];
+    int head;
+    int count;
+    int waiting;
+    int stopping;
+    /* Used as semaphores: released when a block is queued, when the
+       thread makes space for a waiting hook, and when the thread exits */
+    PyThread_type_lock wakeup;
+    PyThread_type_lock space;
+    PyThread_type_lock done;
+#ifndef MS_WINDOWS
+    /* The thread does not survive fork(), so the child starts another */
+    int fork_generation;
+#endif
+};
+
+#ifndef MS_WINDOWS
+static int fork_generation = 0;
+static int atfork_registered = 0;
+
+static void
+block_writer_atfork_child(void)
+{
+    ++fork_generation;
+}
+#endif
+
+
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* FNV-1a, so readers can compute the same bit */
+static uint64_t
+event_bit(const char *event)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)event; *p; ++p) {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    return (uint64_t)1 << (h & 63);
+}
+
+static void
+put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(v >> (i * 8));
+    }
+}
+
+static void
+put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(v >> (i * 8));
+    }
+}
+
+static int
+write_all(int fd, const unsigned char *data, size_t len)
+{
+    while (len) {
+        Py_ssize_t r = write(fd, data, (unsigned int)len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        data += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Runs on the thread */
+static void
+write_block(BlockWriter *w, const Block *b)
+{
+#ifdef SPYTHON_HAVE_ZLIB
+    uLongf compressed_len = compressBound((uLong)b->len);
+    unsigned char *out = (unsigned char *)malloc(BLOCK_HEADER_SIZE + compressed_len);
+    if (!out) {
+        return;
+    }
+    if (compress2(out + BLOCK_HEADER_SIZE, &compressed_len,
+                  (const Bytef *)b->data, (uLong)b->len,
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(out);
+        return;
+    }
+
+    memcpy(out, "SPLZ", 4);
+    put_le32(out + 4, (uint32_t)b->len);
+    put_le32(out + 8, (uint32_t)compressed_len);
+    put_le32(out + 12, b->records);
+    put_le64(out + 16, b->first_us);
+    put_le64(out + 24, b->last_us);
+    put_le64(out + 32, b->events);
+
+    size_t total = BLOCK_HEADER_SIZE + compressed_len;
+    if (write_all(w->fd, out, total) == 0) {
+        /* The log is opened for appending, so this is the end of our
+           block unless a forked process wrote in between, which readers
+           detect from the header */
+        long long end = (long long)lseek(w->fd, 0, SEEK_CUR);
+        unsigned char entry[INDEX_ENTRY_SIZE];
+        put_le64(entry, end >= (long long)total ? (uint64_t)(end - total) : 0);
+        memcpy(entry + 8, out, BLOCK_HEADER_SIZE);
+        memset(entry + 8, 0, 4);
+        write_all(w->index_fd, entry, sizeof(entry));
+    }
+    free(out);
+#endif
+}
+
+static void
+block_worker(void *arg)
+{
+    BlockWriter *w = (BlockWriter *)arg;
+    int stopping = 0;
+
+    while (!stopping) {
+        PyLockStatus woken = PyThread_acquire_lock_timed(w->wakeup, BLOCK_FLUSH_US, 0);
+        PyThread_acquire_lock(w->lock, WAIT_LOCK);
+        if (woken != PY_LOCK_ACQUIRED && w->current.len && w->count < BLOCK_QUEUE &&
+            now_us() - w->current.first_us >= BLOCK_FLUSH_US) {
+            w->queue[(w->head + w->count++) % BLOCK_QUEUE] = w->current;
+            memset(&w->current, 0, sizeof(w->current));
+        }
+        while (w->count) {
+            Block b = w->queue[w->head];
+            w->head = (w->head + 1) % BLOCK_QUEUE;
+            --w->count;
+            if (w->waiting) {
+                PyThread_release_lock(w->space);
+            }
+            PyThread_release_lock(w->lock);
+            write_block(w, &b);
+            free(b.data);
+            PyThread_acquire_lock(w->lock, WAIT_LOCK);
+        }
+        stopping = w->stopping;
+        PyThread_release_lock(w->lock);
+    }
+    PyThread_release_lock(w->done);
+}
+
+/* Allocates the locks and starts the thread */
+static int
+block_writer_start(BlockWriter *w)
+{
+    w->lock = PyThread_allocate_lock();
+    w->wakeup = PyThread_allocate_lock();
+    w->space = PyThread_allocate_lock();
+    w->done = PyThread_allocate_lock();
+    if (!w->lock || !w->wakeup || !w->space || !w->done) {
+        return -1;
+    }
+    /* The semaphores start taken */
+    PyThread_acquire_lock(w->wakeup, NOWAIT_LOCK);
+    PyThread_acquire_lock(w->space, NOWAIT_LOCK);
+    PyThread_acquire_lock(w->done, NOWAIT_LOCK);
+#ifndef MS_WINDOWS
+    w->fork_generation = fork_generation;
+#endif
+    if (PyThread_start_new_thread(block_worker, w) == PYTHREAD_INVALID_THREAD_ID) {
+        return -1;
+    }
+    return 0;
+}
+
+#ifndef MS_WINDOWS
+/* Blocks buffered before fork() belong to the parent, which writes them.
+   The old locks may be held by a thread that no longer exists, so they
+   are abandoned. */
+static void
+block_writer_after_fork(BlockWriter *w)
+{
+    free(w->current.data);
+    memset(&w->current, 0, sizeof(w->current));
+    for (int i = 0; i < w->count; ++i) {
+        free(w->queue[(w->head + i) % BLOCK_QUEUE].data);
+    }
+    w->head = w->count = w->waiting = w->stopping = 0;
+    if (block_writer_start(w) < 0) {
+        Py_FatalError("failed to restart log compression after fork");
+    }
+}
+#endif
+
+BlockWriter *
+block_writer_open(int fd, int index_fd)
+{
+#ifndef SPYTHON_HAVE_ZLIB
+    fprintf(stderr, "this build does not support compressed logs\n");
+    return NULL;
+#else
+    BlockWriter *w = (BlockWriter *)calloc(1, sizeof(BlockWriter));
+    if (!w) {
+        return NULL;
+    }
+    w->fd = fd;
+    w->index_fd = index_fd;
+#ifndef MS_WINDOWS
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, block_writer_atfork_child);
+        atfork_registered = 1;
+    }
+#endif
+    if (block_writer_start(w) < 0) {
+        fprintf(stderr, "failed to start log compression thread\n");
+        free(w);
+        return NULL;
+    }
+    return w;
+#endif
+}
+
+/* Hands the current block to the thread. Called with the lock held, which
+   is released while waiting for space. */
+static void
+queue_current(BlockWriter *w)
+{
+    while (w->count == BLOCK_QUEUE) {
+        /* Waiting is better than losing records */
+        ++w->waiting;
+        PyThread_release_lock(w->lock);
+        PyThread_acquire_lock_timed(w->space, 1000, 0);
+        PyThread_acquire_lock(w->lock, WAIT_LOCK);
+        --w->waiting;
+    }
+    if (w->current.len) {
+        w->queue[(w->head + w->count++) % BLOCK_QUEUE] = w->current;
+        memset(&w->current, 0, sizeof(w->current));
+        PyThread_release_lock(w->wakeup);
+    }
+}
+
+int
+block_writer_append(BlockWriter *w, const char *event,
+                    const BlockPart *parts, int nparts)
+{
+    size_t total = 0;
+    for (int i = 0; i < nparts; ++i) {
+        total += parts[i].len;
+    }
+    uint64_t now = now_us();
+    uint64_t bit = event_bit(event);
+
+#ifndef MS_WINDOWS
+    if (w->fork_generation != fork_generation) {
+        block_writer_after_fork(w);
+    }
+#endif
+
+    PyThread_acquire_lock(w->lock, WAIT_LOCK);
+    Block *b = &w->current;
+    /* Other hooks may fill the next block while this one waits */
+    while (b->len && b->len + total > BLOCK_SIZE) {
+        queue_current(w);
+    }
+    if (b->capacity < total || !b->data) {
+        size_t capacity = total > BLOCK_SIZE ? total : BLOCK_SIZE;
+        char *data = (char *)realloc(b->data, capacity);
+        if (!data) {
+            PyThread_release_lock(w->lock);
+            return -1;
+        }
+        b->data = data;
+        b->capacity = capacity;
+    }
+    for (int i = 0; i < nparts; ++i) {
+        memcpy(b->data + b->len, parts[i].data, parts[i].len);
+        b->len += parts[i].len;
+    }
+    if (!b->records++) {
+        b->first_us = now;
+    }
+    b->last_us = now;
+    b->events |= bit;
+    PyThread_release_lock(w->lock);
+    return 0;
+}
+
+void
+block_writer_close(BlockWriter *w)
+{
+#ifndef MS_WINDOWS
+    if (w->fork_generation != fork_generation) {
+        block_writer_after_fork(w);
+    }
+#endif
+    PyThread_acquire_lock(w->lock, WAIT_LOCK);
+    queue_current(w);
+    w->stopping = 1;
+    PyThread_release_lock(w->lock);
+    PyThread_release_lock(w->wakeup);
+    PyThread_acquire_lock(w->done, WAIT_LOCK);
+
+    close(w->fd);
+    close(w->index_fd);
+    PyThread_free_lock(w->lock);
+    PyThread_free_lock(w->wakeup);
+    PyThread_free_lock(w->space);
+    PyThread_free_lock(w->done);
+    free(w->current.data);
+    free(w);
+}
@@ -0,0 +1,53 @@
+/* Compressed block sink for LogToFile
+ *
+ * Records are copied into a 64 KiB block under a short lock. Full blocks
+ * are compressed with zlib and written by a background thread, so hooks
+ * never wait for compression or the disk. A block that is not full is
+ * written after a second, and when the log is closed.
+ *
+ * Each block is a complete zlib stream after a header, so any block can
+ * be decompressed on its own:
+ *
+ *     char magic[4] = "SPLZ"
+ *     uint32 raw_len, compressed_len, records
+ *     uint64 first_us, last_us   (UTC microseconds since the epoch)
+ *     uint64 events              (bit hash & 63 set for each event name,
+ *                                 where hash is 64-bit FNV-1a)
+ *
+ * All integers are little endian. The index file has a 48 byte entry per
+ * block, the offset of the block as a uint64 followed by its header with
+ * the magic replaced by zeros, so a reader can find the blocks for a time
+ * window or an event without reading the log. The index is a hint: the
+ * log can always be read by following the headers.
+ *
+ * See logcat.py for a reader. Blocks are only written by the process that
+ * filled them, so records buffered by a forked child that ends with
+ * os._exit() are lost. Builds without zlib (including make.cmd) reject
+ * SPYTHONLOGCOMPRESS.
+ */
+#ifndef SPYTHON_LOG_BLOCKS_H
+#define SPYTHON_LOG_BLOCKS_H
+
+#include "Python.h"
+
+typedef struct _BlockWriter BlockWriter;
+
+typedef struct _BlockPart {
+    const void *data;
+    size_t len;
+} BlockPart;
+
+/* Starts the compression thread. Takes ownership of both files, which
+   should be opened for appending. Prints the reason and returns NULL on
+   failure, including when this build has no zlib. */
+BlockWriter *block_writer_open(int fd, int index_fd);
+
+/* Adds one record, made of nparts pieces. Returns -1 if it could not be
+   stored. */
+int block_writer_append(BlockWriter *w, const char *event,
+                        const BlockPart *parts, int nparts);
+
+/* Writes anything buffered, stops the thread and closes the files */
+void block_writer_close(BlockWriter *w);
+
+#endif /* SPYTHON_LOG_BLOCKS_H */
@@ -0,0 +1,548 @@
+#include "log_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+LogRing *
+log_ring_attach(const char *name)
+{
+    fprintf(stderr, "SPYTHONLOGRING is not supported on Windows\n");
+    return NULL;
+}
+
+int
+log_ring_append(LogRing *r, const LogRingPart *parts, int nparts)
+{
+    return -1;
+}
+
+void
+log_ring_detach(LogRing *r)
+{
+}
+
+LogRing *
+log_ring_create(const char *name, size_t size, int mode)
+{
+    fprintf(stderr, "log rings are not supported on Windows\n");
+    return NULL;
+}
+
+size_t
+log_ring_drain(LogRing *r, log_ring_reader read, void *context)
+{
+    return 0;
+}
+
+void
+log_ring_stats(LogRing *r, LogRingStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+int
+log_ring_unlink(const char *name)
+{
+    return -1;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MAGIC "SPYRING1"
+/* Smallest ring, which fits two of the longest records */
+#define RING_MIN_SLOTS (2 * LOG_RING_MAX_RECORD / LOG_RING_SLOT_SIZE)
+
+/* How long the collector waits for an unpublished reservation before
+   reclaiming it, when its producer has exited, and when it was never
+   claimed */
+#define RING_DEAD_NS (100 * 1000000LL)
+#define RING_ORPHAN_NS (1000 * 1000000LL)
+
+/* A claimed slot's sequence number holds the producer's process id and
+   the position of its record, so it matches no free or published value */
+#define RING_CLAIMED (1ULL << 63)
+
+typedef struct _RingHeader {
+    char magic[8];
+    uint32_t slot_size;
+    uint32_t nslots;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    _Atomic int32_t collector;
+    uint32_t unused;
+} RingHeader;
+
+typedef struct _RingSlot {
+    _Atomic uint64_t seq;
+    _Atomic int32_t pid;
+    _Atomic uint32_t len;
+} RingSlot;
+
+struct _LogRing {
+    RingHeader *header;
+    RingSlot *slots;
+    char *data;
+    uint64_t nslots;
+    size_t map_size;
+    /* The rest is only used by the collector */
+    int collector;
+    char *record;
+    uint64_t records;
+    uint64_t reclaimed;
+    /* The unpublished reservation at the tail and when it was first seen */
+    uint64_t stall_pos;
+    uint64_t stall_head;
+    long long stall_start_ns;
+    /* Reservations before this whose producer is unknown were made by
+       producers that are now known to be gone */
+    uint64_t orphan_until;
+};
+
+/* getpid() is a system call, so the id is cached until a fork */
+static int32_t cached_pid = 0;
+
+static void
+ring_after_fork(void)
+{
+    cached_pid = (int32_t)getpid();
+}
+
+static int32_t
+ring_pid(void)
+{
+    if (!cached_pid) {
+        cached_pid = (int32_t)getpid();
+        pthread_atfork(NULL, NULL, ring_after_fork);
+    }
+    return cached_pid;
+}
+
+static long long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+process_alive(int32_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static uint64_t
+ring_claim_stamp(int32_t pid, uint64_t pos)
+{
+    return RING_CLAIMED | ((uint64_t)(uint32_t)pid << 32) | (pos & 0xFFFFFFFFu);
+}
+
+static int32_t
+ring_stamp_pid(uint64_t stamp)
+{
+    return (int32_t)((stamp >> 32) & 0x7FFFFFFF);
+}
+
+static uint64_t
+slots_for(size_t len)
+{
+    return (len + LOG_RING_SLOT_SIZE - 1) / LOG_RING_SLOT_SIZE;
+}
+
+static size_t
+ring_map_size(uint64_t nslots)
+{
+    return sizeof(RingHeader) + nslots * (sizeof(RingSlot) + LOG_RING_SLOT_SIZE);
+}
+
+static LogRing *
+ring_map(int fd, const char *name)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RingHeader)) {
+        fprintf(stderr, "log ring %s is not initialized\n", name);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "failed to map log ring %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    RingHeader *header = (RingHeader *)base;
+    uint64_t nslots = header->nslots;
+    atomic_thread_fence(memory_order_acquire);
+    if (memcmp(header->magic, RING_MAGIC, sizeof(header->magic)) != 0 ||
+        header->slot_size != LOG_RING_SLOT_SIZE ||
+        nslots < RING_MIN_SLOTS || (nslots & (nslots - 1)) ||
+        ring_map_size(nslots) != (size_t)st.st_size) {
+        fprintf(stderr, "%s is not a log ring\n", name);
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+
+    LogRing *r = (LogRing *)calloc(1, sizeof(LogRing));
+    if (!r) {
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+    r->header = header;
+    r->slots = (RingSlot *)(header + 1);
+    r->data = (char *)(r->slots + nslots);
+    r->nslots = nslots;
+    r->map_size = (size_t)st.st_size;
+    return r;
+}
+
+LogRing *
+log_ring_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open log ring %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    LogRing *r = ring_map(fd, name);
+    close(fd);
+    return r;
+}
+
+/* Copies len bytes at slot pos, wrapping at the end of the data */
+static void
+ring_copy_in(LogRing *r, uint64_t pos, const LogRingPart *parts, int nparts)
+{
+    size_t capacity = r->nslots * LOG_RING_SLOT_SIZE;
+    size_t offset = (pos & (r->nslots - 1)) * LOG_RING_SLOT_SIZE;
+    for (int i = 0; i < nparts; ++i) {
+        const char *p = (const char *)parts[i].data;
+        size_t len = parts[i].len;
+        while (len) {
+            size_t n = capacity - offset < len ? capacity - offset : len;
+            memcpy(r->data + offset, p, n);
+            p += n;
+            len -= n;
+            offset = (offset + n) % capacity;
+        }
+    }
+}
+
+int
+log_ring_append(LogRing *r, const LogRingPart *parts, int nparts)
+{
+    RingHeader *header = r->header;
+    size_t len = 0;
+    for (int i = 0; i < nparts; ++i) {
+        len += parts[i].len;
+    }
+    if (!len || len > LOG_RING_MAX_RECORD) {
+        atomic_fetch_add_explicit(&header->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    uint64_t mask = r->nslots - 1;
+    uint64_t k = slots_for(len);
+    uint64_t pos = atomic_load_explicit(&header->head, memory_order_relaxed);
+    for (;;) {
+        /* The collector frees slots in order, so the rest are free when
+           the last one is */
+        uint64_t last = pos + k - 1;
+        uint64_t seq = atomic_load_explicit(&r->slots[last & mask].seq,
+                                            memory_order_acquire);
+        int64_t diff = (int64_t)(seq - last);
+        if (seq & RING_CLAIMED) {
+            /* Claimed by a producer that has not published yet */
+            atomic_fetch_add_explicit(&header->dropped, 1, memory_order_relaxed);
+            return -1;
+        } else if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&header->head, &pos, pos + k,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* Still holds a record from the last time around */
+            atomic_fetch_add_explicit(&header->dropped, 1, memory_order_relaxed);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&header->head, memory_order_relaxed);
+        }
+    }
+
+    /* Claim every slot before writing to any of them. The collector takes
+       back unclaimed slots with a compare and swap as well, so if it gave
+       up on this reservation, the claim fails and nothing is written. Only
+       the first claim can fail, because the collector never passes a slot
+       claimed by a running process. */
+    int32_t pid = ring_pid();
+    uint64_t stamp = ring_claim_stamp(pid, pos);
+    for (uint64_t i = 0; i < k; ++i) {
+        uint64_t expected = pos + i;
+        if (!atomic_compare_exchange_strong_explicit(&r->slots[(pos + i) & mask].seq,
+                                                     &expected, stamp,
+                                                     memory_order_acquire,
+                                                     memory_order_relaxed)) {
+            while (i--) {
+                atomic_store_explicit(&r->slots[(pos + i) & mask].seq, pos + i,
+                                      memory_order_release);
+            }
+            atomic_fetch_add_explicit(&header->dropped, 1, memory_order_relaxed);
+            return -1;
+        }
+    }
+
+    RingSlot *first = &r->slots[pos & mask];
+    atomic_store_explicit(&first->len, (uint32_t)len, memory_order_relaxed);
+    atomic_store_explicit(&first->pid, pid, memory_order_relaxed);
+    ring_copy_in(r, pos, parts, nparts);
+    atomic_store_explicit(&first->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+void
+log_ring_detach(LogRing *r)
+{
+    if (r->collector) {
+        atomic_store_explicit(&r->header->collector, 0, memory_order_release);
+    }
+    munmap(r->header, r->map_size);
+    free(r->record);
+    free(r);
+}
+
+LogRing *
+log_ring_create(const char *name, size_t size, int mode)
+{
+    uint64_t nslots = RING_MIN_SLOTS;
+    while (nslots * LOG_RING_SLOT_SIZE < size) {
+        nslots *= 2;
+    }
+
+    LogRing *r = NULL;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd >= 0) {
+        /* shm_open applies the umask */
+        size_t map_size = ring_map_size(nslots);
+        if (fchmod(fd, mode) < 0 || ftruncate(fd, (off_t)map_size) < 0) {
+            fprintf(stderr, "failed to create log ring %s: %s\n", name, strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+        RingHeader *header = (RingHeader *)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            fprintf(stderr, "failed to map log ring %s: %s\n", name, strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+        RingSlot *slots = (RingSlot *)(header + 1);
+        for (uint64_t i = 0; i < nslots; ++i) {
+            atomic_init(&slots[i].seq, i);
+        }
+        header->slot_size = LOG_RING_SLOT_SIZE;
+        header->nslots = (uint32_t)nslots;
+        atomic_init(&header->collector, (int32_t)getpid());
+        /* Producers check the magic, so it goes in last */
+        atomic_thread_fence(memory_order_release);
+        memcpy(header->magic, RING_MAGIC, sizeof(header->magic));
+        munmap(header, map_size);
+        r = ring_map(fd, name);
+    } else if (errno == EEXIST) {
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            fprintf(stderr, "failed to open log ring %s: %s\n", name, strerror(errno));
+            return NULL;
+        }
+        r = ring_map(fd, name);
+        if (r) {
+            /* Records left by a collector that exited are kept */
+            int32_t pid = atomic_load(&r->header->collector);
+            if (pid && pid != getpid() && process_alive(pid)) {
+                fprintf(stderr, "log ring %s is already collected by process %d\n",
+                        name, (int)pid);
+                log_ring_detach(r);
+                r = NULL;
+            } else {
+                atomic_store(&r->header->collector, (int32_t)getpid());
+            }
+        }
+    } else {
+        fprintf(stderr, "failed to create log ring %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    close(fd);
+
+    if (r) {
+        r->collector = 1;
+        r->record = (char *)malloc(LOG_RING_MAX_RECORD);
+        if (!r->record) {
+            log_ring_detach(r);
+            return NULL;
+        }
+    }
+    return r;
+}
+
+/* Frees the slots of a record, in order, so producers can reserve them */
+static void
+ring_free(LogRing *r, uint64_t pos, uint64_t k)
+{
+    uint64_t mask = r->nslots - 1;
+    for (uint64_t i = pos; i < pos + k; ++i) {
+        RingSlot *s = &r->slots[i & mask];
+        atomic_store_explicit(&s->pid, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->len, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->seq, i + r->nslots, memory_order_release);
+    }
+}
+
+/* Takes back the reservation at tail if its producer is gone. Returns the
+   number of slots freed, or 0 to keep waiting. */
+static uint64_t
+ring_reclaim(LogRing *r, uint64_t tail, uint64_t head, uint64_t seq)
+{
+    long long now = now_ns();
+    if (r->stall_pos != tail || !r->stall_start_ns) {
+        r->stall_pos = tail;
+        r->stall_head = head;
+        r->stall_start_ns = now;
+        if (tail >= r->orphan_until) {
+            return 0;
+        }
+    }
+
+    uint64_t mask = r->nslots - 1;
+    long long waited = now - r->stall_start_ns;
+    uint64_t k = 0;
+    if (seq & RING_CLAIMED) {
+        /* A running producer may still write to the slots it claimed, so
+           they are only taken back once it has exited */
+        int32_t pid = ring_stamp_pid(seq);
+        if (waited < RING_DEAD_NS || process_alive(pid)) {
+            return 0;
+        }
+        while (k < head - tail) {
+            uint64_t expected = seq;
+            if (!atomic_compare_exchange_strong_explicit(&r->slots[(tail + k) & mask].seq,
+                                                         &expected, tail + k - 1,
+                                                         memory_order_acquire,
+                                                         memory_order_relaxed)) {
+                break;
+            }
+            k++;
+        }
+    } else if (seq == tail) {
+        /* Reserved but never claimed. A producer that claims it late fails
+           to, so this is always safe, but give a running one time first. */
+        if (tail >= r->orphan_until && waited < RING_ORPHAN_NS) {
+            return 0;
+        }
+        uint64_t expected = tail;
+        if (atomic_compare_exchange_strong_explicit(&r->slots[tail & mask].seq,
+                                                    &expected, tail - 1,
+                                                    memory_order_acquire,
+                                                    memory_order_relaxed)) {
+            k = 1;
+        }
+    }
+    if (!k) {
+        return 0;
+    }
+
+    /* Unclaimed slots that follow from before the stall belong to the same
+       reservation, or to another one as old */
+    r->orphan_until = r->stall_head;
+    ring_free(r, tail, k);
+    r->reclaimed++;
+    r->stall_start_ns = 0;
+    return k;
+}
+
+/* Copies a record that may wrap around the end of the data */
+static void
+ring_copy_out(LogRing *r, uint64_t pos, char *out, size_t len)
+{
+    size_t capacity = r->nslots * LOG_RING_SLOT_SIZE;
+    size_t offset = (pos & (r->nslots - 1)) * LOG_RING_SLOT_SIZE;
+    size_t n = capacity - offset < len ? capacity - offset : len;
+    memcpy(out, r->data + offset, n);
+    memcpy(out + n, r->data, len - n);
+}
+
+size_t
+log_ring_drain(LogRing *r, log_ring_reader read, void *context)
+{
+    RingHeader *header = r->header;
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    size_t count = 0;
+
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+        if (tail == head) {
+            r->stall_start_ns = 0;
+            break;
+        }
+
+        RingSlot *first = &r->slots[tail & (r->nslots - 1)];
+        uint64_t seq = atomic_load_explicit(&first->seq, memory_order_acquire);
+        uint64_t k;
+        if (seq == tail + 1) {
+            uint32_t len = atomic_load_explicit(&first->len, memory_order_relaxed);
+            int32_t pid = atomic_load_explicit(&first->pid, memory_order_relaxed);
+            k = slots_for(len);
+            if (!len || len > LOG_RING_MAX_RECORD || k > head - tail) {
+                /* Not a record this version of the ring could publish */
+                k = 1;
+                r->reclaimed++;
+            } else {
+                ring_copy_out(r, tail, r->record, len);
+                read(pid, r->record, len, context);
+                r->records++;
+                count++;
+            }
+            r->stall_start_ns = 0;
+            ring_free(r, tail, k);
+        } else {
+            k = ring_reclaim(r, tail, head, seq);
+            if (!k) {
+                break;
+            }
+        }
+        tail += k;
+        atomic_store_explicit(&header->tail, tail, memory_order_release);
+    }
+    return count;
+}
+
+void
+log_ring_stats(LogRing *r, LogRingStats *stats)
+{
+    stats->records = r->records;
+    stats->dropped = atomic_load_explicit(&r->header->dropped, memory_order_relaxed);
+    stats->reclaimed = r->reclaimed;
+}
+
+int
+log_ring_unlink(const char *name)
+{
+    return shm_unlink(name);
+}
+
+#endif
@@ -0,0 +1,101 @@
+/* Shared memory ring for LogToFile
+ *
+ * With SPYTHONLOGRING=<name>, every spython process on the host appends
+ * its records to one ring in POSIX shared memory instead of opening its
+ * own log, and spython-collector (spython_collector.c) drains the ring
+ * into a single file. The collector creates the ring, so it must be
+ * started first.
+ *
+ * The ring is an array of 128 byte slots, each with a sequence number,
+ * followed by the record data:
+ *
+ *     char magic[8] = "SPYRING1"
+ *     uint32 slot_size, nslots
+ *     uint64 head       next slot to reserve
+ *     uint64 tail       next slot to read, only moved by the collector
+ *     uint64 dropped    records that producers could not store
+ *     int32 collector   process id of the collector
+ *     RingSlot slots[nslots]   (uint64 seq, int32 pid, uint32 len)
+ *     char data[nslots * slot_size]
+ *
+ * A producer reserves the slots for a record by moving head forward with a
+ * compare and swap, once it sees that the last of them has been freed.
+ * It then claims each slot by swapping its sequence number from pos to a
+ * stamp of its process id and pos, fills in its process id and the
+ * length, copies the data and publishes the first slot by setting its
+ * sequence number to pos + 1. The collector reads records in order and
+ * frees their slots by setting each sequence number to pos + nslots.
+ * Producers never wait: when the ring is full, the record is counted in
+ * dropped instead.
+ *
+ * A producer that dies after reserving would stop the collector at its
+ * slots. Slots that were never claimed are reclaimed after a second, with
+ * a compare and swap on the sequence number that a producer claiming them
+ * late also needs, so it finds them gone and writes nothing. Claimed slots
+ * are only reclaimed once their producer has exited, because a running
+ * producer may still be copying into them; a producer that is stopped
+ * between claiming and publishing holds up the collector until it
+ * continues or exits, and other producers drop records if the ring fills
+ * meanwhile.
+ *
+ * Text records are prefixed with the producer's process id, such as
+ * '4242 [0] import: ...'. The collector reopens its output on SIGHUP, and
+ * a restarted collector takes over the ring. Cannot be combined with
+ * SPYTHONLOGCOMPRESS or SPYTHONLOGROTATE. Not available on Windows.
+ */
+#ifndef SPYTHON_LOG_RING_H
+#define SPYTHON_LOG_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RING_SLOT_SIZE 128
+/* Longer records are dropped */
+#define LOG_RING_MAX_RECORD (64 * 1024)
+
+typedef struct _LogRing LogRing;
+
+typedef struct _LogRingPart {
+    const void *data;
+    size_t len;
+} LogRingPart;
+
+/* Maps the ring created by the collector. Prints the reason and returns
+   NULL on failure. */
+LogRing *log_ring_attach(const char *name);
+
+/* Copies one record, made of nparts pieces, into the ring. Returns -1
+   and counts it as dropped if it could not be stored. */
+int log_ring_append(LogRing *r, const LogRingPart *parts, int nparts);
+
+void log_ring_detach(LogRing *r);
+
+/* For the collector */
+
+/* Creates the ring with room for size bytes of records and the given
+   permissions, or takes over an existing ring whose collector has
+   exited. Prints the reason and returns NULL on failure. */
+LogRing *log_ring_create(const char *name, size_t size, int mode);
+
+/* Called for each record with the process id of its producer */
+typedef void (*log_ring_reader)(int pid, const char *data, size_t len,
+                                void *context);
+
+typedef struct _LogRingStats {
+    uint64_t records;
+    /* Records that producers could not store */
+    uint64_t dropped;
+    /* Reservations taken back from producers that never published */
+    uint64_t reclaimed;
+} LogRingStats;
+
+/* Reads every published record and frees its slots. Returns the number
+   of records read. */
+size_t log_ring_drain(LogRing *r, log_ring_reader read, void *context);
+
+void log_ring_stats(LogRing *r, LogRingStats *stats);
+
+/* Removes the ring's name, so no new producers can attach */
+int log_ring_unlink(const char *name);
+
+#endif /* SPYTHON_LOG_RING_H */
@@ -0,0 +1,456 @@
+#include "log_rotate.h"
+
+#include "pythread.h"
+
+#include <stdio.h>
+
+#ifdef MS_WINDOWS
+
+int
+log_rotate_init(const char *spec)
+{
+    fprintf(stderr, "log rotation is not supported on Windows\n");
+    return -1;
+}
+
+int
+log_rotate_enabled(void)
+{
+    return 0;
+}
+
+void
+log_rotate_preserve(const char *path)
+{
+}
+
+int
+log_rotate_add(const char *path, int fd, int index_fd)
+{
+    return -1;
+}
+
+void
+log_rotate_remove(int fd)
+{
+}
+
+#else
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How often sizes, times and SIGHUP are checked */
+#define ROTATE_POLL_NS 100000000
+
+/* Longest suffix added to a path: ".20190801T120000Z-<n>.idx" */
+#define ROTATED_SUFFIX_MAX 48
+
+typedef struct _RotatedLog {
+    char *path;
+    int fd;
+    int index_fd;
+    time_t opened;
+} RotatedLog;
+
+static int enabled = 0;
+static unsigned long long max_bytes = 0;
+static long long interval = 0;
+static int keep = 0;
+
+static volatile sig_atomic_t hup_pending = 0;
+
+/* Held by the thread while it rotates, so logs are not closed under it */
+static PyThread_type_lock lock = NULL;
+static RotatedLog *logs = NULL;
+static int nlogs = 0;
+static int capacity = 0;
+static int thread_started = 0;
+
+
+static void
+on_sighup(int signum)
+{
+    hup_pending = 1;
+}
+
+/* A forked child shares its logs with the parent, which rotates them. The
+   thread is not copied, and the lock may have been held by it. */
+static void
+atfork_child(void)
+{
+    enabled = 0;
+}
+
+/* Parses a number followed by an optional unit from units, where scales
+   holds the multiplier for each unit */
+static int
+parse_scaled(const char *s, size_t len, const char *units,
+             const unsigned long long *scales, unsigned long long *value)
+{
+    unsigned long long v = 0;
+    size_t i = 0;
+    for (; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+        v = v * 10 + (unsigned long long)(s[i] - '0');
+    }
+    if (i == 0) {
+        return -1;
+    }
+    if (i < len) {
+        const char *unit = strchr(units, s[i]);
+        if (!unit || !s[i] || i + 1 != len) {
+            return -1;
+        }
+        v *= scales[unit - units];
+    }
+    *value = v;
+    return 0;
+}
+
+int
+log_rotate_init(const char *spec)
+{
+    static const unsigned long long size_scales[] = { 1024, 1024 * 1024, 1024 * 1024 * 1024 };
+    static const unsigned long long time_scales[] = { 1, 60, 3600, 86400 };
+
+    for (const char *p = spec; *p; ) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        unsigned long long v = 0;
+        int ok;
+        if (len > 5 && memcmp(p, "size=", 5) == 0) {
+            ok = parse_scaled(p + 5, len - 5, "KMG", size_scales, &v) == 0 && v > 0;
+            max_bytes = v;
+        } else if (len > 6 && memcmp(p, "every=", 6) == 0) {
+            ok = parse_scaled(p + 6, len - 6, "smhd", time_scales, &v) == 0 && v > 0;
+            interval = (long long)v;
+        } else if (len > 5 && memcmp(p, "keep=", 5) == 0) {
+            ok = parse_scaled(p + 5, len - 5, "", NULL, &v) == 0 && v > 0 && v < 100000;
+            keep = (int)v;
+        } else {
+            ok = len == 3 && memcmp(p, "hup", 3) == 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "invalid SPYTHONLOGROTATE option: %.*s\n", (int)len, p);
+            return -1;
+        }
+        p += len + (end ? 1 : 0);
+    }
+
+    lock = PyThread_allocate_lock();
+    if (!lock) {
+        fprintf(stderr, "failed to allocate log rotation lock\n");
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sighup;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGHUP, &sa, NULL) < 0) {
+        perror("sigaction");
+        return -1;
+    }
+    pthread_atfork(NULL, NULL, atfork_child);
+    enabled = 1;
+    return 0;
+}
+
+int
+log_rotate_enabled(void)
+{
+    return enabled;
+}
+
+/* Parses the part of a rotated name after '<log>.', returning 0 and the
+   time and sequence number for 'YYYYmmddTHHMMSSZ[-n]' */
+static int
+parse_rotated(const char *s, char stamp[17], unsigned long *seq)
+{
+    for (int i = 0; i < 16; ++i) {
+        char c = s[i];
+        if (i == 8 ? c != 'T' : i == 15 ? c != 'Z' : (c < '0' || c > '9')) {
+            return -1;
+        }
+    }
+    memcpy(stamp, s, 16);
+    stamp[16] = '\0';
+    *seq = 0;
+    if (!s[16]) {
+        return 0;
+    }
+    if (s[16] != '-' || !s[17]) {
+        return -1;
+    }
+    for (const char *p = s + 17; *p; ++p) {
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        *seq = *seq * 10 + (unsigned long)(*p - '0');
+    }
+    return 0;
+}
+
+typedef struct _RotatedName {
+    char stamp[17];
+    unsigned long seq;
+    char *name;
+} RotatedName;
+
+static int
+compare_rotated(const void *a, const void *b)
+{
+    const RotatedName *x = (const RotatedName *)a, *y = (const RotatedName *)b;
+    int c = strcmp(x->stamp, y->stamp);
+    if (c) {
+        return c;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Deletes all but the newest rotated files for path */
+static void
+prune(const char *path)
+{
+    if (!keep) {
+        return;
+    }
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    const char *base = slash ? slash + 1 : path;
+    size_t base_len = strlen(base);
+    DIR *d = dir ? opendir(dir) : NULL;
+    if (!d) {
+        free(dir);
+        return;
+    }
+
+    RotatedName *names = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        RotatedName n;
+        if (strncmp(ent->d_name, base, base_len) != 0 || ent->d_name[base_len] != '.' ||
+            parse_rotated(ent->d_name + base_len + 1, n.stamp, &n.seq) < 0) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            RotatedName *p = (RotatedName *)realloc(names, cap * sizeof(RotatedName));
+            if (!p) {
+                break;
+            }
+            names = p;
+        }
+        n.name = strdup(ent->d_name);
+        if (n.name) {
+            names[count++] = n;
+        }
+    }
+    closedir(d);
+
+    qsort(names, count, sizeof(RotatedName), compare_rotated);
+    for (size_t i = 0; i < count; ++i) {
+        if (i + keep < count) {
+            char *victim = (char *)malloc(strlen(dir) + strlen(names[i].name) + 6);
+            if (victim) {
+                sprintf(victim, "%s/%s", dir, names[i].name);
+                unlink(victim);
+                strcat(victim, ".idx");
+                unlink(victim);
+                free(victim);
+            }
+        }
+        free(names[i].name);
+    }
+    free(names);
+    free(dir);
+}
+
+/* Renames path (and its index) to the next rotated name */
+static int
+rename_aside(const char *path, int has_index, time_t now)
+{
+    size_t len = strlen(path);
+    char *rotated = (char *)malloc(len + ROTATED_SUFFIX_MAX);
+    char *index = (char *)malloc(len + ROTATED_SUFFIX_MAX);
+    if (!rotated || !index) {
+        free(rotated);
+        free(index);
+        return -1;
+    }
+
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    memcpy(rotated, path, len);
+    rotated[len] = '.';
+    size_t n = len + 1 + strftime(rotated + len + 1, 17, "%Y%m%dT%H%M%SZ", &tm);
+    rotated[n] = '\0';
+    /* Several rotations in one second get a sequence number */
+    for (unsigned seq = 1; access(rotated, F_OK) == 0; ++seq) {
+        snprintf(rotated + n, ROTATED_SUFFIX_MAX - 17, "-%u", seq);
+    }
+
+    int r = rename(path, rotated);
+    if (r < 0) {
+        fprintf(stderr, "spython: failed to rotate %s: %s\n", path, strerror(errno));
+    } else if (has_index) {
+        snprintf(index, len + ROTATED_SUFFIX_MAX, "%s.idx", path);
+        strcat(rotated, ".idx");
+        rename(index, rotated);
+    }
+    free(rotated);
+    free(index);
+    return r;
+}
+
+/* Opens path and moves it to fd, which writers keep using throughout */
+static void
+reopen(const char *path, int fd)
+{
+    int new_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (new_fd < 0) {
+        fprintf(stderr, "spython: failed to reopen %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (dup2(new_fd, fd) < 0) {
+        fprintf(stderr, "spython: failed to reopen %s: %s\n", path, strerror(errno));
+    } else {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    close(new_fd);
+}
+
+static void
+reopen_log(RotatedLog *l)
+{
+    reopen(l->path, l->fd);
+    if (l->index_fd >= 0) {
+        char *index = (char *)malloc(strlen(l->path) + 5);
+        if (index) {
+            sprintf(index, "%s.idx", l->path);
+            reopen(index, l->index_fd);
+            free(index);
+        }
+    }
+}
+
+static int
+rotation_due(RotatedLog *l, time_t now)
+{
+    struct stat st;
+    if (fstat(l->fd, &st) < 0 || st.st_size == 0) {
+        return 0;
+    }
+    return (max_bytes && (unsigned long long)st.st_size >= max_bytes) ||
+           (interval && now - l->opened >= interval);
+}
+
+static void
+rotate_worker(void *arg)
+{
+    for (;;) {
+        struct timespec pause = { 0, ROTATE_POLL_NS };
+        nanosleep(&pause, NULL);
+
+        int hup = 0;
+        if (hup_pending) {
+            hup_pending = 0;
+            hup = 1;
+        }
+        time_t now = time(NULL);
+
+        PyThread_acquire_lock(lock, WAIT_LOCK);
+        for (int i = 0; i < nlogs; ++i) {
+            RotatedLog *l = &logs[i];
+            if (hup) {
+                reopen_log(l);
+            } else if (rotation_due(l, now)) {
+                if (rename_aside(l->path, l->index_fd >= 0, now) == 0) {
+                    reopen_log(l);
+                    prune(l->path);
+                }
+                l->opened = now;
+            }
+        }
+        PyThread_release_lock(lock);
+    }
+}
+
+void
+log_rotate_preserve(const char *path)
+{
+    struct stat st;
+    if (!enabled || stat(path, &st) < 0 || st.st_size == 0) {
+        return;
+    }
+    size_t len = strlen(path);
+    char *index = (char *)malloc(len + 5);
+    if (!index) {
+        return;
+    }
+    sprintf(index, "%s.idx", path);
+    if (rename_aside(path, access(index, F_OK) == 0, time(NULL)) == 0) {
+        prune(path);
+    }
+    free(index);
+}
+
+int
+log_rotate_add(const char *path, int fd, int index_fd)
+{
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    PyThread_acquire_lock(lock, WAIT_LOCK);
+    if (nlogs == capacity) {
+        int new_capacity = capacity ? capacity * 2 : 4;
+        RotatedLog *p = (RotatedLog *)realloc(logs, new_capacity * sizeof(RotatedLog));
+        if (!p) {
+            PyThread_release_lock(lock);
+            free(copy);
+            return -1;
+        }
+        logs = p;
+        capacity = new_capacity;
+    }
+    logs[nlogs++] = (RotatedLog){ copy, fd, index_fd, time(NULL) };
+    if (!thread_started) {
+        if (PyThread_start_new_thread(rotate_worker, NULL) == PYTHREAD_INVALID_THREAD_ID) {
+            --nlogs;
+            PyThread_release_lock(lock);
+            free(copy);
+            fprintf(stderr, "failed to start log rotation thread\n");
+            return -1;
+        }
+        thread_started = 1;
+    }
+    PyThread_release_lock(lock);
+    return 0;
+}
+
+void
+log_rotate_remove(int fd)
+{
+    if (!enabled) {
+        return;
+    }
+    PyThread_acquire_lock(lock, WAIT_LOCK);
+    for (int i = 0; i < nlogs; ++i) {
+        if (logs[i].fd == fd) {
+            free(logs[i].path);
+            logs[i] = logs[--nlogs];
+            break;
+        }
+    }
+    PyThread_release_lock(lock);
+}
+
+#endif
@@ -0,0 +1,50 @@
+/* Log rotation for LogToFile
+ *
+ * SPYTHONLOGROTATE is a comma separated list of options:
+ *
+ *     size=<n>[K|M|G]    rotate once the file reaches this size
+ *     every=<n>[s|m|h|d] rotate files that have been open this long
+ *     keep=<n>           delete all but the newest n rotated files
+ *     hup                only reopen on SIGHUP (always enabled)
+ *
+ * A rotated log is renamed to '<log>.<UTC time>', such as
+ * 'spython.log.20190801T120000Z', along with its index when it is
+ * compressed. An existing log is moved aside the same way at startup
+ * instead of being truncated.
+ *
+ * Rotation runs on its own thread, which checks each log ten times a
+ * second, so files may grow a little past the size limit.
+ * The file is renamed first, so records written meanwhile stay in it, and
+ * a new file is then put in place with dup2() under the same descriptor.
+ * Hooks keep calling write() throughout and never wait for a rotation, and
+ * every record lands in exactly one of the files.
+ *
+ * On SIGHUP, every log is reopened at its path without being renamed, for
+ * use with logrotate. Not available on Windows, where open files cannot
+ * be renamed.
+ */
+#ifndef SPYTHON_LOG_ROTATE_H
+#define SPYTHON_LOG_ROTATE_H
+
+#include "Python.h"
+
+/* Parses spec and installs the SIGHUP handler. Prints the reason and
+   returns -1 on failure. Called before Python is initialized. */
+int log_rotate_init(const char *spec);
+
+/* Nonzero after log_rotate_init */
+int log_rotate_enabled(void);
+
+/* Moves a log left at path by an earlier run aside, so opening it does
+   not lose it */
+void log_rotate_preserve(const char *path);
+
+/* Rotates the log at path, open as fd, with its index open as index_fd
+   (or -1). Starts the thread on first use. Returns -1 on failure. */
+int log_rotate_add(const char *path, int fd, int index_fd);
+
+/* Stops rotating the log open as fd, waiting for a rotation in progress.
+   Must be called before fd is closed. */
+void log_rotate_remove(int fd);
+
+#endif /* SPYTHON_LOG_ROTATE_H */
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+'''
+Reader for compressed LogToFile logs (SPYTHONLOGCOMPRESS=zlib).
+
+Prints the records in a log, optionally only those in a time window or
+for some events. The index ('<log>.idx') is used to skip blocks that
+cannot match without reading them. Without an index, or when it does not
+describe the log, the block headers in the log are followed instead.
+
+    python3 logcat.py spython.log [--since 2019-08-01T12:00:00] [--until ...]
+                      [--event import --event open] [--no-index]
+
+Times are UTC. Records are filtered by block, then by their own text:
+text records start with '[<interp>] <event>: ', and JSON records have
+"ts" and "event" fields.
+'''
+
+import argparse
+import datetime
+import json
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = b'SPLZ'
+HEADER = struct.Struct('<4sIIIQQQ')
+INDEX_ENTRY = struct.Struct('<Q4sIIIQQQ')
+EPOCH = datetime.datetime(1970, 1, 1, tzinfo=datetime.timezone.utc)
+
+
+def event_bit(event):
+    h = 0xcbf29ce484222325
+    for c in event.encode('utf-8'):
+        h = ((h ^ c) * 0x100000001b3) & 0xFFFFFFFFFFFFFFFF
+    return 1 << (h & 63)
+
+
+def parse_time(s):
+    t = datetime.datetime.fromisoformat(s.rstrip('Z'))
+    if t.tzinfo is None:
+        t = t.replace(tzinfo=datetime.timezone.utc)
+    return (t - EPOCH) // datetime.timedelta(microseconds=1)
+
+
+def blocks_from_index(f, index_path):
+    '''Yields (offset, header) from the index, checking each against the log'''
+    with open(index_path, 'rb') as idx:
+        data = idx.read()
+    for i in range(0, len(data) - INDEX_ENTRY.size + 1, INDEX_ENTRY.size):
+        offset, _, *rest = INDEX_ENTRY.unpack_from(data, i)
+        f.seek(offset)
+        header = f.read(HEADER.size)
+        if len(header) < HEADER.size or HEADER.unpack(header)[1:] != tuple(rest):
+            raise ValueError('index does not match the log at {}'.format(offset))
+        yield offset, HEADER.unpack(header)
+
+
+def blocks_from_log(f):
+    '''Yields (offset, header) by following the headers'''
+    offset = 0
+    while True:
+        f.seek(offset)
+        header = f.read(HEADER.size)
+        if len(header) < HEADER.size:
+            return
+        fields = HEADER.unpack(header)
+        if fields[0] != MAGIC:
+            raise ValueError('no block at {}'.format(offset))
+        yield offset, fields
+        offset += HEADER.size + fields[2]
+
+
+def read_block(f, offset, header):
+    _, raw_len, compressed_len, *_ = header
+    f.seek(offset + HEADER.size)
+    data = zlib.decompress(f.read(compressed_len))
+    if len(data) != raw_len:
+        raise ValueError('block at {} is damaged'.format(offset))
+    return data
+
+
+def record_matches(line, events, since, until):
+    if line.startswith(b'{'):
+        try:
+            record = json.loads(line)
+        except ValueError:
+            return True
+        if events and record.get('event') not in events:
+            return False
+        if since is not None or until is not None:
+            t = parse_time(record['ts'])
+            return (since is None or t >= since) and (until is None or t <= until)
+        return True
+    if events:
+        _, _, rest = line.partition(b'] ')
+        event = rest.partition(b': ')[0].decode('utf-8', 'replace')
+        return event in events
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument('log')
+    parser.add_argument('--since', type=parse_time)
+    parser.add_argument('--until', type=parse_time)
+    parser.add_argument('--event', action='append', default=[])
+    parser.add_argument('--no-index', action='store_true')
+    parser.add_argument('--stats', action='store_true',
+                        help='print how many blocks were read to stderr')
+    args = parser.parse_args()
+
+    mask = 0
+    for event in args.event:
+        mask |= event_bit(event)
+    events = set(args.event)
+    index_path = args.log + '.idx'
+    out = sys.stdout.buffer
+
+    with open(args.log, 'rb') as f:
+        blocks = None
+        if not args.no_index and os.path.exists(index_path):
+            try:
+                blocks = list(blocks_from_index(f, index_path))
+            except ValueError as ex:
+                print('logcat: {}, reading headers instead'.format(ex), file=sys.stderr)
+        if blocks is None:
+            blocks = blocks_from_log(f)
+
+        total = read = 0
+        for offset, header in blocks:
+            total += 1
+            first_us, last_us, bits = header[4:]
+            if args.since is not None and last_us < args.since:
+                continue
+            if args.until is not None and first_us > args.until:
+                continue
+            if mask and not bits & mask:
+                continue
+            read += 1
+            for line in read_block(f, offset, header).splitlines(True):
+                if record_matches(line, events, args.since, args.until):
+                    out.write(line)
+
+    if args.stats:
+        print('logcat: read {} of {} blocks'.format(read, total), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -21,7 +21,35 @@ if exist "%_PYTHONLIB%\python_d.exe" (
 
 @echo on
 @if not exist obj mkdir obj
-cl -nologo %_MD% -c spython.c -Foobj\spython.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c spython.c -Foobj\spython.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
 @if errorlevel 1 exit /B %ERRORLEVEL%
-link /nologo obj\spython.obj /out:spython.exe /debug:FULL /pdb:spython.pdb /libpath:"%_PYTHONLIB%"
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c audit_log.c -Foobj\audit_log.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c audit_json.c -Foobj\audit_json.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c coalesce.c -Foobj\coalesce.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c import_profile.c -Foobj\import_profile.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c interp_state.c -Foobj\interp_state.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c log_blocks.c -Foobj\log_blocks.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c log_ring.c -Foobj\log_ring.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c log_rotate.c -Foobj\log_rotate.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c allowlist.c -Foobj\allowlist.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c path_policy.c -Foobj\path_policy.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c preinit.c -Foobj\preinit.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c scanner.c -Foobj\scanner.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c sha256.c -Foobj\sha256.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c verify_code.c -Foobj\verify_code.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+link /nologo obj\spython.obj obj\audit_log.obj obj\audit_json.obj obj\coalesce.obj obj\import_profile.obj obj\interp_state.obj obj\log_blocks.obj obj\log_ring.obj obj\log_rotate.obj obj\allowlist.obj obj\path_policy.obj obj\preinit.obj obj\scanner.obj obj\sha256.obj obj\verify_code.obj /out:spython.exe /debug:FULL /pdb:spython.pdb /libpath:"%_PYTHONLIB%"
 @if errorlevel 1 exit /B %ERRORLEVEL%
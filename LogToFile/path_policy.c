@@ -0,0 +1,678 @@
+#include "path_policy.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef MS_WINDOWS
+#include <direct.h>
+#define getcwd _getcwd
+#else
+#include <unistd.h>
+#endif
+
+/* Longest normalized path, including the terminator */
+#define POLICY_MAX_PATH 4096
+
+#define RULE_ALLOW 0x1
+#define RULE_DENY 0x2
+#define RULE_HASH 0x4
+#define RULE_LOG 0x8
+
+#define NO_RULE (-1)
+#define NO_NODE UINT32_MAX
+
+/* Used when no policy file is given */
+static const char default_exts[] = ".py\0.pth\0";
+
+typedef struct _PolicyRule {
+    unsigned flags;
+    /* Allowed extensions, each followed by a NUL and the list by another,
+       or NULL for any */
+    char *exts;
+} PolicyRule;
+
+/* Chains of nodes with one child and no rule are merged, so each node
+   matches a label of one or more bytes */
+typedef struct _TrieNode {
+    uint32_t label;
+    uint32_t label_len;
+    /* Edges to children, sorted by the first byte of their label */
+    uint32_t first_edge;
+    uint32_t nedges;
+    int32_t rule;
+} TrieNode;
+
+typedef struct _TrieEdge {
+    unsigned char byte;
+    uint32_t child;
+} TrieEdge;
+
+struct _PathPolicy {
+    TrieNode *nodes;
+    uint32_t nnodes;
+    TrieEdge *edges;
+    char *labels;
+    PolicyRule *rules;
+    int32_t nrules;
+    /* Sorted, for bsearch */
+    unsigned char (*hashes)[SHA256_DIGEST_SIZE];
+    size_t nhashes;
+};
+
+/* Nodes are built as linked lists of children, then flattened */
+typedef struct _BuildNode {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    unsigned char byte;
+    int32_t rule;
+} BuildNode;
+
+typedef struct _PolicyBuilder {
+    BuildNode *nodes;
+    uint32_t nnodes;
+    uint32_t capacity;
+} PolicyBuilder;
+
+
+static int
+is_sep(char c)
+{
+#ifdef MS_WINDOWS
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+}
+
+#ifdef MS_WINDOWS
+static char
+fold(char c)
+{
+    return (char)tolower((unsigned char)c);
+}
+#endif
+
+/* Returns the length of the component at the start of s */
+static Py_ssize_t
+component_len(const char *s, Py_ssize_t len)
+{
+#ifdef MS_WINDOWS
+    Py_ssize_t n = 0;
+    while (n < len && !is_sep(s[n])) {
+        ++n;
+    }
+    return n;
+#else
+    const char *sep = (const char *)memchr(s, '/', (size_t)len);
+    return sep ? sep - s : len;
+#endif
+}
+
+/* Appends the components of src to out, resolving "." and "..", and
+   never removing anything before root */
+static int
+append_components(char *out, Py_ssize_t *o, Py_ssize_t root,
+                  const char *src, Py_ssize_t len)
+{
+    Py_ssize_t i = 0;
+    while (i < len) {
+        while (i < len && is_sep(src[i])) {
+            ++i;
+        }
+        Py_ssize_t start = i;
+        Py_ssize_t n = component_len(&src[i], len - i);
+        i += n;
+        if (n == 0 || (n == 1 && src[start] == '.')) {
+            continue;
+        }
+        if (n == 2 && src[start] == '.' && src[start + 1] == '.') {
+            while (*o > root && out[*o - 1] != '/') {
+                --*o;
+            }
+            if (*o > root) {
+                --*o;
+            }
+            continue;
+        }
+        if (*o + 1 + n >= POLICY_MAX_PATH) {
+            return -1;
+        }
+        out[(*o)++] = '/';
+#ifdef MS_WINDOWS
+        for (Py_ssize_t j = 0; j < n; ++j) {
+            out[(*o)++] = fold(src[start + j]);
+        }
+#else
+        memcpy(&out[*o], &src[start], (size_t)n);
+        *o += n;
+#endif
+    }
+    return 0;
+}
+
+/* Writes the normalized form of path to out, which holds POLICY_MAX_PATH
+   bytes, and returns its length, or -1 if it is too long */
+static Py_ssize_t
+normalize(const char *path, Py_ssize_t len, char *out)
+{
+    Py_ssize_t o = 0, root = 0;
+    int absolute = len > 0 && is_sep(path[0]);
+
+#ifdef MS_WINDOWS
+    if (len >= 2 && path[1] == ':') {
+        out[o++] = fold(path[0]);
+        out[o++] = ':';
+        root = 2;
+        path += 2;
+        len -= 2;
+        absolute = 1;
+    }
+#endif
+
+    if (!absolute) {
+        char cwd[POLICY_MAX_PATH];
+        if (!getcwd(cwd, sizeof(cwd))) {
+            return -1;
+        }
+        const char *c = cwd;
+        Py_ssize_t clen = (Py_ssize_t)strlen(cwd);
+#ifdef MS_WINDOWS
+        if (clen >= 2 && cwd[1] == ':') {
+            out[o++] = fold(cwd[0]);
+            out[o++] = ':';
+            root = 2;
+            c += 2;
+            clen -= 2;
+        }
+#endif
+        if (append_components(out, &o, root, c, clen) < 0) {
+            return -1;
+        }
+    }
+    if (append_components(out, &o, root, path, len) < 0) {
+        return -1;
+    }
+    if (o == root) {
+        out[o++] = '/';
+    }
+    out[o] = '\0';
+    return o;
+}
+
+
+static uint32_t
+builder_new_node(PolicyBuilder *b, unsigned char byte)
+{
+    if (b->nnodes == b->capacity) {
+        uint32_t capacity = b->capacity ? b->capacity * 2 : 256;
+        BuildNode *nodes = (BuildNode *)realloc(b->nodes, capacity * sizeof(BuildNode));
+        if (!nodes) {
+            return NO_NODE;
+        }
+        b->nodes = nodes;
+        b->capacity = capacity;
+    }
+    BuildNode *n = &b->nodes[b->nnodes];
+    n->first_child = NO_NODE;
+    n->next_sibling = NO_NODE;
+    n->byte = byte;
+    n->rule = NO_RULE;
+    return b->nnodes++;
+}
+
+/* Returns the node for prefix, adding any that are missing */
+static uint32_t
+builder_insert(PolicyBuilder *b, const char *prefix, Py_ssize_t len)
+{
+    uint32_t node = 0;
+    for (Py_ssize_t i = 0; i < len; ++i) {
+        unsigned char byte = (unsigned char)prefix[i];
+        /* Children are kept sorted, so flattening needs no sort */
+        uint32_t *link = &b->nodes[node].first_child;
+        while (*link != NO_NODE && b->nodes[*link].byte < byte) {
+            link = &b->nodes[*link].next_sibling;
+        }
+        if (*link == NO_NODE || b->nodes[*link].byte != byte) {
+            uint32_t child = builder_new_node(b, byte);
+            if (child == NO_NODE) {
+                return NO_NODE;
+            }
+            /* builder_new_node may have moved the nodes */
+            link = &b->nodes[node].first_child;
+            while (*link != NO_NODE && b->nodes[*link].byte < byte) {
+                link = &b->nodes[*link].next_sibling;
+            }
+            b->nodes[child].next_sibling = *link;
+            *link = child;
+        }
+        node = *link;
+    }
+    return node;
+}
+
+/* Copies the tree into contiguous arrays in breadth first order,
+   merging chains as it goes */
+static int
+policy_flatten(PathPolicy *policy, const PolicyBuilder *b)
+{
+    const BuildNode *bn = b->nodes;
+    uint32_t *queue = (uint32_t *)malloc(b->nnodes * sizeof(uint32_t));
+    policy->nodes = (TrieNode *)calloc(b->nnodes, sizeof(TrieNode));
+    policy->edges = (TrieEdge *)calloc(b->nnodes, sizeof(TrieEdge));
+    policy->labels = (char *)malloc(b->nnodes);
+    if (!queue || !policy->nodes || !policy->edges || !policy->labels) {
+        free(queue);
+        return -1;
+    }
+
+    /* The queue holds the last build node of each merged chain */
+    uint32_t head = 0, tail = 1, nedges = 0, nlabels = 0;
+    queue[0] = 0;
+    while (head < tail) {
+        uint32_t end = queue[head];
+        TrieNode *n = &policy->nodes[head++];
+        n->rule = bn[end].rule;
+        n->first_edge = nedges;
+        for (uint32_t c = bn[end].first_child; c != NO_NODE; c = bn[c].next_sibling) {
+            TrieNode *child = &policy->nodes[tail];
+            uint32_t last = c;
+            child->label = nlabels;
+            policy->labels[nlabels++] = (char)bn[c].byte;
+            while (bn[last].rule == NO_RULE && bn[last].first_child != NO_NODE &&
+                   bn[bn[last].first_child].next_sibling == NO_NODE) {
+                last = bn[last].first_child;
+                policy->labels[nlabels++] = (char)bn[last].byte;
+            }
+            child->label_len = nlabels - child->label;
+            policy->edges[nedges].byte = bn[c].byte;
+            policy->edges[nedges].child = tail;
+            ++nedges;
+            queue[tail++] = last;
+        }
+        n->nedges = nedges - n->first_edge;
+    }
+    policy->nnodes = tail;
+    free(queue);
+    return 0;
+}
+
+static uint32_t
+trie_step(const PathPolicy *policy, uint32_t node, unsigned char byte)
+{
+    const TrieEdge *edges = &policy->edges[policy->nodes[node].first_edge];
+    uint32_t lo = 0, hi = policy->nodes[node].nedges;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (edges[mid].byte < byte) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < policy->nodes[node].nedges && edges[lo].byte == byte ?
+        edges[lo].child : NO_NODE;
+}
+
+
+/* Splits the next whitespace separated, optionally quoted, token from *p
+   and returns it, or NULL at the end of the line */
+static char *
+next_token(char **p)
+{
+    char *s = *p, *token;
+    while (*s == ' ' || *s == '\t') {
+        ++s;
+    }
+    if (!*s) {
+        return NULL;
+    }
+    if (*s == '"') {
+        token = ++s;
+        while (*s && *s != '"') {
+            ++s;
+        }
+    } else {
+        token = s;
+        while (*s && *s != ' ' && *s != '\t') {
+            ++s;
+        }
+    }
+    if (*s) {
+        *s++ = '\0';
+    }
+    *p = s;
+    return token;
+}
+
+/* Converts "ext=.py,.pth" to the list format, or NULL for "*" */
+static int
+parse_exts(const char *value, char **exts)
+{
+    if (strcmp(value, "*") == 0) {
+        *exts = NULL;
+        return 0;
+    }
+    size_t len = strlen(value);
+    char *list = len ? (char *)malloc(len + 2) : NULL;
+    if (!list) {
+        return -1;
+    }
+    memcpy(list, value, len + 1);
+    list[len + 1] = '\0';
+    for (char *e = list; *e; ) {
+        char *comma = strchr(e, ',');
+        if (comma) {
+            *comma = '\0';
+        }
+        if (e[0] != '.' || !e[1]) {
+            free(list);
+            return -1;
+        }
+        e += strlen(e) + 1;
+    }
+    *exts = list;
+    return 0;
+}
+
+static int
+parse_hash(const char *hex, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    if (strlen(hex) != SHA256_DIGEST_SIZE * 2) {
+        return -1;
+    }
+    for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        unsigned int v;
+        if (!isxdigit((unsigned char)hex[i * 2]) ||
+            !isxdigit((unsigned char)hex[i * 2 + 1]) ||
+            sscanf(hex + i * 2, "%2x", &v) != 1) {
+            return -1;
+        }
+        digest[i] = (unsigned char)v;
+    }
+    return 0;
+}
+
+static int
+policy_add_rule(PathPolicy *policy, PolicyBuilder *b, const char *path,
+                unsigned flags, char *exts)
+{
+    char norm[POLICY_MAX_PATH];
+    Py_ssize_t len = 0;
+    if (path) {
+        len = normalize(path, (Py_ssize_t)strlen(path), norm);
+        if (len < 0) {
+            return -1;
+        }
+    }
+    uint32_t node = builder_insert(b, norm, len);
+    if (node == NO_NODE || b->nodes[node].rule != NO_RULE) {
+        return -1;
+    }
+    PolicyRule *rules = (PolicyRule *)realloc(
+        policy->rules, (policy->nrules + 1) * sizeof(PolicyRule));
+    if (!rules) {
+        return -1;
+    }
+    policy->rules = rules;
+    rules[policy->nrules].flags = flags;
+    rules[policy->nrules].exts = exts;
+    b->nodes[node].rule = policy->nrules++;
+    return 0;
+}
+
+static int
+policy_parse_line(PathPolicy *policy, PolicyBuilder *b, char *line,
+                  const char *file, int lineno)
+{
+    char *p = line;
+    char *kind = next_token(&p);
+    char *arg = kind ? next_token(&p) : NULL;
+    char *opt;
+
+    if (!kind || kind[0] == '#') {
+        return 0;
+    }
+    if (!arg) {
+        fprintf(stderr, "%s:%d: expected a path or hash after '%s'\n", file, lineno, kind);
+        return -1;
+    }
+
+    if (strcmp(kind, "sha256") == 0) {
+        unsigned char (*hashes)[SHA256_DIGEST_SIZE] = realloc(
+            policy->hashes, (policy->nhashes + 1) * SHA256_DIGEST_SIZE);
+        if (!hashes) {
+            fprintf(stderr, "out of memory loading %s\n", file);
+            return -1;
+        }
+        policy->hashes = hashes;
+        if (parse_hash(arg, hashes[policy->nhashes]) < 0 || next_token(&p)) {
+            fprintf(stderr, "%s:%d: expected a SHA-256 hex digest\n", file, lineno);
+            return -1;
+        }
+        ++policy->nhashes;
+        return 0;
+    }
+
+    unsigned flags;
+    if (strcmp(kind, "allow") == 0) {
+        flags = RULE_ALLOW;
+    } else if (strcmp(kind, "deny") == 0) {
+        flags = RULE_DENY;
+    } else {
+        fprintf(stderr, "%s:%d: unknown rule '%s'\n", file, lineno, kind);
+        return -1;
+    }
+
+    char *exts = NULL;
+    int any_ext = 0;
+    while ((opt = next_token(&p)) != NULL) {
+        if (strcmp(opt, "log") == 0) {
+            flags |= RULE_LOG;
+        } else if (strcmp(opt, "hash") == 0 && (flags & RULE_ALLOW)) {
+            flags |= RULE_HASH;
+        } else if (strncmp(opt, "ext=", 4) == 0 && (flags & RULE_ALLOW) &&
+                   !exts && !any_ext) {
+            if (parse_exts(opt + 4, &exts) < 0) {
+                fprintf(stderr, "%s:%d: expected ext=* or a comma separated "
+                        "list such as ext=.py,.pth\n", file, lineno);
+                return -1;
+            }
+            any_ext = !exts;
+        } else {
+            fprintf(stderr, "%s:%d: unexpected option '%s'\n", file, lineno, opt);
+            free(exts);
+            return -1;
+        }
+    }
+    if ((flags & RULE_ALLOW) && !exts && !any_ext) {
+        exts = (char *)malloc(sizeof(default_exts));
+        if (!exts) {
+            fprintf(stderr, "out of memory loading %s\n", file);
+            return -1;
+        }
+        memcpy(exts, default_exts, sizeof(default_exts));
+    }
+    if (policy_add_rule(policy, b, arg, flags, exts) < 0) {
+        fprintf(stderr, "%s:%d: path is too long or already has a rule\n", file, lineno);
+        free(exts);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+compare_hash(const void *a, const void *b)
+{
+    return memcmp(a, b, SHA256_DIGEST_SIZE);
+}
+
+static void
+policy_free(PathPolicy *policy)
+{
+    for (int32_t i = 0; i < policy->nrules; ++i) {
+        free(policy->rules[i].exts);
+    }
+    free(policy->rules);
+    free(policy->nodes);
+    free(policy->edges);
+    free(policy->labels);
+    free(policy->hashes);
+    free(policy);
+}
+
+PathPolicy *
+path_policy_load(const char *path)
+{
+    PolicyBuilder b = {NULL, 0, 0};
+    PathPolicy *policy = (PathPolicy *)calloc(1, sizeof(PathPolicy));
+    int r = -1;
+
+    if (!policy || builder_new_node(&b, 0) == NO_NODE) {
+        fprintf(stderr, "out of memory loading path policy\n");
+        goto done;
+    }
+
+    if (!path) {
+        /* The rule on the root node matches every path */
+        char *exts = (char *)malloc(sizeof(default_exts));
+        if (exts) {
+            memcpy(exts, default_exts, sizeof(default_exts));
+            r = policy_add_rule(policy, &b, NULL, RULE_ALLOW, exts);
+        }
+    } else {
+        char line[POLICY_MAX_PATH + 256];
+        int lineno = 0;
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            perror(path);
+            goto done;
+        }
+        r = 0;
+        while (r == 0 && fgets(line, sizeof(line), f)) {
+            size_t len = strlen(line);
+            ++lineno;
+            while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                line[--len] = '\0';
+            }
+            r = policy_parse_line(policy, &b, line, path, lineno);
+        }
+        fclose(f);
+    }
+
+    if (r == 0) {
+        r = policy_flatten(policy, &b);
+    }
+    if (r == 0 && policy->nhashes) {
+        qsort(policy->hashes, policy->nhashes, SHA256_DIGEST_SIZE, compare_hash);
+    }
+
+done:
+    free(b.nodes);
+    if (r < 0 && policy) {
+        policy_free(policy);
+        policy = NULL;
+    }
+    return policy;
+}
+
+/* Returns 1 if the file name at the end of norm has an allowed extension */
+static int
+extension_allowed(const PolicyRule *rule, const char *norm, Py_ssize_t len)
+{
+    if (!rule->exts) {
+        return 1;
+    }
+    const char *ext = NULL;
+    for (Py_ssize_t i = len - 1; i >= 0 && norm[i] != '/'; --i) {
+        if (norm[i] == '.') {
+            ext = &norm[i];
+            break;
+        }
+    }
+    if (!ext) {
+        return 0;
+    }
+    for (const char *e = rule->exts; *e; e += strlen(e) + 1) {
+        if (PyOS_stricmp(ext, e) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+verdict_violation(PathVerdict *verdict, int log_only,
+                  const char *reason, const char *log_only_reason)
+{
+    verdict->allowed = log_only;
+    verdict->log_only = log_only;
+    verdict->reason = log_only ? log_only_reason : reason;
+}
+
+void
+path_policy_check(const PathPolicy *policy, const char *path,
+                  Py_ssize_t len, PathVerdict *verdict)
+{
+    char norm[POLICY_MAX_PATH];
+
+    verdict->hash_required = 0;
+    if ((Py_ssize_t)strlen(path) != len) {
+        verdict_violation(verdict, 0, "path contains a null character", NULL);
+        return;
+    }
+    Py_ssize_t n = normalize(path, len, norm);
+    if (n < 0) {
+        verdict_violation(verdict, 0, "path is too long", NULL);
+        return;
+    }
+
+    /* The deepest rule that ends on a component boundary wins */
+    int32_t rule = policy->nodes[0].rule;
+    uint32_t node = 0;
+    for (Py_ssize_t i = 0; i < n; ) {
+        node = trie_step(policy, node, (unsigned char)norm[i]);
+        if (node == NO_NODE) {
+            break;
+        }
+        const TrieNode *t = &policy->nodes[node];
+        if (t->label_len > (uint32_t)(n - i) ||
+            memcmp(&policy->labels[t->label], &norm[i], t->label_len) != 0) {
+            break;
+        }
+        i += t->label_len;
+        if (t->rule != NO_RULE && (i == n || norm[i] == '/' || norm[i - 1] == '/')) {
+            rule = t->rule;
+        }
+    }
+
+    if (rule == NO_RULE) {
+        verdict_violation(verdict, 0, "not under any allowed path", NULL);
+        return;
+    }
+    const PolicyRule *r = &policy->rules[rule];
+    int log_only = (r->flags & RULE_LOG) != 0;
+    if (r->flags & RULE_DENY) {
+        verdict_violation(verdict, log_only, "denied by path policy",
+                          "denied by path policy (log only)");
+        return;
+    }
+    if (!extension_allowed(r, norm, n)) {
+        verdict_violation(verdict, log_only, "extension is not allowed",
+                          "extension is not allowed (log only)");
+        return;
+    }
+    verdict->allowed = 1;
+    verdict->log_only = log_only;
+    verdict->hash_required = (r->flags & RULE_HASH) != 0;
+    verdict->reason = verdict->hash_required ? "allowed if hash is trusted" : "allowed";
+}
+
+int
+path_policy_trusted_hash(const PathPolicy *policy,
+                         const unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    return policy->nhashes &&
+        bsearch(digest, policy->hashes, policy->nhashes,
+                SHA256_DIGEST_SIZE, compare_hash) != NULL;
+}
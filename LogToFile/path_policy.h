@@ -0,0 +1,59 @@
+/* Path policy for files loaded through open_code
+ *
+ * Rules name a directory (or file) and apply to everything below it, with
+ * the longest matching rule winning, so a subtree can be denied inside an
+ * allowed root and allowed again further down. Rules are compiled into a
+ * byte trie over normalized paths, with runs of single children merged,
+ * so a lookup compares each byte of the path once however many rules
+ * there are, and never allocates.
+ *
+ * The policy file has one rule per line. Blank lines and lines starting
+ * with '#' are ignored. Paths may be quoted if they contain spaces.
+ *
+ *     allow <path> [ext=.py,.pth | ext=*] [hash] [log]
+ *     deny <path> [log]
+ *     sha256 <hex digest>
+ *
+ * "ext" lists the extensions that may be loaded (.py and .pth when
+ * omitted). "hash" requires the SHA-256 of the content to be one of the
+ * sha256 lines. "log" reports violations under the rule without blocking
+ * them. Paths outside every rule are denied.
+ *
+ * Paths are normalized lexically: relative paths are made absolute,
+ * "." and ".." are resolved and repeated separators are collapsed.
+ * Symbolic links are not resolved, so rules should name real paths.
+ * Separators and ASCII letters are folded on Windows.
+ */
+#ifndef SPYTHON_PATH_POLICY_H
+#define SPYTHON_PATH_POLICY_H
+
+#include "Python.h"
+#include "sha256.h"
+
+typedef struct _PathPolicy PathPolicy;
+
+typedef struct _PathVerdict {
+    /* Whether the file may be loaded, which includes log-only violations */
+    int allowed;
+    /* The content hash must be checked with path_policy_trusted_hash */
+    int hash_required;
+    /* Violations under this rule are only logged */
+    int log_only;
+    /* Why, for logs and error messages */
+    const char *reason;
+} PathVerdict;
+
+/* Loads and compiles the rules in path. When path is NULL, every path is
+   allowed with the .py and .pth extensions. Prints the reason and returns
+   NULL on failure. Called before Python is initialized. */
+PathPolicy *path_policy_load(const char *path);
+
+/* Decides whether the file at path (len bytes of UTF-8) may be loaded */
+void path_policy_check(const PathPolicy *policy, const char *path,
+                       Py_ssize_t len, PathVerdict *verdict);
+
+/* Returns 1 if digest is one of the trusted hashes */
+int path_policy_trusted_hash(const PathPolicy *policy,
+                             const unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif /* SPYTHON_PATH_POLICY_H */
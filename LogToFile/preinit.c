@@ -0,0 +1,452 @@
+#include "preinit.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Startup raises a few hundred events, which fit with room to spare */
+#define PREINIT_BUFFER_SIZE (256 * 1024)
+/* Longer str and bytes values are cut short */
+#define PREINIT_MAX_TEXT 200
+/* Deeper containers are captured by type name */
+#define PREINIT_MAX_DEPTH 8
+
+/* Each snapshot is a uint32 length, the NUL-terminated event name and one
+   encoded value: a tag byte followed by its data. */
+enum {
+    TAG_NONE = 'N',
+    TAG_TRUE = 'T',
+    TAG_FALSE = 'F',
+    TAG_INT = 'i',          /* int64 */
+    TAG_BIG_INT = 'I',
+    TAG_FLOAT = 'f',        /* double */
+    TAG_STR = 's',          /* kind byte, uint32 length, uint32 full length, data */
+    TAG_BYTES = 'b',        /* uint32 length, uint32 full length, data */
+    TAG_TUPLE = '(',        /* uint32 count, values */
+    TAG_LIST = '[',         /* uint32 count, values */
+    TAG_CLASS = 'c',        /* NUL-terminated name of the class */
+    TAG_OTHER = 'o',        /* NUL-terminated type name */
+};
+
+static unsigned char buffer[PREINIT_BUFFER_SIZE];
+static size_t used = 0;
+static atomic_int pending = 0;
+static atomic_flag busy = ATOMIC_FLAG_INIT;
+
+typedef struct _Cursor {
+    unsigned char *p;
+    unsigned char *end;
+} Cursor;
+
+
+static void
+lock(void)
+{
+    while (atomic_flag_test_and_set_explicit(&busy, memory_order_acquire)) {
+    }
+}
+
+static void
+unlock(void)
+{
+    atomic_flag_clear_explicit(&busy, memory_order_release);
+}
+
+static int
+put(Cursor *c, const void *data, size_t n)
+{
+    if ((size_t)(c->end - c->p) < n) {
+        return -1;
+    }
+    memcpy(c->p, data, n);
+    c->p += n;
+    return 0;
+}
+
+static int
+put_tag(Cursor *c, unsigned char tag)
+{
+    return put(c, &tag, 1);
+}
+
+static int
+put_u32(Cursor *c, uint32_t v)
+{
+    return put(c, &v, sizeof(v));
+}
+
+static int
+put_other(Cursor *c, PyObject *o)
+{
+    int is_class = PyType_Check(o);
+    const char *name = is_class ? ((PyTypeObject *)o)->tp_name : Py_TYPE(o)->tp_name;
+    if (put_tag(c, is_class ? TAG_CLASS : TAG_OTHER) < 0) {
+        return -1;
+    }
+    return put(c, name, strlen(name) + 1);
+}
+
+/* Reads o without calling into Python or changing reference counts */
+static int
+encode(Cursor *c, PyObject *o, int depth)
+{
+    if (o == Py_None) {
+        return put_tag(c, TAG_NONE);
+    }
+    if (PyBool_Check(o)) {
+        return put_tag(c, o == Py_True ? TAG_TRUE : TAG_FALSE);
+    }
+    if (PyLong_CheckExact(o)) {
+        int overflow;
+        long long v = PyLong_AsLongLongAndOverflow(o, &overflow);
+        if (overflow) {
+            return put_tag(c, TAG_BIG_INT);
+        }
+        return put_tag(c, TAG_INT) < 0 ? -1 : put(c, &v, sizeof(v));
+    }
+    if (PyFloat_CheckExact(o)) {
+        double v = PyFloat_AS_DOUBLE(o);
+        return put_tag(c, TAG_FLOAT) < 0 ? -1 : put(c, &v, sizeof(v));
+    }
+    if (PyUnicode_CheckExact(o)) {
+#if PY_VERSION_HEX < 0x030C0000
+        if (!PyUnicode_IS_READY(o)) {
+            return put_other(c, o);
+        }
+#endif
+        Py_ssize_t full = PyUnicode_GET_LENGTH(o);
+        Py_ssize_t len = full > PREINIT_MAX_TEXT ? PREINIT_MAX_TEXT : full;
+        unsigned char kind = (unsigned char)PyUnicode_KIND(o);
+        if (put_tag(c, TAG_STR) < 0 || put(c, &kind, 1) < 0 ||
+            put_u32(c, (uint32_t)len) < 0 || put_u32(c, (uint32_t)full) < 0) {
+            return -1;
+        }
+        return put(c, PyUnicode_DATA(o), (size_t)len * kind);
+    }
+    if (PyBytes_CheckExact(o)) {
+        Py_ssize_t full = PyBytes_GET_SIZE(o);
+        Py_ssize_t len = full > PREINIT_MAX_TEXT ? PREINIT_MAX_TEXT : full;
+        if (put_tag(c, TAG_BYTES) < 0 ||
+            put_u32(c, (uint32_t)len) < 0 || put_u32(c, (uint32_t)full) < 0) {
+            return -1;
+        }
+        return put(c, PyBytes_AS_STRING(o), (size_t)len);
+    }
+    if ((PyTuple_CheckExact(o) || PyList_CheckExact(o)) && depth < PREINIT_MAX_DEPTH) {
+        int is_tuple = PyTuple_CheckExact(o);
+        Py_ssize_t n = is_tuple ? PyTuple_GET_SIZE(o) : PyList_GET_SIZE(o);
+        if (put_tag(c, is_tuple ? TAG_TUPLE : TAG_LIST) < 0 || put_u32(c, (uint32_t)n) < 0) {
+            return -1;
+        }
+        for (Py_ssize_t i = 0; i < n; ++i) {
+            PyObject *item = is_tuple ? PyTuple_GET_ITEM(o, i) : PyList_GET_ITEM(o, i);
+            if (encode(c, item, depth + 1) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    return put_other(c, o);
+}
+
+
+typedef struct _Text {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+} Text;
+
+static void
+text_append(Text *t, const char *s, size_t n)
+{
+    if (t->failed) {
+        return;
+    }
+    if (t->len + n > t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 256;
+        while (capacity < t->len + n) {
+            capacity *= 2;
+        }
+        char *data = (char *)realloc(t->data, capacity);
+        if (!data) {
+            t->failed = 1;
+            return;
+        }
+        t->data = data;
+        t->capacity = capacity;
+    }
+    memcpy(t->data + t->len, s, n);
+    t->len += n;
+}
+
+#define TEXT_LITERAL(t, s) text_append((t), (s), sizeof(s) - 1)
+
+static void
+text_escape(Text *t, Py_UCS4 ch)
+{
+    static const char hex[] = "0123456789abcdef";
+    char out[10];
+    int digits = ch <= 0xFF ? 2 : ch <= 0xFFFF ? 4 : 8;
+    out[0] = '\\';
+    out[1] = digits == 2 ? 'x' : digits == 4 ? 'u' : 'U';
+    for (int i = 0; i < digits; ++i) {
+        out[2 + i] = hex[(ch >> (4 * (digits - 1 - i))) & 0xF];
+    }
+    text_append(t, out, 2 + digits);
+}
+
+static void
+text_utf8(Text *t, Py_UCS4 ch)
+{
+    char out[4];
+    if (ch < 0x800) {
+        out[0] = (char)(0xC0 | (ch >> 6));
+        out[1] = (char)(0x80 | (ch & 0x3F));
+        text_append(t, out, 2);
+    } else if (ch < 0x10000) {
+        out[0] = (char)(0xE0 | (ch >> 12));
+        out[1] = (char)(0x80 | ((ch >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (ch & 0x3F));
+        text_append(t, out, 3);
+    } else {
+        out[0] = (char)(0xF0 | (ch >> 18));
+        out[1] = (char)(0x80 | ((ch >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((ch >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (ch & 0x3F));
+        text_append(t, out, 4);
+    }
+}
+
+static Py_UCS4
+read_char(const unsigned char *data, int kind, uint32_t i)
+{
+    switch (kind) {
+    case 1: return data[i];
+    case 2: { uint16_t v; memcpy(&v, data + 2 * i, 2); return v; }
+    default: { uint32_t v; memcpy(&v, data + 4 * i, 4); return v; }
+    }
+}
+
+/* Quotes like repr(), which prefers single quotes */
+static char
+choose_quote(const unsigned char *data, int kind, uint32_t len)
+{
+    int single = 0, dbl = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+        Py_UCS4 ch = read_char(data, kind, i);
+        single |= ch == '\'';
+        dbl |= ch == '"';
+    }
+    return single && !dbl ? '"' : '\'';
+}
+
+static void
+render_chars(Text *t, const unsigned char *data, int kind, uint32_t len, int is_bytes)
+{
+    char quote = choose_quote(data, kind, len);
+    if (is_bytes) {
+        TEXT_LITERAL(t, "b");
+    }
+    text_append(t, &quote, 1);
+    for (uint32_t i = 0; i < len; ++i) {
+        Py_UCS4 ch = read_char(data, kind, i);
+        char c = (char)ch;
+        if (ch == (Py_UCS4)quote || ch == '\\') {
+            char out[2] = { '\\', c };
+            text_append(t, out, 2);
+        } else if (ch == '\t') {
+            TEXT_LITERAL(t, "\\t");
+        } else if (ch == '\n') {
+            TEXT_LITERAL(t, "\\n");
+        } else if (ch == '\r') {
+            TEXT_LITERAL(t, "\\r");
+        } else if (ch >= ' ' && ch < 0x7F) {
+            text_append(t, &c, 1);
+        } else if (is_bytes || ch < 0xA0 || !Py_UNICODE_ISPRINTABLE(ch)) {
+            text_escape(t, ch);
+        } else {
+            text_utf8(t, ch);
+        }
+    }
+    text_append(t, &quote, 1);
+}
+
+static uint32_t
+get_u32(const unsigned char **p)
+{
+    uint32_t v;
+    memcpy(&v, *p, sizeof(v));
+    *p += sizeof(v);
+    return v;
+}
+
+/* Renders one value and returns the position after it */
+static const unsigned char *
+render(Text *t, const unsigned char *p)
+{
+    char tag = (char)*p++;
+    switch (tag) {
+    case TAG_NONE: TEXT_LITERAL(t, "None"); break;
+    case TAG_TRUE: TEXT_LITERAL(t, "True"); break;
+    case TAG_FALSE: TEXT_LITERAL(t, "False"); break;
+    case TAG_BIG_INT: TEXT_LITERAL(t, "<int>"); break;
+    case TAG_INT: {
+        long long v;
+        char out[24];
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        text_append(t, out, (size_t)snprintf(out, sizeof(out), "%lld", v));
+        break;
+    }
+    case TAG_FLOAT: {
+        double v;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        char *s = PyOS_double_to_string(v, 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+        if (s) {
+            text_append(t, s, strlen(s));
+            PyMem_Free(s);
+        } else {
+            t->failed = 1;
+        }
+        break;
+    }
+    case TAG_STR:
+    case TAG_BYTES: {
+        int kind = tag == TAG_STR ? *p++ : 1;
+        uint32_t len = get_u32(&p);
+        uint32_t full = get_u32(&p);
+        render_chars(t, p, kind, len, tag == TAG_BYTES);
+        if (len < full) {
+            TEXT_LITERAL(t, "...");
+        }
+        p += (size_t)len * kind;
+        break;
+    }
+    case TAG_TUPLE:
+    case TAG_LIST: {
+        uint32_t n = get_u32(&p);
+        text_append(t, tag == TAG_TUPLE ? "(" : "[", 1);
+        for (uint32_t i = 0; i < n; ++i) {
+            if (i) {
+                TEXT_LITERAL(t, ", ");
+            }
+            p = render(t, p);
+        }
+        if (tag == TAG_TUPLE && n == 1) {
+            TEXT_LITERAL(t, ",");
+        }
+        text_append(t, tag == TAG_TUPLE ? ")" : "]", 1);
+        break;
+    }
+    case TAG_CLASS: {
+        size_t n = strlen((const char *)p);
+        TEXT_LITERAL(t, "<class '");
+        text_append(t, (const char *)p, n);
+        TEXT_LITERAL(t, "'>");
+        p += n + 1;
+        break;
+    }
+    default: {
+        size_t n = strlen((const char *)p);
+        TEXT_LITERAL(t, "<");
+        text_append(t, (const char *)p, n);
+        TEXT_LITERAL(t, " object>");
+        p += n + 1;
+    }
+    }
+    return p;
+}
+
+/* Called with the lock held */
+static void
+flush_locked(preinit_writer write, void *context)
+{
+    Text t = { NULL, 0, 0, 0 };
+    const unsigned char *p = buffer, *end = buffer + used;
+    while (p < end) {
+        uint32_t len = get_u32(&p);
+        const char *event = (const char *)p;
+        t.len = 0;
+        t.failed = 0;
+        render(&t, p + strlen(event) + 1);
+        if (!t.failed) {
+            write(event, t.data, t.len, context);
+        }
+        p += len;
+    }
+    free(t.data);
+    used = 0;
+    atomic_store(&pending, 0);
+}
+
+void
+preinit_capture(const char *event, PyObject *args,
+                preinit_writer write, void *context)
+{
+    lock();
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        Cursor c = { buffer + used, buffer + sizeof(buffer) };
+        unsigned char *start = c.p;
+        if (put_u32(&c, 0) == 0 && put(&c, event, strlen(event) + 1) == 0 &&
+            encode(&c, args, 0) == 0) {
+            uint32_t len = (uint32_t)(c.p - start - sizeof(uint32_t));
+            memcpy(start, &len, sizeof(len));
+            used = c.p - buffer;
+            atomic_store(&pending, 1);
+            unlock();
+            return;
+        }
+        /* Full, so make room by rendering what we have */
+        flush_locked(write, context);
+    }
+    unlock();
+    static const char too_large[] = "<arguments too large to capture>";
+    write(event, too_large, sizeof(too_large) - 1, context);
+}
+
+int
+preinit_pending(void)
+{
+    return atomic_load_explicit(&pending, memory_order_relaxed);
+}
+
+void
+preinit_flush(preinit_writer write, void *context)
+{
+    lock();
+    flush_locked(write, context);
+    unlock();
+}
+
+char *
+preinit_render(PyObject *args, size_t *len)
+{
+    Text t = { NULL, 0, 0, 0 };
+    for (size_t size = 4096; ; size *= 2) {
+        unsigned char *scratch = (unsigned char *)malloc(size);
+        if (!scratch) {
+            return NULL;
+        }
+        Cursor c = { scratch, scratch + size };
+        int r = encode(&c, args, 0);
+        if (r == 0) {
+            render(&t, scratch);
+        }
+        free(scratch);
+        if (r == 0) {
+            break;
+        }
+        if (size >= PREINIT_BUFFER_SIZE) {
+            TEXT_LITERAL(&t, "<arguments too large to capture>");
+            break;
+        }
+    }
+    if (t.failed) {
+        free(t.data);
+        return NULL;
+    }
+    *len = t.len;
+    return t.data;
+}
@@ -0,0 +1,40 @@
+/* Snapshots of audit events raised while Python cannot run code
+ *
+ * During startup and shutdown, Py_IsInitialized() is false and calling
+ * repr() on event arguments is not safe. Instead, the arguments are copied
+ * into a preallocated buffer without creating or keeping any objects:
+ * None, bool, int, float, str and bytes by value (long strings are cut
+ * short), tuples and lists item by item, and anything else by type name.
+ *
+ * The snapshots are rendered in one batch, in the form repr() would give,
+ * by the first event raised after startup, or by preinit_flush() after
+ * finalization. When the buffer fills up, it is rendered early.
+ *
+ * LogToStderr builds this file from here as well.
+ */
+#ifndef SPYTHON_PREINIT_H
+#define SPYTHON_PREINIT_H
+
+#include "Python.h"
+
+/* Receives the rendered arguments of one event */
+typedef void (*preinit_writer)(const char *event, const char *text,
+                               size_t len, void *context);
+
+/* Copies args for event into the buffer. Never runs Python code or
+   touches the reference counts of args. */
+void preinit_capture(const char *event, PyObject *args,
+                     preinit_writer write, void *context);
+
+/* Nonzero if there are snapshots waiting to be rendered */
+int preinit_pending(void);
+
+/* Renders every snapshot, oldest first, and empties the buffer */
+void preinit_flush(preinit_writer write, void *context);
+
+/* Renders args at once, as preinit_flush would, for callers that keep
+   args alive until Python is finalizing. Returns a malloc'd buffer for
+   the caller to free, or NULL when out of memory. */
+char *preinit_render(PyObject *args, size_t *len);
+
+#endif /* SPYTHON_PREINIT_H */
@@ -0,0 +1,374 @@
+#include "scanner.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Used when SPYTHONSIGNATURES is not set */
+static const char default_signature[] = "I am a virus";
+
+/* Transitions store the offset of the next state's row, with this bit
+   set when a signature ends there */
+#define SCAN_MATCH 0x80000000u
+#define SCAN_NONE 0xFFFFFFFFu
+/* Keeps row offsets below SCAN_MATCH */
+#define SCAN_MAX_STATES (1u << 22)
+
+struct _Scanner {
+    unsigned short byte_class[256];
+    uint32_t nclasses;
+    uint32_t nstates;
+    uint32_t *next;
+    /* Signature that ends at each state, or -1 */
+    int32_t *match;
+    char **signatures;
+    Py_ssize_t nsignatures;
+    /* Length of the longest signature in bytes */
+    Py_ssize_t max_len;
+};
+
+typedef struct _Pattern {
+    unsigned char *bytes;
+    size_t len;
+} Pattern;
+
+
+static int
+hex_digit(int c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Decodes escapes in place and returns the new length, or -1 */
+static Py_ssize_t
+unescape(char *s)
+{
+    char *out = s;
+    for (char *p = s; *p; ++p) {
+        if (*p != '\\') {
+            *out++ = *p;
+            continue;
+        }
+        switch (*++p) {
+        case '\\': *out++ = '\\'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case '0': *out++ = '\0'; break;
+        case 'x': {
+            int hi = hex_digit(p[1]), lo = hi < 0 ? -1 : hex_digit(p[2]);
+            if (lo < 0) {
+                return -1;
+            }
+            *out++ = (char)(hi * 16 + lo);
+            p += 2;
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+    return out - s;
+}
+
+static int
+scanner_add(Scanner *scanner, Pattern **patterns, const char *line,
+            const char *path, int lineno)
+{
+    char *text = strdup(line);
+    char *bytes = strdup(line);
+    if (!text || !bytes) {
+        fprintf(stderr, "out of memory loading signatures\n");
+        free(text);
+        free(bytes);
+        return -1;
+    }
+    Py_ssize_t n = unescape(bytes);
+    if (n <= 0) {
+        fprintf(stderr, "%s:%d: invalid signature\n", path, lineno);
+        free(text);
+        free(bytes);
+        return -1;
+    }
+
+    Py_ssize_t count = scanner->nsignatures + 1;
+    char **signatures = (char **)realloc(scanner->signatures, count * sizeof(char *));
+    if (signatures) {
+        scanner->signatures = signatures;
+    }
+    Pattern *p = (Pattern *)realloc(*patterns, count * sizeof(Pattern));
+    if (p) {
+        *patterns = p;
+    }
+    if (!signatures || !p) {
+        fprintf(stderr, "out of memory loading signatures\n");
+        free(text);
+        free(bytes);
+        return -1;
+    }
+    scanner->signatures[scanner->nsignatures] = text;
+    p[scanner->nsignatures].bytes = (unsigned char *)bytes;
+    p[scanner->nsignatures].len = (size_t)n;
+    scanner->nsignatures = count;
+    return 0;
+}
+
+static int
+scanner_read(Scanner *scanner, Pattern **patterns, const char *path)
+{
+    char line[4096];
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        ++lineno;
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (!len || line[0] == '#') {
+            continue;
+        }
+        if (scanner_add(scanner, patterns, line, path, lineno) < 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Builds the trie, then fills in the failure transitions breadth first so
+   every state has a transition for every byte class */
+static int
+scanner_compile(Scanner *scanner, const Pattern *patterns)
+{
+    uint32_t nclasses = 1, nstates = 1, capacity = 1;
+    uint32_t *next = NULL, *fail = NULL, *queue = NULL;
+    int32_t *match = NULL;
+
+    /* Bytes that appear in no signature all share class 0 */
+    memset(scanner->byte_class, 0, sizeof(scanner->byte_class));
+    for (Py_ssize_t i = 0; i < scanner->nsignatures; ++i) {
+        for (size_t j = 0; j < patterns[i].len; ++j) {
+            unsigned char b = patterns[i].bytes[j];
+            if (!scanner->byte_class[b]) {
+                scanner->byte_class[b] = (unsigned short)nclasses++;
+            }
+        }
+        if ((Py_ssize_t)patterns[i].len > scanner->max_len) {
+            scanner->max_len = (Py_ssize_t)patterns[i].len;
+        }
+        capacity += (uint32_t)patterns[i].len;
+        if (capacity > SCAN_MAX_STATES) {
+            fprintf(stderr, "too many signatures\n");
+            return -1;
+        }
+    }
+
+    next = (uint32_t *)malloc((size_t)capacity * nclasses * sizeof(uint32_t));
+    match = (int32_t *)malloc((size_t)capacity * sizeof(int32_t));
+    fail = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+    queue = (uint32_t *)malloc((size_t)capacity * sizeof(uint32_t));
+    if (!next || !match || !fail || !queue) {
+        goto error;
+    }
+    memset(next, 0xFF, (size_t)capacity * nclasses * sizeof(uint32_t));
+    match[0] = -1;
+
+    for (Py_ssize_t i = 0; i < scanner->nsignatures; ++i) {
+        uint32_t s = 0;
+        for (size_t j = 0; j < patterns[i].len; ++j) {
+            uint32_t *t = &next[s * nclasses + scanner->byte_class[patterns[i].bytes[j]]];
+            if (*t == SCAN_NONE) {
+                match[nstates] = -1;
+                *t = nstates++;
+            }
+            s = *t;
+        }
+        if (match[s] < 0) {
+            match[s] = (int32_t)i;
+        }
+    }
+
+    uint32_t head = 0, tail = 0;
+    for (uint32_t c = 0; c < nclasses; ++c) {
+        uint32_t *t = &next[c];
+        if (*t == SCAN_NONE) {
+            *t = 0;
+        } else {
+            fail[*t] = 0;
+            queue[tail++] = *t;
+        }
+    }
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        /* A state also matches whatever its longest suffix matches */
+        if (match[s] < 0) {
+            match[s] = match[fail[s]];
+        }
+        for (uint32_t c = 0; c < nclasses; ++c) {
+            uint32_t *t = &next[s * nclasses + c];
+            if (*t == SCAN_NONE) {
+                *t = next[fail[s] * nclasses + c];
+            } else {
+                fail[*t] = next[fail[s] * nclasses + c];
+                queue[tail++] = *t;
+            }
+        }
+    }
+
+    /* Store row offsets rather than state numbers, so the scan loop does
+       not multiply, and flag transitions into matching states */
+    for (size_t i = 0; i < (size_t)nstates * nclasses; ++i) {
+        uint32_t t = next[i];
+        next[i] = t * nclasses | (match[t] >= 0 ? SCAN_MATCH : 0);
+    }
+
+    free(fail);
+    free(queue);
+    scanner->nclasses = nclasses;
+    scanner->nstates = nstates;
+    scanner->next = next;
+    scanner->match = match;
+    return 0;
+
+error:
+    fprintf(stderr, "out of memory compiling signatures\n");
+    free(next);
+    free(match);
+    free(fail);
+    free(queue);
+    return -1;
+}
+
+Scanner *
+scanner_load(const char *path)
+{
+    Scanner *scanner = (Scanner *)calloc(1, sizeof(Scanner));
+    Pattern *patterns = NULL;
+    int r;
+
+    if (!scanner) {
+        return NULL;
+    }
+    if (path) {
+        r = scanner_read(scanner, &patterns, path);
+    } else {
+        r = scanner_add(scanner, &patterns, default_signature, "<default>", 0);
+    }
+    if (r == 0) {
+        r = scanner_compile(scanner, patterns);
+    }
+    for (Py_ssize_t i = 0; i < scanner->nsignatures; ++i) {
+        free(patterns[i].bytes);
+    }
+    free(patterns);
+    if (r == 0) {
+        return scanner;
+    }
+
+    for (Py_ssize_t i = 0; i < scanner->nsignatures; ++i) {
+        free(scanner->signatures[i]);
+    }
+    free(scanner->signatures);
+    free(scanner->next);
+    free(scanner->match);
+    free(scanner);
+    return NULL;
+}
+
+/* Continues a scan from state over [p, end) */
+static Py_ssize_t
+scan_from(const Scanner *scanner, uint32_t state,
+          const unsigned char *p, const unsigned char *end)
+{
+    const uint32_t *next = scanner->next;
+    const unsigned short *byte_class = scanner->byte_class;
+
+    while (p < end) {
+        state = next[state + byte_class[*p++]];
+        if (state & SCAN_MATCH) {
+            return scanner->match[(state & ~SCAN_MATCH) / scanner->nclasses];
+        }
+    }
+    return -1;
+}
+
+/* Each step of a scan waits for the previous table lookup, so a single
+   scan is limited by load latency rather than memory bandwidth. Larger
+   buffers are split into SCAN_LANES parts that are scanned together, so
+   the lookups overlap. Each part after the first starts early enough to
+   see any signature that crosses into it. */
+#define SCAN_LANES 4
+
+Py_ssize_t
+scanner_scan(const Scanner *scanner, const char *data, Py_ssize_t len)
+{
+    const uint32_t *next = scanner->next;
+    const unsigned short *byte_class = scanner->byte_class;
+    const unsigned char *start = (const unsigned char *)data;
+    Py_ssize_t overlap = scanner->max_len - 1;
+    Py_ssize_t chunk = len / SCAN_LANES;
+
+    if (chunk <= overlap * 4 || chunk < 256) {
+        return scan_from(scanner, 0, start, start + len);
+    }
+
+    const unsigned char *p[SCAN_LANES], *end[SCAN_LANES];
+    uint32_t state[SCAN_LANES] = { 0 };
+    p[0] = start;
+    for (int k = 1; k < SCAN_LANES; ++k) {
+        p[k] = start + k * chunk - overlap;
+        end[k - 1] = start + k * chunk;
+    }
+    end[SCAN_LANES - 1] = start + len;
+
+    /* Every part is at least chunk bytes long */
+    for (Py_ssize_t j = 0; j < chunk; ++j) {
+        uint32_t any = 0;
+        for (int k = 0; k < SCAN_LANES; ++k) {
+            state[k] = next[state[k] + byte_class[p[k][j]]];
+            any |= state[k];
+        }
+        if (any & SCAN_MATCH) {
+            for (int k = 0; k < SCAN_LANES; ++k) {
+                if (state[k] & SCAN_MATCH) {
+                    return scanner->match[(state[k] & ~SCAN_MATCH) / scanner->nclasses];
+                }
+            }
+        }
+    }
+    for (int k = 0; k < SCAN_LANES; ++k) {
+        Py_ssize_t found = scan_from(scanner, state[k], p[k] + chunk, end[k]);
+        if (found >= 0) {
+            return found;
+        }
+    }
+    return -1;
+}
+
+Py_ssize_t
+scanner_check(const Scanner *scanner, PyObject *content)
+{
+    char *data;
+    Py_ssize_t len;
+    if (PyBytes_AsStringAndSize(content, &data, &len) < 0) {
+        return -2;
+    }
+    return scanner_scan(scanner, data, len);
+}
+
+const char *
+scanner_signature(const Scanner *scanner, Py_ssize_t index)
+{
+    if (index < 0 || index >= scanner->nsignatures) {
+        return NULL;
+    }
+    return scanner->signatures[index];
+}
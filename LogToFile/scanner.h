@@ -0,0 +1,34 @@
+/* Signature scanner for code loaded through open_code
+ *
+ * Signatures are compiled into an Aho-Corasick automaton, stored as a
+ * DFA over byte classes (bytes that no signature uses share a class), so
+ * scanning is one table lookup per byte however many signatures there
+ * are. Large buffers are scanned as several interleaved parts.
+ *
+ * The signature file has one signature per line. Blank lines and lines
+ * starting with '#' are ignored, and \\, \n, \r, \t, \0 and \xNN escapes
+ * allow any bytes to be matched.
+ */
+#ifndef SPYTHON_SCANNER_H
+#define SPYTHON_SCANNER_H
+
+#include "Python.h"
+
+typedef struct _Scanner Scanner;
+
+/* Loads and compiles the signatures in path, or the built-in signature
+   when path is NULL. Prints the reason and returns NULL on failure. Called
+   before Python is initialized. */
+Scanner *scanner_load(const char *path);
+
+/* Returns the index of a signature found in data, or -1 */
+Py_ssize_t scanner_scan(const Scanner *scanner, const char *data, Py_ssize_t len);
+
+/* Like scanner_scan, for a bytes object. Returns -2 with an exception set
+   if content is not bytes. */
+Py_ssize_t scanner_check(const Scanner *scanner, PyObject *content);
+
+/* The signature as written in the file, for error messages */
+const char *scanner_signature(const Scanner *scanner, Py_ssize_t index);
+
+#endif /* SPYTHON_SCANNER_H */
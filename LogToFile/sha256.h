@@ -0,0 +1,16 @@
+/* SHA-256 for checking file content against trusted hashes
+ *
+ * LogToFile does not link a crypto library, and importing hashlib from
+ * inside open_code would need open_code, so this is a plain FIPS 180-4
+ * implementation.
+ */
+#ifndef SPYTHON_SHA256_H
+#define SPYTHON_SHA256_H
+
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif /* SPYTHON_SHA256_H */
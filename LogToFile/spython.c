@@ -1,18 +1,60 @@
 /* Minimal main program -- everything is loaded from the library */
 
 #include "Python.h"
-#include "opcode.h"
+#include <fcntl.h>
 #include <locale.h>
+#include <stdatomic.h>
 #include <string.h>
 
+#include "allowlist.h"
+#include "audit_json.h"
+#include "audit_log.h"
+#include "import_profile.h"
+#include "interp_state.h"
+#include "log_rotate.h"
+#include "path_policy.h"
+#include "preinit.h"
+#include "scanner.h"
+#include "verify_code.h"
+
+#ifdef MS_WINDOWS
+#include <io.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef __FreeBSD__
 #include <fenv.h>
 #endif
 
+#define LOG_JSON(log) (audit_log_format(log) == AUDIT_LOG_JSON)
+
+/* Longest source text included in a compile record */
+#define MAX_SOURCE_LENGTH 200
+
+/* The main log, which records events raised during startup and shutdown */
+static AuditLog *startup_log = NULL;
+
+static void
+write_preinit(const char *event, const char *text, size_t len, void *context)
+{
+    audit_log_write(startup_log, event, text, (Py_ssize_t)len);
+}
+
+/* repr() is not safe before Python is initialized, so text records are
+   copied and written by the first event after startup */
+#define DEFER_TEXT(audit_log) (!LOG_JSON(audit_log) && !Py_IsInitialized())
+
 static int
-hook_addaudithook(const char *event, PyObject *args, FILE *audit_log)
+hook_addaudithook(const char *event, PyObject *args, AuditLog *audit_log)
 {
-    fprintf(audit_log, "%s: hook was not added\n", event);
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_bool(&r, "blocked", 1);
+        json_end(&r, audit_log);
+    } else {
+        audit_log_write(audit_log, event, "hook was not added", -1);
+    }
     PyErr_SetString(PyExc_SystemError, "hook not permitted");
     return -1;
 }
@@ -20,26 +62,42 @@ hook_addaudithook(const char *event, PyObject *args, FILE *audit_log)
 
 // Note that this event is raised by our hook below - it is not a "standard" audit item
 static int
-hook_open_code(const char *event, PyObject *args, FILE *audit_log)
+hook_open_code(const char *event, PyObject *args, AuditLog *audit_log)
 {
     PyObject *path = PyTuple_GetItem(args, 0);
     PyObject *disallow = PyTuple_GetItem(args, 1);
+    PyObject *reason = PyTuple_GetItem(args, 2);
+
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_object(&r, "path", path);
+        json_field_object(&r, "allowed", disallow);
+        json_field_object(&r, "reason", reason);
+        json_end(&r, audit_log);
+        return 0;
+    }
 
-    PyObject *msg = PyUnicode_FromFormat("'%S'; allowed = %S",
-                                         path, disallow);
+    if (DEFER_TEXT(audit_log)) {
+        preinit_capture(event, args, write_preinit, NULL);
+        return 0;
+    }
+
+    PyObject *msg = PyUnicode_FromFormat("'%S'; allowed = %S; %S",
+                                         path, disallow, reason);
     if (!msg) {
         return -1;
     }
 
-    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
+    int r = audit_log_write_unicode(audit_log, event, msg);
     Py_DECREF(msg);
 
-    return 0;
+    return r;
 }
 
 
 static int
-hook_import(const char *event, PyObject *args, FILE *audit_log)
+hook_import(const char *event, PyObject *args, AuditLog *audit_log)
 {
     PyObject *module, *filename, *sysPath, *sysMetaPath, *sysPathHooks;
     if (!PyArg_ParseTuple(args, "OOOOO", &module, &filename, &sysPath,
@@ -47,6 +105,18 @@ hook_import(const char *event, PyObject *args, FILE *audit_log)
         return -1;
     }
 
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_object(&r, "module", module);
+        json_field_object(&r, "filename", filename);
+        if (filename == Py_None) {
+            json_field_object(&r, "sys_path", sysPath);
+        }
+        json_end(&r, audit_log);
+        return 0;
+    }
+
     PyObject *msg;
     if (PyObject_IsTrue(filename)) {
         msg = PyUnicode_FromFormat("importing %S from %S",
@@ -64,15 +134,15 @@ hook_import(const char *event, PyObject *args, FILE *audit_log)
         return -1;
     }
 
-    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
+    int r = audit_log_write_unicode(audit_log, event, msg);
     Py_DECREF(msg);
 
-    return 0;
+    return r;
 }
 
 
 static int
-hook_compile(const char *event, PyObject *args, FILE *audit_log)
+hook_compile(const char *event, PyObject *args, AuditLog *audit_log)
 {
     PyObject *code, *filename, *_;
     if (!PyArg_ParseTuple(args, "OO", &code, &filename,
@@ -80,6 +150,15 @@ hook_compile(const char *event, PyObject *args, FILE *audit_log)
         return -1;
     }
 
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_object(&r, "filename", filename);
+        json_field_text(&r, "source", code, MAX_SOURCE_LENGTH);
+        json_end(&r, audit_log);
+        return 0;
+    }
+
     if (!PyUnicode_Check(code)) {
         code = PyObject_Repr(code);
         if (!code) {
@@ -89,8 +168,8 @@ hook_compile(const char *event, PyObject *args, FILE *audit_log)
         Py_INCREF(code);
     }
 
-    if (PyUnicode_GetLength(code) > 200) {
-        Py_SETREF(code, PyUnicode_Substring(code, 0, 200));
+    if (PyUnicode_GetLength(code) > MAX_SOURCE_LENGTH) {
+        Py_SETREF(code, PyUnicode_Substring(code, 0, MAX_SOURCE_LENGTH));
         if (!code) {
             return -1;
         }
@@ -117,74 +196,130 @@ hook_compile(const char *event, PyObject *args, FILE *audit_log)
         return -1;
     }
 
-    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
+    int r = audit_log_write_unicode(audit_log, event, msg);
     Py_DECREF(msg);
-    return 0;
+    return r;
 }
 
 
 static int
-hook_code_new(const char *event, PyObject *args, FILE *audit_log)
+hook_code_new(const char *event, PyObject *args, AuditLog *audit_log)
 {
     PyObject *code, *filename, *name;
-    int argcount, kwonlyargcount, nlocals, stacksize, flags;
-    if (!PyArg_ParseTuple(args, "OOOiiiii", &code, &filename, &name,
-                          &argcount, &kwonlyargcount, &nlocals,
-                          &stacksize, &flags)) {
+    int argcount, posonlyargcount, kwonlyargcount, nlocals, stacksize, flags;
+    if (!PyArg_ParseTuple(args, "OOOiiiiii", &code, &filename, &name,
+                          &argcount, &posonlyargcount, &kwonlyargcount,
+                          &nlocals, &stacksize, &flags)) {
         return -1;
     }
 
-    PyObject *msg = PyUnicode_FromFormat("compiling: %R", filename);
-    if (!msg) {
-        return -1;
-    }
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_object(&r, "filename", filename);
+        json_field_object(&r, "name", name);
+        json_field_int(&r, "argcount", argcount);
+        json_field_int(&r, "nlocals", nlocals);
+        json_field_int(&r, "stacksize", stacksize);
+        json_field_int(&r, "flags", flags);
+        json_end(&r, audit_log);
+    } else if (DEFER_TEXT(audit_log)) {
+        preinit_capture(event, filename, write_preinit, NULL);
+    } else {
+        PyObject *msg = PyUnicode_FromFormat("compiling: %R", filename);
+        if (!msg) {
+            return -1;
+        }
 
-    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
-    Py_DECREF(msg);
+        int r = audit_log_write_unicode(audit_log, event, msg);
+        Py_DECREF(msg);
+        if (r < 0) {
+            return -1;
+        }
+    }
 
     if (!PyBytes_Check(code)) {
         PyErr_SetString(PyExc_TypeError, "Invalid bytecode object");
         return -1;
     }
 
-    // As an example, let's validate that no STORE_FAST operations are
-    // going to overflow nlocals.
     char *wcode;
     Py_ssize_t wlen;
     if (PyBytes_AsStringAndSize(code, &wcode, &wlen) < 0) {
         return -1;
     }
 
-    for (Py_ssize_t i = 0; i < wlen; i += 2) {
-        if (wcode[i] == STORE_FAST) {
-            if (wcode[i + 1] > nlocals) {
-                PyErr_SetString(PyExc_ValueError, "invalid code object");
-                fprintf(audit_log, "%s: code stores to local %d "
-                        "but only allocates %d\n",
-                        event, wcode[i + 1], nlocals);
-                return -1;
+    VerifyResult v;
+    ImportPhase phase = import_profile_enter(IMPORT_PHASE_VERIFY);
+    int verified = verify_code((const unsigned char *)wcode, wlen, nlocals, stacksize, &v);
+    import_profile_leave(phase);
+    if (verified < 0) {
+        PyErr_Format(PyExc_ValueError, "invalid code object: %s", v.error);
+        if (LOG_JSON(audit_log)) {
+            JsonRecord r;
+            json_begin(&r, audit_log, event);
+            json_field_object(&r, "filename", filename);
+            json_field_object(&r, "name", name);
+            json_field_str(&r, "error", v.error);
+            json_field_int(&r, "offset", v.offset);
+            json_field_int(&r, "opcode", v.opcode);
+            json_field_int(&r, "oparg", v.oparg);
+            json_field_int(&r, "nlocals", nlocals);
+            json_field_int(&r, "stacksize", stacksize);
+            json_field_bool(&r, "blocked", 1);
+            json_end(&r, audit_log);
+        } else {
+            PyObject *msg = PyUnicode_FromFormat(
+                "invalid code object %R in %R: %s at offset %zd (opcode %d, arg %lld)",
+                name, filename, v.error, v.offset, v.opcode, v.oparg);
+            if (msg) {
+                audit_log_write_unicode(audit_log, event, msg);
+                Py_DECREF(msg);
             }
         }
+        return -1;
     }
 
     return 0;
 }
 
 
+/* Globals from SPYTHONPICKLEALLOW that unpickling may load, or NULL to
+   block them all. Shared by every interpreter. */
+static Allowlist *pickle_allow = NULL;
+
 static int
-hook_pickle_find_class(const char *event, PyObject *args, FILE *audit_log)
+hook_pickle_find_class(const char *event, PyObject *args, AuditLog *audit_log)
 {
     PyObject *mod = PyTuple_GetItem(args, 0);
     PyObject *global = PyTuple_GetItem(args, 1);
 
-    PyObject *msg = PyUnicode_FromFormat("finding %R.%R blocked",
-        mod, global);
-    if (!msg) {
-        return -1;
+    /* Only blocked globals are logged, so a large unpickle of allowed
+       types costs one lookup per global */
+    if (pickle_allow && allowlist_contains(pickle_allow, mod, global)) {
+        return 0;
     }
 
-    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
-    Py_DECREF(msg);
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_object(&r, "module", mod);
+        json_field_object(&r, "name", global);
+        json_field_bool(&r, "blocked", 1);
+        json_end(&r, audit_log);
+    } else {
+        PyObject *msg = PyUnicode_FromFormat("finding %R.%R blocked",
+            mod, global);
+        if (!msg) {
+            return -1;
+        }
+
+        int r = audit_log_write_unicode(audit_log, event, msg);
+        Py_DECREF(msg);
+        if (r < 0) {
+            return -1;
+        }
+    }
     PyErr_SetString(PyExc_RuntimeError,
                     "unpickling arbitrary objects is disallowed");
     return -1;
@@ -192,17 +327,28 @@ hook_pickle_find_class(const char *event, PyObject *args, FILE *audit_log)
 
 
 static int
-hook_system(const char *event, PyObject *args, FILE *audit_log)
+hook_system(const char *event, PyObject *args, AuditLog *audit_log)
 {
     PyObject *cmd = PyTuple_GetItem(args, 0);
 
-    PyObject *msg = PyUnicode_FromFormat("%S", cmd);
-    if (!msg) {
-        return -1;
-    }
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_object(&r, "command", cmd);
+        json_field_bool(&r, "blocked", 1);
+        json_end(&r, audit_log);
+    } else {
+        PyObject *msg = PyUnicode_FromFormat("%S", cmd);
+        if (!msg) {
+            return -1;
+        }
 
-    fprintf(audit_log, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
-    Py_DECREF(msg);
+        int r = audit_log_write_unicode(audit_log, event, msg);
+        Py_DECREF(msg);
+        if (r < 0) {
+            return -1;
+        }
+    }
 
     PyErr_SetString(PyExc_RuntimeError, "os.system() is disallowed");
     return -1;
@@ -210,79 +356,253 @@ hook_system(const char *event, PyObject *args, FILE *audit_log)
 
 
 static int
-default_spython_hook(const char *event, PyObject *args, void *userData)
+hook_denied(const char *event, PyObject *args, AuditLog *audit_log)
 {
-    assert(userData);
+    if (LOG_JSON(audit_log)) {
+        JsonRecord r;
+        json_begin(&r, audit_log, event);
+        json_field_object(&r, "args", args);
+        json_field_bool(&r, "blocked", 1);
+        json_end(&r, audit_log);
+    } else {
+        audit_log_write(audit_log, event, "blocked in this interpreter", -1);
+    }
+    PyErr_Format(PyExc_RuntimeError, "%s is disallowed", event);
+    return -1;
+}
 
-    if (strcmp(event, "sys.addaudithook") == 0) {
-        return hook_addaudithook(event, args, (FILE*)userData);
+
+// open and socket.connect only have their own schema in JSON mode
+static void
+json_open(const char *event, PyObject *args, AuditLog *audit_log)
+{
+    PyObject *path, *mode, *flags;
+    JsonRecord r;
+    json_begin(&r, audit_log, event);
+    if (PyArg_ParseTuple(args, "OOO", &path, &mode, &flags)) {
+        json_field_object(&r, "path", path);
+        json_field_object(&r, "mode", mode);
+        json_field_object(&r, "flags", flags);
+    } else {
+        PyErr_Clear();
+        json_field_object(&r, "args", args);
+    }
+    json_end(&r, audit_log);
+}
+
+
+static void
+json_socket_connect(const char *event, PyObject *args, AuditLog *audit_log)
+{
+    PyObject *sock, *address, *host, *port;
+    JsonRecord r;
+    json_begin(&r, audit_log, event);
+    if (PyArg_ParseTuple(args, "OO", &sock, &address)) {
+        // (host, port) for IPv4 and (host, port, flowinfo, scope_id) for IPv6
+        if (PyTuple_Check(address) && PyTuple_GET_SIZE(address) >= 2
+            && PyUnicode_Check(host = PyTuple_GET_ITEM(address, 0))
+            && PyLong_Check(port = PyTuple_GET_ITEM(address, 1))) {
+            json_field_object(&r, "host", host);
+            json_field_object(&r, "port", port);
+        } else {
+            json_field_object(&r, "address", address);
+        }
+    } else {
+        PyErr_Clear();
+        json_field_object(&r, "args", args);
     }
+    json_end(&r, audit_log);
+}
 
-    if (strcmp(event, "spython.open_code") == 0) {
-        return hook_open_code(event, args, (FILE*)userData);
+
+static int
+dispatch_spython_hook(const char *event, PyObject *args)
+{
+    SpythonInterpState *state = interp_state_get();
+    AuditLog *audit_log = state->log;
+
+    if (preinit_pending() && Py_IsInitialized()) {
+        preinit_flush(write_preinit, NULL);
     }
 
-    if (strcmp(event, "import") == 0) {
-        return hook_import(event, args, (FILE*)userData);
+    if (state->deny) {
+        for (const char * const *d = state->deny; *d; ++d) {
+            if (strcmp(event, *d) == 0) {
+                return hook_denied(event, args, audit_log);
+            }
+        }
     }
 
-    if (strcmp(event, "compile") == 0) {
-        return hook_compile(event, args, (FILE*)userData);
+    if (strcmp(event, "sys.addaudithook") == 0) {
+        return hook_addaudithook(event, args, audit_log);
+    }
+
+    if (strcmp(event, "spython.open_code") == 0) {
+        return hook_open_code(event, args, audit_log);
     }
 
     if (strcmp(event, "code.__new__") == 0) {
-        return hook_code_new(event, args, (FILE*)userData);
+        return hook_code_new(event, args, audit_log);
     }
 
     if (strcmp(event, "pickle.find_class") == 0) {
-        return hook_pickle_find_class(event, args, (FILE*)userData);
+        return hook_pickle_find_class(event, args, audit_log);
     }
 
     if (strcmp(event, "os.system") == 0) {
-        return hook_system(event, args, (FILE*)userData);
+        return hook_system(event, args, audit_log);
+    }
+
+    if (DEFER_TEXT(audit_log)) {
+        preinit_capture(event, args, write_preinit, NULL);
+        if (state->coalesce &&
+            strcmp(event, "cpython._PySys_ClearAuditHooks") == 0) {
+            /* Keeps the counts after the records they follow */
+            preinit_flush(write_preinit, NULL);
+            coalesce_flush(state->coalesce, audit_log);
+        }
+        return 0;
+    }
+
+    // The rest are only logged, so repeats may be counted instead
+    if (state->coalesce) {
+        if (strcmp(event, "cpython._PySys_ClearAuditHooks") == 0) {
+            coalesce_flush(state->coalesce, audit_log);
+        } else if (coalesce_record(state->coalesce, audit_log, event, args)) {
+            return 0;
+        }
+    }
+
+    if (strcmp(event, "import") == 0) {
+        return hook_import(event, args, audit_log);
+    }
+
+    if (strcmp(event, "compile") == 0) {
+        return hook_compile(event, args, audit_log);
     }
 
     // All other events just get printed
-    PyObject *msg = PyObject_Repr(args);
-    if (!msg) {
-        return -1;
+    int r = 0;
+    if (LOG_JSON(audit_log)) {
+        if (strcmp(event, "open") == 0) {
+            json_open(event, args, audit_log);
+        } else if (strcmp(event, "socket.connect") == 0) {
+            json_socket_connect(event, args, audit_log);
+        } else {
+            JsonRecord record;
+            json_begin(&record, audit_log, event);
+            json_field_object(&record, "args", args);
+            json_end(&record, audit_log);
+        }
+    } else {
+        PyObject *msg = PyObject_Repr(args);
+        if (!msg) {
+            return -1;
+        }
+
+        r = audit_log_write_unicode(audit_log, event, msg);
+        Py_DECREF(msg);
     }
 
-    fprintf((FILE*)userData, "%s: %s\n", event, PyUnicode_AsUTF8(msg));
-    Py_DECREF(msg);
+    // A subinterpreter is going away, so close its log
+    if (strcmp(event, "cpython.PyInterpreterState_Clear") == 0) {
+        if (state->coalesce) {
+            coalesce_flush(state->coalesce, audit_log);
+        }
+        interp_state_release(state);
+    }
 
-    return 0;
+    return r;
+}
+
+static int
+default_spython_hook(const char *event, PyObject *args, void *userData)
+{
+    if (!import_profile_enabled()) {
+        return dispatch_spython_hook(event, args);
+    }
+
+    /* Time in the hooks is charged to the import that raised the event */
+    if (import_profile_event(event, args)) {
+        return 0;
+    }
+    ImportPhase phase = import_profile_enter(IMPORT_PHASE_AUDIT);
+    int r = dispatch_spython_hook(event, args);
+    import_profile_leave(phase);
+    return r;
 }
 
+/* Cached reference to the _io module, which is per interpreter because
+   objects cannot be shared between them. Hooks may run on many threads at
+   once without a GIL, so the first thread to import it publishes it and
+   any others release their own reference. */
 static PyObject *
-spython_open_code(PyObject *path, void *userData)
+spython_get_io(void)
 {
-    static PyObject *io = NULL;
-    PyObject *stream = NULL, *buffer = NULL, *err = NULL;
+    _Atomic(PyObject *) *io_module = &interp_state_get()->io;
+    PyObject *io = atomic_load_explicit(io_module, memory_order_acquire);
+    if (io) {
+        return io;
+    }
+    io = PyImport_ImportModule("_io");
+    if (!io) {
+        return NULL;
+    }
+    PyObject *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(io_module, &expected, io,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        Py_DECREF(io);
+        io = expected;
+    }
+    return io;
+}
+
+/* Signatures from SPYTHONSIGNATURES, shared by every interpreter */
+static Scanner *scanner = NULL;
 
-    const char *ext = strrchr(PyUnicode_AsUTF8(path), '.');
-    int disallow = !ext || (
-        PyOS_stricmp(ext, ".py") != 0
-        && PyOS_stricmp(ext, ".pth") != 0);
+/* Rules from SPYTHONPATHPOLICY, shared by every interpreter */
+static PathPolicy *path_policy = NULL;
 
-    PyObject *b = PyBool_FromLong(!disallow);
-    if (PySys_Audit("spython.open_code", "OO", path, b) < 0) {
+/* Checks the content of a file under a "hash" rule. Returns -1 with an
+   exception set if it may not be loaded. */
+static int
+spython_check_hash(PyObject *path, PyObject *buffer, const PathVerdict *verdict)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    char digest_hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    ImportPhase phase = import_profile_enter(IMPORT_PHASE_HASH);
+    sha256(PyBytes_AS_STRING(buffer), (size_t)PyBytes_GET_SIZE(buffer), digest);
+    import_profile_leave(phase);
+    for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        digest_hex[i * 2] = hex[digest[i] >> 4];
+        digest_hex[i * 2 + 1] = hex[digest[i] & 0xF];
+    }
+    digest_hex[SHA256_DIGEST_SIZE * 2] = '\0';
+
+    int trusted = path_policy_trusted_hash(path_policy, digest);
+    PyObject *b = PyBool_FromLong(trusted);
+    if (PySys_Audit("spython.open_code.hash", "OsO", path, digest_hex, b) < 0) {
         Py_DECREF(b);
-        return NULL;
+        return -1;
     }
     Py_DECREF(b);
 
-    if (disallow) {
-        PyErr_SetString(PyExc_OSError, "invalid format - only .py");
-        return NULL;
+    if (!trusted && !verdict->log_only) {
+        PyErr_Format(PyExc_OSError, "loading this file is not allowed "
+                     "(sha256 %s is not trusted)", digest_hex);
+        return -1;
     }
+    return 0;
+}
 
-    if (!io) {
-        io = PyImport_ImportModule("_io");
-        if (!io) {
-            return NULL;
-        }
-    }
+/* Returns the content of path as bytes */
+static PyObject *
+spython_read_code(PyObject *io, PyObject *path)
+{
+    PyObject *stream, *buffer, *err;
 
     stream = PyObject_CallMethod(io, "open", "Osisssi", path, "rb",
                                  -1, NULL, NULL, NULL, 1);
@@ -300,21 +620,217 @@ spython_open_code(PyObject *path, void *userData)
     err = PyObject_CallMethod(stream, "close", NULL);
     Py_DECREF(stream);
     if (!err) {
+        Py_DECREF(buffer);
         return NULL;
     }
+    Py_DECREF(err);
+    return buffer;
+}
 
-    /* Here is a good place to validate the contents of
-     * buffer and raise an error if not permitted
-     */
-    if (strstr(PyBytes_AsString(buffer), "I am a virus")) {
+static PyObject *
+spython_open_code_checked(PyObject *path)
+{
+    PyObject *io;
+    PyObject *buffer;
+    PathVerdict verdict;
+    ImportPhase phase;
+    Py_ssize_t path_len;
+
+    const char *path_utf8 = PyUnicode_AsUTF8AndSize(path, &path_len);
+    if (!path_utf8) {
+        return NULL;
+    }
+    path_policy_check(path_policy, path_utf8, path_len, &verdict);
+
+    PyObject *b = PyBool_FromLong(verdict.allowed);
+    if (PySys_Audit("spython.open_code", "OOs", path, b, verdict.reason) < 0) {
+        Py_DECREF(b);
+        return NULL;
+    }
+    Py_DECREF(b);
+
+    if (!verdict.allowed) {
+        PyErr_Format(PyExc_OSError, "loading this file is not allowed (%s)",
+                     verdict.reason);
+        return NULL;
+    }
+
+    io = spython_get_io();
+    if (!io) {
+        return NULL;
+    }
+
+    phase = import_profile_enter(IMPORT_PHASE_READ);
+    buffer = spython_read_code(io, path);
+    import_profile_leave(phase);
+    if (!buffer) {
+        return NULL;
+    }
+
+    /* Scan the whole buffer, including anything after a NUL byte */
+    phase = import_profile_enter(IMPORT_PHASE_SCAN);
+    Py_ssize_t found = scanner_check(scanner, buffer);
+    import_profile_leave(phase);
+    if (found != -1) {
+        Py_DECREF(buffer);
+        if (found >= 0) {
+            PyErr_Format(PyExc_OSError, "loading this file is not allowed "
+                         "(matched signature '%s')",
+                         scanner_signature(scanner, found));
+        }
+        return NULL;
+    }
+
+    if (verdict.hash_required && spython_check_hash(path, buffer, &verdict) < 0) {
         Py_DECREF(buffer);
-        PyErr_SetString(PyExc_OSError, "loading this file is not allowed");
         return NULL;
     }
 
     return PyObject_CallMethod(io, "BytesIO", "N", buffer);
 }
 
+static PyObject *
+spython_open_code(PyObject *path, void *userData)
+{
+    ImportPhase phase = import_profile_enter(IMPORT_PHASE_POLICY);
+    PyObject *stream = spython_open_code_checked(path);
+    /* Importers compile the source next */
+    import_profile_leave(stream ? IMPORT_PHASE_COMPILE : phase);
+    return stream;
+}
+
+/* SPYTHONLOGFORMAT=json selects JSON Lines instead of text */
+static AuditLogFormat log_format = AUDIT_LOG_TEXT;
+
+/* SPYTHONLOGCOMPRESS=zlib writes records in compressed blocks, with an
+   index at '<path>.idx' */
+static int log_compress = 0;
+
+/* SPYTHONLOGRING=<name> appends every interpreter's records to the
+   shared memory ring of spython-collector instead of a file */
+static LogRing *log_ring = NULL;
+
+/* Base path of the log. Subinterpreters log to '<path>.<id>' */
+#ifdef MS_WINDOWS
+static wchar_t *log_path = NULL;
+#else
+static char *log_path = NULL;
+#endif
+
+static AuditLog *
+spython_open_log(long long interp_id)
+{
+    int fd, index_fd = -1;
+
+    if (log_ring) {
+        return audit_log_from_ring(log_ring, interp_id, log_format);
+    }
+
+    /* Every record is a single append, so threads never overwrite
+       each other's output */
+#ifdef MS_WINDOWS
+    size_t path_len = wcslen(log_path) + 28;
+    wchar_t *path = (wchar_t*)malloc(path_len * sizeof(wchar_t));
+    if (!path) {
+        return NULL;
+    }
+    if (interp_id) {
+        swprintf_s(path, path_len, L"%s.%lld", log_path, interp_id);
+    } else {
+        wcscpy_s(path, path_len, log_path);
+    }
+    fd = _wopen(path,
+                _O_WRONLY | _O_CREAT | _O_TRUNC | _O_APPEND | _O_BINARY,
+                _S_IREAD | _S_IWRITE);
+    if (fd < 0) {
+        fwprintf_s(stderr,
+                   L"Fatal Python error: failed to open log file: %s\n",
+                   path);
+    } else if (log_compress) {
+        wcscat_s(path, path_len, L".idx");
+        index_fd = _wopen(path,
+                          _O_WRONLY | _O_CREAT | _O_TRUNC | _O_APPEND | _O_BINARY,
+                          _S_IREAD | _S_IWRITE);
+        if (index_fd < 0) {
+            fwprintf_s(stderr,
+                       L"Fatal Python error: failed to open log index: %s\n",
+                       path);
+        }
+    }
+#else
+    size_t path_len = strlen(log_path) + 28;
+    char *path = (char*)malloc(path_len);
+    if (!path) {
+        return NULL;
+    }
+    if (interp_id) {
+        snprintf(path, path_len, "%s.%lld", log_path, interp_id);
+    } else {
+        strcpy(path, log_path);
+    }
+    /* A restart keeps the previous log */
+    log_rotate_preserve(path);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Fatal Python error: "
+            "failed to open log file: %s\n", path);
+    } else if (log_compress) {
+        size_t len = strlen(path);
+        strcpy(path + len, ".idx");
+        index_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (index_fd < 0) {
+            fprintf(stderr, "Fatal Python error: "
+                "failed to open log index: %s\n", path);
+        }
+        path[len] = '\0';
+    }
+#endif
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+    AuditLog *log = audit_log_from_fd(fd, interp_id, log_format);
+    if (log && log_compress && (index_fd < 0 || audit_log_compress(log, index_fd) < 0)) {
+        audit_log_close(log);
+        log = NULL;
+    }
+#ifndef MS_WINDOWS
+    if (log && log_rotate_enabled() && log_rotate_add(path, fd, index_fd) < 0) {
+        audit_log_close(log);
+        log = NULL;
+    }
+#endif
+    free(path);
+    return log;
+}
+
+/* Events named in SPYTHONSUBINTERPDENY (comma separated) are blocked in
+   subinterpreters, in addition to the events blocked everywhere */
+static const char * const *
+spython_subinterp_deny(void)
+{
+    const char *env = getenv("SPYTHONSUBINTERPDENY");
+    if (!env || !*env) {
+        return NULL;
+    }
+    char *names = strdup(env);
+    size_t n = 2;
+    for (const char *p = env; *p; ++p) {
+        n += *p == ',';
+    }
+    char **deny = (char **)calloc(n, sizeof(char *));
+    if (!names || !deny) {
+        free(names);
+        free(deny);
+        return NULL;
+    }
+    n = 0;
+    for (char *name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+        deny[n++] = name;
+    }
+    return (const char * const *)deny;
+}
+
 static int
 spython_usage(int exitcode, wchar_t *program)
 {
@@ -326,61 +842,169 @@ spython_usage(int exitcode, wchar_t *program)
 }
 
 static int
-spython_main(int argc, wchar_t **argv, FILE *audit_log)
+spython_main(int argc, wchar_t **argv)
 {
+    PyStatus status;
+    PyConfig config;
+    AuditLog *audit_log;
+
     if (argc == 1) {
         return spython_usage(1, argv[0]);
     }
 
-    /* The auditing log should be opened by the platform-specific main */
-    if (!audit_log) {
-        Py_FatalError("failed to open log file");
+    const char *format = getenv("SPYTHONLOGFORMAT");
+    if (format && strcmp(format, "json") == 0) {
+        log_format = AUDIT_LOG_JSON;
+    } else if (format && *format && strcmp(format, "text") != 0) {
+        fprintf(stderr, "Fatal Python error: unknown SPYTHONLOGFORMAT: %s\n",
+                format);
         return 1;
     }
 
-    /* Run the interactive loop. This should be removed for production use */
-    if (wcscmp(argv[1], L"-i") == 0) {
-        fclose(audit_log);
-        audit_log = stderr;
+    const char *coalesce = getenv("SPYTHONLOGCOALESCE");
+    if (coalesce && *coalesce) {
+        char *end;
+        long ms = strtol(coalesce, &end, 10);
+        if (*end || ms < 0) {
+            fprintf(stderr, "Fatal Python error: invalid SPYTHONLOGCOALESCE: %s\n",
+                    coalesce);
+            return 1;
+        }
+        coalesce_init((long long)ms * 1000);
     }
 
-    PySys_AddAuditHook(default_spython_hook, audit_log);
-    PyFile_SetOpenCodeHook(spython_open_code, NULL);
+    const char *rotate = getenv("SPYTHONLOGROTATE");
+    if (rotate && *rotate && log_rotate_init(rotate) < 0) {
+        fprintf(stderr, "Fatal Python error: failed to set up log rotation\n");
+        return 1;
+    }
 
-    Py_IgnoreEnvironmentFlag = 1;
-    Py_NoUserSiteDirectory = 1;
-    Py_DontWriteBytecodeFlag = 1;
+    const char *compress = getenv("SPYTHONLOGCOMPRESS");
+    if (compress && strcmp(compress, "zlib") == 0) {
+        log_compress = 1;
+    } else if (compress && *compress) {
+        fprintf(stderr, "Fatal Python error: unknown SPYTHONLOGCOMPRESS: %s\n",
+                compress);
+        return 1;
+    }
 
-    Py_SetProgramName(argv[0]);
-    Py_Initialize();
-    PySys_SetArgv(argc - 1, &argv[1]);
+    const char *ring = getenv("SPYTHONLOGRING");
+    if (ring && *ring) {
+        /* The collector owns the output, so it rotates or compresses it */
+        if (log_compress || log_rotate_enabled()) {
+            fprintf(stderr, "Fatal Python error: SPYTHONLOGRING cannot be combined "
+                            "with SPYTHONLOGCOMPRESS or SPYTHONLOGROTATE\n");
+            return 1;
+        }
+        log_ring = log_ring_attach(ring);
+        if (!log_ring) {
+            fprintf(stderr, "Fatal Python error: failed to attach to log ring\n");
+            return 1;
+        }
+    }
 
     /* Run the interactive loop. This should be removed for production use */
-    if (wcscmp(argv[1], L"-i") == 0) {
-        PyRun_InteractiveLoop(stdin, "<stdin>");
-        Py_Finalize();
-        return 0;
+    int interactive = wcscmp(argv[1], L"-i") == 0;
+    if (interactive) {
+        audit_log = audit_log_from_fd(2, 0, log_format);
+    } else {
+        audit_log = spython_open_log(0);
     }
+    if (!audit_log) {
+        return 1;
+    }
+    startup_log = audit_log;
 
-    FILE *fp = _Py_wfopen(argv[1], L"r");
-    if (fp != NULL) {
-        (void)PyRun_SimpleFile(fp, "__main__");
-        PyErr_Clear();
-        fclose(fp);
+    if (interp_state_init(audit_log, interactive ? NULL : spython_open_log,
+                          spython_subinterp_deny()) < 0) {
+        Py_FatalError("failed to initialize interpreter state");
+        return 1;
+    }
+
+    scanner = scanner_load(getenv("SPYTHONSIGNATURES"));
+    if (!scanner) {
+        fprintf(stderr, "Fatal Python error: failed to load signatures\n");
+        return 1;
+    }
+
+    path_policy = path_policy_load(getenv("SPYTHONPATHPOLICY"));
+    if (!path_policy) {
+        fprintf(stderr, "Fatal Python error: failed to load path policy\n");
+        return 1;
+    }
+
+    const char *pickle_allow_path = getenv("SPYTHONPICKLEALLOW");
+    if (pickle_allow_path && *pickle_allow_path) {
+        pickle_allow = allowlist_load(pickle_allow_path);
+        if (!pickle_allow) {
+            fprintf(stderr, "Fatal Python error: failed to load pickle allowlist\n");
+            return 1;
+        }
+    }
+
+    const char *import_profile_path = getenv("SPYTHONIMPORTPROFILE");
+    if (import_profile_path && *import_profile_path &&
+        import_profile_init(import_profile_path) < 0) {
+        fprintf(stderr, "Fatal Python error: failed to open import profile\n");
+        return 1;
+    }
+
+    if (verify_code_init() < 0) {
+        Py_FatalError("failed to initialize bytecode verifier");
+        return 1;
+    }
+
+    PySys_AddAuditHook(default_spython_hook, NULL);
+    PyFile_SetOpenCodeHook(spython_open_code, NULL);
+
+    /* Not an isolated config: like PySys_SetArgv, Py_RunMain puts the
+       script's directory first in sys.path */
+    PyConfig_InitPythonConfig(&config);
+    config.use_environment = 0;
+    config.user_site_directory = 0;
+    config.write_bytecode = 0;
+    config.parse_argv = 0;
+
+    status = PyConfig_SetString(&config, &config.program_name, argv[0]);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+    status = PyConfig_SetArgv(&config, argc - 1, &argv[1]);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+    if (interactive) {
+        config.inspect = 1;
     } else {
-        fprintf(stderr, "failed to open source file %ls\n", argv[1]);
+        status = PyConfig_SetString(&config, &config.run_filename, argv[1]);
+        if (PyStatus_Exception(status)) {
+            goto fail;
+        }
     }
 
-    Py_Finalize();
-    return 0;
+    status = Py_InitializeFromConfig(&config);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+    PyConfig_Clear(&config);
+
+    int exitcode = Py_RunMain();
+    import_profile_write();
+    /* Writes the events raised during finalization */
+    preinit_flush(write_preinit, NULL);
+    /* Writes any compressed blocks still buffered */
+    audit_log_close(audit_log);
+    return exitcode;
+
+fail:
+    PyConfig_Clear(&config);
+    Py_ExitStatusException(status);
 }
 
 #ifdef MS_WINDOWS
 int
 wmain(int argc, wchar_t **argv)
 {
-    FILE *audit_log;
-    wchar_t *log_path = NULL;
     size_t log_path_len;
 
     if (_wgetenv_s(&log_path_len, NULL, 0, L"SPYTHONLOG") == 0 &&
@@ -395,15 +1019,7 @@ wmain(int argc, wchar_t **argv)
         wcscat_s(log_path, log_path_len, L".log");
     }
 
-    if (_wfopen_s(&audit_log, log_path, L"w")) {
-        fwprintf_s(stderr,
-                   L"Fatal Python error: failed to open log file: %s\n",
-                   log_path);
-        return 1;
-    }
-    free(log_path);
-
-    return spython_main(argc, argv, audit_log);
+    return spython_main(argc, argv);
 }
 
 #else
@@ -415,7 +1031,6 @@ main(int argc, char **argv)
     /* We need a second copy, as Python might modify the first one. */
     wchar_t **argv_copy2;
     int i, res;
-    FILE *audit_log;
 
     argv_copy = (wchar_t **)malloc(sizeof(wchar_t*) * (argc+1));
     argv_copy2 = (wchar_t **)malloc(sizeof(wchar_t*) * (argc+1));
@@ -438,30 +1053,24 @@ main(int argc, char **argv)
     argv_copy2[argc] = argv_copy[argc] = NULL;
 
     if (getenv("SPYTHONLOG")) {
-        audit_log = fopen(getenv("SPYTHONLOG"), "w");
-        if (!audit_log) {
-            fprintf(stderr, "Fatal Python error: "
-                "failed to open log file: %s\n", getenv("SPYTHONLOG"));
-            return 1;
-        }
+        log_path = strdup(getenv("SPYTHONLOG"));
     } else {
         unsigned int log_path_len = strlen(argv[0]) + 5;
-        char *log_path = (char*)malloc(log_path_len);
-        strcpy(log_path, argv[0]);
-        strcat(log_path, ".log");
-        audit_log = fopen(log_path, "w");
-        if (!audit_log) {
-            fprintf(stderr, "Fatal Python error: "
-                "failed to open log file: %s\n", log_path);
-            return 1;
+        log_path = (char*)malloc(log_path_len);
+        if (log_path) {
+            strcpy(log_path, argv[0]);
+            strcat(log_path, ".log");
         }
-        free(log_path);
+    }
+    if (!log_path) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
     }
 
-    res = spython_main(argc, argv_copy, audit_log);
+    res = spython_main(argc, argv_copy);
 
     for (i = 0; i < argc; i++) {
-        free(argv_copy2[i]);
+        PyMem_RawFree(argv_copy2[i]);
     }
     free(argv_copy);
     free(argv_copy2);
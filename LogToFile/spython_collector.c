@@ -0,0 +1,238 @@
+/* Collector for SPYTHONLOGRING
+ *
+ * Creates the shared memory ring that spython processes log to, and
+ * drains it into one file, or to standard output for '-' so the records
+ * can be piped to another sink. See log_ring.h.
+ *
+ *     spython-collector [-s <size>[K|M]] [-m <mode>] [-u] <ring> <output>
+ *
+ * -s sets the size of the ring (default 8M), -m its permissions in octal
+ * (default 600), and -u removes the ring on exit. Text records are
+ * prefixed with the process id of their producer; JSON records already
+ * have a "pid" field. SIGHUP reopens the output, for use with logrotate,
+ * and SIGINT or SIGTERM drain the ring and exit. A restarted collector
+ * takes over the ring and the records still in it.
+ */
+
+#include "log_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+/* Polling interval when the ring is idle, which doubles up to the
+   maximum while nothing arrives */
+#define POLL_MIN_NS 1000000L
+#define POLL_MAX_NS 20000000L
+
+typedef struct _Output {
+    const char *path;
+    int fd;
+    size_t len;
+    char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t reopening = 0;
+
+static void
+on_stop(int sig)
+{
+    stopping = 1;
+}
+
+static void
+on_hup(int sig)
+{
+    reopening = 1;
+}
+
+static int
+output_open(Output *out)
+{
+    if (strcmp(out->path, "-") == 0) {
+        out->fd = 1;
+        return 0;
+    }
+    out->fd = open(out->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (out->fd < 0) {
+        fprintf(stderr, "spython-collector: failed to open %s: %s\n",
+                out->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+output_flush(Output *out)
+{
+    const char *p = out->buffer;
+    size_t len = out->len;
+    while (len) {
+        ssize_t r = write(out->fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            fprintf(stderr, "spython-collector: failed to write %s: %s\n",
+                    out->path, strerror(errno));
+            break;
+        }
+        p += r;
+        len -= (size_t)r;
+    }
+    out->len = 0;
+}
+
+static void
+output_append(Output *out, const char *data, size_t len)
+{
+    if (out->len + len > sizeof(out->buffer)) {
+        output_flush(out);
+    }
+    memcpy(out->buffer + out->len, data, len);
+    out->len += len;
+}
+
+static void
+read_record(int pid, const char *data, size_t len, void *context)
+{
+    Output *out = (Output *)context;
+    if (data[0] != '{') {
+        char prefix[16];
+        int n = snprintf(prefix, sizeof(prefix), "%d ", pid);
+        output_append(out, prefix, (size_t)n);
+    }
+    output_append(out, data, len);
+}
+
+static size_t
+parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        n <<= 10;
+        ++end;
+    } else if (*end == 'M' || *end == 'm') {
+        n <<= 20;
+        ++end;
+    }
+    return *end || !n ? 0 : (size_t)n;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: spython-collector [-s <size>[K|M]] [-m <mode>] [-u] "
+                    "<ring> <output>\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t size = 8 << 20;
+    int mode = 0600;
+    int unlink_on_exit = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:m:u")) != -1) {
+        switch (opt) {
+        case 's':
+            size = parse_size(optarg);
+            if (!size) {
+                usage();
+                return 2;
+            }
+            break;
+        case 'm':
+            mode = (int)strtol(optarg, NULL, 8);
+            break;
+        case 'u':
+            unlink_on_exit = 1;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return 2;
+    }
+    const char *name = argv[optind];
+
+    static Output out;
+    out.path = argv[optind + 1];
+    if (output_open(&out) < 0) {
+        return 1;
+    }
+
+    LogRing *ring = log_ring_create(name, size, mode);
+    if (!ring) {
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = on_hup;
+    sigaction(SIGHUP, &sa, NULL);
+
+    LogRingStats reported = { 0 };
+    long poll_ns = POLL_MIN_NS;
+    for (;;) {
+        int last = stopping;
+        size_t n = log_ring_drain(ring, read_record, &out);
+        output_flush(&out);
+
+        LogRingStats stats;
+        log_ring_stats(ring, &stats);
+        if (stats.dropped != reported.dropped || stats.reclaimed != reported.reclaimed) {
+            fprintf(stderr, "spython-collector: %llu records dropped by producers, "
+                            "%llu reservations reclaimed\n",
+                    (unsigned long long)stats.dropped,
+                    (unsigned long long)stats.reclaimed);
+            reported = stats;
+        }
+
+        if (last) {
+            break;
+        }
+        if (reopening) {
+            reopening = 0;
+            if (out.fd > 2) {
+                close(out.fd);
+            }
+            if (output_open(&out) < 0) {
+                break;
+            }
+        }
+        if (n) {
+            poll_ns = POLL_MIN_NS;
+            continue;
+        }
+        struct timespec ts = { 0, poll_ns };
+        nanosleep(&ts, NULL);
+        if (poll_ns < POLL_MAX_NS) {
+            poll_ns *= 2;
+        }
+    }
+
+    log_ring_detach(ring);
+    if (unlink_on_exit) {
+        log_ring_unlink(name);
+    }
+    if (out.fd > 2) {
+        close(out.fd);
+    }
+    return 0;
+}
@@ -0,0 +1,368 @@
+#include "verify_code.h"
+#include "opcode.h"
+
+/* Properties of each opcode */
+#define OP_LOCAL    0x01
+#define OP_CONST    0x02
+#define OP_NAME     0x04
+#define OP_FREE     0x08
+#define OP_JREL     0x10
+#define OP_JABS     0x20
+/* Execution never continues with the next instruction */
+#define OP_STOP     0x40
+/* Also reads the item oparg below the inputs, such as LIST_APPEND */
+#define OP_PEEK     0x80
+/* Set by verify_code_init() */
+#define OP_VALID    0x100
+/* The stack effect depends on oparg in a way that scale cannot express */
+#define OP_VARIABLE 0x200
+
+static const unsigned char op_flags[256] = {
+    [LOAD_FAST] = OP_LOCAL,
+    [STORE_FAST] = OP_LOCAL,
+    [DELETE_FAST] = OP_LOCAL,
+#ifdef LOAD_FAST_CHECK
+    [LOAD_FAST_CHECK] = OP_LOCAL,
+#endif
+#ifdef LOAD_FAST_AND_CLEAR
+    [LOAD_FAST_AND_CLEAR] = OP_LOCAL,
+#endif
+#ifdef VERIFY_CODE_FLOW
+    /* Later versions pack flags into these arguments */
+    [LOAD_CONST] = OP_CONST,
+    [STORE_NAME] = OP_NAME,
+    [DELETE_NAME] = OP_NAME,
+    [STORE_ATTR] = OP_NAME,
+    [DELETE_ATTR] = OP_NAME,
+    [STORE_GLOBAL] = OP_NAME,
+    [DELETE_GLOBAL] = OP_NAME,
+    [LOAD_NAME] = OP_NAME,
+    [LOAD_ATTR] = OP_NAME,
+    [IMPORT_NAME] = OP_NAME,
+    [IMPORT_FROM] = OP_NAME,
+    [LOAD_GLOBAL] = OP_NAME,
+    [LOAD_METHOD] = OP_NAME,
+    [LOAD_CLOSURE] = OP_FREE,
+    [LOAD_DEREF] = OP_FREE,
+    [STORE_DEREF] = OP_FREE,
+    [DELETE_DEREF] = OP_FREE,
+    [LOAD_CLASSDEREF] = OP_FREE,
+    [FOR_ITER] = OP_JREL,
+    [JUMP_FORWARD] = OP_JREL | OP_STOP,
+    [SETUP_FINALLY] = OP_JREL,
+    [SETUP_WITH] = OP_JREL,
+    [SETUP_ASYNC_WITH] = OP_JREL,
+    [JUMP_IF_FALSE_OR_POP] = OP_JABS,
+    [JUMP_IF_TRUE_OR_POP] = OP_JABS,
+    [JUMP_ABSOLUTE] = OP_JABS | OP_STOP,
+    [POP_JUMP_IF_FALSE] = OP_JABS,
+    [POP_JUMP_IF_TRUE] = OP_JABS,
+    [RETURN_VALUE] = OP_STOP,
+    [RAISE_VARARGS] = OP_STOP,
+    [LIST_APPEND] = OP_PEEK,
+    [SET_ADD] = OP_PEEK,
+    [MAP_ADD] = OP_PEEK,
+#if PY_VERSION_HEX < 0x03090000
+    [CALL_FINALLY] = OP_JREL,
+#else
+    [JUMP_IF_NOT_EXC_MATCH] = OP_JABS,
+    [RERAISE] = OP_STOP,
+    [LIST_EXTEND] = OP_PEEK,
+    [SET_UPDATE] = OP_PEEK,
+    [DICT_UPDATE] = OP_PEEK,
+    [DICT_MERGE] = OP_PEEK,
+#endif
+#endif
+};
+
+/* Everything the pass needs to know about an opcode, so each
+   instruction takes one table lookup. Stack effects are precomputed as
+   effect + scale * oparg, which covers everything but a few opcodes such
+   as MAKE_FUNCTION, and only those call into the compiler. */
+typedef struct _OpInfo {
+    unsigned short flags;
+    signed char effect;
+    signed char jump_effect;
+    signed char scale;
+    /* Values that must be on the stack. When the effect depends on oparg,
+       the values left behind instead, and the effect is subtracted at
+       run time. */
+    signed char needs;
+} OpInfo;
+
+static OpInfo op_info[256];
+
+#ifdef VERIFY_CODE_FLOW
+/* The number of values an instruction leaves on the stack when it does
+   not jump. Together with the stack effect this gives the number it
+   takes, which must already be there. Most opcodes push one value or
+   none, so only the others are listed. */
+static int
+stack_pushes(int op)
+{
+    switch (op) {
+    case ROT_TWO: return 2;
+    case ROT_THREE: return 3;
+    case ROT_FOUR: return 4;
+    case DUP_TOP: return 2;
+    case DUP_TOP_TWO: return 4;
+    case LOAD_METHOD: return 2;
+    case GET_ANEXT: return 2;
+    case BEFORE_ASYNC_WITH: return 2;
+    case FOR_ITER: return 2;
+    case SETUP_WITH: return 2;
+#if PY_VERSION_HEX < 0x03090000
+    case BEGIN_FINALLY: return 6;
+    case WITH_CLEANUP_START: return 2;
+#endif
+    /* Opcodes that leave nothing behind */
+    case POP_TOP: case NOP: case EXTENDED_ARG:
+    case STORE_NAME: case STORE_ATTR: case STORE_GLOBAL: case STORE_FAST:
+    case STORE_DEREF: case STORE_SUBSCR: case DELETE_SUBSCR:
+    case DELETE_NAME: case DELETE_ATTR: case DELETE_GLOBAL: case DELETE_FAST:
+    case DELETE_DEREF:
+    case RETURN_VALUE: case IMPORT_STAR: case SETUP_ANNOTATIONS:
+    case POP_BLOCK: case POP_EXCEPT: case PRINT_EXPR: case RAISE_VARARGS:
+    case JUMP_FORWARD: case JUMP_ABSOLUTE: case POP_JUMP_IF_FALSE:
+    case POP_JUMP_IF_TRUE: case JUMP_IF_FALSE_OR_POP: case JUMP_IF_TRUE_OR_POP:
+    case SETUP_FINALLY: case END_ASYNC_FOR:
+    case LIST_APPEND: case SET_ADD: case MAP_ADD:
+#if PY_VERSION_HEX < 0x03090000
+    case END_FINALLY: case POP_FINALLY: case CALL_FINALLY:
+    case WITH_CLEANUP_FINISH:
+#else
+    case JUMP_IF_NOT_EXC_MATCH: case RERAISE:
+    case LIST_EXTEND: case SET_UPDATE: case DICT_UPDATE: case DICT_MERGE:
+#endif
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+int
+verify_code_init(void)
+{
+    /* Enough arguments to tell apart every opcode whose effect depends on
+       oparg, including the flag bits of MAKE_FUNCTION and FORMAT_VALUE */
+    static const int probes[] = { 1, 2, 3, 4, 8, 0x100 };
+    int scale;
+
+    for (int op = 0; op < 256; ++op) {
+        OpInfo *info = &op_info[op];
+        int effect = PyCompile_OpcodeStackEffectWithJump(op, 0, 0);
+        int jump_effect = PyCompile_OpcodeStackEffectWithJump(op, 0, 1);
+        info->flags = op_flags[op];
+        if (effect == PY_INVALID_STACK_EFFECT) {
+            continue;
+        }
+        info->flags |= OP_VALID;
+        info->effect = (signed char)effect;
+        info->jump_effect = (signed char)jump_effect;
+        scale = PyCompile_OpcodeStackEffectWithJump(op, 1, 0) - effect;
+        for (size_t i = 0; i < Py_ARRAY_LENGTH(probes); ++i) {
+            if (PyCompile_OpcodeStackEffectWithJump(op, probes[i], 0) != effect + scale * probes[i] ||
+                PyCompile_OpcodeStackEffectWithJump(op, probes[i], 1) != jump_effect + scale * probes[i]) {
+                info->flags |= OP_VARIABLE;
+            }
+        }
+        info->scale = (info->flags & OP_VARIABLE) ? 0 : (signed char)scale;
+        int pushes = stack_pushes(op);
+        if (scale || (info->flags & OP_VARIABLE)) {
+            info->needs = (signed char)pushes;
+        } else {
+            info->needs = (signed char)(pushes > effect ? pushes - effect : 0);
+        }
+    }
+
+    /* Opcodes that read more than they pop */
+    op_info[IMPORT_FROM].needs = 1;
+#if PY_VERSION_HEX >= 0x03090000
+    op_info[WITH_EXCEPT_START].needs = 7;
+#endif
+    return 0;
+}
+#else
+int
+verify_code_init(void)
+{
+    for (int op = 0; op < 256; ++op) {
+        op_info[op].flags = op_flags[op];
+    }
+    return 0;
+}
+#endif
+
+#define VERIFY_FAIL(msg) do { \
+        result->error = (msg); \
+        result->offset = i; \
+        result->opcode = op; \
+        result->oparg = oparg; \
+        goto done; \
+    } while (0)
+
+int
+verify_code(const unsigned char *code, Py_ssize_t len,
+            int nlocals, int stacksize, VerifyResult *result)
+{
+    Py_ssize_t i = 0;
+    int op = 0;
+    /* At most INT_MAX << 8, since larger arguments stop the pass */
+    long long oparg = 0, extended = 0;
+    /* Kept in locals, since stores through result could alias code */
+    long long max_const = -1, max_name = -1, max_free = -1;
+    int max_depth = 0;
+
+    memset(result, 0, sizeof(*result));
+
+#ifdef VERIFY_CODE_FLOW
+    /* Stack depth on entry to each instruction, or -1 until some path
+       reaches it. Paths that meet keep the deepest. */
+    int depth_small[512];
+    int *depth_at = depth_small;
+    int depth = 0, effect = 0, jump_effect = 0;
+    long long needs = 0;
+    Py_ssize_t ninstr = len / 2;
+
+    if (ninstr > (Py_ssize_t)Py_ARRAY_LENGTH(depth_small)) {
+        depth_at = (int*)PyMem_RawMalloc(ninstr * sizeof(int));
+        if (!depth_at) {
+            result->error = "out of memory";
+            return -1;
+        }
+    }
+    memset(depth_at, 0xFF, ninstr * sizeof(int));
+#endif
+
+    if (len <= 0 || len % 2) {
+        VERIFY_FAIL("code is not a whole number of instructions");
+    }
+
+    /* The common checks are combined without branching, and only a
+       failure leaves the loop to work out which one it was */
+    for (i = 0; i < len; i += 2) {
+        op = code[i];
+        oparg = extended | code[i + 1];
+        extended = op == EXTENDED_ARG ? oparg << 8 : 0;
+
+        const OpInfo *info = &op_info[op];
+        unsigned int flags = info->flags;
+
+#ifdef VERIFY_CODE_FLOW
+        /* depth is -1 after an unconditional jump, until an earlier jump
+           to here is found. Code that is never reached is skipped, and a
+           backward jump into it is rejected below. */
+        if (depth_at[i / 2] > depth) {
+            depth = depth_at[i / 2];
+        }
+        if (depth < 0) {
+            continue;
+        }
+        depth_at[i / 2] = depth;
+#endif
+
+        max_const = (flags & OP_CONST) && oparg > max_const ? oparg : max_const;
+        max_name = (flags & OP_NAME) && oparg > max_name ? oparg : max_name;
+        max_free = (flags & OP_FREE) && oparg > max_free ? oparg : max_free;
+        int bad = (oparg > INT_MAX) | ((flags & OP_LOCAL) && oparg >= nlocals);
+
+#ifdef VERIFY_CODE_FLOW
+        long long scaled = info->scale * oparg;
+        effect = info->effect + (int)scaled;
+        jump_effect = info->jump_effect + (int)scaled;
+        needs = info->needs;
+        if (flags & OP_VARIABLE) {
+            effect = PyCompile_OpcodeStackEffectWithJump(op, (int)oparg, 0);
+            jump_effect = PyCompile_OpcodeStackEffectWithJump(op, (int)oparg, 1);
+            bad |= effect == PY_INVALID_STACK_EFFECT ||
+                   jump_effect == PY_INVALID_STACK_EFFECT;
+        }
+        if (info->scale || (flags & OP_VARIABLE)) {
+            /* UNPACK_SEQUENCE and UNPACK_EX take one value */
+            needs = op == UNPACK_SEQUENCE || op == UNPACK_EX ? 1 :
+                    needs > effect ? needs - effect : 0;
+        }
+        needs += (flags & OP_PEEK) ? oparg : 0;
+        /* Checking the limit at every step also keeps depth from
+           overflowing with huge arguments */
+        bad |= scaled < -INT_MAX / 2 || scaled > INT_MAX / 2;
+        bad |= !(flags & OP_VALID) | (depth < needs) |
+               ((long long)depth + effect > stacksize);
+#endif
+
+        if (bad) {
+            break;
+        }
+
+#ifdef VERIFY_CODE_FLOW
+        if (flags & (OP_JREL | OP_JABS)) {
+            Py_ssize_t target = (flags & OP_JREL) ? i + 2 + oparg : oparg;
+            long long jump_depth = (long long)depth + jump_effect;
+            if (target >= len || target % 2) {
+                VERIFY_FAIL("jump target out of range");
+            }
+            if (jump_depth < 0) {
+                VERIFY_FAIL("stack underflow");
+            }
+            if (jump_depth > stacksize) {
+                VERIFY_FAIL("stack is deeper than stacksize");
+            }
+            max_depth = jump_depth > max_depth ? (int)jump_depth : max_depth;
+            if (target > i) {
+                if (depth_at[target / 2] < jump_depth) {
+                    depth_at[target / 2] = (int)jump_depth;
+                }
+            } else if (depth_at[target / 2] < 0) {
+                VERIFY_FAIL("backward jump into unreachable code");
+            } else if (depth_at[target / 2] < jump_depth) {
+                VERIFY_FAIL("stack grows on every loop iteration");
+            }
+        }
+
+        /* Needs were checked above, so this cannot go below zero */
+        depth = (flags & OP_STOP) ? -1 : depth + effect;
+        max_depth = depth > max_depth ? depth : max_depth;
+#endif
+    }
+
+    if (i < len) {
+        if (oparg > INT_MAX) {
+            VERIFY_FAIL("argument is too large");
+        }
+        if ((op_info[op].flags & OP_LOCAL) && oparg >= nlocals) {
+            VERIFY_FAIL("local variable index out of range");
+        }
+#ifdef VERIFY_CODE_FLOW
+        if (!(op_info[op].flags & OP_VALID) || effect == PY_INVALID_STACK_EFFECT ||
+            jump_effect == PY_INVALID_STACK_EFFECT) {
+            VERIFY_FAIL("unknown opcode");
+        }
+        if (depth < needs) {
+            VERIFY_FAIL("stack underflow");
+        }
+        VERIFY_FAIL("stack is deeper than stacksize");
+#endif
+    }
+
+#ifdef VERIFY_CODE_FLOW
+    if (depth >= 0) {
+        VERIFY_FAIL("execution runs past the end of the code");
+    }
+#else
+    if (extended) {
+        VERIFY_FAIL("code ends with EXTENDED_ARG");
+    }
+#endif
+
+done:
+    result->max_depth = max_depth;
+    result->max_const = max_const;
+    result->max_name = max_name;
+    result->max_free = max_free;
+#ifdef VERIFY_CODE_FLOW
+    if (depth_at != depth_small) {
+        PyMem_RawFree(depth_at);
+    }
+#endif
+    return result->error ? -1 : 0;
+}
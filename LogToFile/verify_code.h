@@ -0,0 +1,49 @@
+/* Bytecode verifier for the code.__new__ hook
+ *
+ * Code objects are verified in one forward pass over co_code:
+ *   - every instruction has a known opcode, and EXTENDED_ARG prefixes
+ *     are combined into the argument that follows them
+ *   - LOAD_FAST, STORE_FAST and DELETE_FAST use a local below nlocals
+ *   - jump targets are inside the code and on an instruction boundary
+ *   - the stack never goes below empty, never grows around a loop, and
+ *     never exceeds the declared stacksize
+ *   - execution cannot run off the end of the code
+ *
+ * The code.__new__ event does not include co_consts, co_names or the
+ * cell and free variables, so their indices are reported in the result
+ * but cannot be checked here.
+ *
+ * Control flow, stack and index checks follow the 3.8 and 3.9
+ * instruction format. Later versions only get the local checks.
+ */
+#ifndef SPYTHON_VERIFY_CODE_H
+#define SPYTHON_VERIFY_CODE_H
+
+#include "Python.h"
+
+#if PY_VERSION_HEX < 0x030A0000
+#define VERIFY_CODE_FLOW 1
+#endif
+
+typedef struct _VerifyResult {
+    /* Set when verification fails */
+    const char *error;
+    Py_ssize_t offset;
+    int opcode;
+    long long oparg;
+    /* Deepest stack seen, and the highest indices used */
+    int max_depth;
+    long long max_const;
+    long long max_name;
+    long long max_free;
+} VerifyResult;
+
+/* Builds the opcode tables. Call once before installing the hook. */
+int verify_code_init(void);
+
+/* Returns 0 if the code is valid, or -1 and fills in result->error.
+   Never raises. */
+int verify_code(const unsigned char *code, Py_ssize_t len,
+                int nlocals, int stacksize, VerifyResult *result);
+
+#endif /* SPYTHON_VERIFY_CODE_H */
@@ -21,7 +21,9 @@ if exist "%_PYTHONLIB%\python_d.exe" (
 
 @echo on
 @if not exist obj mkdir obj
-cl -nologo %_MD% -c spython.c -Foobj\spython.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c spython.c -Foobj\spython.obj -Iobj -I..\LogToFile -Zi -O2 %_PYTHONINCLUDE%
 @if errorlevel 1 exit /B %ERRORLEVEL%
-link /nologo obj\spython.obj /out:spython.exe /debug:FULL /pdb:spython.pdb /libpath:"%_PYTHONLIB%"
+cl -nologo %_MD% -std:c11 -experimental:c11atomics -c ..\LogToFile\preinit.c -Foobj\preinit.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
+@if errorlevel 1 exit /B %ERRORLEVEL%
+link /nologo obj\spython.obj obj\preinit.obj /out:spython.exe /debug:FULL /pdb:spython.pdb /libpath:"%_PYTHONLIB%"
 @if errorlevel 1 exit /B %ERRORLEVEL%
@@ -3,8 +3,11 @@
 #include "Python.h"
 #include "opcode.h"
 #include <locale.h>
+#include <stdatomic.h>
 #include <string.h>
 
+#include "preinit.h"
+
 #ifdef __FreeBSD__
 #include <fenv.h>
 #endif
@@ -59,13 +62,24 @@ hook_compile(const char *event, PyObject *args)
     return 0;
 }
 
+static void
+write_preinit(const char *event, const char *text, size_t len, void *context)
+{
+    fprintf(stderr, "%s: %.*s\n", event, (int)len, text);
+}
+
 static int
 default_spython_hook(const char *event, PyObject *args, void *userData)
 {
+    /* During startup and shutdown we cannot call repr() on arguments, so
+       they are copied and printed once it is safe */
     if (!Py_IsInitialized()) {
-        fprintf(stderr, "%s: during startup/shutdown we cannot call repr() on arguments\n", event);
+        preinit_capture(event, args, write_preinit, NULL);
         return 0;
     }
+    if (preinit_pending()) {
+        preinit_flush(write_preinit, NULL);
+    }
 
     /* We handle compile() separately to trim the very long code argument */
     if (strcmp(event, "compile") == 0) {
@@ -84,21 +98,45 @@ default_spython_hook(const char *event, PyObject *args, void *userData)
     return 0;
 }
 
+/* Cached reference to the _io module. Hooks may run on many threads at
+   once without a GIL, so the first thread to import it publishes it and
+   any others release their own reference. */
+static _Atomic(PyObject *) io_module = NULL;
+
+static PyObject *
+spython_get_io(void)
+{
+    PyObject *io = atomic_load_explicit(&io_module, memory_order_acquire);
+    if (io) {
+        return io;
+    }
+    io = PyImport_ImportModule("_io");
+    if (!io) {
+        return NULL;
+    }
+    PyObject *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&io_module, &expected, io,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        Py_DECREF(io);
+        io = expected;
+    }
+    return io;
+}
+
 static PyObject *
 spython_open_code(PyObject *path, void *userData)
 {
-    static PyObject *io = NULL;
+    PyObject *io;
     PyObject *stream = NULL, *buffer = NULL, *err = NULL;
 
     if (PySys_Audit("spython.open_code", "O", path) < 0) {
         return NULL;
     }
 
+    io = spython_get_io();
     if (!io) {
-        io = PyImport_ImportModule("_io");
-        if (!io) {
-            return NULL;
-        }
+        return NULL;
     }
 
     stream = PyObject_CallMethod(io, "open", "Osisssi", path, "rb",
@@ -133,7 +171,9 @@ wmain(int argc, wchar_t **argv)
 {
     PySys_AddAuditHook(default_spython_hook, NULL);
     PyFile_SetOpenCodeHook(spython_open_code, NULL);
-    return Py_Main(argc, argv);
+    int exitcode = Py_Main(argc, argv);
+    preinit_flush(write_preinit, NULL);
+    return exitcode;
 }
 #else
 int
@@ -141,6 +181,8 @@ main(int argc, char **argv)
 {
     PySys_AddAuditHook(default_spython_hook, NULL);
     PyFile_SetOpenCodeHook(spython_open_code, NULL);
-    return Py_BytesMain(argc, argv);
+    int exitcode = Py_BytesMain(argc, argv);
+    preinit_flush(write_preinit, NULL);
+    return exitcode;
 }
 #endif
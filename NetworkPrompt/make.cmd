@@ -23,5 +23,5 @@ if exist "%_PYTHONLIB%\python_d.exe" (
 @if not exist obj mkdir obj
 cl -nologo %_MD% -c spython.c -Foobj\spython.obj -Iobj -Zi -O2 %_PYTHONINCLUDE%
 @if errorlevel 1 exit /B %ERRORLEVEL%
-link /nologo obj\spython.obj /out:spython.exe /debug:FULL /pdb:spython.pdb /libpath:"%_PYTHONLIB%"
+link /nologo obj\spython.obj ws2_32.lib /out:spython.exe /debug:FULL /pdb:spython.pdb /libpath:"%_PYTHONLIB%"
 @if errorlevel 1 exit /B %ERRORLEVEL%
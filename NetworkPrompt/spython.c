@@ -2,15 +2,743 @@
 #include "opcode.h"
 #include <locale.h>
 #include <string.h>
+#include <ctype.h>
+
+#ifdef MS_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#endif
+
+/* Non-interactive policy mode
+ *
+ * When SPYTHONNETPOLICY names a rules file, socket events are decided
+ * by the rules instead of prompting. IP rules are stored in a binary
+ * trie per address family (longest prefix wins), host name rules in a
+ * hash table (exact name first, then '*.' suffixes from the most
+ * specific). Every (host, port) decision is memoized, so repeated
+ * connections only pay for one cache probe.
+ *
+ * Host name rules are checked when the name is resolved, but connect()
+ * only sees the address. So when a host name rule allows a lookup, the
+ * hook resolves the name itself and remembers the addresses with that
+ * rule, and connections to them are decided by it like the name.
+ */
+
+#define POLICY_PROMPT 0
+#define POLICY_ALLOW 1
+#define POLICY_DENY 2
+
+#define MAX_HOST_LEN 255
+#define MAX_RULE_PORTS 16
+#define HOST_TABLE_MIN_SIZE 64
+#define DECISION_CACHE_SIZE 1024
+#define MAX_RESOLVED 256
+
+typedef struct _PolicyRule {
+    int action;
+    /* nports == 0 means any port */
+    int nports;
+    unsigned short port_lo[MAX_RULE_PORTS];
+    unsigned short port_hi[MAX_RULE_PORTS];
+    struct _PolicyRule *next;
+} PolicyRule;
+
+typedef struct _TrieNode {
+    struct _TrieNode *child[2];
+    PolicyRule *rules;
+} TrieNode;
+
+typedef struct _HostEntry {
+    char *name;
+    size_t len;
+    Py_uhash_t hash;
+    PolicyRule *rules;
+} HostEntry;
+
+typedef struct _CachedDecision {
+    Py_uhash_t hash;
+    unsigned short port;
+    unsigned char len;
+    unsigned char action;
+    char host[MAX_HOST_LEN + 1];
+} CachedDecision;
+
+typedef struct _ResolvedAddr {
+    int family;
+    unsigned char addr[16];
+    /* the host name rules that allowed the lookup */
+    const PolicyRule *rules;
+} ResolvedAddr;
+
+typedef struct _NetworkPolicy {
+    int default_action;
+    TrieNode *ipv4;
+    TrieNode *ipv6;
+    /* open addressing, size is a power of two */
+    HostEntry *hosts;
+    size_t hosts_size;
+    size_t hosts_used;
+    /* direct mapped, indexed by the (host, port) hash */
+    CachedDecision cache[DECISION_CACHE_SIZE];
+    /* addresses of allowed host names, the oldest replaced first */
+    ResolvedAddr resolved[MAX_RESOLVED];
+    size_t nresolved;
+} NetworkPolicy;
+
+static NetworkPolicy *network_policy = NULL;
+
+
+static Py_uhash_t
+policy_hash(const char *s, size_t len)
+{
+    /* FNV-1a */
+    Py_uhash_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
 
 static int
-network_prompt_hook(const char *event, PyObject *args, void *userData)
+policy_rule_matches(const PolicyRule *rule, int port)
 {
-    /* Only care about 'socket.' events */
-    if (strncmp(event, "socket.", 7) != 0) {
+    if (rule->nports == 0) {
+        return 1;
+    }
+    for (int i = 0; i < rule->nports; ++i) {
+        if (port >= rule->port_lo[i] && port <= rule->port_hi[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns the action of the first rule in the chain that covers port,
+   or -1 if none does. */
+static int
+policy_rules_action(const PolicyRule *rule, int port)
+{
+    for (; rule; rule = rule->next) {
+        if (policy_rule_matches(rule, port)) {
+            return rule->action;
+        }
+    }
+    return -1;
+}
+
+static void
+policy_append_rule(PolicyRule **chain, PolicyRule *rule)
+{
+    while (*chain) {
+        chain = &(*chain)->next;
+    }
+    *chain = rule;
+}
+
+static int
+trie_insert(TrieNode **root, const unsigned char *addr, int prefix_len,
+            PolicyRule *rule)
+{
+    TrieNode **node = root;
+    for (int bit = 0; ; ++bit) {
+        if (!*node) {
+            *node = (TrieNode*)calloc(1, sizeof(TrieNode));
+            if (!*node) {
+                return -1;
+            }
+        }
+        if (bit == prefix_len) {
+            break;
+        }
+        int b = (addr[bit / 8] >> (7 - bit % 8)) & 1;
+        node = &(*node)->child[b];
+    }
+    policy_append_rule(&(*node)->rules, rule);
+    return 0;
+}
+
+/* Walks at most addr_bits nodes, remembering the deepest rule that
+   covers the port. */
+static int
+trie_lookup(const TrieNode *node, const unsigned char *addr, int addr_bits,
+            int port)
+{
+    int action = -1;
+    for (int bit = 0; node; ++bit) {
+        int a = policy_rules_action(node->rules, port);
+        if (a >= 0) {
+            action = a;
+        }
+        if (bit == addr_bits) {
+            break;
+        }
+        node = node->child[(addr[bit / 8] >> (7 - bit % 8)) & 1];
+    }
+    return action;
+}
+
+static void
+trie_free(TrieNode *node)
+{
+    if (!node) {
+        return;
+    }
+    trie_free(node->child[0]);
+    trie_free(node->child[1]);
+    PolicyRule *rule = node->rules;
+    while (rule) {
+        PolicyRule *next = rule->next;
+        free(rule);
+        rule = next;
+    }
+    free(node);
+}
+
+static HostEntry *
+host_find(const NetworkPolicy *policy, const char *name, size_t len,
+          Py_uhash_t hash)
+{
+    size_t mask = policy->hosts_size - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        HostEntry *e = &policy->hosts[i];
+        if (!e->name) {
+            return e;
+        }
+        if (e->hash == hash && e->len == len && memcmp(e->name, name, len) == 0) {
+            return e;
+        }
+    }
+}
+
+static int
+host_insert(NetworkPolicy *policy, const char *name, PolicyRule *rule)
+{
+    size_t len = strlen(name);
+
+    if ((policy->hosts_used + 1) * 2 > policy->hosts_size) {
+        HostEntry *old = policy->hosts;
+        size_t old_size = policy->hosts_size;
+        size_t new_size = old_size ? old_size * 2 : HOST_TABLE_MIN_SIZE;
+        policy->hosts = (HostEntry*)calloc(new_size, sizeof(HostEntry));
+        if (!policy->hosts) {
+            policy->hosts = old;
+            return -1;
+        }
+        policy->hosts_size = new_size;
+        for (size_t i = 0; i < old_size; ++i) {
+            if (old[i].name) {
+                *host_find(policy, old[i].name, old[i].len, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    Py_uhash_t hash = policy_hash(name, len);
+    HostEntry *e = host_find(policy, name, len, hash);
+    if (!e->name) {
+        e->name = strdup(name);
+        if (!e->name) {
+            return -1;
+        }
+        e->len = len;
+        e->hash = hash;
+        policy->hosts_used += 1;
+    }
+    policy_append_rule(&e->rules, rule);
+    return 0;
+}
+
+/* Returns the action for name and port, or -1 if no rule covers them.
+   If rules is not NULL, it is set to the rules that decided. */
+static int
+host_lookup(const NetworkPolicy *policy, const char *name, size_t len, int port,
+            const PolicyRule **rules)
+{
+    char buf[MAX_HOST_LEN + 3];
+    int action;
+
+    if (!policy->hosts_size) {
+        return -1;
+    }
+
+    /* Exact entry first */
+    HostEntry *e = host_find(policy, name, len, policy_hash(name, len));
+    if (e->name && (action = policy_rules_action(e->rules, port)) >= 0) {
+        if (rules) {
+            *rules = e->rules;
+        }
+        return action;
+    }
+
+    /* Then '*.<suffix>' entries, longest suffix first */
+    for (size_t i = 0; i < len; ++i) {
+        if (name[i] != '.') {
+            continue;
+        }
+        size_t slen = len - i + 1;
+        buf[0] = '*';
+        memcpy(&buf[1], &name[i], slen - 1);
+        e = host_find(policy, buf, slen, policy_hash(buf, slen));
+        if (e->name && (action = policy_rules_action(e->rules, port)) >= 0) {
+            if (rules) {
+                *rules = e->rules;
+            }
+            return action;
+        }
+    }
+    return -1;
+}
+
+/* Decides an address that no address rule covers by the host name rules
+   of a name that resolved to it, or returns -1 */
+static int
+resolved_lookup(const NetworkPolicy *policy, int family,
+                const unsigned char *addr, int port)
+{
+    size_t n = policy->nresolved < MAX_RESOLVED ? policy->nresolved : MAX_RESOLVED;
+    size_t addr_len = family == AF_INET ? 4 : 16;
+    for (size_t i = 0; i < n; ++i) {
+        const ResolvedAddr *r = &policy->resolved[i];
+        if (r->family == family && memcmp(r->addr, addr, addr_len) == 0) {
+            int action = policy_rules_action(r->rules, port);
+            if (action >= 0) {
+                return action;
+            }
+        }
+    }
+    return -1;
+}
+
+static void
+resolved_add(NetworkPolicy *policy, int family, const void *addr,
+             const PolicyRule *rules)
+{
+    size_t n = policy->nresolved < MAX_RESOLVED ? policy->nresolved : MAX_RESOLVED;
+    size_t addr_len = family == AF_INET ? 4 : 16;
+    for (size_t i = 0; i < n; ++i) {
+        const ResolvedAddr *r = &policy->resolved[i];
+        if (r->family == family && r->rules == rules
+            && memcmp(r->addr, addr, addr_len) == 0) {
+            return;
+        }
+    }
+    ResolvedAddr *r = &policy->resolved[policy->nresolved++ % MAX_RESOLVED];
+    r->family = family;
+    memset(r->addr, 0, sizeof(r->addr));
+    memcpy(r->addr, addr, addr_len);
+    r->rules = rules;
+    /* Earlier decisions for this address may have used the default */
+    memset(policy->cache, 0, sizeof(policy->cache));
+}
+
+/* Called after a host name rule allowed resolving host. Resolves it again
+   here, because the audit event comes before the lookup, and remembers
+   the addresses for connect(). Errors are ignored, since the real lookup
+   will report them. */
+static void
+policy_remember_addresses(NetworkPolicy *policy, const char *host, size_t len,
+                          int port)
+{
+    char lower[MAX_HOST_LEN + 1];
+    unsigned char addr[16];
+    const PolicyRule *rules = NULL;
+    struct addrinfo hints, *res = NULL, *ai;
+
+    if (len > MAX_HOST_LEN) {
+        return;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        lower[i] = (char)tolower((unsigned char)host[i]);
+    }
+    lower[len] = '\0';
+    if (inet_pton(AF_INET, lower, addr) == 1 || inet_pton(AF_INET6, lower, addr) == 1
+        || host_lookup(policy, lower, len, port, &rules) != POLICY_ALLOW) {
+        return;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err;
+    Py_BEGIN_ALLOW_THREADS
+    err = getaddrinfo(lower, NULL, &hints, &res);
+    Py_END_ALLOW_THREADS
+    if (err) {
+        return;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            resolved_add(policy, AF_INET,
+                         &((struct sockaddr_in*)ai->ai_addr)->sin_addr, rules);
+        } else if (ai->ai_family == AF_INET6) {
+            resolved_add(policy, AF_INET6,
+                         &((struct sockaddr_in6*)ai->ai_addr)->sin6_addr, rules);
+        }
+    }
+    freeaddrinfo(res);
+}
+
+static int
+policy_parse_ports(char *spec, PolicyRule *rule)
+{
+    if (!spec || strcmp(spec, "*") == 0) {
+        rule->nports = 0;
         return 0;
     }
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        char *end;
+        long lo = strtol(tok, &end, 10), hi = lo;
+        if (*end == '-') {
+            hi = strtol(end + 1, &end, 10);
+        }
+        if (*end || lo < 0 || hi > 65535 || lo > hi
+            || rule->nports == MAX_RULE_PORTS) {
+            return -1;
+        }
+        rule->port_lo[rule->nports] = (unsigned short)lo;
+        rule->port_hi[rule->nports] = (unsigned short)hi;
+        rule->nports += 1;
+    }
+    return 0;
+}
 
+static int
+policy_parse_action(const char *word)
+{
+    if (strcmp(word, "allow") == 0) {
+        return POLICY_ALLOW;
+    }
+    if (strcmp(word, "deny") == 0) {
+        return POLICY_DENY;
+    }
+    if (strcmp(word, "prompt") == 0) {
+        return POLICY_PROMPT;
+    }
+    return -1;
+}
+
+/* Adds one 'action target [ports]' rule. Targets are an IPv4 or IPv6
+   address with an optional '/prefix', a host name, or '*.suffix'. */
+static int
+policy_add_rule(NetworkPolicy *policy, int action, char *target, char *ports)
+{
+    unsigned char addr[16];
+    PolicyRule *rule = (PolicyRule*)calloc(1, sizeof(PolicyRule));
+    if (!rule) {
+        return -1;
+    }
+    rule->action = action;
+    if (policy_parse_ports(ports, rule) < 0) {
+        free(rule);
+        return -1;
+    }
+
+    char *slash = strchr(target, '/');
+    if (slash) {
+        *slash = '\0';
+    }
+    int max_bits = 0;
+    TrieNode **root = NULL;
+    if (inet_pton(AF_INET, target, addr) == 1) {
+        max_bits = 32;
+        root = &policy->ipv4;
+    } else if (inet_pton(AF_INET6, target, addr) == 1) {
+        max_bits = 128;
+        root = &policy->ipv6;
+    }
+
+    if (root) {
+        int prefix_len = max_bits;
+        if (slash) {
+            char *end;
+            prefix_len = (int)strtol(slash + 1, &end, 10);
+            if (*end || prefix_len < 0 || prefix_len > max_bits) {
+                free(rule);
+                return -1;
+            }
+        }
+        if (trie_insert(root, addr, prefix_len, rule) < 0) {
+            free(rule);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (slash || strlen(target) > MAX_HOST_LEN) {
+        free(rule);
+        return -1;
+    }
+    for (char *p = target; *p; ++p) {
+        *p = (char)tolower((unsigned char)*p);
+    }
+    if (host_insert(policy, target, rule) < 0) {
+        free(rule);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+policy_free(NetworkPolicy *policy)
+{
+    if (!policy) {
+        return;
+    }
+    trie_free(policy->ipv4);
+    trie_free(policy->ipv6);
+    for (size_t i = 0; i < policy->hosts_size; ++i) {
+        PolicyRule *rule = policy->hosts[i].rules;
+        while (rule) {
+            PolicyRule *next = rule->next;
+            free(rule);
+            rule = next;
+        }
+        free(policy->hosts[i].name);
+    }
+    free(policy->hosts);
+    free(policy);
+}
+
+/* Loads the rules file. This runs before Python is initialized, so
+   errors are reported directly to stderr. */
+static NetworkPolicy *
+policy_load(const char *path)
+{
+    char line[1024];
+    int lineno = 0;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "failed to open network policy %s\n", path);
+        return NULL;
+    }
+
+    NetworkPolicy *policy = (NetworkPolicy*)calloc(1, sizeof(NetworkPolicy));
+    if (!policy) {
+        fclose(f);
+        return NULL;
+    }
+    policy->default_action = POLICY_PROMPT;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno += 1;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        char *words[4] = { NULL };
+        int nwords = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok && nwords < 4;
+             tok = strtok(NULL, " \t\r\n")) {
+            words[nwords++] = tok;
+        }
+        if (nwords == 0) {
+            continue;
+        }
+
+        int action = nwords > 1 ? policy_parse_action(words[1]) : -1;
+        if (strcmp(words[0], "default") == 0 && nwords == 2 && action >= 0) {
+            policy->default_action = action;
+            continue;
+        }
+
+        action = policy_parse_action(words[0]);
+        /* strtok is not reentrant, so copy the ports out first */
+        char ports[256] = "*";
+        if (nwords == 3 && strlen(words[2]) < sizeof(ports)) {
+            strcpy(ports, words[2]);
+        }
+        if (action < 0 || nwords < 2 || nwords > 3
+            || policy_add_rule(policy, action, words[1], ports) < 0) {
+            fprintf(stderr, "%s:%d: invalid network policy rule\n",
+                    path, lineno);
+            fclose(f);
+            policy_free(policy);
+            return NULL;
+        }
+    }
+
+    fclose(f);
+    return policy;
+}
+
+static int
+policy_decide(NetworkPolicy *policy, const char *host, size_t len, int port)
+{
+    char lower[MAX_HOST_LEN + 1];
+    unsigned char addr[16];
+    int action = -1;
+
+    if (len > MAX_HOST_LEN) {
+        return policy->default_action;
+    }
+
+    Py_uhash_t hash = policy_hash(host, len) ^ ((Py_uhash_t)port * 0x9E3779B1u);
+    CachedDecision *cached = &policy->cache[hash % DECISION_CACHE_SIZE];
+    if (cached->hash == hash && cached->port == port && cached->len == len
+        && memcmp(cached->host, host, len) == 0) {
+        return cached->action;
+    }
+
+    memcpy(lower, host, len);
+    lower[len] = '\0';
+    if (inet_pton(AF_INET, lower, addr) == 1) {
+        action = trie_lookup(policy->ipv4, addr, 32, port);
+        if (action < 0) {
+            action = resolved_lookup(policy, AF_INET, addr, port);
+        }
+    } else if (inet_pton(AF_INET6, lower, addr) == 1) {
+        action = trie_lookup(policy->ipv6, addr, 128, port);
+        if (action < 0) {
+            action = resolved_lookup(policy, AF_INET6, addr, port);
+        }
+    } else {
+        for (size_t i = 0; i < len; ++i) {
+            lower[i] = (char)tolower((unsigned char)lower[i]);
+        }
+        action = host_lookup(policy, lower, len, port, NULL);
+    }
+    if (action < 0) {
+        action = policy->default_action;
+    }
+
+    cached->hash = hash;
+    cached->port = (unsigned short)port;
+    cached->len = (unsigned char)len;
+    cached->action = (unsigned char)action;
+    memcpy(cached->host, host, len);
+    return action;
+}
+
+/* Extracts a host name and port from Python objects. Unknown ports
+   (None or service names) are reported as 0, which only matches rules
+   that allow any port. Returns 0 if the host is not a name or address. */
+static int
+policy_get_host_port(PyObject *hosto, PyObject *porto,
+                     const char **host, Py_ssize_t *len, int *port)
+{
+    if (PyUnicode_Check(hosto)) {
+        *host = PyUnicode_AsUTF8AndSize(hosto, len);
+        if (!*host) {
+            return -1;
+        }
+    } else if (PyBytes_Check(hosto)) {
+        *host = PyBytes_AS_STRING(hosto);
+        *len = PyBytes_GET_SIZE(hosto);
+    } else {
+        return 0;
+    }
+
+    *port = 0;
+    if (porto && PyLong_Check(porto)) {
+        long p = PyLong_AsLong(porto);
+        if (p == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (p > 0 && p <= 65535) {
+            *port = (int)p;
+        }
+    } else if (porto && PyUnicode_Check(porto)) {
+        const char *s = PyUnicode_AsUTF8(porto);
+        char *end;
+        long p;
+        if (!s) {
+            return -1;
+        }
+        p = strtol(s, &end, 10);
+        if (*s && !*end && p > 0 && p <= 65535) {
+            *port = (int)p;
+        }
+    }
+    return 1;
+}
+
+static int network_prompt(const char *event, PyObject *args);
+
+static int
+policy_act(int action, const char *event, PyObject *args,
+           const char *host, int port)
+{
+    switch (action) {
+    case POLICY_ALLOW:
+        return 0;
+    case POLICY_DENY:
+        if (host) {
+            PyErr_Format(PyExc_OSError, "'%s' to %.200s:%d is blocked by policy",
+                         event, host, port);
+        } else {
+            PyErr_Format(PyExc_OSError, "'%s' is blocked by policy", event);
+        }
+        return -1;
+    default:
+        return network_prompt(event, args);
+    }
+}
+
+/* Events with a host are checked against the rules. Creating sockets and
+   looking up local names never reach another host, and are allowed.
+   Every other socket event, including any added by later versions of
+   Python, gets the default action. */
+static int
+network_policy_hook(const char *event, PyObject *args, NetworkPolicy *policy)
+{
+    PyObject *hosto = NULL, *porto = NULL, *addro = NULL;
+
+    /* So yeah, I'm very lazily using PyTuple_GET_ITEM here.
+       Not best practice! PyArg_ParseTuple is much better! */
+    if (strcmp(event, "socket.getaddrinfo") == 0) {
+        hosto = PyTuple_GET_ITEM(args, 0);
+        porto = PyTuple_GET_ITEM(args, 1);
+    } else if (strcmp(event, "socket.gethostbyname") == 0
+               || strcmp(event, "socket.gethostbyaddr") == 0) {
+        hosto = PyTuple_GET_ITEM(args, 0);
+    } else if (strcmp(event, "socket.getnameinfo") == 0) {
+        addro = PyTuple_GET_ITEM(args, 0);
+    } else if (strcmp(event, "socket.connect") == 0
+               || strcmp(event, "socket.sendto") == 0
+               || strcmp(event, "socket.sendmsg") == 0
+               || strcmp(event, "socket.bind") == 0) {
+        addro = PyTuple_GET_ITEM(args, 1);
+    } else if (strcmp(event, "socket.__new__") == 0
+               || strcmp(event, "socket.gethostname") == 0
+               || strcmp(event, "socket.getservbyname") == 0
+               || strcmp(event, "socket.getservbyport") == 0) {
+        return 0;
+    } else {
+        return policy_act(policy->default_action, event, args, NULL, 0);
+    }
+
+    if (addro) {
+        /* Non-tuple addresses (AF_UNIX, etc.) are not host names */
+        if (!PyTuple_Check(addro) || PyTuple_GET_SIZE(addro) < 2) {
+            return 0;
+        }
+        hosto = PyTuple_GET_ITEM(addro, 0);
+        porto = PyTuple_GET_ITEM(addro, 1);
+    }
+
+    const char *host;
+    Py_ssize_t len;
+    int port;
+    int r = policy_get_host_port(hosto, porto, &host, &len, &port);
+    if (r <= 0) {
+        return r;
+    }
+
+    int action = policy_decide(policy, host, (size_t)len, port);
+    if (action == POLICY_ALLOW && !addro) {
+        policy_remember_addresses(policy, host, (size_t)len, port);
+    }
+    return policy_act(action, event, args, host, port);
+}
+
+static int
+network_prompt(const char *event, PyObject *args)
+{
     PyObject *msg = NULL;
 
     /* So yeah, I'm very lazily using PyTuple_GET_ITEM here.
@@ -36,27 +764,61 @@ network_prompt_hook(const char *event, PyObject *args, void *userData)
     if (ch == 'n' || ch == 'N') {
         exit(1);
     }
-    
-    while (ch != '\n') {
+
+    while (ch != '\n' && ch != EOF) {
         ch = fgetc(stdin);
     }
 
     return 0;
 }
 
+static int
+network_prompt_hook(const char *event, PyObject *args, void *userData)
+{
+    /* Only care about 'socket.' events */
+    if (strncmp(event, "socket.", 7) != 0) {
+        return 0;
+    }
+
+    if (userData) {
+        return network_policy_hook(event, args, (NetworkPolicy*)userData);
+    }
+
+    return network_prompt(event, args);
+}
+
+static int
+network_policy_init(void)
+{
+    const char *path = getenv("SPYTHONNETPOLICY");
+    if (path && *path) {
+        network_policy = policy_load(path);
+        if (!network_policy) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 
 #ifdef MS_WINDOWS
 int
 wmain(int argc, wchar_t **argv)
 {
-    PySys_AddAuditHook(network_prompt_hook, NULL);
+    if (network_policy_init() < 0) {
+        return 1;
+    }
+    PySys_AddAuditHook(network_prompt_hook, network_policy);
     return Py_Main(argc, argv);
 }
 #else
 int
 main(int argc, char **argv)
 {
-    PySys_AddAuditHook(network_prompt_hook, NULL);
-    return _Py_UnixMain(argc, argv);
+    if (network_policy_init() < 0) {
+        return 1;
+    }
+    PySys_AddAuditHook(network_prompt_hook, network_policy);
+    return Py_BytesMain(argc, argv);
 }
 #endif
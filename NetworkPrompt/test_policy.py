@@ -0,0 +1,80 @@
+"""End-to-end check of the SPYTHONNETPOLICY rules.
+
+Runs ./spython with a 'default deny' policy that only allows 'localhost'
+on one port, and checks which connections to a local server succeed.
+"""
+
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import textwrap
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SPYTHON = os.path.join(HERE, "spython")
+
+CLIENT = textwrap.dedent("""
+    import socket, sys
+    host, port = sys.argv[1], int(sys.argv[2])
+    try:
+        if host == "-":
+            s = socket.socket()
+            s.connect(("127.0.0.1", port))
+        else:
+            s = socket.create_connection((host, port), timeout=5)
+    except OSError as ex:
+        print("denied" if "blocked by policy" in str(ex) else "error", ex)
+    else:
+        s.close()
+        print("connected")
+""")
+
+
+class PolicyTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.servers = []
+        cls.ports = []
+        for _ in range(2):
+            s = socket.socket()
+            s.bind(("127.0.0.1", 0))
+            s.listen(16)
+            cls.servers.append(s)
+            cls.ports.append(s.getsockname()[1])
+        cls.tmp = tempfile.TemporaryDirectory()
+        cls.policy = os.path.join(cls.tmp.name, "policy.conf")
+        with open(cls.policy, "w") as f:
+            f.write("default deny\nallow localhost {}\n".format(cls.ports[0]))
+        cls.client = os.path.join(cls.tmp.name, "client.py")
+        with open(cls.client, "w") as f:
+            f.write(CLIENT)
+
+    @classmethod
+    def tearDownClass(cls):
+        for s in cls.servers:
+            s.close()
+        cls.tmp.cleanup()
+
+    def run_client(self, host, port):
+        env = dict(os.environ, SPYTHONNETPOLICY=self.policy)
+        p = subprocess.run([SPYTHON, self.client, host, str(port)], env=env,
+                           stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                           universal_newlines=True, timeout=30)
+        return p.stdout.strip()
+
+    def test_allowed_host_connects(self):
+        self.assertEqual(self.run_client("localhost", self.ports[0]), "connected")
+
+    def test_other_port_denied(self):
+        self.assertTrue(self.run_client("localhost", self.ports[1]).startswith("denied"))
+
+    def test_address_without_lookup_denied(self):
+        self.assertTrue(self.run_client("-", self.ports[0]).startswith("denied"))
+
+
+if __name__ == "__main__":
+    if not os.path.isfile(SPYTHON):
+        sys.exit("build spython first")
+    unittest.main()
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+'''
+Latency benchmark for the PolicyDaemon sample.
+
+Starts policy_daemon.py on a temporary socket and runs ./spython on a
+script that raises 'spython.bench' audit events, measuring the cost of
+each event when the verdict is cached, when it needs a round trip to
+the daemon, and when the daemon is too slow and the timeout applies.
+
+    python3 bench_policy.py [--spython ./spython] [-n 20000]
+'''
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+BENCH_SCRIPT = r'''
+import sys, time
+mode, n = sys.argv[1], int(sys.argv[2])
+samples = []
+audit = sys.audit
+perf = time.perf_counter_ns
+if mode == "cached":
+    audit("spython.bench", "warm")
+keys = ["warm"] * n if mode == "cached" else ["key%d" % i for i in range(n)]
+for key in keys:
+    t = perf()
+    audit("spython.bench", key)
+    samples.append(perf() - t)
+samples.sort()
+print(samples[len(samples) // 2], samples[len(samples) * 99 // 100], sum(samples) // len(samples))
+'''
+
+parser = argparse.ArgumentParser("bench_policy")
+parser.add_argument("--spython", default=os.path.join(HERE, "spython"))
+parser.add_argument("-n", type=int, default=20000)
+
+
+def start_daemon(sock, *extra):
+    proc = subprocess.Popen([sys.executable, os.path.join(HERE, "policy_daemon.py"),
+                             "--socket", sock, "--default", "allow", *extra],
+                            stderr=subprocess.DEVNULL)
+    for _ in range(100):
+        if os.path.exists(sock):
+            return proc
+        time.sleep(0.05)
+    proc.kill()
+    raise RuntimeError("policy daemon did not start")
+
+
+def run(spython, script, sock, mode, n, timeout_ms=250):
+    env = dict(os.environ,
+               SPYTHONPOLICYSOCK=sock,
+               SPYTHONPOLICYEVENTS="spython.bench",
+               SPYTHONPOLICYTIMEOUT=str(timeout_ms),
+               SPYTHONPOLICYDEFAULT="allow")
+    out = subprocess.check_output([spython, script, mode, str(n)], env=env)
+    return [int(x) for x in out.split()]
+
+
+def main():
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, "bench.py")
+        with open(script, "w") as f:
+            f.write(BENCH_SCRIPT)
+        sock = os.path.join(tmp, "policy.sock")
+
+        results = []
+        daemon = start_daemon(sock)
+        try:
+            results.append(("cached verdict", run(args.spython, script, sock, "cached", args.n)))
+            results.append(("daemon round trip", run(args.spython, script, sock, "uncached", args.n)))
+        finally:
+            daemon.terminate()
+            daemon.wait()
+
+        daemon = start_daemon(sock, "--delay", "0.05")
+        try:
+            results.append(("slow daemon, 5ms", run(args.spython, script, sock, "uncached",
+                                                    max(args.n // 100, 20), timeout_ms=5)))
+        finally:
+            daemon.terminate()
+            daemon.wait()
+
+        print("{:<20} {:>12} {:>12} {:>12}".format("case", "median ns", "p99 ns", "mean ns"))
+        for name, (median, p99, mean) in results:
+            print("{:<20} {:>12} {:>12} {:>12}".format(name, median, p99, mean))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+'''
+Stand-in policy daemon for the PolicyDaemon sample.
+
+Each request line is '<id> <event> <key>' and each response line is
+'<id> <allow|deny> <ttl_ms>'. Requests on one connection may be
+pipelined, and responses are sent as soon as each decision is made,
+so they can arrive out of order.
+
+Rules are fnmatch patterns over '<event> <key>', checked in order:
+
+    python3 policy_daemon.py --allow 'socket.* 127.0.0.1:*' --deny '*'
+
+With --prompt, anything not matched by a rule is asked on this
+daemon's terminal, in the same way as the NetworkPrompt sample.
+'''
+
+import argparse
+import asyncio
+import fnmatch
+import os
+import sys
+
+
+parser = argparse.ArgumentParser("policy_daemon")
+parser.add_argument("--socket", default="/run/spython/policy.sock")
+parser.add_argument("--allow", action="append", default=[], metavar="PATTERN")
+parser.add_argument("--deny", action="append", default=[], metavar="PATTERN")
+parser.add_argument("--default", choices=("allow", "deny"), default="deny")
+parser.add_argument("--prompt", action="store_true",
+                    help="ask on stdin for anything not matched by a rule")
+parser.add_argument("--ttl", type=int, default=60000,
+                    help="milliseconds clients may cache a verdict")
+parser.add_argument("--delay", type=float, default=0.0,
+                    help="seconds to wait before answering (for testing)")
+parser.add_argument("--verbose", action="store_true")
+
+
+def unescape(key):
+    out = []
+    chars = iter(key)
+    for c in chars:
+        if c == "\\":
+            c = {"n": "\n", "r": "\r"}.get(next(chars, ""), "\\")
+        out.append(c)
+    return "".join(out)
+
+
+class Policy:
+    def __init__(self, args):
+        self.args = args
+        self.rules = []
+        # argparse does not keep the interleaving of --allow and --deny,
+        # so walk argv to preserve the order they were given in
+        allow, deny = iter(args.allow), iter(args.deny)
+        for arg in sys.argv[1:]:
+            if arg.startswith("--allow"):
+                self.rules.append(("allow", next(allow)))
+            elif arg.startswith("--deny"):
+                self.rules.append(("deny", next(deny)))
+        self.prompt_lock = asyncio.Lock()
+
+    async def decide(self, event, key):
+        subject = "{} {}".format(event, key)
+        for verdict, pattern in self.rules:
+            if fnmatch.fnmatchcase(subject, pattern):
+                return verdict, self.args.ttl
+        if not self.args.prompt:
+            return self.args.default, self.args.ttl
+        # Only one prompt at a time, other connections keep being served
+        async with self.prompt_lock:
+            loop = asyncio.get_event_loop()
+            ch = await loop.run_in_executor(None, input,
+                "WARNING: {} {}. Continue [Y/n]\n".format(event, key))
+        return ("deny" if ch[:1] in ("n", "N") else "allow"), self.args.ttl
+
+
+async def answer(policy, writer, req_id, event, key):
+    if policy.args.delay:
+        await asyncio.sleep(policy.args.delay)
+    verdict, ttl = await policy.decide(event, key)
+    if policy.args.verbose:
+        print(req_id, event, key, "->", verdict, file=sys.stderr)
+    writer.write("{} {} {}\n".format(req_id, verdict, ttl).encode())
+
+
+async def serve_client(policy, reader, writer):
+    tasks = set()
+    try:
+        while True:
+            line = await reader.readline()
+            if not line:
+                break
+            try:
+                req_id, event, key = line.decode("utf-8", "replace").rstrip("\n").split(" ", 2)
+            except ValueError:
+                continue
+            task = asyncio.ensure_future(
+                answer(policy, writer, req_id, event, unescape(key)))
+            tasks.add(task)
+            task.add_done_callback(tasks.discard)
+    finally:
+        for task in list(tasks):
+            task.cancel()
+        writer.close()
+
+
+def main():
+    args = parser.parse_args()
+    try:
+        os.unlink(args.socket)
+    except FileNotFoundError:
+        pass
+    loop = asyncio.get_event_loop()
+    policy = Policy(args)
+    server = loop.run_until_complete(asyncio.start_unix_server(
+        lambda r, w: serve_client(policy, r, w), path=args.socket))
+    print("Serving policy on", args.socket, file=sys.stderr)
+    try:
+        loop.run_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
+        os.unlink(args.socket)
+
+
+if __name__ == "__main__":
+    main()
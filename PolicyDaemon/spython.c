@@ -0,0 +1,624 @@
+/* Policy daemon client using PySys_AddAuditHook
+ *
+ * Decisions about selected events are delegated to a local policy
+ * daemon over a Unix socket, so interactive prompts and centrally
+ * managed allowlists live in one place rather than in every process.
+ * Verdicts are cached in-process for the TTL the daemon returns.
+ */
+#include "Python.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_SOCKET_PATH "/run/spython/policy.sock"
+#define DEFAULT_EVENTS "socket.connect,socket.getaddrinfo,os.system," \
+                       "subprocess.Popen,os.exec,os.posix_spawn,os.spawn," \
+                       "ctypes.dlopen"
+#define DEFAULT_TIMEOUT_MS 250
+#define RECONNECT_DELAY_MS 1000
+
+#define MAX_EVENT_LEN 63
+#define MAX_KEY_LEN 447
+#define MAX_PREFIXES 32
+#define MAX_PENDING 64
+/* abandoned requests older than this many timeouts mean a hung daemon */
+#define STALE_TIMEOUTS 8
+
+/* Set-associative verdict cache */
+#define CACHE_SETS 1024
+#define CACHE_WAYS 4
+
+#define VERDICT_WAITING -1
+#define VERDICT_ALLOW 0
+#define VERDICT_DENY 1
+#define VERDICT_FAILED 2
+
+typedef struct _CacheEntry {
+    Py_uhash_t hash;
+    long long expires;
+    int verdict;
+    unsigned short event_len;
+    unsigned short key_len;
+    char event[MAX_EVENT_LEN + 1];
+    char key[MAX_KEY_LEN + 1];
+} CacheEntry;
+
+typedef struct _PendingRequest {
+    unsigned long id;
+    int in_use;
+    /* set when the requesting thread has given up waiting */
+    int abandoned;
+    int verdict;
+    long long sent;
+    CacheEntry entry;
+} PendingRequest;
+
+typedef struct _PolicyClient {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* configuration */
+    char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int timeout_ms;
+    int default_verdict;
+    int nprefixes;
+    char *prefixes[MAX_PREFIXES];
+
+    /* connection */
+    int fd;
+    int reading;
+    long long retry_after;
+    unsigned long next_id;
+    char rbuf[4096];
+    size_t rlen;
+
+    PendingRequest pending[MAX_PENDING];
+    CacheEntry cache[CACHE_SETS][CACHE_WAYS];
+} PolicyClient;
+
+
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static Py_uhash_t
+policy_hash(const char *event, size_t event_len, const char *key, size_t key_len)
+{
+    /* FNV-1a over event, a separator and key */
+    Py_uhash_t h = 2166136261u;
+    for (size_t i = 0; i < event_len; ++i) {
+        h = (h ^ (unsigned char)event[i]) * 16777619u;
+    }
+    h = (h ^ 0xff) * 16777619u;
+    for (size_t i = 0; i < key_len; ++i) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int
+cache_matches(const CacheEntry *e, const CacheEntry *probe)
+{
+    return e->hash == probe->hash
+        && e->event_len == probe->event_len
+        && e->key_len == probe->key_len
+        && memcmp(e->event, probe->event, probe->event_len) == 0
+        && memcmp(e->key, probe->key, probe->key_len) == 0;
+}
+
+/* Caller holds client->lock */
+static int
+cache_lookup(PolicyClient *client, const CacheEntry *probe, long long now)
+{
+    CacheEntry *set = client->cache[probe->hash % CACHE_SETS];
+    for (int i = 0; i < CACHE_WAYS; ++i) {
+        if (set[i].expires > now && cache_matches(&set[i], probe)) {
+            return set[i].verdict;
+        }
+    }
+    return VERDICT_WAITING;
+}
+
+/* Caller holds client->lock */
+static void
+cache_insert(PolicyClient *client, const CacheEntry *entry, long long now)
+{
+    CacheEntry *set = client->cache[entry->hash % CACHE_SETS];
+    CacheEntry *victim = &set[0];
+    for (int i = 0; i < CACHE_WAYS; ++i) {
+        if (set[i].expires <= now || cache_matches(&set[i], entry)) {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].expires < victim->expires) {
+            victim = &set[i];
+        }
+    }
+    *victim = *entry;
+}
+
+/* Caller holds client->lock */
+static void
+client_disconnect(PolicyClient *client)
+{
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+    }
+    client->rlen = 0;
+    client->retry_after = now_ms() + RECONNECT_DELAY_MS;
+    for (int i = 0; i < MAX_PENDING; ++i) {
+        PendingRequest *p = &client->pending[i];
+        if (p->in_use && p->verdict == VERDICT_WAITING) {
+            p->verdict = VERDICT_FAILED;
+        }
+        if (p->abandoned) {
+            p->in_use = 0;
+        }
+    }
+    pthread_cond_broadcast(&client->cond);
+}
+
+/* Caller holds client->lock */
+static int
+client_connect(PolicyClient *client)
+{
+    struct sockaddr_un addr;
+
+    if (client->fd >= 0) {
+        return 0;
+    }
+    if (now_ms() < client->retry_after) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        client->retry_after = now_ms() + RECONNECT_DELAY_MS;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, client->socket_path);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        close(fd);
+        client->retry_after = now_ms() + RECONNECT_DELAY_MS;
+        return -1;
+    }
+    client->fd = fd;
+    client->rlen = 0;
+    return 0;
+}
+
+/* Parses '<id> <allow|deny> <ttl_ms>' lines from the read buffer and
+   completes the matching requests. Late answers to abandoned requests
+   still populate the cache. Caller holds client->lock. */
+static void
+client_dispatch(PolicyClient *client)
+{
+    long long now = now_ms();
+    char *start = client->rbuf;
+    char *end = client->rbuf + client->rlen;
+    char *nl;
+
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        char verdict[8];
+        unsigned long id;
+        long ttl;
+        *nl = '\0';
+        if (sscanf(start, "%lu %7s %ld", &id, verdict, &ttl) == 3) {
+            for (int i = 0; i < MAX_PENDING; ++i) {
+                PendingRequest *p = &client->pending[i];
+                if (!p->in_use || p->id != id) {
+                    continue;
+                }
+                p->verdict = strcmp(verdict, "allow") == 0
+                    ? VERDICT_ALLOW : VERDICT_DENY;
+                if (ttl > 0) {
+                    p->entry.verdict = p->verdict;
+                    p->entry.expires = now + ttl;
+                    cache_insert(client, &p->entry, now);
+                }
+                if (p->abandoned) {
+                    p->in_use = 0;
+                }
+                break;
+            }
+        }
+        start = nl + 1;
+    }
+    client->rlen = end - start;
+    memmove(client->rbuf, start, client->rlen);
+    pthread_cond_broadcast(&client->cond);
+}
+
+/* Abandoned requests keep their slots so late answers reach the cache,
+   but a daemon that stops answering would hold them forever. Once every
+   slot is abandoned, or one has waited STALE_TIMEOUTS timeouts, drop the
+   connection to free them all and reconnect. Caller holds client->lock. */
+static void
+client_reclaim(PolicyClient *client, long long now)
+{
+    long long stale = now - (long long)client->timeout_ms * STALE_TIMEOUTS;
+    int abandoned = 0;
+    if (client->fd < 0) {
+        return;
+    }
+    for (int i = 0; i < MAX_PENDING; ++i) {
+        PendingRequest *p = &client->pending[i];
+        if (!p->in_use || !p->abandoned) {
+            continue;
+        }
+        if (p->sent < stale) {
+            client_disconnect(client);
+            return;
+        }
+        abandoned += 1;
+    }
+    if (abandoned == MAX_PENDING) {
+        client_disconnect(client);
+    }
+}
+
+static PendingRequest *
+client_alloc_pending(PolicyClient *client)
+{
+    for (int i = 0; i < MAX_PENDING; ++i) {
+        if (!client->pending[i].in_use) {
+            return &client->pending[i];
+        }
+    }
+    return NULL;
+}
+
+/* Writes one request line, escaping the separators. Requests are
+   pipelined: other threads may send theirs before this one is
+   answered. Caller holds client->lock. */
+static int
+client_send(PolicyClient *client, PendingRequest *p)
+{
+    char line[32 + (MAX_EVENT_LEN + MAX_KEY_LEN) * 2];
+    int n = sprintf(line, "%lu %s ", p->id, p->entry.event);
+    for (size_t i = 0; i < p->entry.key_len; ++i) {
+        char c = p->entry.key[i];
+        switch (c) {
+        case '\\': line[n++] = '\\'; line[n++] = '\\'; break;
+        case '\n': line[n++] = '\\'; line[n++] = 'n'; break;
+        case '\r': line[n++] = '\\'; line[n++] = 'r'; break;
+        default: line[n++] = c; break;
+        }
+    }
+    line[n++] = '\n';
+
+    for (int sent = 0; sent < n; ) {
+        ssize_t r = send(client->fd, line + sent, n - sent, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 && errno == EAGAIN) {
+            struct pollfd pfd = { client->fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, client->timeout_ms) > 0) {
+                continue;
+            }
+        }
+        if (r <= 0) {
+            client_disconnect(client);
+            return -1;
+        }
+        sent += (int)r;
+    }
+    return 0;
+}
+
+/* Waits until the request is answered or the deadline passes. One
+   waiting thread at a time reads from the socket and dispatches every
+   response it finds, the rest wait on the condition variable. Caller
+   holds client->lock. */
+static int
+client_wait(PolicyClient *client, PendingRequest *p, long long deadline)
+{
+    while (p->verdict == VERDICT_WAITING) {
+        long long remaining = deadline - now_ms();
+        if (remaining <= 0) {
+            break;
+        }
+        if (client->reading) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += remaining / 1000;
+            ts.tv_nsec += (remaining % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&client->cond, &client->lock, &ts);
+            continue;
+        }
+
+        int fd = client->fd;
+        size_t space = sizeof(client->rbuf) - client->rlen;
+        if (fd < 0 || space == 0) {
+            /* a full buffer without a newline is a protocol error */
+            client_disconnect(client);
+            break;
+        }
+        client->reading = 1;
+        pthread_mutex_unlock(&client->lock);
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, (int)remaining);
+        ssize_t r = 0;
+        char buf[sizeof(client->rbuf)];
+        if (ready > 0) {
+            r = read(fd, buf, space);
+        }
+
+        pthread_mutex_lock(&client->lock);
+        client->reading = 0;
+        if (ready > 0 && (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)
+                          || fd != client->fd)) {
+            client_disconnect(client);
+            break;
+        }
+        if (r > 0) {
+            memcpy(client->rbuf + client->rlen, buf, r);
+            client->rlen += r;
+            client_dispatch(client);
+        } else {
+            pthread_cond_broadcast(&client->cond);
+        }
+    }
+
+    int verdict = p->verdict;
+    if (verdict == VERDICT_WAITING) {
+        /* keep the slot so a late answer still reaches the cache */
+        p->abandoned = 1;
+    } else {
+        p->in_use = 0;
+    }
+    return verdict;
+}
+
+static int
+client_query(PolicyClient *client, const CacheEntry *probe)
+{
+    int verdict;
+    long long now = now_ms();
+    long long deadline = now + client->timeout_ms;
+    PyThreadState *ts = NULL;
+
+    pthread_mutex_lock(&client->lock);
+    verdict = cache_lookup(client, probe, now);
+    if (verdict != VERDICT_WAITING) {
+        pthread_mutex_unlock(&client->lock);
+        return verdict;
+    }
+
+    PendingRequest *p;
+    client_reclaim(client, now);
+    if (client_connect(client) < 0 || !(p = client_alloc_pending(client))) {
+        pthread_mutex_unlock(&client->lock);
+        return VERDICT_FAILED;
+    }
+    p->in_use = 1;
+    p->abandoned = 0;
+    p->verdict = VERDICT_WAITING;
+    p->sent = now;
+    p->id = ++client->next_id;
+    p->entry = *probe;
+    if (client_send(client, p) < 0) {
+        p->in_use = 0;
+        pthread_mutex_unlock(&client->lock);
+        return VERDICT_FAILED;
+    }
+
+    /* Let other threads run (and pipeline their own requests) while we
+       wait. Only safe once the runtime is fully initialized. */
+    if (Py_IsInitialized()) {
+        pthread_mutex_unlock(&client->lock);
+        ts = PyEval_SaveThread();
+        pthread_mutex_lock(&client->lock);
+    }
+    verdict = client_wait(client, p, deadline);
+    pthread_mutex_unlock(&client->lock);
+    if (ts) {
+        PyEval_RestoreThread(ts);
+    }
+    return verdict;
+}
+
+/* Copies a str, bytes or int argument into buf. Returns the length,
+   -1 with an exception set, or -2 if the value cannot be used as a key */
+static Py_ssize_t
+key_append(char *buf, Py_ssize_t pos, PyObject *o)
+{
+    const char *s;
+    Py_ssize_t len;
+    char num[32];
+
+    if (PyUnicode_Check(o)) {
+        s = PyUnicode_AsUTF8AndSize(o, &len);
+        if (!s) {
+            return -1;
+        }
+    } else if (PyBytes_Check(o)) {
+        s = PyBytes_AS_STRING(o);
+        len = PyBytes_GET_SIZE(o);
+    } else if (PyLong_Check(o)) {
+        long long v = PyLong_AsLongLong(o);
+        if (v == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        len = sprintf(num, "%lld", v);
+        s = num;
+    } else if (o == Py_None) {
+        s = "";
+        len = 0;
+    } else {
+        return -2;
+    }
+
+    if (pos + len > MAX_KEY_LEN) {
+        return -2;
+    }
+    memcpy(buf + pos, s, len);
+    return pos + len;
+}
+
+/* Builds the key the daemon decides on for an event. Addresses become
+   'host:port', everything else uses the first argument. */
+static Py_ssize_t
+policy_make_key(const char *event, PyObject *args, char *buf)
+{
+    PyObject *host = NULL, *port = NULL;
+    Py_ssize_t n = PyTuple_GET_SIZE(args);
+
+    if (strcmp(event, "socket.getaddrinfo") == 0 && n >= 2) {
+        host = PyTuple_GET_ITEM(args, 0);
+        port = PyTuple_GET_ITEM(args, 1);
+    } else if ((strcmp(event, "socket.connect") == 0
+                || strcmp(event, "socket.sendto") == 0) && n >= 2) {
+        PyObject *addr = PyTuple_GET_ITEM(args, 1);
+        if (!PyTuple_Check(addr) || PyTuple_GET_SIZE(addr) < 2) {
+            return key_append(buf, 0, addr);
+        }
+        host = PyTuple_GET_ITEM(addr, 0);
+        port = PyTuple_GET_ITEM(addr, 1);
+    }
+
+    if (host) {
+        Py_ssize_t pos = key_append(buf, 0, host);
+        if (pos < 0 || pos + 1 > MAX_KEY_LEN) {
+            return pos < 0 ? pos : -2;
+        }
+        buf[pos++] = ':';
+        return key_append(buf, pos, port);
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+    return key_append(buf, 0, PyTuple_GET_ITEM(args, 0));
+}
+
+static int
+policy_event_selected(PolicyClient *client, const char *event)
+{
+    for (int i = 0; i < client->nprefixes; ++i) {
+        if (strncmp(event, client->prefixes[i], strlen(client->prefixes[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+policy_daemon_hook(const char *event, PyObject *args, void *userData)
+{
+    PolicyClient *client = (PolicyClient*)userData;
+    CacheEntry probe;
+
+    if (!policy_event_selected(client, event)) {
+        return 0;
+    }
+
+    size_t event_len = strlen(event);
+    Py_ssize_t key_len = -2;
+    if (event_len <= MAX_EVENT_LEN) {
+        key_len = policy_make_key(event, args, probe.key);
+    }
+    if (key_len == -1) {
+        return -1;
+    }
+
+    int verdict = VERDICT_FAILED;
+    if (key_len >= 0) {
+        memcpy(probe.event, event, event_len + 1);
+        probe.key[key_len] = '\0';
+        probe.event_len = (unsigned short)event_len;
+        probe.key_len = (unsigned short)key_len;
+        probe.hash = policy_hash(event, event_len, probe.key, key_len);
+        verdict = client_query(client, &probe);
+    }
+
+    /* Unreachable daemon, timeouts and keys we cannot send all fall
+       back to the configured default */
+    if (verdict == VERDICT_FAILED || verdict == VERDICT_WAITING) {
+        verdict = client->default_verdict;
+    }
+    if (verdict == VERDICT_DENY) {
+        PyErr_Format(PyExc_OSError, "'%.100s' is disabled by policy", event);
+        return -1;
+    }
+    return 0;
+}
+
+static PolicyClient *
+policy_client_new(void)
+{
+    pthread_condattr_t attr;
+    const char *s;
+
+    PolicyClient *client = (PolicyClient*)calloc(1, sizeof(PolicyClient));
+    if (!client) {
+        fprintf(stderr, "out of memory\n");
+        return NULL;
+    }
+    client->fd = -1;
+
+    s = getenv("SPYTHONPOLICYSOCK");
+    s = s && *s ? s : DEFAULT_SOCKET_PATH;
+    if (strlen(s) >= sizeof(client->socket_path)) {
+        fprintf(stderr, "Fatal Python error: policy socket path too long: %s\n", s);
+        free(client);
+        return NULL;
+    }
+    strcpy(client->socket_path, s);
+
+    s = getenv("SPYTHONPOLICYTIMEOUT");
+    client->timeout_ms = s && *s ? atoi(s) : DEFAULT_TIMEOUT_MS;
+
+    s = getenv("SPYTHONPOLICYDEFAULT");
+    client->default_verdict = s && strcmp(s, "allow") == 0
+        ? VERDICT_ALLOW : VERDICT_DENY;
+
+    s = getenv("SPYTHONPOLICYEVENTS");
+    char *events = strdup(s && *s ? s : DEFAULT_EVENTS);
+    if (!events) {
+        free(client);
+        return NULL;
+    }
+    for (char *tok = strtok(events, ","); tok && client->nprefixes < MAX_PREFIXES;
+         tok = strtok(NULL, ",")) {
+        client->prefixes[client->nprefixes++] = tok;
+    }
+
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&client->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return client;
+}
+
+int
+main(int argc, char **argv)
+{
+    PolicyClient *client = policy_client_new();
+    if (!client) {
+        return 1;
+    }
+    PySys_AddAuditHook(policy_daemon_hook, client);
+    return Py_BytesMain(argc, argv);
+}
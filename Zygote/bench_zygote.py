@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+'''
+Compares launch-to-first-line latency of a cold ./spython start with a
+request to a running zygote.
+
+    python3 bench_zygote.py [--spython ./spython] [-n 50]
+
+The script being launched imports a few modules (as most short-lived
+scripts do) and prints one line. The time measured is from starting the
+process (the client, in the zygote case) until that line is read.
+'''
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+SCRIPT = '''
+import json, argparse, subprocess, re
+print("ready", flush=True)
+'''
+
+parser = argparse.ArgumentParser("bench_zygote")
+parser.add_argument("--spython", default=os.path.join(HERE, "spython"))
+parser.add_argument("-n", type=int, default=50)
+
+
+def first_line_latency(cmd, n):
+    samples = []
+    for _ in range(n):
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+        line = proc.stdout.readline()
+        samples.append(time.perf_counter() - start)
+        proc.stdout.read()
+        if proc.wait() != 0 or line.strip() != b"ready":
+            raise RuntimeError("{} failed".format(cmd))
+    samples.sort()
+    return samples
+
+
+def report(name, samples):
+    print("{:<10} {:>10.2f} {:>10.2f} {:>10.2f}".format(
+        name,
+        statistics.median(samples) * 1000,
+        samples[len(samples) * 9 // 10] * 1000,
+        min(samples) * 1000))
+
+
+def main():
+    args = parser.parse_args()
+    with tempfile.TemporaryDirectory() as tmp:
+        script = os.path.join(tmp, "script.py")
+        with open(script, "w") as f:
+            f.write(SCRIPT)
+        sock = os.path.join(tmp, "zygote.sock")
+
+        zygote = subprocess.Popen([args.spython, "--zygote", sock],
+                                  stderr=subprocess.DEVNULL)
+        try:
+            for _ in range(100):
+                if os.path.exists(sock):
+                    break
+                time.sleep(0.05)
+            cold = first_line_latency([args.spython, script], args.n)
+            warm = first_line_latency([args.spython, "--zygote-run", sock, script], args.n)
+        finally:
+            zygote.terminate()
+            zygote.wait()
+
+    print("{:<10} {:>10} {:>10} {:>10}".format("start", "median ms", "p90 ms", "min ms"))
+    report("cold", cold)
+    report("zygote", warm)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,718 @@
+/* Zygote (fork server) example using PySys_AddAuditHook
+ *
+ * `spython --zygote SOCKET` initializes Python once, installs the hooks,
+ * imports a set of modules, and then forks a child for every request
+ * received on SOCKET from the same user. `spython --zygote-run SOCKET file
+ * [arg] ...` is the client, which passes its stdin/stdout/stderr, working
+ * directory and environment to the zygote and waits for the child's exit
+ * status.
+ *
+ * Without either option, this is a normal (cold starting) spython with
+ * the same hooks, for comparison.
+ */
+#include "Python.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DEFAULT_PRELOAD "encodings,io,abc,codecs,os,stat,posixpath," \
+                        "genericpath,collections,functools,re,enum,types," \
+                        "operator,keyword,heapq,reprlib,sre_compile," \
+                        "sre_parse,sre_constants,copyreg,warnings," \
+                        "linecache,tokenize,traceback,weakref,random," \
+                        "json,argparse,subprocess,signal,threading"
+
+/* Room for the arguments and the environment */
+#define MAX_REQUEST (1024 * 1024)
+#define MAX_CHILDREN 256
+/* The client sends its request as soon as it connects, so a client that
+   has not sent it by then is dropped rather than stalling the zygote */
+#define REQUEST_TIMEOUT_MS 500
+
+extern char **environ;
+
+typedef struct _ZygoteChild {
+    pid_t pid;
+    int conn;
+} ZygoteChild;
+
+static int sigchld_pipe[2] = { -1, -1 };
+
+
+/* cpython.run_*(*) - disable launch options except run_file, exactly
+   as in the StartupControl sample. The zygote raises cpython.run_file
+   itself for every script it runs. */
+static int
+startup_hook(const char *event, PyObject *args, void *userData)
+{
+    if (strncmp(event, "cpython.run_", 12) == 0
+        && strcmp(event, "cpython.run_file") != 0) {
+        PyErr_Format(PyExc_OSError, "'%.100s' is disabled by policy", &event[8]);
+        return -1;
+    }
+    return 0;
+}
+
+/* Cached reference to the _io module. Hooks may run on many threads at
+   once without a GIL, so the first thread to import it publishes it and
+   any others release their own reference. */
+static _Atomic(PyObject *) io_module = NULL;
+
+static PyObject *
+spython_get_io(void)
+{
+    PyObject *io = atomic_load_explicit(&io_module, memory_order_acquire);
+    if (io) {
+        return io;
+    }
+    io = PyImport_ImportModule("_io");
+    if (!io) {
+        return NULL;
+    }
+    PyObject *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&io_module, &expected, io,
+                                                 memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        Py_DECREF(io);
+        io = expected;
+    }
+    return io;
+}
+
+static PyObject *
+spython_open_code(PyObject *path, void *userData)
+{
+    PyObject *io;
+    PyObject *stream = NULL, *buffer = NULL, *err = NULL;
+
+    if (PySys_Audit("spython.open_code", "O", path) < 0) {
+        return NULL;
+    }
+
+    io = spython_get_io();
+    if (!io) {
+        return NULL;
+    }
+
+    stream = PyObject_CallMethod(io, "open", "Osisssi", path, "rb",
+                                 -1, NULL, NULL, NULL, 1);
+    if (!stream) {
+        return NULL;
+    }
+
+    buffer = PyObject_CallMethod(stream, "read", "(i)", -1);
+
+    if (!buffer) {
+        Py_DECREF(stream);
+        return NULL;
+    }
+
+    err = PyObject_CallMethod(stream, "close", NULL);
+    Py_DECREF(stream);
+    if (!err) {
+        return NULL;
+    }
+
+    /* Here is a good place to validate the contents of
+     * buffer and raise an error if not permitted. Modules the zygote
+     * preloads pass through here once, and not again in its children.
+     */
+
+    return PyObject_CallMethod(io, "BytesIO", "N", buffer);
+}
+
+static void
+sigchld_handler(int signum)
+{
+    int saved_errno = errno;
+    (void)write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Makes sys.stdout and sys.stderr line buffered when the client's
+   streams are terminals, as they would be in a cold start */
+static int
+zygote_reconfigure_stdio(void)
+{
+    static const char *names[] = { "stdout", "stderr" };
+    for (int i = 0; i < 2; ++i) {
+        PyObject *stream = PySys_GetObject(names[i]);
+        if (!stream || stream == Py_None) {
+            continue;
+        }
+        PyObject *kwargs = Py_BuildValue("{sO}", "line_buffering",
+                                         isatty(i + 1) ? Py_True : Py_False);
+        if (!kwargs) {
+            return -1;
+        }
+        PyObject *noargs = PyTuple_New(0);
+        PyObject *reconfigure = PyObject_GetAttrString(stream, "reconfigure");
+        PyObject *r = NULL;
+        if (noargs && reconfigure) {
+            r = PyObject_Call(reconfigure, noargs, kwargs);
+        }
+        Py_XDECREF(reconfigure);
+        Py_XDECREF(noargs);
+        Py_DECREF(kwargs);
+        if (!r) {
+            return -1;
+        }
+        Py_DECREF(r);
+    }
+    return 0;
+}
+
+/* Runs the requested script in __main__. The script itself goes through
+   open_code like any other module. Returns the exit status. */
+static int
+zygote_run_file(int argc, wchar_t **wargv)
+{
+    PyObject *path = NULL, *stream = NULL, *source = NULL, *code = NULL;
+    PyObject *main_dict, *result = NULL;
+    int status = 1;
+
+    PySys_SetArgvEx(argc, wargv, 1);
+
+    path = PyUnicode_FromWideChar(wargv[0], -1);
+    if (!path || PySys_Audit("cpython.run_file", "O", path) < 0) {
+        goto error;
+    }
+    if (zygote_reconfigure_stdio() < 0) {
+        goto error;
+    }
+
+    stream = PyFile_OpenCodeObject(path);
+    if (!stream) {
+        goto error;
+    }
+    source = PyObject_CallMethod(stream, "read", NULL);
+    Py_DECREF(stream);
+    if (!source) {
+        goto error;
+    }
+
+    main_dict = PyModule_GetDict(PyImport_AddModule("__main__"));
+    if (PyDict_SetItemString(main_dict, "__file__", path) < 0) {
+        goto error;
+    }
+    code = Py_CompileStringObject(PyBytes_AsString(source), path,
+                                  Py_file_input, NULL, -1);
+    if (!code) {
+        goto error;
+    }
+    result = PyEval_EvalCode(code, main_dict, main_dict);
+    if (!result) {
+        goto error;
+    }
+    status = 0;
+    goto end;
+
+  error:
+    if (PyErr_ExceptionMatches(PyExc_SystemExit)) {
+        /* Handle SystemExit here so that PyErr_Print does not exit
+           the process before we finalize */
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        PyErr_NormalizeException(&type, &value, &tb);
+        PyObject *exitcode = value ? PyObject_GetAttrString(value, "code") : NULL;
+        if (!exitcode || exitcode == Py_None) {
+            status = 0;
+        } else if (PyLong_Check(exitcode)) {
+            status = (int)PyLong_AsLong(exitcode);
+        } else {
+            PyObject_Print(exitcode, stderr, Py_PRINT_RAW);
+            fputc('\n', stderr);
+            status = 1;
+        }
+        PyErr_Clear();
+        Py_XDECREF(exitcode);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(tb);
+    } else {
+        PyErr_Print();
+        status = 1;
+    }
+
+  end:
+    Py_XDECREF(result);
+    Py_XDECREF(code);
+    Py_XDECREF(source);
+    Py_XDECREF(path);
+    return status;
+}
+
+/* Replaces os.environ, and through it the C environment that subprocesses
+   inherit, with the 'KEY=VALUE' strings from p to end */
+static int
+zygote_set_environ(const char *p, const char *end)
+{
+    PyObject *os = PyImport_ImportModule("os");
+    if (!os) {
+        return -1;
+    }
+    PyObject *environ_obj = PyObject_GetAttrString(os, "environ");
+    Py_DECREF(os);
+    if (!environ_obj) {
+        return -1;
+    }
+    PyObject *r = PyObject_CallMethod(environ_obj, "clear", NULL);
+    if (!r) {
+        Py_DECREF(environ_obj);
+        return -1;
+    }
+    Py_DECREF(r);
+
+    for (; p < end; p += strlen(p) + 1) {
+        /* Names starting with '=' cannot be set */
+        const char *eq = strchr(p + 1, '=');
+        if (!eq) {
+            continue;
+        }
+        PyObject *key = PyUnicode_DecodeFSDefaultAndSize(p, eq - p);
+        PyObject *value = PyUnicode_DecodeFSDefault(eq + 1);
+        if (!key || !value || PyObject_SetItem(environ_obj, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(environ_obj);
+            return -1;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+    Py_DECREF(environ_obj);
+    return 0;
+}
+
+/* Body of a forked child. Never returns. */
+static void
+zygote_child(int listen_fd, ZygoteChild *children, int conn, int *fds,
+             char *payload, size_t len)
+{
+    PyOS_AfterFork_Child();
+    signal(SIGCHLD, SIG_DFL);
+
+    close(listen_fd);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    for (int i = 0; i < MAX_CHILDREN; ++i) {
+        if (children[i].pid) {
+            close(children[i].conn);
+        }
+    }
+    close(conn);
+    for (int i = 0; i < 3; ++i) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    /* payload is cwd\0argc\0argv[0]\0...argv[argc-1]\0KEY=VALUE\0... */
+    char *p = payload, *end = payload + len;
+    if (chdir(p) < 0) {
+        perror("chdir");
+        _exit(1);
+    }
+    p += strlen(p) + 1;
+
+    char *count_end;
+    long count = p < end ? strtol(p, &count_end, 10) : 0;
+    if (count <= 0 || count > 255 || *count_end) {
+        _exit(2);
+    }
+    p += strlen(p) + 1;
+
+    int argc = 0;
+    wchar_t *wargv[256];
+    while (p < end && argc < count) {
+        wargv[argc] = Py_DecodeLocale(p, NULL);
+        if (!wargv[argc]) {
+            fprintf(stderr, "unable to decode the command line argument #%i\n",
+                    argc + 1);
+            _exit(1);
+        }
+        argc += 1;
+        p += strlen(p) + 1;
+    }
+    wargv[argc] = NULL;
+    if (argc != count) {
+        _exit(2);
+    }
+
+    if (zygote_set_environ(p, end) < 0) {
+        PyErr_Print();
+        _exit(1);
+    }
+
+    int status = zygote_run_file(argc, wargv);
+    if (Py_FinalizeEx() < 0) {
+        status = 120;
+    }
+    _exit(status);
+}
+
+/* Only accepts clients running as the same user as the zygote, and
+   bounds how long the zygote waits for their request */
+static int
+zygote_check_client(int conn)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    struct timeval timeout = { 0, REQUEST_TIMEOUT_MS * 1000 };
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0
+        || cred.uid != geteuid()) {
+        return -1;
+    }
+    if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Receives '<u32 length><payload>' with the client's three standard
+   file descriptors attached to the first message */
+static int
+zygote_recv_request(int conn, int *fds, char *payload, uint32_t *len)
+{
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = { len, sizeof(*len) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(*len)) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3)) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+    if (*len == 0 || *len >= MAX_REQUEST || read_all(conn, payload, *len) < 0) {
+        for (int i = 0; i < 3; ++i) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    payload[*len] = '\0';
+    return 0;
+}
+
+static void
+zygote_reap(ZygoteChild *children)
+{
+    int wstatus;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        int32_t status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus)
+                       : 128 + WTERMSIG(wstatus);
+        for (int i = 0; i < MAX_CHILDREN; ++i) {
+            if (children[i].pid == pid) {
+                (void)write_all(children[i].conn, &status, sizeof(status));
+                close(children[i].conn);
+                children[i].pid = 0;
+                break;
+            }
+        }
+    }
+}
+
+static int
+zygote_preload(void)
+{
+    const char *s = getenv("SPYTHONZYGOTEPRELOAD");
+    char *modules = strdup(s ? s : DEFAULT_PRELOAD);
+    if (!modules) {
+        return -1;
+    }
+    for (char *tok = strtok(modules, ","); tok; tok = strtok(NULL, ",")) {
+        PyObject *mod = PyImport_ImportModule(tok);
+        if (!mod) {
+            PyErr_Print();
+            free(modules);
+            return -1;
+        }
+        Py_DECREF(mod);
+    }
+    free(modules);
+    return 0;
+}
+
+static int
+zygote_serve(const char *program, const char *socket_path)
+{
+    static ZygoteChild children[MAX_CHILDREN];
+    static char payload[MAX_REQUEST];
+    struct sockaddr_un addr;
+    PyStatus status;
+    PyConfig config;
+
+    /* initialize Python in isolated mode */
+    PyConfig_InitIsolatedConfig(&config);
+    status = PyConfig_SetBytesString(&config, &config.program_name, program);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+    status = Py_InitializeFromConfig(&config);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+    PyConfig_Clear(&config);
+
+    if (zygote_preload() < 0) {
+        return 1;
+    }
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    /* Create the socket accessible only to this user, whatever the umask */
+    mode_t umask_old = umask(0077);
+    int bound = listen_fd >= 0
+        && bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(umask_old);
+    if (!bound || chmod(socket_path, 0600) < 0 || listen(listen_fd, 64) < 0) {
+        perror(socket_path);
+        return 1;
+    }
+
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe2");
+        return 1;
+    }
+    struct sigaction sa = { 0 };
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    fprintf(stderr, "spython zygote listening on %s\n", socket_path);
+    for (;;) {
+        struct pollfd pfds[2] = {
+            { listen_fd, POLLIN, 0 },
+            { sigchld_pipe[0], POLLIN, 0 },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+        if (pfds[1].revents) {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+            zygote_reap(children);
+        }
+        if (!pfds[0].revents) {
+            continue;
+        }
+
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            continue;
+        }
+        int slot = -1;
+        for (int i = 0; i < MAX_CHILDREN; ++i) {
+            if (!children[i].pid) {
+                slot = i;
+                break;
+            }
+        }
+        int fds[3];
+        uint32_t len;
+        if (slot < 0 || zygote_check_client(conn) < 0
+            || zygote_recv_request(conn, fds, payload, &len) < 0) {
+            close(conn);
+            continue;
+        }
+
+        PyOS_BeforeFork();
+        pid_t pid = fork();
+        if (pid == 0) {
+            zygote_child(listen_fd, children, conn, fds, payload, len);
+        }
+        PyOS_AfterFork_Parent();
+
+        for (int i = 0; i < 3; ++i) {
+            close(fds[i]);
+        }
+        int32_t child_pid = (int32_t)pid;
+        if (pid < 0 || write_all(conn, &child_pid, sizeof(child_pid)) < 0) {
+            close(conn);
+            continue;
+        }
+        children[slot].pid = pid;
+        children[slot].conn = conn;
+    }
+
+  fail:
+    PyConfig_Clear(&config);
+    if (PyStatus_IsExit(status)) {
+        return status.exitcode;
+    }
+    /* Display the error message and exit the process with
+       non-zero exit code */
+    Py_ExitStatusException(status);
+}
+
+static volatile pid_t zygote_child_pid = 0;
+
+static void
+forward_signal(int signum)
+{
+    if (zygote_child_pid > 0) {
+        kill(zygote_child_pid, signum);
+    }
+}
+
+/* Client side. This does not initialize Python at all. */
+static int
+zygote_client(const char *socket_path, int argc, char **argv)
+{
+    static char payload[MAX_REQUEST];
+    struct sockaddr_un addr;
+    size_t len = 0;
+
+    if (!getcwd(payload, sizeof(payload))) {
+        perror("getcwd");
+        return 1;
+    }
+    len = strlen(payload) + 1;
+    if (argc > 255) {
+        fprintf(stderr, "too many arguments\n");
+        return 1;
+    }
+    len += (size_t)snprintf(payload + len, sizeof(payload) - len, "%d", argc) + 1;
+    for (int i = 0; i < argc; ++i) {
+        size_t n = strlen(argv[i]) + 1;
+        if (len + n >= sizeof(payload)) {
+            fprintf(stderr, "arguments too long\n");
+            return 1;
+        }
+        memcpy(payload + len, argv[i], n);
+        len += n;
+    }
+    for (char **e = environ; *e; ++e) {
+        size_t n = strlen(*e) + 1;
+        if (len + n >= sizeof(payload)) {
+            fprintf(stderr, "environment too large\n");
+            return 1;
+        }
+        memcpy(payload + len, *e, n);
+        len += n;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(socket_path);
+        return 1;
+    }
+
+    int fds[3] = { 0, 1, 2 };
+    uint32_t len32 = (uint32_t)len;
+    char cmsgbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &len32, sizeof(len32) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t pid, status;
+    if (sendmsg(fd, &msg, 0) != sizeof(len32)
+        || write_all(fd, payload, len) < 0
+        || read_all(fd, &pid, sizeof(pid)) < 0) {
+        fprintf(stderr, "zygote request failed\n");
+        return 1;
+    }
+
+    zygote_child_pid = pid;
+    signal(SIGINT, forward_signal);
+    signal(SIGTERM, forward_signal);
+    signal(SIGHUP, forward_signal);
+
+    if (read_all(fd, &status, sizeof(status)) < 0) {
+        fprintf(stderr, "lost connection to zygote\n");
+        return 1;
+    }
+    return status;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc >= 4 && strcmp(argv[1], "--zygote-run") == 0) {
+        return zygote_client(argv[2], argc - 3, &argv[3]);
+    }
+
+    PySys_AddAuditHook(startup_hook, NULL);
+    PyFile_SetOpenCodeHook(spython_open_code, NULL);
+
+    if (argc == 3 && strcmp(argv[1], "--zygote") == 0) {
+        return zygote_serve(argv[0], argv[2]);
+    }
+
+    return Py_BytesMain(argc, argv);
+}
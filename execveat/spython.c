@@ -1,4 +1,5 @@
 #include "Python.h"
+#include <stdatomic.h>
 
 static PyObject*
 spython_open_stream(const char *filename, int fd)
@@ -66,16 +67,20 @@ spython_open_code(PyObject *path, void *userData)
 static int
 execveatHook(const char *event, PyObject *args, void *userData)
 {
-    // Fast exit if we've already handled a run event
-    int *inspected = (int *)userData;
-    if (*inspected) {
+    // Fast exit if we've already handled a run event. Hooks may run on
+    // several threads at once without a GIL, so the flag is atomic and
+    // only the thread that sets it does the inspection.
+    atomic_int *inspected = (atomic_int *)userData;
+    if (atomic_load_explicit(inspected, memory_order_relaxed)) {
         return 0;
     }
 
 
     // Open the launch file and validate it
     if (strcmp(event, "cpython.run_file") == 0) {
-        *inspected = 1;
+        if (atomic_exchange(inspected, 1)) {
+            return 0;
+        }
         // We always open the launch file and let the open_code handler
         // decide whether to abort or not.
         PyObject *pathname;
@@ -93,7 +98,9 @@ execveatHook(const char *event, PyObject *args, void *userData)
 
     // Other run options depend on the global setting.
     if (strncmp(event, "cpython.run_", 12) == 0) {
-        *inspected = 1;
+        if (atomic_exchange(inspected, 1)) {
+            return 0;
+        }
         unsigned secbits = prctl(PR_GET_SECUREBITS);
         if (secbits & SECBIT_EXEC_DENY_INTERACTIVE) {
             PyErr_Format(PyExc_OSError, "'%.20s' is disabled by policy", &event[8]);
@@ -110,10 +117,10 @@ int
 main(int argc, char **argv)
 {
     unsigned secbits = prctl(PR_GET_SECUREBITS);
-    int inspected = 0;
+    static atomic_int inspected = 0;
     if (secbits & (SECBIT_EXEC_RESTRICT_FILE | SECBIT_EXEC_DENY_INTERACTIVE)) {
         // Either bit set means we need to inspect launch events
-        PySys_AddAuditHook(spython_launch_hook, &inspected);
+        PySys_AddAuditHook(execveatHook, &inspected);
     }
 
     // All open_code calls will be hooked regardless of initial settings,
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3.8
+"""Pack the files a script opens into a spython bundle
+
+Runs the script once under spython with SPYTHONPREFETCH, so spython
+records every file that passed open_code, then packs those files into
+one bundle and stores the bundle's SHA-256 in its xattr. Run the script
+with SPYTHONBUNDLE=<bundle> to serve them from the bundle. See spython.c
+for the format.
+"""
+import argparse
+import glob
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+import mkmanifest
+
+XATTR_NAME = "user.org.python.x-spython-hash"
+MAGIC = b"SPYBNDL1"
+HEADER = struct.Struct("=8sIIQQ")
+ENTRY = struct.Struct("=QQII")
+TRACE_HEADER = b"spython-prefetch 1\n"
+
+parser = argparse.ArgumentParser("mkbundle for spython")
+parser.add_argument("--spython", default="./spython")
+parser.add_argument("--output", "-o", required=True)
+parser.add_argument("--xattr-name", default=XATTR_NAME)
+parser.add_argument("--align", type=int, default=4096)
+parser.add_argument("--verbose", action="store_true")
+parser.add_argument("script")
+parser.add_argument("args", nargs=argparse.REMAINDER)
+
+
+def main():
+    args = parser.parse_args()
+    paths = trace(args)
+    files = [(path, read_verified(args, path)) for path in paths]
+    write_bundle(args, files)
+
+
+def trace(args):
+    """Returns the files that the script opened through open_code"""
+    with tempfile.TemporaryDirectory() as tmp:
+        env = dict(os.environ, SPYTHONPREFETCH=tmp)
+        env.pop("SPYTHONBUNDLE", None)
+        proc = subprocess.run([args.spython, args.script, *args.args], env=env)
+        if proc.returncode:
+            sys.exit(f"{args.script} exited with {proc.returncode}")
+        traces = glob.glob(os.path.join(tmp, "*.trace"))
+        if len(traces) != 1:
+            sys.exit(f"{args.spython} did not write a trace")
+        with open(traces[0], "rb") as f:
+            if f.readline() != TRACE_HEADER:
+                sys.exit(f"unknown trace format in {traces[0]}")
+            return [line.rstrip(b"\n") for line in f]
+
+
+# Maps a directory to (root, leaves) for the manifest that covers it, or None
+_manifest_dirs = {}
+
+
+def load_manifest(args, directory):
+    """Returns (root, leaves) for the manifest in directory, or None"""
+    path = os.path.join(directory, os.fsencode(mkmanifest.MANIFEST_NAME))
+    try:
+        with open(path, "rb") as f:
+            root_hash = os.getxattr(f.fileno(), args.xattr_name.encode("ascii"))
+            if f.readline() != mkmanifest.MANIFEST_HEADER:
+                sys.exit(f"unknown manifest format in '{os.fsdecode(path)}'")
+            leaves = {}
+            for line in f:
+                digest, _, _, rel = line.rstrip(b"\n").split(b" ", 3)
+                leaves[rel] = digest
+    except FileNotFoundError:
+        return None
+    except (OSError, ValueError) as ex:
+        sys.exit(f"cannot read manifest '{os.fsdecode(path)}': {ex}")
+    if mkmanifest.merkle_root(leaves) != root_hash:
+        sys.exit(f"'{os.fsdecode(path)}' does not match its root hash")
+    return directory, leaves
+
+
+def manifest_hash(args, path):
+    """Returns the manifest hash for path, or None if no manifest covers it.
+    Like spython, the nearest manifest above the file decides."""
+    walked = []
+    directory = os.path.dirname(path)
+    while True:
+        if directory in _manifest_dirs:
+            covering = _manifest_dirs[directory]
+            break
+        walked.append(directory)
+        covering = load_manifest(args, directory)
+        parent = os.path.dirname(directory)
+        if covering or parent == directory:
+            break
+        directory = parent
+    for d in walked:
+        _manifest_dirs[d] = covering
+    if covering is None:
+        return None
+    root, leaves = covering
+    rel = os.path.relpath(path, root)
+    if rel not in leaves:
+        sys.exit(f"'{os.fsdecode(path)}' is not in manifest "
+                 f"'{os.fsdecode(root)}/{mkmanifest.MANIFEST_NAME}'")
+    return leaves[rel]
+
+
+def read_verified(args, path):
+    """Reads a file, refusing it if it does not match its manifest or xattr"""
+    path = os.path.abspath(path)
+    expected = manifest_hash(args, path)
+    with open(path, "rb") as f:
+        data = f.read()
+        if expected is None:
+            try:
+                expected = os.getxattr(f.fileno(), args.xattr_name.encode("ascii"))
+            except OSError:
+                sys.exit(f"'{os.fsdecode(path)}' has no hash in an xattr or manifest")
+    if expected != hashlib.sha256(data).hexdigest().encode("ascii"):
+        sys.exit(f"'{os.fsdecode(path)}' changed since it was traced")
+    return data
+
+
+def align(offset, alignment):
+    return (offset + alignment - 1) // alignment * alignment
+
+
+def write_bundle(args, files):
+    files.sort()
+    strings = bytearray()
+    path_offsets = []
+    for path, _ in files:
+        path_offsets.append(len(strings))
+        strings += path + b"\0"
+
+    strings_offset = HEADER.size + ENTRY.size * len(files)
+    offset = align(strings_offset + len(strings), args.align)
+    entries = bytearray()
+    for (path, data), path_offset in zip(files, path_offsets):
+        entries += ENTRY.pack(offset, len(data), path_offset, len(path))
+        offset = align(offset + len(data), args.align)
+
+    output = os.path.abspath(args.output)
+    tmp = output + ".tmp"
+    hasher = hashlib.sha256()
+    with open(tmp, "wb") as f:
+
+        def write(block):
+            f.write(block)
+            hasher.update(block)
+
+        write(HEADER.pack(MAGIC, len(files), args.align, strings_offset, len(strings)))
+        write(entries)
+        write(strings)
+        for path, data in files:
+            write(bytes(align(f.tell(), args.align) - f.tell()))
+            if args.verbose:
+                print(f"Adding '{os.fsdecode(path)}'")
+            write(data)
+    hexdigest = hasher.hexdigest()
+    os.setxattr(tmp, args.xattr_name.encode("ascii"), hexdigest.encode("ascii"))
+    os.replace(tmp, output)
+    print(f"{output}: {len(files)} files, {os.path.getsize(output)} bytes, "
+          f"sha256 {hexdigest}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,130 @@
+#!/usr/bin/env python3.8
+"""Freeze spython-approved stdlib modules into a C header
+
+Every module listed in the modules file (and, for packages, every
+submodule) is compiled and marshalled into a static array for
+PyImport_FrozenModules. Sources must carry a valid spython hash xattr,
+which is checked here, at build time, and recorded in a sorted table of
+(name, path, sha256) entries.
+
+Must be run with the same Python version spython is built against.
+"""
+import argparse
+import hashlib
+import importlib.util
+import marshal
+import os
+import pkgutil
+import sys
+
+XATTR_NAME = "user.org.python.x-spython-hash"
+
+parser = argparse.ArgumentParser("mkfrozen for spython")
+parser.add_argument("--modules", default="frozen_modules.txt")
+parser.add_argument("--output", default="frozen_modules.h")
+parser.add_argument("--xattr-name", default=XATTR_NAME)
+parser.add_argument("--hash", default="sha256")
+parser.add_argument("--no-verify", action="store_true",
+                    help="do not require a matching xattr on each source")
+parser.add_argument("--verbose", action="store_true")
+
+
+def main():
+    args = parser.parse_args()
+    names = read_module_list(args.modules)
+    modules = {}
+    for name in names:
+        collect(name, modules)
+    for name in sorted(modules):
+        if args.verbose:
+            print(f"Freezing {name} from {modules[name][0]}")
+    write_header(args, modules)
+
+
+def read_module_list(path):
+    names = []
+    with open(path) as f:
+        for line in f:
+            line = line.partition("#")[0].strip()
+            if line:
+                names.append(line)
+    return names
+
+
+def collect(name, modules):
+    """Adds the module, and all submodules of packages, to modules."""
+    if name in modules:
+        return
+    if name in sys.builtin_module_names:
+        sys.exit(f"{name} is built in and does not need freezing")
+    spec = importlib.util.find_spec(name)
+    if spec is None or not spec.has_location or not spec.origin.endswith(".py"):
+        sys.exit(f"{name} is not a pure Python module")
+    is_package = spec.submodule_search_locations is not None
+    modules[name] = (spec.origin, is_package)
+    if is_package:
+        # Frozen packages get a meaningless __path__, so every submodule
+        # has to be frozen too
+        for info in pkgutil.iter_modules(spec.submodule_search_locations):
+            collect(f"{name}.{info.name}", modules)
+
+
+def read_verified(args, path):
+    with open(path, "rb") as f:
+        data = f.read()
+        digest = hashlib.new(args.hash, data).hexdigest()
+        if not args.no_verify:
+            try:
+                value = os.getxattr(f.fileno(), args.xattr_name).decode("ascii")
+            except OSError:
+                sys.exit(f"{path} has no xattr {args.xattr_name}")
+            if value != digest:
+                sys.exit(f"File hash mismatch: {path} (expected: {value!r}, got {digest!r})")
+    return data, digest
+
+
+def c_array(name, data):
+    lines = [f"static const unsigned char {name}[] = {{"]
+    for i in range(0, len(data), 16):
+        lines.append("    " + ",".join(str(b) for b in data[i:i + 16]) + ",")
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def c_string(s):
+    return '"' + s.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+def write_header(args, modules):
+    out = [
+        "/* Generated by mkfrozen.py - do not edit */",
+        f"/* Python {sys.version.split()[0]} */",
+        "",
+    ]
+    frozen, hashes = [], []
+    for i, name in enumerate(sorted(modules)):
+        path, is_package = modules[name]
+        source, digest = read_verified(args, path)
+        code = marshal.dumps(compile(source, path, "exec", dont_inherit=True))
+        out.append(c_array(f"spython_frozen_code_{i}", code))
+        size = -len(code) if is_package else len(code)
+        frozen.append(f"    {{{c_string(name)}, spython_frozen_code_{i}, {size}}},")
+        hashes.append(f"    {{{c_string(name)}, {c_string(path)}, {c_string(digest)}}},")
+
+    out.append("")
+    out.append("static const struct _frozen spython_frozen_modules[] = {")
+    out.extend(frozen)
+    out.append("    {0, 0, 0}")
+    out.append("};")
+    out.append("")
+    out.append("/* sorted by name */")
+    out.append("static const SpythonFrozenHash spython_frozen_hashes[] = {")
+    out.extend(hashes)
+    out.append("};")
+    out.append("")
+    with open(args.output, "w") as f:
+        f.write("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3.8
+"""Write a spython directory manifest
+
+Lists every file below a directory with its SHA-256 hash in
+'.spython-manifest' and stores the Merkle root of the tree in the
+manifest's xattr. When a manifest already exists, files whose size and
+mtime are unchanged keep their hash, so updating a package only rehashes
+the files that changed. See spython.c for the format.
+"""
+import argparse
+import hashlib
+import os
+
+XATTR_NAME = "user.org.python.x-spython-hash"
+MANIFEST_NAME = ".spython-manifest"
+MANIFEST_HEADER = b"spython-manifest 1\n"
+
+parser = argparse.ArgumentParser("mkmanifest for spython")
+parser.add_argument("directory", nargs="+")
+parser.add_argument("--xattr-name", default=XATTR_NAME)
+parser.add_argument("--rehash", action="store_true",
+                    help="hash every file, even when it looks unchanged")
+parser.add_argument("--verbose", action="store_true")
+
+
+def main():
+    args = parser.parse_args()
+    for directory in args.directory:
+        write_manifest(args, os.fsencode(os.path.abspath(directory)))
+
+
+def read_manifest(path):
+    """Returns {relpath: (hash, size, mtime_ns)} from an existing manifest"""
+    entries = {}
+    try:
+        with open(path, "rb") as f:
+            if f.readline() != MANIFEST_HEADER:
+                return entries
+            for line in f:
+                digest, size, mtime, rel = line.rstrip(b"\n").split(b" ", 3)
+                entries[rel] = (digest, int(size), int(mtime))
+    except (OSError, ValueError):
+        pass
+    return entries
+
+
+def hash_file(path):
+    hasher = hashlib.sha256()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(1 << 20), b""):
+            hasher.update(block)
+    return hasher.hexdigest().encode("ascii")
+
+
+def sort_key(rel):
+    # '/' sorts before every other character, so a directory's files
+    # stay together
+    return rel.split(b"/")
+
+
+def merkle_root(leaves):
+    """Hashes the tree of {relpath: hash}, one node per directory"""
+    tree = {}
+    for rel, digest in leaves.items():
+        *dirs, name = rel.split(b"/")
+        node = tree
+        for d in dirs:
+            node = node.setdefault(d, {})
+        node[name] = digest
+
+    def node_hash(node):
+        hasher = hashlib.sha256()
+        for name in sorted(node):
+            child = node[name]
+            if isinstance(child, dict):
+                hasher.update(b"d " + node_hash(child) + b" " + name + b"\n")
+            else:
+                hasher.update(b"f " + child + b" " + name + b"\n")
+        return hasher.hexdigest().encode("ascii")
+
+    return node_hash(tree)
+
+
+def write_manifest(args, root):
+    manifest = os.path.join(root, os.fsencode(MANIFEST_NAME))
+    previous = {} if args.rehash else read_manifest(manifest)
+    entries = {}
+    rehashed = 0
+    for dirpath, dirs, files in os.walk(root):
+        dirs.sort()
+        for name in files:
+            path = os.path.join(dirpath, name)
+            if path == manifest or not os.path.isfile(path) or os.path.islink(path):
+                continue
+            rel = os.path.relpath(path, root)
+            st = os.stat(path)
+            old = previous.get(rel)
+            if old and old[1] == st.st_size and old[2] == st.st_mtime_ns:
+                digest = old[0]
+            else:
+                digest = hash_file(path)
+                rehashed += 1
+                if args.verbose:
+                    print(f"Hashing '{os.fsdecode(path)}'")
+            entries[rel] = (digest, st.st_size, st.st_mtime_ns)
+
+    tmp = manifest + b".tmp"
+    with open(tmp, "wb") as f:
+        f.write(MANIFEST_HEADER)
+        for rel in sorted(entries, key=sort_key):
+            digest, size, mtime = entries[rel]
+            f.write(b"%s %d %d %s\n" % (digest, size, mtime, rel))
+    root_hash = merkle_root({rel: e[0] for rel, e in entries.items()})
+    os.setxattr(tmp, args.xattr_name.encode("ascii"), root_hash)
+    os.replace(tmp, manifest)
+    print(f"{os.fsdecode(manifest)}: {len(entries)} files, {rehashed} hashed, "
+          f"root {root_hash.decode()}")
+
+
+if __name__ == "__main__":
+    main()
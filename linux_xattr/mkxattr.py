@@ -25,7 +25,7 @@ def setxattr(args):
     xattr_name = args.xattr_name.encode("ascii")
     for root, dirs, files in os.walk(args.basedir, topdown=True):
         for filename in sorted(files):
-            if not filename.endswith((".py", ".pyc")):
+            if not filename.endswith((".py", ".pyc", ".zip", ".pyz", ".so")):
                 continue
             filename = os.path.join(root, filename)
             hasher = hashlib.new(args.hash)
@@ -42,8 +42,9 @@ def setxattr(args):
                             print(f"Adding spython hash to '{filename}'")
                         else:
                             print(f"Updating spython hash of '{filename}'")
-                    # it's likely that the pyc file is also out of sync
-                    compileall.compile_file(filename, quiet=2)
+                    if filename.endswith((".py", ".pyc")):
+                        # it's likely that the pyc file is also out of sync
+                        compileall.compile_file(filename, quiet=2)
                     os.setxattr(filename, xattr_name, hexdigest)
 
 
@@ -8,12 +8,19 @@
 #include "pystrhex.h"
 
 /* xattr, stat */
+#include <dlfcn.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/xattr.h>
 
+/* bundles */
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
 /* seccomp */
 #include <sys/prctl.h>
 #include <seccomp.h>
@@ -24,11 +31,38 @@
 /* logging */
 #include <syslog.h>
 
+/* prefetching */
+#include <pthread.h>
+#include <stdatomic.h>
+
 // 2 MB
 #define MAX_PY_FILE_SIZE (2*1024*1024)
+// 256 MB
+#define MAX_ARCHIVE_SIZE (256*1024*1024)
 
 #define XATTR_NAME "user.org.python.x-spython-hash"
 #define XATTR_LENGTH ((EVP_MAX_MD_SIZE * 2) + 1)
+#define SHA256_HEX_LENGTH 64
+
+/* Modules frozen into the binary by mkfrozen.py. They are served by the
+ * frozen importer from read-only memory, without open_code. Their
+ * sources were checked against the xattr hash when the header was
+ * generated, and the hashes are kept here for the audit trail.
+ */
+typedef struct {
+    const char *name;
+    const char *path;
+    const char *sha256;
+} SpythonFrozenHash;
+
+#ifdef SPYTHON_FROZEN
+#include "frozen_modules.h"
+#else
+static const struct _frozen spython_frozen_modules[] = { {0, 0, 0} };
+static const SpythonFrozenHash spython_frozen_hashes[] = { {0, 0, 0} };
+#endif
+
+#define FROZEN_HASH_COUNT (Py_ARRAY_LENGTH(spython_frozen_modules) - 1)
 
 /* Block setxattr syscalls
  */
@@ -80,9 +114,31 @@ spython_seccomp_setxattr(int kill) {
     return rc;
 }
 
+/* zipimport opens an archive through open_code to read its directory,
+ * and again for every member it loads. Zip and pyz archives are read and
+ * verified once, and later opens are served from the verified copy, so
+ * loading N modules from one archive costs one hash instead of N.
+ *
+ * The cache maps (st_dev, st_ino) to ((st_size, st_mtime, st_ctime), data).
+ * A replaced archive has a new inode, and writing to the file or its
+ * xattr changes mtime or ctime, so either is verified again. The data is
+ * a private copy rather than a mapping of the file, because a mapping
+ * would show later writes to the file.
+ */
+static PyObject *spython_archives = NULL;
+
+static int
+spython_is_archive(const char *filename)
+{
+    size_t len = strlen(filename);
+    return len > 4 && (strcmp(filename + len - 4, ".zip") == 0 ||
+                       strcmp(filename + len - 4, ".pyz") == 0);
+}
+
 /* very file properties */
 static int
-spython_check_file(const char *filename, int fd)
+spython_check_file(const char *filename, int fd, off_t max_size,
+                   struct stat *sb_out)
 {
     struct stat sb;
     struct statvfs sbvfs;
@@ -100,7 +156,7 @@ spython_check_file(const char *filename, int fd)
     }
 
     /* limit file size */
-    if (sb.st_size > MAX_PY_FILE_SIZE) {
+    if (sb.st_size > max_size) {
         errno = EFBIG;
         PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
         return -1;
@@ -116,6 +172,7 @@ spython_check_file(const char *filename, int fd)
         PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
         return -1;
     }
+    *sb_out = sb;
     return 0;
 }
 
@@ -173,138 +230,1633 @@ spython_fgetxattr(const char *filename, int fd)
     return PyUnicode_DecodeASCII(buf, size, "strict");
 }
 
+/* Directory manifests
+ *
+ * Stamping every file in a large site-packages is slow to create and to
+ * update, so a tree can instead carry one manifest, MANIFEST_NAME at its
+ * root, usually one per installed distribution. It lists a leaf for
+ * every file below it, sorted by path with '/' ordered before any other
+ * character:
+ *
+ *     spython-manifest 1
+ *     <sha256> <size> <mtime_ns> <relative path>
+ *
+ * The leaves form a Merkle tree. Each directory hashes the lines
+ * "f <sha256> <name>\n" for its files and "d <sha256> <name>\n" for its
+ * subdirectories, in the same order, and the xattr of the manifest holds
+ * the hash of the root directory. Size and mtime are only hints for
+ * mkmanifest.py and are not covered by the hash.
+ *
+ * The first open below a directory loads the manifest that covers it and
+ * checks the root hash once for the process. Each file is then hashed
+ * lazily, when it is opened, and compared with its leaf. Files below a
+ * manifest that are not listed in it are refused. Directories are mapped
+ * to the manifest covering them, or None, so later opens need one dict
+ * lookup.
+ */
+#define MANIFEST_NAME ".spython-manifest"
+#define MANIFEST_HEADER "spython-manifest 1\n"
+#define MANIFEST_MAX_DEPTH 64
+// 64 MB
+#define MAX_MANIFEST_SIZE (64*1024*1024)
+
+/* Maps a directory to (root, leaves) for the manifest that covers it,
+   where leaves maps relative paths to hashes, or to None */
+static PyObject *spython_manifest_dirs = NULL;
+
+typedef struct {
+    EVP_MD_CTX *ctx;
+    const char *name;
+    size_t name_len;
+} SpythonManifestDir;
+
+/* Compares paths with '/' before every other character, so that the
+   contents of a directory sort together and right after its name */
+static int
+spython_manifest_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    size_t n = alen < blen ? alen : blen;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char ca = a[i] == '/' ? 0 : (unsigned char)a[i];
+        unsigned char cb = b[i] == '/' ? 0 : (unsigned char)b[i];
+        if (ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+    }
+    return alen < blen ? -1 : alen > blen;
+}
+
+static int
+spython_manifest_feed(SpythonManifestDir *dir, char type, const char *hexdigest,
+                      const char *name, size_t name_len)
+{
+    char prefix[SHA256_HEX_LENGTH + 4];
+    snprintf(prefix, sizeof(prefix), "%c %s ", type, hexdigest);
+    return EVP_DigestUpdate(dir->ctx, prefix, strlen(prefix)) &&
+        EVP_DigestUpdate(dir->ctx, name, name_len) &&
+        EVP_DigestUpdate(dir->ctx, "\n", 1);
+}
+
+static int
+spython_manifest_finish(SpythonManifestDir *dir, char *hexdigest)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    int ok = EVP_DigestFinal_ex(dir->ctx, digest, &digest_size);
+    EVP_MD_CTX_free(dir->ctx);
+    dir->ctx = NULL;
+    for (unsigned int i = 0; ok && i < digest_size; i++) {
+        sprintf(hexdigest + i * 2, "%02x", digest[i]);
+    }
+    return ok;
+}
+
+static int
+spython_manifest_push(SpythonManifestDir *dir, const char *name, size_t name_len)
+{
+    dir->name = name;
+    dir->name_len = name_len;
+    dir->ctx = EVP_MD_CTX_new();
+    return dir->ctx != NULL && EVP_DigestInit(dir->ctx, EVP_sha256());
+}
+
+/* Parses data, fills leaves and computes the root hash into hexdigest.
+   Returns -1 with an exception set if the manifest is malformed. */
+static int
+spython_manifest_parse(const char *path, const char *data, size_t size,
+                       PyObject *leaves, char *hexdigest)
+{
+    SpythonManifestDir stack[MANIFEST_MAX_DEPTH + 1];
+    char child[SHA256_HEX_LENGTH + 1];
+    int depth = 0;
+    const char *prev = NULL;
+    size_t prev_len = 0;
+    const char *p = data + strlen(MANIFEST_HEADER);
+    const char *end = data + size;
+    int rc = -1;
+
+    memset(stack, 0, sizeof(stack));
+    if (size < strlen(MANIFEST_HEADER) ||
+        memcmp(data, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0) {
+        goto malformed;
+    }
+    if (!spython_manifest_push(&stack[0], "", 0)) {
+        goto failed;
+    }
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (eol == NULL) {
+            goto malformed;
+        }
+        /* <sha256> <size> <mtime_ns> <path> */
+        const char *hash = p;
+        const char *q = p + SHA256_HEX_LENGTH;
+        if (eol - p < SHA256_HEX_LENGTH + 6 || *q != ' ' ||
+            strspn(hash, "0123456789abcdef") < SHA256_HEX_LENGTH) {
+            goto malformed;
+        }
+        for (int field = 0; field < 2; field++) {
+            q++;
+            size_t digits = strspn(q, "0123456789");
+            if (!digits || q + digits >= eol || q[digits] != ' ') {
+                goto malformed;
+            }
+            q += digits;
+        }
+        const char *rel = q + 1;
+        size_t rel_len = (size_t)(eol - rel);
+        if (!rel_len || (prev && spython_manifest_cmp(prev, prev_len, rel, rel_len) >= 0)) {
+            goto malformed;
+        }
+        prev = rel;
+        prev_len = rel_len;
+
+        /* Split rel into its directories and file name */
+        const char *names[MANIFEST_MAX_DEPTH + 1];
+        size_t lens[MANIFEST_MAX_DEPTH + 1];
+        int count = 0;
+        const char *s = rel;
+        for (;;) {
+            const char *slash = memchr(s, '/', (size_t)(eol - s));
+            size_t len = slash ? (size_t)(slash - s) : (size_t)(eol - s);
+            if (!len || count > MANIFEST_MAX_DEPTH ||
+                (len == 1 && s[0] == '.') || (len == 2 && s[0] == '.' && s[1] == '.')) {
+                goto malformed;
+            }
+            names[count] = s;
+            lens[count++] = len;
+            if (!slash) {
+                break;
+            }
+            s = slash + 1;
+        }
+
+        /* Finish the directories this path is not in, deepest first */
+        int common = 0;
+        while (common < depth && common < count - 1 &&
+               stack[common + 1].name_len == lens[common] &&
+               memcmp(stack[common + 1].name, names[common], lens[common]) == 0) {
+            common++;
+        }
+        while (depth > common) {
+            if (!spython_manifest_finish(&stack[depth], child) ||
+                !spython_manifest_feed(&stack[depth - 1], 'd', child,
+                                       stack[depth].name, stack[depth].name_len)) {
+                goto failed;
+            }
+            depth--;
+        }
+        while (depth < count - 1) {
+            depth++;
+            if (!spython_manifest_push(&stack[depth], names[depth - 1], lens[depth - 1])) {
+                goto failed;
+            }
+        }
+
+        memcpy(child, hash, SHA256_HEX_LENGTH);
+        child[SHA256_HEX_LENGTH] = '\0';
+        if (!spython_manifest_feed(&stack[depth], 'f', child,
+                                   names[count - 1], lens[count - 1])) {
+            goto failed;
+        }
+
+        PyObject *key = PyBytes_FromStringAndSize(rel, (Py_ssize_t)rel_len);
+        PyObject *value = PyUnicode_FromStringAndSize(hash, SHA256_HEX_LENGTH);
+        int r = (key && value) ? PyDict_SetItem(leaves, key, value) : -1;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        if (r < 0) {
+            goto end;
+        }
+        p = eol + 1;
+    }
+
+    while (depth > 0) {
+        if (!spython_manifest_finish(&stack[depth], child) ||
+            !spython_manifest_feed(&stack[depth - 1], 'd', child,
+                                   stack[depth].name, stack[depth].name_len)) {
+            goto failed;
+        }
+        depth--;
+    }
+    if (!spython_manifest_finish(&stack[0], hexdigest)) {
+        goto failed;
+    }
+    rc = 0;
+    goto end;
+
+  malformed:
+    PyErr_Format(PyExc_ValueError, "Malformed manifest: %s", path);
+    goto end;
+  failed:
+    PyErr_SetString(PyExc_ValueError, "EVP SHA-256 failed");
+  end:
+    for (int i = 0; i <= MANIFEST_MAX_DEPTH; i++) {
+        EVP_MD_CTX_free(stack[i].ctx);
+    }
+    return rc;
+}
 
+/* Loads and verifies the manifest in dir. Returns (root, leaves), None
+   when dir has no manifest, or NULL with an exception set. */
 static PyObject*
-spython_open_stream(const char *filename, int fd)
+spython_manifest_load(const char *dir, size_t dir_len)
 {
-    PyObject *stream = NULL;
-    PyObject *iomod = NULL;
-    PyObject *fileio = NULL;
-    PyObject *buffer = NULL;
-    PyObject *res = NULL;
-    PyObject *file_hash = NULL;
-    PyObject *xattr_hash = NULL;
-    int cmp;
+    char xattr[XATTR_LENGTH];
+    char root_hash[EVP_MAX_MD_SIZE * 2 + 1];
+    char *data = NULL;
+    PyObject *leaves = NULL;
+    PyObject *result = NULL;
+    struct stat sb;
+    ssize_t size;
 
-    if (spython_check_file(filename, fd) != 0) {
-        goto end;
+    size_t path_len = dir_len + sizeof("/" MANIFEST_NAME);
+    char *path = (char *)PyMem_Malloc(path_len);
+    if (path == NULL) {
+        return PyErr_NoMemory();
     }
+    snprintf(path, path_len, "%.*s/%s", (int)dir_len, dir, MANIFEST_NAME);
 
-    if ((iomod = PyImport_ImportModule("_io")) == NULL) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            result = Py_None;
+            Py_INCREF(result);
+        } else {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        }
         goto end;
     }
-
-    /* read file with _io module */
-    fileio = PyObject_CallMethod(iomod, "FileIO", "isi", fd, "r", 0);
-    if (fileio == NULL) {
+    if (spython_check_file(path, fd, MAX_MANIFEST_SIZE, &sb) != 0) {
         goto end;
     }
-    buffer = PyObject_CallMethod(fileio, "readall", NULL);
-    res = PyObject_CallMethod(fileio, "close", NULL);
-    if ((buffer == NULL) || (res == NULL)) {
+    size = fgetxattr(fd, XATTR_NAME, (void*)xattr, sizeof(xattr) - 1);
+    if (size == -1) {
+        PyErr_Format(PyExc_OSError, "File %s has no xattr %s.", path, XATTR_NAME);
         goto end;
     }
+    xattr[size] = '\0';
 
-    if ((file_hash = spython_hash_bytes(filename, buffer)) == NULL) {
+    if ((data = (char *)PyMem_Malloc((size_t)sb.st_size + 1)) == NULL) {
+        PyErr_NoMemory();
         goto end;
     }
-    if ((xattr_hash = spython_fgetxattr(filename, fd)) == NULL) {
+    size_t total = 0;
+    while (total < (size_t)sb.st_size) {
+        ssize_t n = read(fd, data + total, (size_t)sb.st_size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            goto end;
+        }
+        total += (size_t)n;
+    }
+    data[total] = '\0';
+
+    if ((leaves = PyDict_New()) == NULL ||
+        spython_manifest_parse(path, data, total, leaves, root_hash) < 0) {
         goto end;
     }
-    cmp = PyObject_RichCompareBool(file_hash, xattr_hash, Py_EQ);
-    switch(cmp) {
-      case 1:
-        stream = PyObject_CallMethod(iomod, "BytesIO", "O", buffer);
-        break;
-      case 0:
+    if (strcmp(root_hash, xattr) != 0) {
         PyErr_Format(PyExc_ValueError,
-                     "File hash mismatch: %s (expected: %R, got %R)",
-                      filename, xattr_hash, file_hash);
-        goto end;
-      default:
+                     "Manifest hash mismatch: %s (expected: '%s', got '%s')",
+                     path, xattr, root_hash);
         goto end;
     }
+    result = Py_BuildValue("(y#O)", dir, (Py_ssize_t)dir_len, leaves);
 
   end:
-    Py_XDECREF(buffer);
-    Py_XDECREF(iomod);
-    Py_XDECREF(fileio);
-    Py_XDECREF(res);
-    Py_XDECREF(file_hash);
-    Py_XDECREF(xattr_hash);
-    return stream;
+    if (fd >= 0) {
+        close(fd);
+    }
+    PyMem_Free(path);
+    PyMem_Free(data);
+    Py_XDECREF(leaves);
+    return result;
 }
 
+/* Returns the manifest hash for filename, None if no manifest covers it,
+   or NULL with an exception set */
 static PyObject*
-spython_open_code(PyObject *path, void *userData)
+spython_manifest_hash(const char *filename)
 {
-    PyObject *filename_obj = NULL;
-    const char *filename;
-    int fd = -1;
-    PyObject *stream = NULL;
+    PyObject *walked = NULL;
+    PyObject *covering = NULL;
+    PyObject *result = NULL;
+    size_t len = strlen(filename);
 
-    if (PySys_Audit("spython.open_code", "O", path) < 0) {
-        goto end;
+    if (filename[0] != '/') {
+        Py_RETURN_NONE;
+    }
+    if (spython_manifest_dirs == NULL &&
+        (spython_manifest_dirs = PyDict_New()) == NULL) {
+        return NULL;
+    }
+    if ((walked = PyList_New(0)) == NULL) {
+        return NULL;
     }
 
-    if (!PyUnicode_FSConverter(path, &filename_obj)) {
-        goto end;
+    /* Find the nearest directory that is known or has a manifest */
+    while (len > 0) {
+        while (len > 0 && filename[len - 1] != '/') {
+            len--;
+        }
+        if (len == 0) {
+            break;
+        }
+        len--;
+        PyObject *key = PyBytes_FromStringAndSize(filename, (Py_ssize_t)len);
+        if (key == NULL) {
+            goto end;
+        }
+        covering = PyDict_GetItemWithError(spython_manifest_dirs, key);
+        if (covering != NULL) {
+            Py_INCREF(covering);
+            Py_DECREF(key);
+            break;
+        }
+        if (PyErr_Occurred() ||
+            (covering = spython_manifest_load(len ? filename : "", len)) == NULL) {
+            Py_DECREF(key);
+            goto end;
+        }
+        int r = PyList_Append(walked, key);
+        Py_DECREF(key);
+        if (r < 0) {
+            goto end;
+        }
+        if (covering != Py_None) {
+            break;
+        }
+        Py_CLEAR(covering);
+    }
+    if (covering == NULL) {
+        covering = Py_None;
+        Py_INCREF(covering);
+    }
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(walked); i++) {
+        if (PyDict_SetItem(spython_manifest_dirs, PyList_GET_ITEM(walked, i), covering) < 0) {
+            goto end;
+        }
     }
-    filename = PyBytes_AS_STRING(filename_obj);
 
-    fd = _Py_open(filename, O_RDONLY);
-    if (fd < 0) {
+    if (covering == Py_None) {
+        result = covering;
+        Py_INCREF(result);
         goto end;
     }
-
-    stream = spython_open_stream(filename, fd);
-    if (stream == NULL) {
-        syslog(LOG_CRIT, "spython failed to verify file %s.", filename);
+    Py_ssize_t root_len = PyBytes_GET_SIZE(PyTuple_GET_ITEM(covering, 0));
+    PyObject *rel = PyBytes_FromString(filename + root_len + 1);
+    if (rel == NULL) {
+        goto end;
+    }
+    result = PyDict_GetItemWithError(PyTuple_GET_ITEM(covering, 1), rel);
+    Py_DECREF(rel);
+    if (result != NULL) {
+        Py_INCREF(result);
+    } else if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_OSError, "File %s is not in manifest %s/%s.",
+                     filename, PyBytes_AS_STRING(PyTuple_GET_ITEM(covering, 0)),
+                     MANIFEST_NAME);
     }
 
   end:
-    Py_XDECREF(filename_obj);
-    if (fd >= 0) {
-        close(fd);
+    Py_XDECREF(walked);
+    Py_XDECREF(covering);
+    return result;
+}
+
+/* The expected hash of a file, from its manifest or else its xattr */
+static PyObject*
+spython_expected_hash(const char *filename, int fd)
+{
+    PyObject *hash = spython_manifest_hash(filename);
+    if (hash != Py_None) {
+        return hash;
     }
-    return stream;
+    Py_DECREF(hash);
+    return spython_fgetxattr(filename, fd);
 }
 
-int
-main(int argc, char **argv)
+
+/* hash everything read from fd into hexdigest, using buf for the reads.
+ * Returns -1 with errno set if reading fails, or -2 if OpenSSL fails.
+ * Sets no Python exception; spython_hash_fd() raises one.
+ */
+static int
+spython_sha256_fd(int fd, char *buf, size_t buf_size, char *hexdigest)
 {
-    PyStatus status;
-    PyConfig config;
+    EVP_MD_CTX *ctx = NULL;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    ssize_t n;
+    int rc = -2;
 
-    /* block syscalls */
-    if (spython_seccomp_setxattr(0) < 0) {
-        exit(1);
+    if ((ctx = EVP_MD_CTX_new()) == NULL || !EVP_DigestInit(ctx, EVP_sha256())) {
+        goto end;
+    }
+    for (;;) {
+        n = read(fd, buf, buf_size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            rc = -1;
+            goto end;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (!EVP_DigestUpdate(ctx, (const void*)buf, (size_t)n)) {
+            goto end;
+        }
+    }
+    if (!EVP_DigestFinal_ex(ctx, digest, &digest_size)) {
+        goto end;
     }
+    for (unsigned int i = 0; i < digest_size; i++) {
+        sprintf(hexdigest + i * 2, "%02x", digest[i]);
+    }
+    rc = 0;
 
-    /* configure syslog */
-    openlog(NULL, LOG_CONS | LOG_PERROR | LOG_PID, LOG_USER);
+  end:
+    EVP_MD_CTX_free(ctx);
+    return rc;
+}
 
-    /* initialize Python in isolated mode, but allow argv */
-    status = PyConfig_InitIsolatedConfig(&config);
-    if (PyStatus_Exception(status)) {
+/* Startup prefetching
+ *
+ * On a cold page cache, startup is dominated by reading hundreds of small
+ * files one at a time, as the importer asks for them. With
+ * SPYTHONPREFETCH=<dir>, spython records the files that passed open_code,
+ * in order, in '<dir>/<key>.trace', where key is the SHA-256 of the real
+ * path of the script (or of 'module:<name>' for -m). On later runs of the
+ * same script, PREFETCH_THREADS threads open the recorded files and have
+ * the kernel read them with posix_fadvise(WILLNEED) while the interpreter
+ * initializes.
+ *
+ * With SPYTHONPREFETCHVERIFY=1, the threads instead read each source file
+ * into memory and hash those bytes. When open_code is asked for a file
+ * with the same device, inode, size, mtime and ctime, it compares that
+ * hash with the xattr or manifest and, if they match, returns exactly the
+ * bytes that were hashed. Otherwise it reads and hashes the file again, so
+ * bytes that were not hashed are never returned. At most
+ * PREFETCH_MAX_BYTES are held at a time.
+ *
+ * The trace is only a hint: a missing, stale or edited trace costs time,
+ * never a verification. It is rewritten when a run opens different files.
+ */
+#define PREFETCH_THREADS 4
+#define MAX_PREFETCH_FILES 4096
+#define PREFETCH_HEADER "spython-prefetch 1\n"
+// 64 MB
+#define PREFETCH_MAX_BYTES (64*1024*1024)
+
+typedef struct {
+    char *path;
+    /* Written by a prefetch thread before it sets state to 1 */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    char *data;
+    size_t data_size;
+    /* SHA-256 of data */
+    char sha256[SHA256_HEX_LENGTH + 1];
+    /* 0 while pending, 1 when read and hashed, -1 when not, 2 when used */
+    atomic_int state;
+} SpythonPrefetch;
+
+static SpythonPrefetch *spython_prefetch = NULL;
+static size_t spython_prefetch_count = 0;
+static atomic_size_t spython_prefetch_next;
+static int spython_prefetch_verify = 0;
+/* Bytes held in SpythonPrefetch.data */
+static atomic_size_t spython_prefetch_bytes;
+/* Where the first prefetched file not used yet is likely to be */
+static size_t spython_prefetch_cursor = 0;
+
+static char *spython_trace_path = NULL;
+/* The files this run opened, in order */
+static char *spython_trace[MAX_PREFETCH_FILES];
+static size_t spython_trace_count = 0;
+/* Open addressing set of the files in spython_trace, as index + 1 */
+#define TRACE_SET_SIZE (MAX_PREFETCH_FILES * 2)
+static uint16_t spython_trace_set[TRACE_SET_SIZE];
+
+/* Reads the size bytes of fd into p->data and hashes them */
+static int
+spython_prefetch_read(int fd, size_t size, SpythonPrefetch *p)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    size_t pos = 0;
+    ssize_t n;
+    char extra;
+
+    if (atomic_fetch_add(&spython_prefetch_bytes, size) + size > PREFETCH_MAX_BYTES) {
+        goto fail;
+    }
+    if ((p->data = (char *)malloc(size ? size : 1)) == NULL) {
+        goto fail;
+    }
+    while (pos < size) {
+        n = read(fd, p->data + pos, size - pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            goto fail;
+        }
+        pos += (size_t)n;
+    }
+    /* the file grew since fstat */
+    while ((n = read(fd, &extra, 1)) < 0 && errno == EINTR) {
+    }
+    if (n != 0 ||
+        !EVP_Digest(p->data, size, digest, &digest_size, EVP_sha256(), NULL)) {
         goto fail;
     }
+    for (unsigned int i = 0; i < digest_size; i++) {
+        sprintf(p->sha256 + i * 2, "%02x", digest[i]);
+    }
+    p->data_size = size;
+    return 0;
 
-    /* install hooks */
-    PyFile_SetOpenCodeHook(spython_open_code, NULL);
+  fail:
+    free(p->data);
+    p->data = NULL;
+    atomic_fetch_sub(&spython_prefetch_bytes, size);
+    return -1;
+}
 
-    /* handle and parse argv */
-    config.parse_argv = 1;
-    status = PyConfig_SetBytesArgv(&config, argc, argv);
-    if (PyStatus_Exception(status)) {
-        goto fail;
+static void *
+spython_prefetch_thread(void *arg)
+{
+    struct stat sb;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&spython_prefetch_next, 1);
+        if (i >= spython_prefetch_count) {
+            break;
+        }
+        SpythonPrefetch *p = &spython_prefetch[i];
+        int state = -1;
+        int fd = open(p->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            atomic_store(&p->state, state);
+            continue;
+        }
+        if (!spython_prefetch_verify) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        } else if (!spython_is_archive(p->path) &&
+                   fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+                   sb.st_size <= MAX_PY_FILE_SIZE &&
+                   spython_prefetch_read(fd, (size_t)sb.st_size, p) == 0) {
+            p->dev = sb.st_dev;
+            p->ino = sb.st_ino;
+            p->size = sb.st_size;
+            p->mtime = sb.st_mtim;
+            p->ctime = sb.st_ctim;
+            state = 1;
+        }
+        close(fd);
+        atomic_store_explicit(&p->state, state, memory_order_release);
     }
+    return NULL;
+}
 
-    /* perform remaining initialization */
-    status = PyConfig_Read(&config);
-    if (PyStatus_Exception(status)) {
-        goto fail;
+/* Chooses the trace for the script in config and starts prefetching the
+   files it lists. Failures only disable prefetching. */
+static void
+spython_prefetch_start(const PyConfig *config)
+{
+    const char *dir = getenv("SPYTHONPREFETCH");
+    char *key = NULL;
+    char hexdigest[SHA256_HEX_LENGTH + 1];
+    char line[PATH_MAX + 2];
+
+    if (dir == NULL || !*dir) {
+        return;
+    }
+    spython_prefetch_verify = getenv("SPYTHONPREFETCHVERIFY") != NULL;
+
+    if (config->run_filename != NULL) {
+        char *encoded = Py_EncodeLocale(config->run_filename, NULL);
+        if (encoded != NULL) {
+            key = realpath(encoded, NULL);
+            PyMem_Free(encoded);
+        }
+    } else if (config->run_module != NULL) {
+        char *encoded = Py_EncodeLocale(config->run_module, NULL);
+        if (encoded != NULL) {
+            size_t len = strlen(encoded) + sizeof("module:");
+            if ((key = (char *)malloc(len)) != NULL) {
+                snprintf(key, len, "module:%s", encoded);
+            }
+            PyMem_Free(encoded);
+        }
+    }
+    if (key == NULL) {
+        return;
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+    int ok = EVP_Digest(key, strlen(key), digest, &digest_size, EVP_sha256(), NULL);
+    free(key);
+    if (!ok) {
+        return;
+    }
+    for (unsigned int i = 0; i < digest_size; i++) {
+        sprintf(hexdigest + i * 2, "%02x", digest[i]);
+    }
+    size_t len = strlen(dir) + SHA256_HEX_LENGTH + sizeof("/.trace");
+    if ((spython_trace_path = (char *)malloc(len)) == NULL) {
+        return;
+    }
+    snprintf(spython_trace_path, len, "%s/%s.trace", dir, hexdigest);
+
+    FILE *f = fopen(spython_trace_path, "re");
+    if (f == NULL) {
+        return;
     }
+    if (fgets(line, sizeof(line), f) == NULL || strcmp(line, PREFETCH_HEADER) != 0 ||
+        (spython_prefetch = (SpythonPrefetch *)calloc(MAX_PREFETCH_FILES,
+                                                      sizeof(SpythonPrefetch))) == NULL) {
+        fclose(f);
+        return;
+    }
+    while (spython_prefetch_count < MAX_PREFETCH_FILES && fgets(line, sizeof(line), f)) {
+        size_t n = strlen(line);
+        if (n < 2 || line[0] != '/' || line[n - 1] != '\n') {
+            continue;
+        }
+        line[n - 1] = '\0';
+        SpythonPrefetch *p = &spython_prefetch[spython_prefetch_count];
+        if ((p->path = strdup(line)) == NULL) {
+            break;
+        }
+        atomic_init(&p->state, 0);
+        spython_prefetch_count++;
+    }
+    fclose(f);
+
+    atomic_init(&spython_prefetch_next, 0);
+    for (int i = 0; i < PREFETCH_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, spython_prefetch_thread, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/* Hands over the bytes a prefetch thread read and hashed for the file
+   described by sb, and their hash in hexdigest. Returns NULL without an
+   exception if there are none. */
+static PyObject*
+spython_prefetch_take(const struct stat *sb, char *hexdigest)
+{
+    for (size_t n = 0; n < spython_prefetch_count; n++) {
+        size_t i = (spython_prefetch_cursor + n) % spython_prefetch_count;
+        SpythonPrefetch *p = &spython_prefetch[i];
+        if (atomic_load_explicit(&p->state, memory_order_acquire) != 1 ||
+            p->dev != sb->st_dev || p->ino != sb->st_ino) {
+            continue;
+        }
+        spython_prefetch_cursor = i + 1;
+        PyObject *buffer = NULL;
+        if (p->size == sb->st_size &&
+            p->mtime.tv_sec == sb->st_mtim.tv_sec &&
+            p->mtime.tv_nsec == sb->st_mtim.tv_nsec &&
+            p->ctime.tv_sec == sb->st_ctim.tv_sec &&
+            p->ctime.tv_nsec == sb->st_ctim.tv_nsec) {
+            buffer = PyBytes_FromStringAndSize(p->data, (Py_ssize_t)p->data_size);
+            memcpy(hexdigest, p->sha256, SHA256_HEX_LENGTH + 1);
+        }
+        free(p->data);
+        p->data = NULL;
+        atomic_fetch_sub(&spython_prefetch_bytes, p->data_size);
+        atomic_store(&p->state, 2);
+        return buffer;
+    }
+    return NULL;
+}
+
+static void
+spython_trace_record(const char *filename)
+{
+    if (spython_trace_path == NULL || filename[0] != '/' ||
+        spython_trace_count == MAX_PREFETCH_FILES) {
+        return;
+    }
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)filename; *c; c++) {
+        h = (h ^ *c) * 1099511628211ULL;
+    }
+    size_t slot = h % TRACE_SET_SIZE;
+    while (spython_trace_set[slot]) {
+        if (strcmp(spython_trace[spython_trace_set[slot] - 1], filename) == 0) {
+            return;
+        }
+        slot = (slot + 1) % TRACE_SET_SIZE;
+    }
+    char *copy = strdup(filename);
+    if (copy != NULL) {
+        spython_trace[spython_trace_count++] = copy;
+        spython_trace_set[slot] = (uint16_t)spython_trace_count;
+    }
+}
+
+/* Replaces the trace when this run opened different files */
+static void
+spython_trace_write(void)
+{
+    if (spython_trace_path == NULL || spython_trace_count == 0) {
+        return;
+    }
+    if (spython_trace_count == spython_prefetch_count) {
+        size_t i = 0;
+        while (i < spython_trace_count &&
+               strcmp(spython_trace[i], spython_prefetch[i].path) == 0) {
+            i++;
+        }
+        if (i == spython_trace_count) {
+            return;
+        }
+    }
+
+    size_t len = strlen(spython_trace_path) + 8;
+    char *tmp = (char *)malloc(len);
+    if (tmp == NULL) {
+        return;
+    }
+    snprintf(tmp, len, "%s.%05d", spython_trace_path, (int)(getpid() % 100000));
+    FILE *f = fopen(tmp, "we");
+    if (f != NULL) {
+        int ok = fputs(PREFETCH_HEADER, f) >= 0;
+        for (size_t i = 0; i < spython_trace_count && ok; i++) {
+            ok = fprintf(f, "%s\n", spython_trace[i]) > 0;
+        }
+        if (fclose(f) == 0 && ok) {
+            rename(tmp, spython_trace_path);
+        } else {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+}
+
+/* Application bundles
+ *
+ * mkbundle.py packs every file that a script opens through open_code into
+ * one bundle and stores the SHA-256 of the whole bundle in its xattr. With
+ * SPYTHONBUNDLE=<bundle>, spython verifies the bundle once at startup and
+ * serves the files in it from memory, so loading them costs one open, one
+ * map and one hash in total instead of one of each per file. Files that
+ * are not in the bundle are opened and verified as usual.
+ *
+ *     char magic[8] = "SPYBNDL1"
+ *     uint32 count, align
+ *     uint64 strings_offset, strings_size
+ *     SpythonBundleEntry entries[count]    sorted by path
+ *     char strings[strings_size]           NUL terminated paths
+ *     file data, each file at a multiple of align
+ *
+ * The bundle is mapped only when it has the immutable attribute (chattr
+ * +i), because a mapping would show later writes to the file. Otherwise
+ * it is read into private memory.
+ */
+#define BUNDLE_MAGIC "SPYBNDL1"
+// 1 GB
+#define MAX_BUNDLE_SIZE (1024*1024*1024)
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t align;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} SpythonBundleHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t path_offset;
+    uint32_t path_len;
+} SpythonBundleEntry;
+
+static const char *spython_bundle = NULL;
+static const SpythonBundleEntry *spython_bundle_entries = NULL;
+static size_t spython_bundle_count = 0;
+static const char *spython_bundle_strings = NULL;
+
+/* Checks that every offset in the bundle is in range and the paths are
+   sorted, so lookups can trust them */
+static int
+spython_bundle_check(const char *data, size_t size)
+{
+    const SpythonBundleHeader *header = (const SpythonBundleHeader *)data;
+    const SpythonBundleEntry *entries = (const SpythonBundleEntry *)(header + 1);
+    const char *strings = data + header->strings_offset;
+    const char *previous = NULL;
+
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0) {
+        return -1;
+    }
+    if (sizeof(*header) + (uint64_t)header->count * sizeof(*entries) > header->strings_offset ||
+        header->strings_offset > size ||
+        header->strings_size > size - header->strings_offset) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < header->count; i++) {
+        const SpythonBundleEntry *e = &entries[i];
+        if (e->path_offset >= header->strings_size ||
+            e->path_len >= header->strings_size - e->path_offset ||
+            strings[e->path_offset + e->path_len] != '\0' ||
+            e->offset > size || e->size > size - e->offset) {
+            return -1;
+        }
+        if (previous != NULL && strcmp(previous, strings + e->path_offset) >= 0) {
+            return -1;
+        }
+        previous = strings + e->path_offset;
+    }
+    return 0;
+}
+
+/* Maps or reads the bundle at path and checks it against its xattr.
+   Prints the reason and returns -1 on failure. */
+static int
+spython_bundle_load(const char *path)
+{
+    struct stat sb;
+    struct statvfs sbvfs;
+    int fd, flags = 0;
+    char *data = MAP_FAILED;
+    char xattr_hash[XATTR_LENGTH];
+    char hexdigest[EVP_MAX_MD_SIZE * 2 + 1];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    ssize_t len;
+    const char *reason = NULL;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ||
+        fstat(fd, &sb) < 0 || fstatvfs(fd, &sbvfs) < 0) {
+        reason = strerror(errno);
+        goto end;
+    }
+    if (!S_ISREG(sb.st_mode) || (sbvfs.f_flag & ST_NOEXEC) == ST_NOEXEC ||
+        sb.st_size < (off_t)sizeof(SpythonBundleHeader) ||
+        sb.st_size > MAX_BUNDLE_SIZE) {
+        reason = "not a bundle";
+        goto end;
+    }
+
+    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_IMMUTABLE_FL)) {
+        data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    } else {
+        data = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        for (off_t pos = 0; data != MAP_FAILED && pos < sb.st_size; pos += len) {
+            len = pread(fd, data + pos, sb.st_size - pos, pos);
+            if (len < 0 && errno == EINTR) {
+                len = 0;
+            } else if (len <= 0) {
+                reason = len ? strerror(errno) : "file changed while reading";
+                goto end;
+            }
+        }
+        if (data != MAP_FAILED) {
+            mprotect(data, sb.st_size, PROT_READ);
+        }
+    }
+    if (data == MAP_FAILED) {
+        reason = strerror(errno);
+        goto end;
+    }
+
+    len = fgetxattr(fd, XATTR_NAME, xattr_hash, sizeof(xattr_hash) - 1);
+    if (len < 0) {
+        reason = strerror(errno);
+        goto end;
+    }
+    xattr_hash[len] = '\0';
+    if (!EVP_Digest(data, sb.st_size, digest, &digest_size, EVP_sha256(), NULL)) {
+        reason = "EVP SHA-256 failed";
+        goto end;
+    }
+    for (unsigned int i = 0; i < digest_size; i++) {
+        sprintf(hexdigest + i * 2, "%02x", digest[i]);
+    }
+    if (strcmp(hexdigest, xattr_hash) != 0) {
+        reason = "hash mismatch";
+        goto end;
+    }
+    if (spython_bundle_check(data, sb.st_size) < 0) {
+        reason = "invalid index";
+        goto end;
+    }
+
+    const SpythonBundleHeader *header = (const SpythonBundleHeader *)data;
+    spython_bundle = data;
+    spython_bundle_entries = (const SpythonBundleEntry *)(header + 1);
+    spython_bundle_count = header->count;
+    spython_bundle_strings = data + header->strings_offset;
+
+  end:
+    if (reason != NULL) {
+        syslog(LOG_CRIT, "spython failed to verify bundle %s: %s.", path, reason);
+        if (data != MAP_FAILED) {
+            munmap(data, sb.st_size);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return reason ? -1 : 0;
+}
+
+static int
+spython_bundle_cmp(const void *key, const void *entry)
+{
+    return strcmp((const char *)key,
+                  spython_bundle_strings + ((const SpythonBundleEntry *)entry)->path_offset);
+}
+
+static const SpythonBundleEntry *
+spython_bundle_find(const char *filename)
+{
+    if (spython_bundle == NULL) {
+        return NULL;
+    }
+    return (const SpythonBundleEntry *)bsearch(
+        filename, spython_bundle_entries, spython_bundle_count,
+        sizeof(SpythonBundleEntry), spython_bundle_cmp);
+}
+
+static PyObject*
+spython_bundle_open(const SpythonBundleEntry *entry)
+{
+    PyObject *iomod = NULL;
+    PyObject *buffer = NULL;
+    PyObject *stream = NULL;
+
+    if ((iomod = PyImport_ImportModule("_io")) != NULL &&
+        (buffer = PyBytes_FromStringAndSize(spython_bundle + entry->offset,
+                                            (Py_ssize_t)entry->size)) != NULL) {
+        stream = PyObject_CallMethod(iomod, "BytesIO", "O", buffer);
+    }
+    Py_XDECREF(buffer);
+    Py_XDECREF(iomod);
+    return stream;
+}
+
+static PyObject*
+spython_open_stream(const char *filename, int fd)
+{
+    PyObject *stream = NULL;
+    PyObject *iomod = NULL;
+    PyObject *fileio = NULL;
+    PyObject *buffer = NULL;
+    PyObject *res = NULL;
+    PyObject *file_hash = NULL;
+    PyObject *xattr_hash = NULL;
+    PyObject *key = NULL;
+    PyObject *stamp = NULL;
+    PyObject *cached;
+    struct stat sb;
+    int archive = spython_is_archive(filename);
+    int cmp;
+
+    if (spython_check_file(filename, fd,
+                           archive ? MAX_ARCHIVE_SIZE : MAX_PY_FILE_SIZE,
+                           &sb) != 0) {
+        goto end;
+    }
+
+    if ((iomod = PyImport_ImportModule("_io")) == NULL) {
+        goto end;
+    }
+
+    if (archive) {
+        key = Py_BuildValue("(KK)", (unsigned long long)sb.st_dev,
+                            (unsigned long long)sb.st_ino);
+        stamp = Py_BuildValue("(LLLLL)", (long long)sb.st_size,
+                              (long long)sb.st_mtim.tv_sec,
+                              (long long)sb.st_mtim.tv_nsec,
+                              (long long)sb.st_ctim.tv_sec,
+                              (long long)sb.st_ctim.tv_nsec);
+        if (key == NULL || stamp == NULL) {
+            goto end;
+        }
+        cached = spython_archives ? PyDict_GetItemWithError(spython_archives, key) : NULL;
+        if (cached != NULL) {
+            cmp = PyObject_RichCompareBool(PyTuple_GET_ITEM(cached, 0), stamp, Py_EQ);
+            if (cmp < 0) {
+                goto end;
+            }
+            if (cmp) {
+                /* BytesIO shares the bytes until it is written to */
+                stream = PyObject_CallMethod(iomod, "BytesIO", "O",
+                                             PyTuple_GET_ITEM(cached, 1));
+                goto end;
+            }
+        } else if (PyErr_Occurred()) {
+            goto end;
+        }
+    }
+
+    if (!archive) {
+        char prefetch_hash[SHA256_HEX_LENGTH + 1];
+        buffer = spython_prefetch_take(&sb, prefetch_hash);
+        if (buffer == NULL && PyErr_Occurred()) {
+            goto end;
+        }
+        if (buffer != NULL) {
+            if ((file_hash = PyUnicode_FromString(prefetch_hash)) == NULL ||
+                (xattr_hash = spython_expected_hash(filename, fd)) == NULL ||
+                (cmp = PyObject_RichCompareBool(file_hash, xattr_hash, Py_EQ)) < 0) {
+                goto end;
+            }
+            if (cmp) {
+                /* the bytes that were hashed */
+                stream = PyObject_CallMethod(iomod, "BytesIO", "O", buffer);
+                goto end;
+            }
+            /* changed since it was read ahead */
+            Py_CLEAR(buffer);
+            Py_CLEAR(file_hash);
+            Py_CLEAR(xattr_hash);
+        }
+    }
+
+    /* read file with _io module */
+    fileio = PyObject_CallMethod(iomod, "FileIO", "isi", fd, "r", 0);
+    if (fileio == NULL) {
+        goto end;
+    }
+    buffer = PyObject_CallMethod(fileio, "readall", NULL);
+    res = PyObject_CallMethod(fileio, "close", NULL);
+    if ((buffer == NULL) || (res == NULL)) {
+        goto end;
+    }
+
+    if ((file_hash = spython_hash_bytes(filename, buffer)) == NULL) {
+        goto end;
+    }
+    if ((xattr_hash = spython_expected_hash(filename, fd)) == NULL) {
+        goto end;
+    }
+    cmp = PyObject_RichCompareBool(file_hash, xattr_hash, Py_EQ);
+    switch(cmp) {
+      case 1:
+        if (archive) {
+            if (spython_archives == NULL &&
+                (spython_archives = PyDict_New()) == NULL) {
+                goto end;
+            }
+            PyObject *entry = PyTuple_Pack(2, stamp, buffer);
+            if (entry == NULL ||
+                PyDict_SetItem(spython_archives, key, entry) < 0) {
+                Py_XDECREF(entry);
+                goto end;
+            }
+            Py_DECREF(entry);
+        }
+        stream = PyObject_CallMethod(iomod, "BytesIO", "O", buffer);
+        break;
+      case 0:
+        PyErr_Format(PyExc_ValueError,
+                     "File hash mismatch: %s (expected: %R, got %R)",
+                      filename, xattr_hash, file_hash);
+        goto end;
+      default:
+        goto end;
+    }
+
+  end:
+    Py_XDECREF(buffer);
+    Py_XDECREF(iomod);
+    Py_XDECREF(fileio);
+    Py_XDECREF(res);
+    Py_XDECREF(file_hash);
+    Py_XDECREF(xattr_hash);
+    Py_XDECREF(key);
+    Py_XDECREF(stamp);
+    return stream;
+}
+
+/* Bytecode caches under __pycache__ are written by the importer after the
+ * tree was stamped, so they have no xattr or manifest leaf and are
+ * refused. The importer then compiles the verified source instead, so
+ * this is logged at a lower level, once per path, rather than at every
+ * import.
+ */
+static PyObject *spython_refused_caches = NULL;
+
+static int
+spython_is_bytecode_cache(const char *filename)
+{
+    size_t len = strlen(filename);
+    return len > 4 && strcmp(filename + len - 4, ".pyc") == 0 &&
+           strstr(filename, "/__pycache__/") != NULL;
+}
+
+static void
+spython_log_refused_cache(PyObject *filename_obj)
+{
+    PyObject *type, *value, *tb;
+
+    /* Keep the verification error for the importer */
+    PyErr_Fetch(&type, &value, &tb);
+    if (spython_refused_caches == NULL) {
+        spython_refused_caches = PySet_New(NULL);
+    }
+    if (spython_refused_caches != NULL) {
+        int seen = PySet_Contains(spython_refused_caches, filename_obj);
+        if (seen == 0 && PySet_Add(spython_refused_caches, filename_obj) == 0) {
+            syslog(LOG_NOTICE, "spython refused unverified bytecode cache %s.",
+                   PyBytes_AS_STRING(filename_obj));
+        }
+    }
+    PyErr_Clear();
+    PyErr_Restore(type, value, tb);
+}
+
+static PyObject*
+spython_open_code(PyObject *path, void *userData)
+{
+    PyObject *filename_obj = NULL;
+    const char *filename;
+    const SpythonBundleEntry *entry;
+    int fd = -1;
+    PyObject *stream = NULL;
+
+    if (PySys_Audit("spython.open_code", "O", path) < 0) {
+        goto end;
+    }
+
+    if (!PyUnicode_FSConverter(path, &filename_obj)) {
+        goto end;
+    }
+    filename = PyBytes_AS_STRING(filename_obj);
+
+    if ((entry = spython_bundle_find(filename)) != NULL) {
+        /* verified with the bundle */
+        stream = spython_bundle_open(entry);
+    } else {
+        fd = _Py_open(filename, O_RDONLY);
+        if (fd < 0) {
+            goto end;
+        }
+        stream = spython_open_stream(filename, fd);
+    }
+    if (stream == NULL && spython_is_bytecode_cache(filename)) {
+        spython_log_refused_cache(filename_obj);
+    } else if (stream == NULL) {
+        syslog(LOG_CRIT, "spython failed to verify file %s.", filename);
+    } else {
+        spython_trace_record(filename);
+    }
+
+  end:
+    Py_XDECREF(filename_obj);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return stream;
+}
+
+/* Extension modules are loaded with dlopen() and never pass through
+ * open_code. The interpreter raises the import audit event with the path
+ * of the shared library just before loading it, so the hook checks its
+ * xattr hash there and fails the import when it does not match.
+ *
+ * The library is then loaded with dlopen() through the descriptor that was
+ * hashed. When the interpreter loads it by path next, the dynamic loader
+ * finds the same file already loaded and returns it, so a file swapped in
+ * after hashing is not loaded. A file renamed over the path after the hook
+ * returns would still be loaded, so the directories of extension modules
+ * must not be writable by accounts that cannot set the hashes.
+ *
+ * Large packages ship dozens of multi-megabyte libraries, so verdicts are
+ * cached in VERDICT_CACHE_PATH (or SPYTHONVERDICTCACHE), one line per
+ * file: "<dev> <ino> <size> <mtime_ns> <ctime_ns> <sha256>". A file whose
+ * identity and xattr still match a cached line is not hashed again.
+ * Replacing or writing to a library, or changing its xattr, changes its
+ * inode, mtime, ctime or xattr, so it is hashed again. The cache is only
+ * as trustworthy as the xattrs, so it should only be writable by the
+ * accounts that may set them. Processes that cannot write it keep new
+ * verdicts in memory.
+ */
+#define VERDICT_CACHE_PATH "/var/cache/spython/extension-verdicts"
+// 512 MB
+#define MAX_EXTENSION_SIZE (512*1024*1024)
+
+typedef struct {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime_ns;
+    long long ctime_ns;
+    char sha256[SHA256_HEX_LENGTH + 1];
+} SpythonVerdict;
+
+static SpythonVerdict *spython_verdicts = NULL;
+static size_t spython_verdict_count = 0;
+static size_t spython_verdict_capacity = 0;
+static const char *spython_verdict_path = NULL;
+
+static SpythonVerdict *
+spython_verdict_find(const struct stat *sb)
+{
+    for (size_t i = 0; i < spython_verdict_count; i++) {
+        SpythonVerdict *v = &spython_verdicts[i];
+        if (v->dev == (unsigned long long)sb->st_dev &&
+            v->ino == (unsigned long long)sb->st_ino) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+/* Adds or replaces the verdict for a file. Returns -1 when out of memory. */
+static int
+spython_verdict_store(const SpythonVerdict *verdict)
+{
+    struct stat sb;
+    sb.st_dev = (dev_t)verdict->dev;
+    sb.st_ino = (ino_t)verdict->ino;
+    SpythonVerdict *v = spython_verdict_find(&sb);
+    if (v == NULL) {
+        if (spython_verdict_count == spython_verdict_capacity) {
+            size_t capacity = spython_verdict_capacity ? spython_verdict_capacity * 2 : 64;
+            v = (SpythonVerdict *)realloc(spython_verdicts, capacity * sizeof(SpythonVerdict));
+            if (v == NULL) {
+                return -1;
+            }
+            spython_verdicts = v;
+            spython_verdict_capacity = capacity;
+        }
+        v = &spython_verdicts[spython_verdict_count++];
+    }
+    *v = *verdict;
+    return 0;
+}
+
+static void
+spython_verdict_load(void)
+{
+    SpythonVerdict v;
+    char line[256];
+    size_t lines = 0;
+
+    spython_verdict_path = getenv("SPYTHONVERDICTCACHE");
+    if (spython_verdict_path == NULL || !*spython_verdict_path) {
+        spython_verdict_path = VERDICT_CACHE_PATH;
+    }
+    FILE *f = fopen(spython_verdict_path, "re");
+    if (f == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%llu %llu %lld %lld %lld %64[0-9a-f]",
+                   &v.dev, &v.ino, &v.size, &v.mtime_ns, &v.ctime_ns,
+                   v.sha256) == 6 &&
+            strlen(v.sha256) == SHA256_HEX_LENGTH) {
+            /* later lines replace earlier ones for the same file */
+            if (spython_verdict_store(&v) < 0) {
+                break;
+            }
+            lines++;
+        }
+    }
+    fclose(f);
+
+    /* Rewrite the file once it is mostly replaced verdicts */
+    if (lines > 2 * spython_verdict_count + 64) {
+        size_t len = strlen(spython_verdict_path);
+        char *tmp = (char *)malloc(len + 8);
+        if (tmp == NULL) {
+            return;
+        }
+        snprintf(tmp, len + 8, "%s.%05d", spython_verdict_path, (int)(getpid() % 100000));
+        f = fopen(tmp, "we");
+        if (f != NULL) {
+            int ok = 1;
+            for (size_t i = 0; i < spython_verdict_count && ok; i++) {
+                const SpythonVerdict *p = &spython_verdicts[i];
+                ok = fprintf(f, "%llu %llu %lld %lld %lld %s\n", p->dev, p->ino,
+                             p->size, p->mtime_ns, p->ctime_ns, p->sha256) > 0;
+            }
+            if (fclose(f) == 0 && ok) {
+                rename(tmp, spython_verdict_path);
+            } else {
+                unlink(tmp);
+            }
+        }
+        free(tmp);
+    }
+}
+
+/* Appends a verdict with a single write, so concurrent processes never
+   interleave their lines */
+static void
+spython_verdict_save(const SpythonVerdict *v)
+{
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%llu %llu %lld %lld %lld %s\n",
+                       v->dev, v->ino, v->size, v->mtime_ns, v->ctime_ns,
+                       v->sha256);
+    int fd = open(spython_verdict_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    if (write(fd, line, (size_t)len) != len) {
+        syslog(LOG_WARNING, "spython failed to write verdict cache %s.",
+               spython_verdict_path);
+    }
+    close(fd);
+}
+
+/* hash a file with OpenSSL without reading it into memory at once */
+static int
+spython_hash_fd(const char *filename, int fd, char *hexdigest)
+{
+    static char buf[256 * 1024];
+
+    switch (spython_sha256_fd(fd, buf, sizeof(buf), hexdigest)) {
+      case 0:
+        return 0;
+      case -1:
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return -1;
+      default:
+        PyErr_SetString(PyExc_ValueError, "EVP SHA-256 failed");
+        return -1;
+    }
+}
+
+/* Loads the verified library through fd, with the flags the interpreter
+   will use, and checks that filename still names it */
+static int
+spython_preload_extension(const char *filename, int fd, const struct stat *sb)
+{
+    char fd_path[32];
+    struct stat now;
+    int flags = RTLD_NOW;
+
+    PyObject *getflags = PySys_GetObject("getdlopenflags");
+    if (getflags != NULL) {
+        PyObject *r = PyObject_CallObject(getflags, NULL);
+        if (r == NULL) {
+            return -1;
+        }
+        flags = (int)PyLong_AsLong(r);
+        Py_DECREF(r);
+        if (flags == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+    }
+
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    if (dlopen(fd_path, flags) == NULL) {
+        PyErr_Format(PyExc_ImportError, "failed to load %s: %s",
+                     filename, dlerror());
+        return -1;
+    }
+    if (stat(filename, &now) != 0 || now.st_dev != sb->st_dev ||
+        now.st_ino != sb->st_ino) {
+        PyErr_Format(PyExc_OSError, "%s was replaced while it was verified",
+                     filename);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+spython_verify_extension(const char *filename)
+{
+    char xattr[XATTR_LENGTH];
+    char hexdigest[EVP_MAX_MD_SIZE * 2 + 1];
+    struct stat sb;
+    ssize_t size;
+    int rc = -1;
+
+    int fd = _Py_open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (spython_check_file(filename, fd, MAX_EXTENSION_SIZE, &sb) != 0) {
+        goto end;
+    }
+
+    PyObject *expected = spython_expected_hash(filename, fd);
+    if (expected == NULL) {
+        goto end;
+    }
+    const char *utf8 = PyUnicode_AsUTF8AndSize(expected, &size);
+    if (utf8 == NULL) {
+        Py_DECREF(expected);
+        goto end;
+    }
+    if (size >= (ssize_t)sizeof(xattr)) {
+        PyErr_Format(PyExc_ValueError, "xattr hash for %s is too long", filename);
+        Py_DECREF(expected);
+        goto end;
+    }
+    memcpy(xattr, utf8, (size_t)size + 1);
+    Py_DECREF(expected);
+
+    SpythonVerdict v = {
+        (unsigned long long)sb.st_dev, (unsigned long long)sb.st_ino,
+        (long long)sb.st_size,
+        (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec,
+        (long long)sb.st_ctim.tv_sec * 1000000000LL + sb.st_ctim.tv_nsec,
+        "",
+    };
+    SpythonVerdict *cached = spython_verdict_find(&sb);
+    if (cached != NULL && cached->size == v.size &&
+        cached->mtime_ns == v.mtime_ns && cached->ctime_ns == v.ctime_ns &&
+        strcmp(cached->sha256, xattr) == 0) {
+        rc = spython_preload_extension(filename, fd, &sb);
+        goto end;
+    }
+
+    if (spython_hash_fd(filename, fd, hexdigest) < 0) {
+        goto end;
+    }
+    if (strcmp(hexdigest, xattr) != 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "File hash mismatch: %s (expected: '%s', got '%s')",
+                     filename, xattr, hexdigest);
+        goto end;
+    }
+
+    memcpy(v.sha256, hexdigest, SHA256_HEX_LENGTH + 1);
+    if (spython_verdict_store(&v) == 0) {
+        spython_verdict_save(&v);
+    }
+    rc = spython_preload_extension(filename, fd, &sb);
+
+  end:
+    close(fd);
+    return rc;
+}
+
+/* The import event for an extension module has its path as the second
+ * argument. For other imports it is None.
+ */
+static int
+spython_extension_hook(const char *event, PyObject *args, void *userData)
+{
+    if (strcmp(event, "import") != 0) {
+        return 0;
+    }
+    PyObject *path = PyTuple_GetItem(args, 1);
+    if (path == NULL) {
+        return -1;
+    }
+    if (!PyUnicode_Check(path)) {
+        return 0;
+    }
+
+    PyObject *filename_obj = NULL;
+    if (!PyUnicode_FSConverter(path, &filename_obj)) {
+        return -1;
+    }
+    const char *filename = PyBytes_AS_STRING(filename_obj);
+    int rc = spython_verify_extension(filename);
+    if (rc < 0) {
+        syslog(LOG_CRIT, "spython failed to verify extension %s.", filename);
+    }
+    Py_DECREF(filename_obj);
+    return rc;
+}
+
+static int
+spython_frozen_cmp(const void *key, const void *entry)
+{
+    return strcmp((const char *)key, ((const SpythonFrozenHash *)entry)->name);
+}
+
+static const SpythonFrozenHash *
+spython_frozen_lookup(const char *name)
+{
+    return (const SpythonFrozenHash *)bsearch(
+        name, spython_frozen_hashes, FROZEN_HASH_COUNT,
+        sizeof(SpythonFrozenHash), spython_frozen_cmp);
+}
+
+/* Frozen modules never reach open_code, so raise spython.frozen with the
+ * build-time verified hash for hooks that keep an audit trail.
+ */
+static int
+spython_frozen_hook(const char *event, PyObject *args, void *userData)
+{
+    if (strcmp(event, "import") != 0) {
+        return 0;
+    }
+    PyObject *module = PyTuple_GetItem(args, 0);
+    const char *name = module ? PyUnicode_AsUTF8(module) : NULL;
+    if (!name) {
+        return -1;
+    }
+    const SpythonFrozenHash *entry = spython_frozen_lookup(name);
+    if (entry) {
+        return PySys_Audit("spython.frozen", "sss",
+                           entry->name, entry->path, entry->sha256);
+    }
+    return 0;
+}
+
+/* Appends our frozen modules after the interpreter's own, so that
+ * _frozen_importlib and friends are always found first.
+ */
+static int
+spython_install_frozen(void)
+{
+    const struct _frozen *p;
+    size_t n = 0;
+
+    if (FROZEN_HASH_COUNT == 0) {
+        return 0;
+    }
+    for (p = PyImport_FrozenModules; p->name; ++p) {
+        n += 1;
+    }
+    struct _frozen *table = (struct _frozen *)malloc(
+        (n + FROZEN_HASH_COUNT + 1) * sizeof(struct _frozen));
+    if (!table) {
+        return -1;
+    }
+    memcpy(table, PyImport_FrozenModules, n * sizeof(struct _frozen));
+    memcpy(&table[n], spython_frozen_modules,
+           (FROZEN_HASH_COUNT + 1) * sizeof(struct _frozen));
+    PyImport_FrozenModules = table;
+
+    return PySys_AddAuditHook(spython_frozen_hook, NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+    PyStatus status;
+    PyConfig config;
+
+    /* block syscalls */
+    if (spython_seccomp_setxattr(0) < 0) {
+        exit(1);
+    }
+
+    /* configure syslog */
+    openlog(NULL, LOG_CONS | LOG_PERROR | LOG_PID, LOG_USER);
+
+    /* verify the application bundle once */
+    const char *bundle = getenv("SPYTHONBUNDLE");
+    if (bundle != NULL && *bundle && spython_bundle_load(bundle) < 0) {
+        exit(1);
+    }
+
+    /* initialize Python in isolated mode, but allow argv */
+    PyConfig_InitIsolatedConfig(&config);
+
+    /* install hooks */
+    PyFile_SetOpenCodeHook(spython_open_code, NULL);
+    spython_verdict_load();
+    if (PySys_AddAuditHook(spython_extension_hook, NULL) < 0) {
+        fprintf(stderr, "failed to install extension hook\n");
+        exit(1);
+    }
+    if (spython_install_frozen() < 0) {
+        fprintf(stderr, "failed to install frozen modules\n");
+        exit(1);
+    }
+
+    /* handle and parse argv */
+    config.parse_argv = 1;
+    status = PyConfig_SetBytesArgv(&config, argc, argv);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+
+    /* perform remaining initialization */
+    status = PyConfig_Read(&config);
+    if (PyStatus_Exception(status)) {
+        goto fail;
+    }
+    /* argv is parsed now. Py_InitializeFromConfig() would parse it again
+       and drop the script name from sys.argv. */
+    config.parse_argv = 0;
+
+    /* read ahead the files the last run of this script opened */
+    spython_prefetch_start(&config);
 
     status = Py_InitializeFromConfig(&config);
     if (PyStatus_Exception(status)) {
@@ -312,7 +1864,9 @@ main(int argc, char **argv)
     }
     PyConfig_Clear(&config);
 
-    return Py_RunMain();
+    int exitcode = Py_RunMain();
+    spython_trace_write();
+    return exitcode;
 
   fail:
     PyConfig_Clear(&config);
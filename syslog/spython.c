@@ -21,7 +21,6 @@ syslogHook(const char *event, PyObject *args, void *userData)
                    PyUnicode_AsUTF8(module),
                    PyUnicode_AsUTF8(filename));
         }
-        Py_DECREF(filename);
         return 0;
     }
 
@@ -62,12 +61,8 @@ main(int argc, char **argv)
         goto fail;
     }
 
-    /* perform remaining initialization */
-    status = PyConfig_Read(&config);
-    if (PyStatus_Exception(status)) {
-        goto fail;
-    }
-
+    /* Py_InitializeFromConfig() reads the config itself. Reading it here
+       first makes 3.8 parse argv twice and lose the script name. */
     status = Py_InitializeFromConfig(&config);
     if (PyStatus_Exception(status)) {
         goto fail;